@@ -61,6 +61,41 @@ int32_t krun_set_vm_config(uint32_t ctx_id, uint8_t num_vcpus, uint32_t ram_mib)
  */
 int32_t krun_set_root(uint32_t ctx_id, const char *root_path);
 
+/*
+ * Sets a stack of directories to be merged and used as root for the microVM, like overlayfs does.
+ * The lower directories are never modified; all the changes are stored in the upper directory.
+ * Removed entries are recorded with OCI-style whiteouts (".wh.<name>"), so unpacked image layers
+ * can be used as lower directories as they are. Only available on Linux. Not available in
+ * libkrun-SEV.
+ *
+ * Arguments:
+ *  "ctx_id"     - the configuration context ID.
+ *  "upper_dir"  - a null-terminated string representing the absolute path to the writable
+ *                 directory, which must exist.
+ *  "lower_dirs" - a null-terminated array of string pointers representing the absolute paths to
+ *                 the read-only directories, from the topmost to the bottom one.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_root_layers(uint32_t ctx_id, const char *upper_dir, char *const lower_dirs[]);
+
+/*
+ * Sets a tar archive to be used as a read-only root for the microVM, served straight from the
+ * archive without unpacking it. Only available on Linux. Not available in libkrun-SEV.
+ *
+ * The archive is read when the microVM starts, and krun_start_enter fails if it's malformed.
+ * The volumes set with krun_set_mapped_volumes don't apply to it.
+ *
+ * Arguments:
+ *  "ctx_id"       - the configuration context ID.
+ *  "archive_path" - a null-terminated string representing the path to the tar archive.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_root_archive(uint32_t ctx_id, const char *archive_path);
+
 /*
  * Sets the path to the disk image that contains the file-system to be used as root for the microVM.
  * The only supported image format is "raw". Only available in libkrun-SEV.
@@ -89,18 +124,149 @@ int32_t krun_set_root_disk(uint32_t ctx_id, const char *disk_path);
  */
 int32_t krun_set_mapped_volumes(uint32_t ctx_id, char *const mapped_volumes[]);
 
+/*
+ * Adds a scratch volume to the microVM: an empty file system kept in the memory of the process,
+ * like tmpfs, mounted at "guest_path" by init. Its contents are lost when the microVM exits.
+ * Can be called more than once to add several volumes. Only available on Linux. Not available
+ * in libkrun-SEV.
+ *
+ * Arguments:
+ *  "ctx_id"     - the configuration context ID.
+ *  "guest_path" - a null-terminated string representing the absolute path where the volume will
+ *                 be mounted inside the microVM.
+ *  "size_mib"   - the maximum size, in MiB, the contents of the files in the volume may take.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_add_scratch_volume(uint32_t ctx_id, const char *guest_path, uint32_t size_mib);
+
+/*
+ * Sets the largest amount of data the guest may read or write in a single request to the
+ * file-system shared with the microVM. Larger values reduce the number of round trips for big
+ * sequential I/O. The value is rounded down to a multiple of the page size and limited to what
+ * fits in the device's queues (8 MiB at most). The default is 1 MiB. Not available in
+ * libkrun-SEV.
+ *
+ * Note that the guest kernel may impose a lower limit (see /proc/sys/fs/fuse/max_pages_limit).
+ *
+ * Arguments:
+ *  "ctx_id"      - the configuration context ID.
+ *  "max_io_size" - the maximum transfer size, in bytes.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_fs_max_io_size(uint32_t ctx_id, uint32_t max_io_size);
+
+/*
+ * Makes the file-system shared with the microVM refer to the host files the guest knows about
+ * through file handles, instead of keeping a file descriptor open for each of them. This bounds
+ * the number of file descriptors used when the guest walks large trees. It requires the
+ * CAP_DAC_READ_SEARCH capability, and falls back to file descriptors if file handles can't be
+ * used for the shared directory. Disabled by default. Only available on Linux, and not in
+ * libkrun-SEV.
+ *
+ * Arguments:
+ *  "ctx_id" - the configuration context ID.
+ *  "enable" - non-zero to use file handles, zero to use file descriptors.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_fs_inode_file_handles(uint32_t ctx_id, uint32_t enable);
+
+/*
+ * Sets a directory where every virtio-fs device of the microVM records the FUSE requests it
+ * receives, in a "<tag>.trace" file, to replay them later with the fs-replay tool. Not recorded
+ * by default. Not available in libkrun-SEV.
+ *
+ * Arguments:
+ *  "ctx_id"   - the configuration context ID.
+ *  "dir_path" - a null-terminated string representing the absolute path to an existing directory.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_fs_trace_dir(uint32_t ctx_id, const char *dir_path);
+
+/*
+ * Sets a directory where the file-system shared with the microVM keeps a "<tag>.prefetch" profile
+ * of the files read by the guest right after boot. On the next boots, the files in the profile are
+ * read into the host page cache in the background, ahead of the guest asking for them. Disabled
+ * by default. Only available on Linux, and not in libkrun-SEV.
+ *
+ * Arguments:
+ *  "ctx_id"   - the configuration context ID.
+ *  "dir_path" - a null-terminated string representing the absolute path to an existing directory.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_fs_prefetch_dir(uint32_t ctx_id, const char *dir_path);
+
 /*
  * Configures a map of host to guest TCP ports for the microVM.
  *
  * Arguments:
  *  "ctx_id"         - the configuration context ID.
- *  "mapped_volumes" - an array of string pointers with format "host_port:guest_port"
+ *  "mapped_volumes" - an array of string pointers with format "host_port:guest_port", or
+ *                     "host_port:guest_port:weight" to give the connections to that port
+ *                     "weight" times the share of the guest RX bandwidth of the others. The
+ *                     weight only applies to the connections accepted on "host_port" on
+ *                     behalf of a guest listener; connections the guest initiates always get
+ *                     the default share.
  *
  * Returns:
  *  Zero on success or a negative error number on failure.
  */
 int32_t krun_set_port_map(uint32_t ctx_id, char *const port_map[]);
 
+/*
+ * Sets the largest amount of data carried by a single packet between the host and the microVM's
+ * vsock device, which carries the traffic of the mapped ports. Larger values reduce the per-packet
+ * overhead of bulk transfers, as long as the guest driver provides large enough receive buffers
+ * (which may span several descriptors). The value must be in the 4 KiB - 1 MiB range. The
+ * default is 64 KiB. Packets sent by the guest may still carry up to 64 KiB, whatever the value.
+ *
+ * Arguments:
+ *  "ctx_id"       - the configuration context ID.
+ *  "max_pkt_size" - the maximum packet data size, in bytes.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_vsock_max_pkt_size(uint32_t ctx_id, uint32_t max_pkt_size);
+
+/*
+ * Sets how long a connection made by the microVM to a host port may take to be established on
+ * the host, before it's reset. The default is 10 seconds.
+ *
+ * Arguments:
+ *  "ctx_id"     - the configuration context ID.
+ *  "timeout_ms" - the timeout, in milliseconds.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_vsock_connect_timeout(uint32_t ctx_id, uint32_t timeout_ms);
+
+/*
+ * Sets the number of threads the connections of the vsock device are spread over. The default is
+ * one per host CPU, up to 4.
+ *
+ * Each connection holds a file descriptor in the host process, so the number of connections is
+ * also bounded by its open files limit (RLIMIT_NOFILE), which libkrun leaves alone.
+ *
+ * Arguments:
+ *  "ctx_id" - the configuration context ID.
+ *  "shards" - the number of threads.
+ *
+ * Returns:
+ *  Zero on success or a negative error number on failure.
+ */
+int32_t krun_set_vsock_shards(uint32_t ctx_id, uint32_t shards);
+
 /*
  * Configures a map of rlimits to be set in the guest before starting the isolated binary.
  *
@@ -161,6 +327,25 @@ int32_t krun_set_exec(uint32_t ctx_id,
  */
 int32_t krun_set_attestation_url(uint32_t ctx_id, const char *url);
 
+/*
+ * Gets the request statistics of the virtio-fs devices of a running microVM: for each device, the
+ * requests, errors, bytes in and out and latencies per FUSE opcode, and the inodes with the
+ * slowest requests. It's meant to be called from another thread while "krun_start_enter" runs
+ * the microVM. The same report is logged at info level when the microVM shuts down.
+ *
+ * Arguments:
+ *  "ctx_id" - the configuration context ID the microVM was started with.
+ *  "buf"    - a buffer to hold the report, as a null-terminated string. It's truncated if it
+ *             doesn't fit.
+ *  "size"   - the size of "buf", in bytes. If zero, nothing is written and "buf" may be NULL.
+ *
+ * Returns:
+ *  The length of the full report (not counting the null terminator) on success, or a negative
+ *  error number on failure. Like with snprintf(), a return value of "size" or more means the
+ *  report was truncated.
+ */
+int32_t krun_get_fs_stats(uint32_t ctx_id, char *buf, uint32_t size);
+
 /*
  * Starts and enters the microVM with the configured parameters. The VMM will attempt to take over
  * stdin/stdout to manage them on behalf of the process running inside the isolated environment,
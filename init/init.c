@@ -52,6 +52,31 @@ void set_rlimits(const char *rlimits)
     }
 }
 
+void mount_scratch(const char *scratch)
+{
+    char *volumes = strdup(scratch);
+    char *item = volumes;
+    char *tag;
+    char *path;
+
+    while ((tag = strsep(&item, ",")) != NULL) {
+        path = strchr(tag, ':');
+        if (path == NULL) {
+            printf("Invalid scratch volume: %s\n", tag);
+            continue;
+        }
+        *path++ = '\0';
+
+        /* May fail if already exists and that's fine. */
+        mkdir(path, 0755);
+        if (mount(tag, path, "virtiofs", MS_NODEV | MS_NOSUID, NULL) < 0) {
+            perror("mount(scratch)");
+        }
+    }
+
+    free(volumes);
+}
+
 int main(int argc, char **argv)
 {
     struct ifreq ifr;
@@ -63,6 +88,7 @@ int main(int argc, char **argv)
     char *krun_init;
     char *workdir;
     char *rlimits;
+    char *scratch;
     char *passp;
 
 
@@ -98,6 +124,11 @@ int main(int argc, char **argv)
         set_rlimits(rlimits);
     }
 
+    scratch = getenv("KRUN_SCRATCH");
+    if (scratch) {
+        mount_scratch(scratch);
+    }
+
     workdir = getenv("KRUN_WORKDIR");
     if (workdir) {
         chdir(workdir);
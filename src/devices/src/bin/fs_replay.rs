@@ -0,0 +1,258 @@
+//! Replays a trace of FUSE requests, captured with krun_set_fs_trace_dir(), against a file system
+//! served by `Server` in this process, and reports the throughput and the latency per opcode.
+//!
+//! The node ids and file handles in the trace are those the captured server gave out, so the
+//! requests must be replayed in order against a copy of the tree the trace was captured on.
+
+use std::env;
+use std::fmt;
+use std::fs::File;
+use std::io::{self, BufReader};
+use std::process;
+use std::sync::Arc;
+use std::thread;
+use std::time::{Duration, Instant};
+
+use devices::virtio::fs::descriptor_utils::{
+    create_descriptor_chain, DescriptorType, Reader, Writer,
+};
+#[cfg(target_os = "linux")]
+use devices::virtio::fs::linux::memfs::{self, MemFs};
+use devices::virtio::fs::passthrough::{self, PassthroughFs};
+use devices::virtio::fs::stats::StatsSnapshot;
+use devices::virtio::fs::trace::{TraceReader, TraceRecord};
+use devices::virtio::fs::{FileSystem, Server, MAX_MAX_BUFFER_SIZE};
+use vm_memory::{Bytes, GuestAddress, GuestMemoryMmap};
+
+const USAGE: &str = "\
+usage: fs_replay [options] <trace> <root>
+
+Replays the FUSE requests in <trace> against <root>. With several threads, each one replays the
+whole trace against its own file system, and any \"{}\" in <root> is replaced by the number of the
+thread, so each one can get its own copy of the tree.
+
+options:
+    --threads <n>       number of threads replaying the trace (default: 1)
+    --iterations <n>    times each thread replays the trace (default: 1)
+    --backend <name>    file system to replay against: passthrough or mem (default: passthrough)";
+
+// Where the descriptor table of the chains goes. The request and reply buffers follow it.
+const DESC_TABLE_ADDR: GuestAddress = GuestAddress(0);
+const BUFFERS_ADDR: GuestAddress = GuestAddress(0x1000);
+
+#[derive(Clone, Copy)]
+enum Backend {
+    Passthrough,
+    #[cfg(target_os = "linux")]
+    Mem,
+}
+
+struct Options {
+    trace: String,
+    root: String,
+    threads: usize,
+    iterations: usize,
+    backend: Backend,
+}
+
+fn usage() -> ! {
+    eprintln!("{}", USAGE);
+    process::exit(2);
+}
+
+fn parse_args() -> Options {
+    let mut args = env::args().skip(1);
+    let mut positional = Vec::new();
+    let mut threads = 1;
+    let mut iterations = 1;
+    let mut backend = Backend::Passthrough;
+
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--threads" => {
+                threads = args
+                    .next()
+                    .and_then(|n| n.parse().ok())
+                    .unwrap_or_else(|| usage())
+            }
+            "--iterations" => {
+                iterations = args
+                    .next()
+                    .and_then(|n| n.parse().ok())
+                    .unwrap_or_else(|| usage())
+            }
+            "--backend" => {
+                backend = match args.next().as_deref() {
+                    Some("passthrough") => Backend::Passthrough,
+                    #[cfg(target_os = "linux")]
+                    Some("mem") => Backend::Mem,
+                    _ => usage(),
+                }
+            }
+            "-h" | "--help" => usage(),
+            _ => positional.push(arg),
+        }
+    }
+
+    if positional.len() != 2 || threads == 0 {
+        usage();
+    }
+    let root = positional.pop().unwrap();
+    let trace = positional.pop().unwrap();
+
+    Options {
+        trace,
+        root,
+        threads,
+        iterations,
+        backend,
+    }
+}
+
+fn load_trace(path: &str) -> io::Result<Vec<TraceRecord>> {
+    let reader = TraceReader::new(BufReader::new(File::open(path)?))?;
+    let mut records = Vec::new();
+    for record in reader {
+        let record = record?;
+        // Only complete requests are worth replaying.
+        if record.header().is_some() {
+            records.push(record);
+        }
+    }
+
+    Ok(records)
+}
+
+fn other<E: fmt::Debug>(e: E) -> io::Error {
+    io::Error::new(io::ErrorKind::Other, format!("{:?}", e))
+}
+
+// Totals of a replay.
+#[derive(Default)]
+struct Replayed {
+    requests: u64,
+    bytes: u64,
+    stats: StatsSnapshot,
+}
+
+// Sends every request in `records` to `server`, one at a time, through descriptor chains built
+// in a memory of its own.
+fn replay<F: FileSystem + Sync>(
+    server: &Server<F>,
+    records: &[TraceRecord],
+    iterations: usize,
+) -> io::Result<Replayed> {
+    let max_len = records
+        .iter()
+        .map(|r| r.request.len() + r.out_len as usize)
+        .max()
+        .unwrap_or(0);
+    let mem_size = BUFFERS_ADDR.0 as usize + max_len;
+    let mem = GuestMemoryMmap::from_ranges(&[(GuestAddress(0), mem_size)]).map_err(other)?;
+
+    let mut replayed = Replayed::default();
+    for _ in 0..iterations {
+        for record in records.iter() {
+            mem.write_slice(&record.request, BUFFERS_ADDR)
+                .map_err(other)?;
+
+            let mut descriptors = vec![(DescriptorType::Readable, record.request.len() as u32)];
+            if record.out_len != 0 {
+                descriptors.push((DescriptorType::Writable, record.out_len));
+            }
+            let chain =
+                create_descriptor_chain(&mem, DESC_TABLE_ADDR, BUFFERS_ADDR, descriptors, 0)
+                    .map_err(other)?;
+
+            let reader = Reader::new(&mem, chain.clone()).map_err(other)?;
+            let writer = Writer::new(&mem, chain).map_err(other)?;
+
+            let out = server.handle_message(reader, writer, None).map_err(other)?;
+
+            replayed.requests += 1;
+            replayed.bytes += (record.request.len() + out) as u64;
+        }
+    }
+    replayed.stats = server.stats().snapshot();
+
+    Ok(replayed)
+}
+
+fn replay_thread(
+    root: String,
+    backend: Backend,
+    records: &[TraceRecord],
+    iterations: usize,
+) -> io::Result<Replayed> {
+    match backend {
+        Backend::Passthrough => {
+            let cfg = passthrough::Config {
+                root_dir: root,
+                ..Default::default()
+            };
+            let server = Server::new(PassthroughFs::new(cfg)?, MAX_MAX_BUFFER_SIZE);
+            replay(&server, records, iterations)
+        }
+        #[cfg(target_os = "linux")]
+        Backend::Mem => {
+            let server = Server::new(MemFs::new(memfs::Config::default())?, MAX_MAX_BUFFER_SIZE);
+            replay(&server, records, iterations)
+        }
+    }
+}
+
+fn main() {
+    let opts = parse_args();
+
+    let records = match load_trace(&opts.trace) {
+        Ok(records) => Arc::new(records),
+        Err(e) => {
+            eprintln!("Failed to read {}: {}", opts.trace, e);
+            process::exit(1);
+        }
+    };
+    let captured: Duration = records.iter().map(|r| r.latency).sum();
+
+    let start = Instant::now();
+    let handles: Vec<_> = (0..opts.threads)
+        .map(|i| {
+            let records = records.clone();
+            let root = opts.root.replace("{}", &i.to_string());
+            let backend = opts.backend;
+            let iterations = opts.iterations;
+            thread::spawn(move || replay_thread(root, backend, &records, iterations))
+        })
+        .collect();
+
+    let mut total = Replayed::default();
+    for handle in handles {
+        match handle.join().unwrap() {
+            Ok(replayed) => {
+                total.requests += replayed.requests;
+                total.bytes += replayed.bytes;
+                total.stats.merge(&replayed.stats);
+            }
+            Err(e) => {
+                eprintln!("Replay failed: {}", e);
+                process::exit(1);
+            }
+        }
+    }
+    let elapsed = start.elapsed();
+    let secs = elapsed.as_secs_f64();
+
+    println!(
+        "{} requests replayed by {} threads in {:.3}s: {:.0} requests/s, {:.1} MiB/s",
+        total.requests,
+        opts.threads,
+        secs,
+        total.requests as f64 / secs,
+        total.bytes as f64 / secs / f64::from(1 << 20)
+    );
+    println!(
+        "{} requests captured, handled in {:.3}s\n",
+        records.len(),
+        captured.as_secs_f64()
+    );
+    print!("{}", total.stats);
+}
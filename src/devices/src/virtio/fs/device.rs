@@ -1,4 +1,5 @@
 use std::cmp;
+use std::convert::TryInto;
 use std::io::Write;
 use std::path::PathBuf;
 use std::result;
@@ -13,24 +14,43 @@ use super::super::{
     VirtioShmRegion, VIRTIO_MMIO_INT_VRING,
 };
 use super::descriptor_utils::{Reader, Writer};
+#[cfg(target_os = "linux")]
+use super::linux::archive::{self, ArchiveFs};
+#[cfg(target_os = "linux")]
+use super::linux::memfs::{self, MemFs};
+#[cfg(target_os = "linux")]
+use super::linux::overlay::{self, OverlayFs};
+use super::notify::{Notifier, NOTIFY_BUF_SIZE};
 use super::passthrough::{self, PassthroughFs};
-use super::server::Server;
+use super::server::{Server, DEFAULT_MAX_BUFFER_SIZE, MAX_MAX_BUFFER_SIZE};
+use super::stats::Stats;
+use super::trace::TraceWriter;
+use super::worker::{self, SyncRequest, SyncWorker};
 use super::{defs, defs::uapi};
 use crate::legacy::Gic;
 use crate::Error as DeviceError;
 
 // High priority queue.
 pub(crate) const HPQ_INDEX: usize = 0;
-// Request queue.
+// Request queue, when the notification queue is not in use.
 pub(crate) const REQ_INDEX: usize = 1;
+// Notification queue, if VIRTIO_FS_F_NOTIFICATION was acknowledged. The request queue comes
+// right after it in that case.
+pub(crate) const NOTIFY_INDEX: usize = 1;
 
-pub(crate) const AVAIL_FEATURES: u64 = 1 << uapi::VIRTIO_F_VERSION_1 as u64;
+// Descriptors the driver needs for the FUSE headers and arguments of a request, besides the ones
+// for the data pages.
+const REQUEST_HEADER_DESCRIPTORS: u32 = 4;
+
+pub(crate) const AVAIL_FEATURES: u64 =
+    1 << uapi::VIRTIO_F_VERSION_1 as u64 | 1 << uapi::VIRTIO_FS_F_NOTIFICATION as u64;
 
 #[derive(Copy, Clone)]
 #[repr(C, packed)]
 struct VirtioFsConfig {
     tag: [u8; 36],
     num_request_queues: u32,
+    notify_buf_size: u32,
 }
 
 impl Default for VirtioFsConfig {
@@ -38,13 +58,105 @@ impl Default for VirtioFsConfig {
         VirtioFsConfig {
             tag: [0; 36],
             num_request_queues: 0,
+            notify_buf_size: 0,
         }
     }
 }
 
 unsafe impl ByteValued for VirtioFsConfig {}
 
+// The file system backends a device may serve. `Server` is generic over the backend because
+// `FileSystem` can't be used as a trait object.
+enum FsServer {
+    Passthrough(Server<PassthroughFs>),
+    #[cfg(target_os = "linux")]
+    Overlay(Server<OverlayFs>),
+    #[cfg(target_os = "linux")]
+    Archive(Server<ArchiveFs>),
+    #[cfg(target_os = "linux")]
+    Mem(Server<MemFs>),
+}
+
+impl FsServer {
+    fn handle_message(
+        &self,
+        r: Reader,
+        w: Writer,
+        shm_region: Option<&VirtioShmRegion>,
+    ) -> super::Result<usize> {
+        match self {
+            FsServer::Passthrough(server) => server.handle_message(r, w, shm_region),
+            #[cfg(target_os = "linux")]
+            FsServer::Overlay(server) => server.handle_message(r, w, shm_region),
+            #[cfg(target_os = "linux")]
+            FsServer::Archive(server) => server.handle_message(r, w, shm_region),
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(server) => server.handle_message(r, w, shm_region),
+        }
+    }
+
+    fn set_trace(&mut self, trace: TraceWriter) {
+        match self {
+            FsServer::Passthrough(server) => server.set_trace(trace),
+            #[cfg(target_os = "linux")]
+            FsServer::Overlay(server) => server.set_trace(trace),
+            #[cfg(target_os = "linux")]
+            FsServer::Archive(server) => server.set_trace(trace),
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(server) => server.set_trace(trace),
+        }
+    }
+
+    #[cfg(test)]
+    fn max_buffer_size(&self) -> u32 {
+        match self {
+            FsServer::Passthrough(server) => server.max_buffer_size(),
+            #[cfg(target_os = "linux")]
+            FsServer::Overlay(server) => server.max_buffer_size(),
+            #[cfg(target_os = "linux")]
+            FsServer::Archive(server) => server.max_buffer_size(),
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(server) => server.max_buffer_size(),
+        }
+    }
+
+    fn set_max_buffer_size(&self, max_buffer_size: u32) {
+        match self {
+            FsServer::Passthrough(server) => server.set_max_buffer_size(max_buffer_size),
+            #[cfg(target_os = "linux")]
+            FsServer::Overlay(server) => server.set_max_buffer_size(max_buffer_size),
+            #[cfg(target_os = "linux")]
+            FsServer::Archive(server) => server.set_max_buffer_size(max_buffer_size),
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(server) => server.set_max_buffer_size(max_buffer_size),
+        }
+    }
+
+    // Only the files of the host can be mapped into a DAX window, the scratch volumes kept in
+    // memory have nothing to map.
+    fn uses_shm_region(&self) -> bool {
+        match self {
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(_) => false,
+            _ => true,
+        }
+    }
+
+    fn stats(&self) -> Arc<Stats> {
+        match self {
+            FsServer::Passthrough(server) => server.stats(),
+            #[cfg(target_os = "linux")]
+            FsServer::Overlay(server) => server.stats(),
+            #[cfg(target_os = "linux")]
+            FsServer::Archive(server) => server.stats(),
+            #[cfg(target_os = "linux")]
+            FsServer::Mem(server) => server.stats(),
+        }
+    }
+}
+
 pub struct Fs {
+    id: String,
     pub(crate) queues: Vec<VirtQueue>,
     pub(crate) queue_events: Vec<EventFd>,
     pub(crate) avail_features: u64,
@@ -55,16 +167,30 @@ pub struct Fs {
     pub(crate) device_state: DeviceState,
     config: VirtioFsConfig,
     shm_region: Option<VirtioShmRegion>,
-    server: Server<PassthroughFs>,
+    server: Arc<FsServer>,
+    // The maximum transfer size asked for, which is fitted to the queue sizes negotiated by the
+    // driver on activation.
+    max_buffer_size: u32,
+    // Handles the requests waiting for the disk, once the device is activated.
+    sync_worker: Option<SyncWorker>,
+    notifier: Notifier,
     intc: Option<Arc<Mutex<Gic>>>,
     irq_line: Option<u32>,
 }
 
 impl Fs {
+    #[allow(clippy::too_many_arguments)]
     pub(crate) fn with_queues(
         fs_id: String,
         shared_dir: String,
         mapped_volumes: Option<Vec<(PathBuf, PathBuf)>>,
+        root_layers: Option<Vec<PathBuf>>,
+        root_archive: Option<PathBuf>,
+        scratch_size: Option<u64>,
+        max_buffer_size: Option<u32>,
+        inode_file_handles: bool,
+        trace_dir: Option<PathBuf>,
+        prefetch_dir: Option<PathBuf>,
         queues: Vec<VirtQueue>,
     ) -> super::Result<Fs> {
         let mut queue_events = Vec::new();
@@ -73,18 +199,100 @@ impl Fs {
                 .push(EventFd::new(utils::eventfd::EFD_NONBLOCK).map_err(FsError::EventFd)?);
         }
 
+        let file_name = fs_id.trim_start_matches('/').replace('/', "_");
+        // Each device needs an id of its own to be registered.
+        let id = format!("{}_{}", defs::FS_DEV_ID, file_name);
+        // The FUSE requests received are recorded in "<tag>.trace", to replay them later with
+        // the fs-replay tool.
+        let trace_path = trace_dir.map(|dir| dir.join(format!("{}.trace", file_name)));
+        // Passthrough devices keep a "<tag>.prefetch" profile of the files read by the guest
+        // right after boot, to read them ahead on the next boots.
+        #[cfg(target_os = "linux")]
+        let prefetch_profile = prefetch_dir.map(|dir| dir.join(format!("{}.prefetch", file_name)));
+        #[cfg(not(target_os = "linux"))]
+        let _ = prefetch_dir;
+
         let tag = fs_id.into_bytes();
         let mut config = VirtioFsConfig::default();
         config.tag[..tag.len()].copy_from_slice(tag.as_slice());
         config.num_request_queues = 1;
-
-        let fs_cfg = passthrough::Config {
-            root_dir: shared_dir,
-            mapped_volumes,
-            ..Default::default()
+        config.notify_buf_size = NOTIFY_BUF_SIZE as u32;
+
+        let notifier = Notifier::new().map_err(FsError::EventFd)?;
+
+        // Until the driver sets up the queues, the most they can hold is all that's known.
+        let max_buffer_size = max_buffer_size.unwrap_or(DEFAULT_MAX_BUFFER_SIZE);
+        let queue_size = queues.iter().map(|q| q.get_max_size()).min().unwrap_or(0);
+        let initial_buffer_size = validate_max_buffer_size(max_buffer_size, queue_size);
+
+        let mut server = match (root_layers, root_archive, scratch_size) {
+            #[cfg(target_os = "linux")]
+            (_, _, Some(size_limit)) => {
+                let fs_cfg = memfs::Config {
+                    size_limit,
+                    ..Default::default()
+                };
+                FsServer::Mem(Server::new(
+                    MemFs::new(fs_cfg).map_err(FsError::CreateFs)?,
+                    initial_buffer_size,
+                ))
+            }
+            #[cfg(target_os = "linux")]
+            (_, Some(archive), None) => {
+                let fs_cfg = archive::Config {
+                    archive,
+                    ..Default::default()
+                };
+                FsServer::Archive(Server::new(
+                    ArchiveFs::new(fs_cfg).map_err(FsError::CreateFs)?,
+                    initial_buffer_size,
+                ))
+            }
+            // `shared_dir` holds the changes made on top of the read-only layers.
+            #[cfg(target_os = "linux")]
+            (Some(lower_dirs), None, None) => {
+                let fs_cfg = overlay::Config {
+                    upper_dir: shared_dir,
+                    lower_dirs,
+                    ..Default::default()
+                };
+                FsServer::Overlay(Server::new(
+                    OverlayFs::new(fs_cfg).map_err(FsError::CreateFs)?,
+                    initial_buffer_size,
+                ))
+            }
+            _ => {
+                let fs_cfg = passthrough::Config {
+                    root_dir: shared_dir,
+                    mapped_volumes,
+                    ..Default::default()
+                };
+                #[cfg(target_os = "linux")]
+                let fs_cfg = passthrough::Config {
+                    notifier: Some(notifier.clone()),
+                    inode_file_handles,
+                    prefetch_profile,
+                    ..fs_cfg
+                };
+                // File handles are only available on Linux.
+                #[cfg(not(target_os = "linux"))]
+                let _ = inode_file_handles;
+                FsServer::Passthrough(Server::new(
+                    PassthroughFs::new(fs_cfg).unwrap(),
+                    initial_buffer_size,
+                ))
+            }
         };
 
+        if let Some(path) = trace_path {
+            match TraceWriter::create(&path) {
+                Ok(trace) => server.set_trace(trace),
+                Err(e) => error!("Failed to create FUSE trace {}: {}", path.display(), e),
+            }
+        }
+
         Ok(Fs {
+            id,
             queues,
             queue_events,
             avail_features: AVAIL_FEATURES,
@@ -95,32 +303,107 @@ impl Fs {
             device_state: DeviceState::Inactive,
             config,
             shm_region: None,
-            server: Server::new(PassthroughFs::new(fs_cfg).unwrap()),
+            server: Arc::new(server),
+            max_buffer_size,
+            sync_worker: None,
+            notifier,
             intc: None,
             irq_line: None,
         })
     }
 
+    #[allow(clippy::too_many_arguments)]
     pub fn new(
         fs_id: String,
         shared_dir: String,
         mapped_volumes: Option<Vec<(PathBuf, PathBuf)>>,
+        root_layers: Option<Vec<PathBuf>>,
+        root_archive: Option<PathBuf>,
+        scratch_size: Option<u64>,
+        max_buffer_size: Option<u32>,
+        inode_file_handles: bool,
+        trace_dir: Option<PathBuf>,
+        prefetch_dir: Option<PathBuf>,
     ) -> super::Result<Fs> {
         let queues: Vec<VirtQueue> = defs::QUEUE_SIZES
             .iter()
             .map(|&max_size| VirtQueue::new(max_size))
             .collect();
-        Self::with_queues(fs_id, shared_dir, mapped_volumes, queues)
+        Self::with_queues(
+            fs_id,
+            shared_dir,
+            mapped_volumes,
+            root_layers,
+            root_archive,
+            scratch_size,
+            max_buffer_size,
+            inode_file_handles,
+            trace_dir,
+            prefetch_dir,
+            queues,
+        )
     }
 
     pub fn id(&self) -> &str {
-        defs::FS_DEV_ID
+        &self.id
+    }
+
+    /// Returns the tag the guest knows the file system by.
+    pub fn tag(&self) -> String {
+        let len = self
+            .config
+            .tag
+            .iter()
+            .position(|b| *b == 0)
+            .unwrap_or(self.config.tag.len());
+        String::from_utf8_lossy(&self.config.tag[..len]).into_owned()
+    }
+
+    /// Returns the statistics of the FUSE requests served by this device. They can be read at
+    /// any time, without locking the device.
+    pub fn stats(&self) -> Arc<Stats> {
+        self.server.stats()
+    }
+
+    pub(crate) fn sync_worker_evt(&self) -> Option<&EventFd> {
+        self.sync_worker.as_ref().map(|w| w.evt())
+    }
+
+    /// Returns a handle that can be used to send FUSE notifications to the guest.
+    pub fn notifier(&self) -> Notifier {
+        self.notifier.clone()
+    }
+
+    pub(crate) fn notification_enabled(&self) -> bool {
+        self.acked_features & (1 << uapi::VIRTIO_FS_F_NOTIFICATION) != 0
+    }
+
+    pub(crate) fn req_index(&self) -> usize {
+        if self.notification_enabled() {
+            NOTIFY_INDEX + 1
+        } else {
+            REQ_INDEX
+        }
+    }
+
+    // Number of queues the driver is expected to set up, given the acknowledged features.
+    fn active_queues(&self) -> usize {
+        if self.notification_enabled() {
+            defs::NUM_QUEUES
+        } else {
+            defs::NUM_QUEUES - 1
+        }
     }
 
     pub fn set_intc(&mut self, intc: Arc<Mutex<Gic>>) {
         self.intc = Some(intc);
     }
 
+    /// Whether the device can make use of a DAX window, see `set_shm_region`.
+    pub fn uses_shm_region(&self) -> bool {
+        self.server.uses_shm_region()
+    }
+
     pub fn set_shm_region(&mut self, shm_region: VirtioShmRegion) {
         self.shm_region = Some(shm_region);
     }
@@ -144,22 +427,106 @@ impl Fs {
 
     pub(crate) fn handle_hpq_event(&mut self) {
         debug!("Fs: HPQ queue event");
-        if let Err(e) = self.queue_events[0].read() {
+        if let Err(e) = self.queue_events[HPQ_INDEX].read() {
             error!("Failed to get queue event: {:?}", e);
-        } else if self.process_queue(0) {
+        } else if self.process_queue(HPQ_INDEX) {
             let _ = self.signal_used_queue();
         }
     }
 
     pub(crate) fn handle_req_event(&mut self) {
         debug!("Fs: REQ queue event");
-        if let Err(e) = self.queue_events[1].read() {
+        let req_index = self.req_index();
+        if let Err(e) = self.queue_events[req_index].read() {
+            error!("Failed to get queue event: {:?}", e);
+        } else if self.process_queue(req_index) {
+            let _ = self.signal_used_queue();
+        }
+    }
+
+    pub(crate) fn handle_notify_queue_event(&mut self) {
+        debug!("Fs: notification queue event");
+        if let Err(e) = self.queue_events[NOTIFY_INDEX].read() {
             error!("Failed to get queue event: {:?}", e);
-        } else if self.process_queue(1) {
+        } else if self.process_notifications() {
             let _ = self.signal_used_queue();
         }
     }
 
+    pub(crate) fn handle_notifier_event(&mut self) {
+        debug!("Fs: notifier event");
+        if let Err(e) = self.notifier.evt().read() {
+            error!("Failed to get notifier event: {:?}", e);
+        } else if self.process_notifications() {
+            let _ = self.signal_used_queue();
+        }
+    }
+
+    pub(crate) fn handle_sync_worker_event(&mut self) {
+        debug!("Fs: sync worker event");
+        let worker = self.sync_worker.as_ref().unwrap();
+        if let Err(e) = worker.evt().read() {
+            error!("Failed to get sync worker event: {:?}", e);
+            return;
+        }
+
+        let mem = match self.device_state {
+            DeviceState::Activated(ref mem) => mem,
+            // This should never happen, it's been already validated in the event handler.
+            DeviceState::Inactive => unreachable!(),
+        };
+
+        let completions = worker.take_completions();
+        for c in completions.iter() {
+            self.queues[c.queue_index].add_used(mem, c.head_index, c.len);
+        }
+        if !completions.is_empty() {
+            let _ = self.signal_used_queue();
+        }
+    }
+
+    // Moves the pending notifications to the buffers the driver made available in the
+    // notification queue.
+    fn process_notifications(&mut self) -> bool {
+        let mem = match self.device_state {
+            DeviceState::Activated(ref mem) => mem,
+            // This should never happen, it's been already validated in the event handler.
+            DeviceState::Inactive => unreachable!(),
+        };
+
+        let queue = &mut self.queues[NOTIFY_INDEX];
+        let mut used_any = false;
+        while let Some(msg) = self.notifier.pop() {
+            let head = match queue.pop(mem) {
+                Some(head) => head,
+                None => {
+                    // We'll try again when the driver provides more buffers.
+                    self.notifier.unpop(msg);
+                    break;
+                }
+            };
+
+            let len = match Writer::new(mem, head.clone()) {
+                Ok(mut writer) => match writer.write_all(&msg) {
+                    Ok(()) => writer.bytes_written(),
+                    Err(e) => {
+                        error!("fs: failed to write notification: {:?}", e);
+                        0
+                    }
+                },
+                Err(e) => {
+                    error!("fs: invalid notification buffer: {:?}", e);
+                    0
+                }
+            };
+
+            queue.add_used(mem, head.index, len as u32);
+            used_any = true;
+        }
+
+        used_any
+    }
+
     pub(crate) fn process_queue(&mut self, queue_index: usize) -> bool {
         let mem = match self.device_state {
             DeviceState::Activated(ref mem) => mem,
@@ -173,16 +540,35 @@ impl Fs {
             let reader = Reader::new(mem, head.clone())
                 .map_err(FsError::QueueReader)
                 .unwrap();
+
+            // The requests waiting for the disk are completed later, by the worker.
+            if let Some(ref sync_worker) = self.sync_worker {
+                if worker::is_sync_request(&reader) {
+                    let req = SyncRequest {
+                        queue_index,
+                        desc_table: queue.desc_table,
+                        queue_size: queue.actual_size(),
+                        head_index: head.index,
+                    };
+                    match sync_worker.submit(req) {
+                        Ok(()) => continue,
+                        Err(_) => error!("fs: sync worker is gone, handling request in place"),
+                    }
+                }
+            }
+
             let writer = Writer::new(mem, head.clone())
                 .map_err(FsError::QueueWriter)
                 .unwrap();
 
-            self.server
+            let len = self
+                .server
                 .handle_message(reader, writer, self.shm_region.as_ref())
                 //.map_err(FsError::ProcessQueue)
                 .unwrap();
 
-            queue.add_used(mem, head.index, 0);
+            // Like the requests completed by the worker, report the length of the reply.
+            queue.add_used(mem, head.index, len as u32);
             used_any = true;
         }
 
@@ -190,6 +576,29 @@ impl Fs {
     }
 }
 
+// Adjusts the requested maximum transfer size so a request of that size always fits in a queue
+// of `queue_size` descriptors, given that the driver may use one descriptor per page.
+fn validate_max_buffer_size(requested: u32, queue_size: u16) -> u32 {
+    // Safe because this doesn't modify any memory and has no failure modes we care about.
+    let page_size: u32 = unsafe { libc::sysconf(libc::_SC_PAGESIZE).try_into().unwrap() };
+
+    let max_pages = (queue_size as u32).saturating_sub(REQUEST_HEADER_DESCRIPTORS);
+    let limit = cmp::min(max_pages.saturating_mul(page_size), MAX_MAX_BUFFER_SIZE);
+
+    let size = if requested > limit {
+        warn!(
+            "fs: max buffer size {} doesn't fit in the queue, using {}",
+            requested, limit
+        );
+        limit
+    } else {
+        requested
+    };
+
+    // The size is negotiated as a number of pages.
+    cmp::max(size - size % page_size, page_size)
+}
+
 impl VirtioDevice for Fs {
     fn avail_features(&self) -> u64 {
         self.avail_features
@@ -208,11 +617,12 @@ impl VirtioDevice for Fs {
     }
 
     fn queues(&self) -> &[VirtQueue] {
-        &self.queues
+        &self.queues[..self.active_queues()]
     }
 
     fn queues_mut(&mut self) -> &mut [VirtQueue] {
-        &mut self.queues
+        let active_queues = self.active_queues();
+        &mut self.queues[..active_queues]
     }
 
     fn queue_events(&self) -> &[EventFd] {
@@ -268,6 +678,28 @@ impl VirtioDevice for Fs {
             return Err(ActivateError::BadActivate);
         }
 
+        // A request must fit in the queues the driver actually set up, which may be smaller than
+        // the ones offered. The notification queue is left unset unless it was negotiated.
+        let queue_size = self
+            .queues()
+            .iter()
+            .map(|q| q.actual_size())
+            .min()
+            .unwrap_or(0);
+        self.server
+            .set_max_buffer_size(validate_max_buffer_size(self.max_buffer_size, queue_size));
+
+        let server = self.server.clone();
+        self.sync_worker = SyncWorker::start(mem.clone(), move |r, w| {
+            server.handle_message(r, w, None).unwrap_or_else(|e| {
+                error!("fs sync: failed to handle request: {:?}", e);
+                0
+            })
+        })
+        .map_err(|e| error!("fs: failed to start sync worker: {:?}", e))
+        .ok();
+
+        self.notifier.set_enabled(self.notification_enabled());
         self.device_state = DeviceState::Activated(mem);
 
         Ok(())
@@ -284,3 +716,55 @@ impl VirtioDevice for Fs {
         self.shm_region.as_ref()
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_validate_max_buffer_size() {
+        // Safe because this doesn't modify any memory.
+        let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u32;
+
+        assert_eq!(
+            validate_max_buffer_size(DEFAULT_MAX_BUFFER_SIZE, 1024),
+            cmp::min(DEFAULT_MAX_BUFFER_SIZE, 1020 * page_size)
+        );
+        // Capped by the number of descriptors in the queue.
+        assert_eq!(validate_max_buffer_size(u32::MAX, 64), 60 * page_size);
+        // Rounded down to whole pages, but never below a single page.
+        assert_eq!(
+            validate_max_buffer_size(3 * page_size + 1, 1024),
+            3 * page_size
+        );
+        assert_eq!(validate_max_buffer_size(1, 1024), page_size);
+    }
+
+    #[test]
+    fn test_activate_queue_size() {
+        let mut fs = Fs::new(
+            "test".to_string(),
+            std::env::temp_dir().to_str().unwrap().to_string(),
+            None,
+            None,
+            None,
+            None,
+            None,
+            false,
+            None,
+            None,
+        )
+        .unwrap();
+
+        // Without notifications, the driver only sets up the high priority and request queues.
+        fs.queues[HPQ_INDEX].size = 128;
+        fs.queues[REQ_INDEX].size = 256;
+        let mem = GuestMemoryMmap::from_ranges(&[(vm_memory::GuestAddress(0), 0x10000)]).unwrap();
+        fs.activate(mem).unwrap();
+
+        assert_eq!(
+            fs.server.max_buffer_size(),
+            validate_max_buffer_size(DEFAULT_MAX_BUFFER_SIZE, 128)
+        );
+    }
+}
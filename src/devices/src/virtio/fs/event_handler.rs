@@ -3,7 +3,7 @@ use std::os::unix::io::AsRawFd;
 use polly::event_manager::{EventManager, Subscriber};
 use utils::epoll::{EpollEvent, EventSet};
 
-use super::device::{Fs, HPQ_INDEX, REQ_INDEX};
+use super::device::{Fs, HPQ_INDEX, NOTIFY_INDEX};
 use crate::virtio::device::VirtioDevice;
 
 impl Fs {
@@ -32,12 +32,13 @@ impl Fs {
                 error!("Failed to register fs hpq with event manager: {:?}", e);
             });
 
+        let req_index = self.req_index();
         event_manager
             .register(
-                self.queue_events[REQ_INDEX].as_raw_fd(),
+                self.queue_events[req_index].as_raw_fd(),
                 EpollEvent::new(
                     EventSet::IN,
-                    self.queue_events[REQ_INDEX].as_raw_fd() as u64,
+                    self.queue_events[req_index].as_raw_fd() as u64,
                 ),
                 self_subscriber.clone(),
             )
@@ -45,6 +46,44 @@ impl Fs {
                 error!("Failed to register fs req with event manager: {:?}", e);
             });
 
+        if self.notification_enabled() {
+            event_manager
+                .register(
+                    self.queue_events[NOTIFY_INDEX].as_raw_fd(),
+                    EpollEvent::new(
+                        EventSet::IN,
+                        self.queue_events[NOTIFY_INDEX].as_raw_fd() as u64,
+                    ),
+                    self_subscriber.clone(),
+                )
+                .unwrap_or_else(|e| {
+                    error!("Failed to register fs notq with event manager: {:?}", e);
+                });
+
+            let notifier = self.notifier();
+            event_manager
+                .register(
+                    notifier.evt().as_raw_fd(),
+                    EpollEvent::new(EventSet::IN, notifier.evt().as_raw_fd() as u64),
+                    self_subscriber.clone(),
+                )
+                .unwrap_or_else(|e| {
+                    error!("Failed to register fs notifier with event manager: {:?}", e);
+                });
+        }
+
+        if let Some(evt) = self.sync_worker_evt() {
+            event_manager
+                .register(
+                    evt.as_raw_fd(),
+                    EpollEvent::new(EventSet::IN, evt.as_raw_fd() as u64),
+                    self_subscriber.clone(),
+                )
+                .unwrap_or_else(|e| {
+                    error!("Failed to register fs sync evt with event manager: {:?}", e);
+                });
+        }
+
         event_manager
             .unregister(self.activate_evt.as_raw_fd())
             .unwrap_or_else(|e| {
@@ -57,13 +96,22 @@ impl Subscriber for Fs {
     fn process(&mut self, event: &EpollEvent, event_manager: &mut EventManager) {
         let source = event.fd();
         let hpq = self.queue_events[HPQ_INDEX].as_raw_fd();
-        let req = self.queue_events[REQ_INDEX].as_raw_fd();
+        let req = self.queue_events[self.req_index()].as_raw_fd();
         let activate_evt = self.activate_evt.as_raw_fd();
+        let notify_evt = self.notifier().evt().as_raw_fd();
+        let sync_evt = self.sync_worker_evt().map(|evt| evt.as_raw_fd());
 
         if self.is_activated() {
             match source {
                 _ if source == hpq => self.handle_hpq_event(),
                 _ if source == req => self.handle_req_event(),
+                _ if self.notification_enabled()
+                    && source == self.queue_events[NOTIFY_INDEX].as_raw_fd() =>
+                {
+                    self.handle_notify_queue_event()
+                }
+                _ if source == notify_evt => self.handle_notifier_event(),
+                _ if Some(source) == sync_evt => self.handle_sync_worker_event(),
                 _ if source == activate_evt => {
                     self.handle_activate_event(event_manager);
                 }
@@ -13,6 +13,7 @@ use super::bindings;
 use super::fuse;
 
 pub use super::fuse::FsOptions;
+pub use fuse::IoctlFlags;
 pub use fuse::OpenOptions;
 pub use fuse::RemovemappingOne;
 pub use fuse::SetattrValid;
@@ -1132,8 +1133,25 @@ pub trait FileSystem {
         Err(io::Error::from_raw_os_error(bindings::LINUX_ENOSYS))
     }
 
-    /// TODO: support this
-    fn ioctl(&self) -> io::Result<()> {
+    /// Perform an ioctl on a file or directory.
+    ///
+    /// `handle` is the file handle previously returned by `open` or `opendir`. `cmd` and `arg`
+    /// are the values passed by the client to the ioctl, and `in_size` bytes of input data for
+    /// the ioctl can be read from `r`. On success, the returned data is sent back to the client
+    /// as the output of the ioctl, and must not be larger than `out_size`.
+    #[allow(clippy::too_many_arguments)]
+    fn ioctl<R: io::Read>(
+        &self,
+        ctx: Context,
+        inode: Self::Inode,
+        handle: Self::Handle,
+        flags: IoctlFlags,
+        cmd: u32,
+        arg: u64,
+        in_size: u32,
+        out_size: u32,
+        r: R,
+    ) -> io::Result<Vec<u8>> {
         Err(io::Error::from_raw_os_error(bindings::LINUX_ENOSYS))
     }
 
@@ -0,0 +1,1112 @@
+use std::collections::BTreeMap;
+use std::ffi::{CStr, CString};
+use std::fs::File;
+use std::io;
+use std::mem;
+use std::os::unix::io::AsRawFd;
+use std::path::PathBuf;
+use std::ptr;
+use std::slice;
+use std::time::Duration;
+
+use super::super::filesystem::{
+    Context, DirEntry, Entry, FileSystem, FsOptions, GetxattrReply, ListxattrReply, OpenOptions,
+    SetattrValid, ZeroCopyReader, ZeroCopyWriter,
+};
+use super::super::fuse;
+use super::passthrough::{ebadf, INIT_BINARY};
+
+const INIT_CSTR: &[u8] = b"init.krun\0";
+
+// Size of the tar headers and the unit the contents of the entries are padded to.
+const BLOCK_SIZE: usize = 512;
+
+// Prefix of the PAX records holding the extended attributes of an entry.
+const PAX_XATTR_PREFIX: &[u8] = b"SCHILY.xattr.";
+
+type Inode = u64;
+type Handle = u64;
+
+// Where the inodes are in `Index::nodes`. The root comes first, followed by the init binary.
+const INIT_INODE: Inode = fuse::ROOT_ID + 1;
+
+fn einval() -> io::Error {
+    io::Error::from_raw_os_error(libc::EINVAL)
+}
+
+fn erofs() -> io::Error {
+    io::Error::from_raw_os_error(libc::EROFS)
+}
+
+fn bad_archive(msg: &str) -> io::Error {
+    io::Error::new(
+        io::ErrorKind::InvalidData,
+        format!("malformed archive: {}", msg),
+    )
+}
+
+// Same encoding as glibc's `makedev`.
+fn makedev(major: u64, minor: u64) -> u64 {
+    ((major & 0xffff_f000) << 32)
+        | ((major & 0xfff) << 8)
+        | ((minor & 0xffff_ff00) << 12)
+        | (minor & 0xff)
+}
+
+// The bytes of a header field, up to the first nul byte.
+fn field(buf: &[u8]) -> &[u8] {
+    &buf[..buf.iter().position(|c| *c == 0).unwrap_or(buf.len())]
+}
+
+// Parses a numeric header field, either in octal or, for values too large for it, in the
+// base-256 encoding used by GNU tar.
+fn parse_num(buf: &[u8]) -> io::Result<u64> {
+    if buf[0] & 0x80 != 0 {
+        return buf[1..].iter().try_fold(u64::from(buf[0] & 0x7f), |n, c| {
+            n.checked_mul(256)
+                .map(|n| n | u64::from(*c))
+                .ok_or_else(|| bad_archive("numeric field overflow"))
+        });
+    }
+
+    let digits = field(buf);
+    let digits = std::str::from_utf8(digits)
+        .map_err(|_| bad_archive("numeric field"))?
+        .trim_matches(|c| c == ' ' || c == '\0');
+    if digits.is_empty() {
+        return Ok(0);
+    }
+
+    u64::from_str_radix(digits, 8).map_err(|_| bad_archive("numeric field"))
+}
+
+fn parse_decimal(buf: &[u8]) -> io::Result<u64> {
+    std::str::from_utf8(buf)
+        .ok()
+        .and_then(|s| s.parse().ok())
+        .ok_or_else(|| bad_archive("PAX record"))
+}
+
+// A read-only mapping of the whole archive.
+struct Mapping {
+    addr: *mut libc::c_void,
+    len: usize,
+}
+
+// Safe because the mapping is never written to and lives as long as the struct.
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    fn new(f: &File) -> io::Result<Mapping> {
+        let len = f.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(bad_archive("empty file"));
+        }
+
+        // Safe because we check the return value and the mapping is only accessed within `len`.
+        let addr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                f.as_raw_fd(),
+                0,
+            )
+        };
+        if addr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(Mapping { addr, len })
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        // Safe because the mapping is valid for `len` bytes until we drop it.
+        unsafe { slice::from_raw_parts(self.addr as *const u8, self.len) }
+    }
+}
+
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        // Safe because we own the mapping and nobody can use it anymore.
+        unsafe { libc::munmap(self.addr, self.len) };
+    }
+}
+
+enum NodeKind {
+    Dir(BTreeMap<CString, Inode>),
+    // Where the contents start in the archive. The size is in the attributes.
+    File(usize),
+    Symlink(Vec<u8>),
+    // Devices, fifos and sockets.
+    Special,
+    Init,
+}
+
+struct Node {
+    attr: libc::stat64,
+    kind: NodeKind,
+    xattrs: Vec<(CString, Vec<u8>)>,
+}
+
+// Attributes of an archive entry, after applying the extended headers that precede it.
+#[derive(Default)]
+struct Header {
+    path: Vec<u8>,
+    link: Vec<u8>,
+    type_: u8,
+    mode: u32,
+    uid: u32,
+    gid: u32,
+    size: u64,
+    mtime: i64,
+    rdev: u64,
+    xattrs: Vec<(CString, Vec<u8>)>,
+}
+
+// Values from GNU long name and PAX headers, which apply to the next entry.
+#[derive(Default)]
+struct Overrides {
+    path: Option<Vec<u8>>,
+    link: Option<Vec<u8>>,
+    size: Option<u64>,
+    uid: Option<u32>,
+    gid: Option<u32>,
+    mtime: Option<i64>,
+    xattrs: Vec<(CString, Vec<u8>)>,
+}
+
+impl Overrides {
+    fn parse_pax(&mut self, data: &[u8]) -> io::Result<()> {
+        let mut rem = data;
+        while !rem.is_empty() {
+            // Each record is "<length> <key>=<value>\n", where the length covers the whole
+            // record.
+            let space = rem
+                .iter()
+                .position(|c| *c == b' ')
+                .ok_or_else(|| bad_archive("PAX record"))?;
+            let len = parse_decimal(&rem[..space])? as usize;
+            if len <= space + 1 || len > rem.len() || rem[len - 1] != b'\n' {
+                return Err(bad_archive("PAX record"));
+            }
+
+            let record = &rem[space + 1..len - 1];
+            rem = &rem[len..];
+
+            let eq = record
+                .iter()
+                .position(|c| *c == b'=')
+                .ok_or_else(|| bad_archive("PAX record"))?;
+            let (key, value) = (&record[..eq], &record[eq + 1..]);
+            match key {
+                b"path" => self.path = Some(value.to_vec()),
+                b"linkpath" => self.link = Some(value.to_vec()),
+                b"size" => self.size = Some(parse_decimal(value)?),
+                b"uid" => self.uid = Some(parse_decimal(value)? as u32),
+                b"gid" => self.gid = Some(parse_decimal(value)? as u32),
+                b"mtime" => {
+                    // May have a fractional part, which we don't keep.
+                    let secs = value.split(|c| *c == b'.').next().unwrap_or(value);
+                    self.mtime = Some(parse_decimal(secs)? as i64);
+                }
+                _ if key.starts_with(PAX_XATTR_PREFIX) => {
+                    let name = CString::new(&key[PAX_XATTR_PREFIX.len()..])
+                        .map_err(|_| bad_archive("xattr name"))?;
+                    self.xattrs.push((name, value.to_vec()));
+                }
+                _ => {}
+            }
+        }
+
+        Ok(())
+    }
+}
+
+// The tree of the archive, built by reading all its headers once.
+struct Index {
+    nodes: Vec<Node>,
+}
+
+impl Index {
+    fn new() -> Index {
+        let mut index = Index { nodes: Vec::new() };
+        index.push(
+            libc::S_IFDIR | 0o755,
+            0,
+            NodeKind::Dir(BTreeMap::new()),
+            Vec::new(),
+        );
+        index.push(
+            libc::S_IFREG | 0o755,
+            INIT_BINARY.len() as u64,
+            NodeKind::Init,
+            Vec::new(),
+        );
+        index
+    }
+
+    fn get(&self, inode: Inode) -> io::Result<&Node> {
+        inode
+            .checked_sub(fuse::ROOT_ID)
+            .and_then(|i| self.nodes.get(i as usize))
+            .ok_or_else(ebadf)
+    }
+
+    fn get_mut(&mut self, inode: Inode) -> &mut Node {
+        &mut self.nodes[(inode - fuse::ROOT_ID) as usize]
+    }
+
+    fn push(
+        &mut self,
+        mode: u32,
+        size: u64,
+        kind: NodeKind,
+        xattrs: Vec<(CString, Vec<u8>)>,
+    ) -> Inode {
+        let inode = fuse::ROOT_ID + self.nodes.len() as u64;
+
+        // Safe because a zeroed stat64 is a valid value.
+        let mut attr: libc::stat64 = unsafe { mem::zeroed() };
+        attr.st_ino = inode;
+        attr.st_mode = mode;
+        attr.st_nlink = 1;
+        attr.st_size = size as i64;
+        attr.st_blksize = 4096;
+        attr.st_blocks = ((size + 511) / 512) as i64;
+
+        self.nodes.push(Node { attr, kind, xattrs });
+        inode
+    }
+
+    fn entries(&self, inode: Inode) -> io::Result<&BTreeMap<CString, Inode>> {
+        match self.get(inode)?.kind {
+            NodeKind::Dir(ref entries) => Ok(entries),
+            _ => Err(io::Error::from_raw_os_error(libc::ENOTDIR)),
+        }
+    }
+
+    fn insert(&mut self, parent: Inode, name: CString, inode: Inode) {
+        let old = match self.get_mut(parent).kind {
+            NodeKind::Dir(ref mut entries) => entries.insert(name, inode),
+            _ => unreachable!(),
+        };
+
+        // An entry replaced by a later one with the same path loses a link.
+        if let Some(old) = old {
+            let attr = &mut self.get_mut(old).attr;
+            attr.st_nlink = attr.st_nlink.saturating_sub(1);
+        }
+    }
+
+    // Splits an archive path into its components, ignoring leading slashes and "." components.
+    fn components(path: &[u8]) -> io::Result<Vec<CString>> {
+        path.split(|c| *c == b'/')
+            .filter(|c| !c.is_empty() && *c != b".")
+            .map(|c| {
+                if c == b".." {
+                    Err(bad_archive("path escapes the root"))
+                } else {
+                    CString::new(c).map_err(|_| bad_archive("nul byte in path"))
+                }
+            })
+            .collect()
+    }
+
+    // Returns the directory at `path`, creating the missing ones.
+    fn make_dirs(&mut self, path: &[CString]) -> io::Result<Inode> {
+        let mut dir = fuse::ROOT_ID;
+        for name in path {
+            dir = match self.entries(dir)?.get(name) {
+                Some(inode) => *inode,
+                None => {
+                    let inode = self.push(
+                        libc::S_IFDIR | 0o755,
+                        0,
+                        NodeKind::Dir(BTreeMap::new()),
+                        Vec::new(),
+                    );
+                    self.insert(dir, name.clone(), inode);
+                    inode
+                }
+            };
+        }
+
+        Ok(dir)
+    }
+
+    fn resolve(&self, path: &[CString]) -> io::Result<Inode> {
+        path.iter().try_fold(fuse::ROOT_ID, |dir, name| {
+            self.entries(dir)?
+                .get(name)
+                .copied()
+                .ok_or_else(|| bad_archive("hard link to a missing entry"))
+        })
+    }
+
+    fn add(&mut self, h: Header, data_offset: usize) -> io::Result<()> {
+        let mut path = Self::components(&h.path)?;
+        let name = match path.pop() {
+            Some(name) => name,
+            // The root itself, as in "./".
+            None if h.type_ == b'5' => {
+                self.set_attr(fuse::ROOT_ID, &h);
+                return Ok(());
+            }
+            None => return Err(bad_archive("empty path")),
+        };
+        let parent = self.make_dirs(&path)?;
+
+        let (fmt, kind) = match h.type_ {
+            b'0' | b'\0' | b'7' => (libc::S_IFREG, NodeKind::File(data_offset)),
+            b'1' => {
+                let target = self.resolve(&Self::components(&h.link)?)?;
+                if let NodeKind::Dir(_) = self.get(target)?.kind {
+                    return Err(bad_archive("hard link to a directory"));
+                }
+                self.get_mut(target).attr.st_nlink += 1;
+                self.insert(parent, name, target);
+                return Ok(());
+            }
+            b'2' => (libc::S_IFLNK, NodeKind::Symlink(h.link.clone())),
+            b'3' => (libc::S_IFCHR, NodeKind::Special),
+            b'4' => (libc::S_IFBLK, NodeKind::Special),
+            b'5' => {
+                // Directories may show up after their contents, or more than once.
+                let existing = self.entries(parent)?.get(&name).copied();
+                if let Some(inode) = existing {
+                    if let NodeKind::Dir(_) = self.get(inode)?.kind {
+                        self.set_attr(inode, &h);
+                        return Ok(());
+                    }
+                }
+                (libc::S_IFDIR, NodeKind::Dir(BTreeMap::new()))
+            }
+            b'6' => (libc::S_IFIFO, NodeKind::Special),
+            _ => {
+                warn!(
+                    "archive: ignoring entry of unknown type {:?}: {}",
+                    h.type_ as char,
+                    String::from_utf8_lossy(&h.path)
+                );
+                return Ok(());
+            }
+        };
+
+        let size = match kind {
+            NodeKind::File(_) => h.size,
+            NodeKind::Symlink(ref link) => link.len() as u64,
+            _ => 0,
+        };
+        let inode = self.push(fmt, size, kind, Vec::new());
+        self.set_attr(inode, &h);
+        self.insert(parent, name, inode);
+
+        Ok(())
+    }
+
+    fn set_attr(&mut self, inode: Inode, h: &Header) {
+        let node = self.get_mut(inode);
+        node.attr.st_mode = (node.attr.st_mode & libc::S_IFMT) | (h.mode & 0o7777);
+        node.attr.st_uid = h.uid;
+        node.attr.st_gid = h.gid;
+        node.attr.st_rdev = h.rdev;
+        node.attr.st_mtime = h.mtime;
+        node.attr.st_atime = h.mtime;
+        node.attr.st_ctime = h.mtime;
+        node.xattrs = h.xattrs.clone();
+    }
+
+    // Fills in what can only be known once all the entries are in.
+    fn finish(&mut self) {
+        for i in 0..self.nodes.len() {
+            let subdirs = match self.nodes[i].kind {
+                NodeKind::Dir(ref entries) => entries
+                    .values()
+                    .filter(|inode| {
+                        matches!(
+                            self.nodes[(**inode - fuse::ROOT_ID) as usize].kind,
+                            NodeKind::Dir(_)
+                        )
+                    })
+                    .count(),
+                _ => continue,
+            };
+            self.nodes[i].attr.st_nlink = 2 + subdirs as libc::nlink_t;
+        }
+
+        // The init binary always takes precedence over anything in the archive.
+        let init = CStr::from_bytes_with_nul(INIT_CSTR).unwrap().to_owned();
+        self.insert(fuse::ROOT_ID, init, INIT_INODE);
+    }
+
+    // Reads the headers of a tar archive.
+    fn parse(data: &[u8]) -> io::Result<Index> {
+        let mut index = Index::new();
+        let mut overrides = Overrides::default();
+        let mut off = 0;
+
+        while off + BLOCK_SIZE <= data.len() {
+            let block = &data[off..off + BLOCK_SIZE];
+            // The archive ends with zeroed blocks.
+            if block.iter().all(|c| *c == 0) {
+                break;
+            }
+
+            // The checksum is computed with its own field filled with spaces.
+            let sum: u64 = block
+                .iter()
+                .enumerate()
+                .map(|(i, c)| {
+                    if (148..156).contains(&i) {
+                        u64::from(b' ')
+                    } else {
+                        u64::from(*c)
+                    }
+                })
+                .sum();
+            if sum != parse_num(&block[148..156])? {
+                return Err(bad_archive("bad header checksum"));
+            }
+
+            let type_ = block[156];
+            let size = match overrides.size {
+                Some(size) if type_ != b'x' && type_ != b'L' && type_ != b'K' => size,
+                _ => parse_num(&block[124..136])?,
+            };
+            let data_offset = off + BLOCK_SIZE;
+            let data_end = data_offset
+                .checked_add(size as usize)
+                .filter(|end| *end <= data.len())
+                .ok_or_else(|| bad_archive("truncated entry"))?;
+            let contents = &data[data_offset..data_end];
+
+            match type_ {
+                b'L' => overrides.path = Some(field(contents).to_vec()),
+                b'K' => overrides.link = Some(field(contents).to_vec()),
+                b'x' => overrides.parse_pax(contents)?,
+                // Global PAX headers only carry values we have no use for.
+                b'g' => {}
+                _ => {
+                    let mut path = field(&block[..100]).to_vec();
+                    // The "ustar" format may split long paths in two. GNU headers, with a
+                    // "ustar  " magic, keep other fields where the prefix would be.
+                    let prefix = field(&block[345..500]);
+                    if &block[257..263] == b"ustar\0" && !prefix.is_empty() {
+                        path = [prefix, b"/", &path].concat();
+                    }
+
+                    let overrides = mem::take(&mut overrides);
+                    let h = Header {
+                        path: overrides.path.unwrap_or(path),
+                        link: overrides
+                            .link
+                            .unwrap_or_else(|| field(&block[157..257]).to_vec()),
+                        type_,
+                        mode: parse_num(&block[100..108])? as u32,
+                        uid: overrides
+                            .uid
+                            .map_or_else(|| parse_num(&block[108..116]).map(|n| n as u32), Ok)?,
+                        gid: overrides
+                            .gid
+                            .map_or_else(|| parse_num(&block[116..124]).map(|n| n as u32), Ok)?,
+                        size,
+                        mtime: overrides
+                            .mtime
+                            .map_or_else(|| parse_num(&block[136..148]).map(|n| n as i64), Ok)?,
+                        rdev: makedev(parse_num(&block[329..337])?, parse_num(&block[337..345])?),
+                        xattrs: overrides.xattrs,
+                    };
+                    index.add(h, data_offset)?;
+                }
+            }
+
+            // The contents are padded to a whole number of blocks.
+            off = data_offset + (size as usize + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        }
+
+        index.finish();
+        Ok(index)
+    }
+}
+
+/// Options that configure the behavior of the file system.
+#[derive(Debug, Clone)]
+pub struct Config {
+    /// How long the FUSE client should consider directory entries to be valid. The contents of
+    /// the archive never change, so it may as well cache them for as long as it wants.
+    ///
+    /// The default value for this option is 1 day.
+    pub entry_timeout: Duration,
+
+    /// How long the FUSE client should consider file and directory attributes to be valid.
+    ///
+    /// The default value for this option is 1 day.
+    pub attr_timeout: Duration,
+
+    /// The tar archive with the tree to serve.
+    pub archive: PathBuf,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            entry_timeout: Duration::from_secs(86400),
+            attr_timeout: Duration::from_secs(86400),
+            archive: PathBuf::new(),
+        }
+    }
+}
+
+/// A read-only file system that serves the tree stored in a tar archive, without unpacking it.
+///
+/// The headers of the archive are read once to build an index of the tree in memory, so lookups
+/// and attributes never reach the host. The archive is mapped in memory and the contents of the
+/// files are copied from there, so serving the whole tree only takes one fd. PAX and GNU
+/// extensions for long names, large files and extended attributes are supported.
+pub struct ArchiveFs {
+    index: Index,
+    map: Mapping,
+    cfg: Config,
+}
+
+impl ArchiveFs {
+    pub fn new(cfg: Config) -> io::Result<ArchiveFs> {
+        let file = File::open(&cfg.archive)?;
+        let map = Mapping::new(&file)?;
+        let index = Index::parse(map.as_slice())?;
+
+        debug!(
+            "archive: indexed {} inodes from {:?}",
+            index.nodes.len(),
+            cfg.archive
+        );
+
+        Ok(ArchiveFs { index, map, cfg })
+    }
+
+    fn entry(&self, inode: Inode) -> io::Result<Entry> {
+        Ok(Entry {
+            inode,
+            generation: 0,
+            attr: self.index.get(inode)?.attr,
+            attr_timeout: self.cfg.attr_timeout,
+            entry_timeout: self.cfg.entry_timeout,
+        })
+    }
+}
+
+impl FileSystem for ArchiveFs {
+    type Inode = Inode;
+    type Handle = Handle;
+
+    fn init(&self, _capable: FsOptions) -> io::Result<FsOptions> {
+        Ok(FsOptions::DO_READDIRPLUS
+            | FsOptions::READDIRPLUS_AUTO
+            | FsOptions::CACHE_SYMLINKS
+            | FsOptions::PARALLEL_DIROPS)
+    }
+
+    fn statfs(&self, _ctx: Context, _inode: Inode) -> io::Result<libc::statvfs64> {
+        // Safe because a zeroed statvfs64 is a valid value.
+        let mut st: libc::statvfs64 = unsafe { mem::zeroed() };
+        st.f_bsize = 4096;
+        st.f_frsize = 4096;
+        st.f_blocks = (self.map.len as u64 + 4095) / 4096;
+        st.f_files = self.index.nodes.len() as u64;
+        st.f_namemax = 255;
+        st.f_flag = libc::ST_RDONLY;
+
+        Ok(st)
+    }
+
+    fn lookup(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<Entry> {
+        let inode = self
+            .index
+            .entries(parent)?
+            .get(name)
+            .copied()
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::ENOENT))?;
+
+        self.entry(inode)
+    }
+
+    fn getattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Option<Handle>,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        Ok((self.index.get(inode)?.attr, self.cfg.attr_timeout))
+    }
+
+    fn readlink(&self, _ctx: Context, inode: Inode) -> io::Result<Vec<u8>> {
+        match self.index.get(inode)?.kind {
+            NodeKind::Symlink(ref link) => Ok(link.clone()),
+            _ => Err(einval()),
+        }
+    }
+
+    fn open(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        let flags = flags as i32;
+        if flags & libc::O_ACCMODE != libc::O_RDONLY || flags & libc::O_TRUNC != 0 {
+            return Err(erofs());
+        }
+
+        match self.index.get(inode)?.kind {
+            NodeKind::Dir(_) => Err(io::Error::from_raw_os_error(libc::EISDIR)),
+            // Reads don't need any state, and the cached contents are always valid.
+            _ => Ok((None, OpenOptions::KEEP_CACHE)),
+        }
+    }
+
+    fn read<W: io::Write + ZeroCopyWriter>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        mut w: W,
+        size: u32,
+        offset: u64,
+        _lock_owner: Option<u64>,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        let node = self.index.get(inode)?;
+        let contents = match node.kind {
+            NodeKind::File(start) => {
+                &self.map.as_slice()[start..start + node.attr.st_size as usize]
+            }
+            NodeKind::Init => INIT_BINARY,
+            _ => return Err(einval()),
+        };
+
+        let start = std::cmp::min(offset, contents.len() as u64) as usize;
+        let end = std::cmp::min(start + size as usize, contents.len());
+        w.write(&contents[start..end])
+    }
+
+    fn release(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _flags: u32,
+        _handle: Handle,
+        _flush: bool,
+        _flock_release: bool,
+        _lock_owner: Option<u64>,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn opendir(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        self.index.entries(inode)?;
+
+        Ok((None, OpenOptions::CACHE_DIR))
+    }
+
+    fn readdir<F>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry) -> io::Result<usize>,
+    {
+        if size == 0 {
+            return Ok(());
+        }
+
+        let entries = self.index.entries(inode)?;
+        for (i, (name, inode)) in entries.iter().enumerate().skip(offset as usize) {
+            let attr = &self.index.get(*inode)?.attr;
+            let res = add_entry(DirEntry {
+                ino: *inode,
+                offset: i as u64 + 1,
+                type_: (attr.st_mode & libc::S_IFMT) >> 12,
+                name: name.to_bytes(),
+            })?;
+            if res == 0 {
+                break;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn readdirplus<F>(
+        &self,
+        ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry, Entry) -> io::Result<usize>,
+    {
+        self.readdir(ctx, inode, handle, size, offset, |dir_entry| {
+            let entry = self.entry(dir_entry.ino)?;
+            add_entry(dir_entry, entry)
+        })
+    }
+
+    fn releasedir(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _flags: u32,
+        _handle: Handle,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn access(&self, ctx: Context, inode: Inode, mask: u32) -> io::Result<()> {
+        let st = self.index.get(inode)?.attr;
+        let mode = mask as i32 & (libc::R_OK | libc::W_OK | libc::X_OK);
+
+        if mode == libc::F_OK {
+            return Ok(());
+        }
+
+        if (mode & libc::W_OK) != 0 {
+            return Err(erofs());
+        }
+
+        if (mode & libc::R_OK) != 0
+            && ctx.uid != 0
+            && (st.st_uid != ctx.uid || st.st_mode & 0o400 == 0)
+            && (st.st_gid != ctx.gid || st.st_mode & 0o040 == 0)
+            && st.st_mode & 0o004 == 0
+        {
+            return Err(io::Error::from_raw_os_error(libc::EACCES));
+        }
+
+        // root can only execute something if it is executable by one of the owner, the group, or
+        // everyone.
+        if (mode & libc::X_OK) != 0
+            && (ctx.uid != 0 || st.st_mode & 0o111 == 0)
+            && (st.st_uid != ctx.uid || st.st_mode & 0o100 == 0)
+            && (st.st_gid != ctx.gid || st.st_mode & 0o010 == 0)
+            && st.st_mode & 0o001 == 0
+        {
+            return Err(io::Error::from_raw_os_error(libc::EACCES));
+        }
+
+        Ok(())
+    }
+
+    fn getxattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        name: &CStr,
+        size: u32,
+    ) -> io::Result<GetxattrReply> {
+        let value = self
+            .index
+            .get(inode)?
+            .xattrs
+            .iter()
+            .find(|(n, _)| n.as_c_str() == name)
+            .map(|(_, v)| v)
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::ENODATA))?;
+
+        if size == 0 {
+            Ok(GetxattrReply::Count(value.len() as u32))
+        } else if value.len() > size as usize {
+            Err(io::Error::from_raw_os_error(libc::ERANGE))
+        } else {
+            Ok(GetxattrReply::Value(value.clone()))
+        }
+    }
+
+    fn listxattr(&self, _ctx: Context, inode: Inode, size: u32) -> io::Result<ListxattrReply> {
+        let mut names = Vec::new();
+        for (name, _) in self.index.get(inode)?.xattrs.iter() {
+            names.extend_from_slice(name.to_bytes_with_nul());
+        }
+
+        if size == 0 {
+            Ok(ListxattrReply::Count(names.len() as u32))
+        } else if names.len() > size as usize {
+            Err(io::Error::from_raw_os_error(libc::ERANGE))
+        } else {
+            Ok(ListxattrReply::Names(names))
+        }
+    }
+
+    fn setattr(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _attr: libc::stat64,
+        _handle: Option<Handle>,
+        _valid: SetattrValid,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        Err(erofs())
+    }
+
+    fn symlink(
+        &self,
+        _ctx: Context,
+        _linkname: &CStr,
+        _parent: Inode,
+        _name: &CStr,
+    ) -> io::Result<Entry> {
+        Err(erofs())
+    }
+
+    fn mknod(
+        &self,
+        _ctx: Context,
+        _parent: Inode,
+        _name: &CStr,
+        _mode: u32,
+        _rdev: u32,
+        _umask: u32,
+    ) -> io::Result<Entry> {
+        Err(erofs())
+    }
+
+    fn mkdir(
+        &self,
+        _ctx: Context,
+        _parent: Inode,
+        _name: &CStr,
+        _mode: u32,
+        _umask: u32,
+    ) -> io::Result<Entry> {
+        Err(erofs())
+    }
+
+    fn unlink(&self, _ctx: Context, _parent: Inode, _name: &CStr) -> io::Result<()> {
+        Err(erofs())
+    }
+
+    fn rmdir(&self, _ctx: Context, _parent: Inode, _name: &CStr) -> io::Result<()> {
+        Err(erofs())
+    }
+
+    fn rename(
+        &self,
+        _ctx: Context,
+        _olddir: Inode,
+        _oldname: &CStr,
+        _newdir: Inode,
+        _newname: &CStr,
+        _flags: u32,
+    ) -> io::Result<()> {
+        Err(erofs())
+    }
+
+    fn link(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _newparent: Inode,
+        _newname: &CStr,
+    ) -> io::Result<Entry> {
+        Err(erofs())
+    }
+
+    fn create(
+        &self,
+        _ctx: Context,
+        _parent: Inode,
+        _name: &CStr,
+        _mode: u32,
+        _flags: u32,
+        _umask: u32,
+    ) -> io::Result<(Entry, Option<Handle>, OpenOptions)> {
+        Err(erofs())
+    }
+
+    fn write<R: io::Read + ZeroCopyReader>(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _handle: Handle,
+        _r: R,
+        _size: u32,
+        _offset: u64,
+        _lock_owner: Option<u64>,
+        _delayed_write: bool,
+        _kill_priv: bool,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        Err(erofs())
+    }
+
+    fn setxattr(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _name: &CStr,
+        _value: &[u8],
+        _flags: u32,
+    ) -> io::Result<()> {
+        Err(erofs())
+    }
+
+    fn removexattr(&self, _ctx: Context, _inode: Inode, _name: &CStr) -> io::Result<()> {
+        Err(erofs())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::test_utils::{ctx, name, Dst};
+    use super::*;
+
+    // Builds a tar header block for an entry of `type_` with `size` bytes of contents.
+    fn header(path: &str, type_: u8, size: usize, link: &str) -> Vec<u8> {
+        let mut block = vec![0u8; BLOCK_SIZE];
+        block[..path.len()].copy_from_slice(path.as_bytes());
+        block[100..107].copy_from_slice(b"0000644");
+        block[108..115].copy_from_slice(b"0001750");
+        block[116..123].copy_from_slice(b"0001750");
+        block[124..135].copy_from_slice(format!("{:011o}", size).as_bytes());
+        block[136..147].copy_from_slice(b"14000000000");
+        block[156] = type_;
+        block[157..157 + link.len()].copy_from_slice(link.as_bytes());
+        block[257..263].copy_from_slice(b"ustar\0");
+        block[263..265].copy_from_slice(b"00");
+        checksum(&mut block);
+        block
+    }
+
+    fn checksum(block: &mut [u8]) {
+        block[148..156].copy_from_slice(b"        ");
+        let sum: u32 = block.iter().map(|c| u32::from(*c)).sum();
+        block[148..155].copy_from_slice(format!("{:06o}\0", sum).as_bytes());
+    }
+
+    fn entry(archive: &mut Vec<u8>, path: &str, type_: u8, contents: &[u8], link: &str) {
+        archive.extend(header(path, type_, contents.len(), link));
+        archive.extend_from_slice(contents);
+        let padding = (BLOCK_SIZE - contents.len() % BLOCK_SIZE) % BLOCK_SIZE;
+        archive.extend(vec![0u8; padding]);
+    }
+
+    #[test]
+    fn test_parse() {
+        let long = "d/".to_string() + &"x".repeat(150);
+        let record = format!(" path={}\n", long);
+        let pax = format!("{}{}", record.len() + 3, record);
+        let mut archive = Vec::new();
+        entry(&mut archive, "./d/", b'5', b"", "");
+        entry(&mut archive, "./d/file", b'0', b"hello", "");
+        entry(&mut archive, "./d/hard", b'1', b"", "./d/file");
+        entry(&mut archive, "./e/link", b'2', b"", "../d/file");
+        entry(&mut archive, "././@PaxHeader", b'x', pax.as_bytes(), "");
+        entry(&mut archive, "truncated", b'0', b"long", "");
+        // A GNU header, with the access and change times where "ustar" has the path prefix.
+        let mut gnu = header("gnu", b'0', 0, "");
+        gnu[257..265].copy_from_slice(b"ustar  \0");
+        gnu[345..356].copy_from_slice(b"14000000000");
+        checksum(&mut gnu);
+        archive.extend(gnu);
+        archive.extend(vec![0u8; 2 * BLOCK_SIZE]);
+
+        let index = Index::parse(&archive).unwrap();
+        let root = index.entries(fuse::ROOT_ID).unwrap();
+        assert_eq!(
+            root.keys().collect::<Vec<_>>(),
+            vec![&name("d"), &name("e"), &name("gnu"), &name("init.krun")]
+        );
+
+        let d = index.entries(root[&name("d")]).unwrap();
+        assert_eq!(d.len(), 3);
+        let file = index.get(d[&name("file")]).unwrap();
+        assert_eq!(file.attr.st_size, 5);
+        assert_eq!(file.attr.st_nlink, 2);
+        assert_eq!(file.attr.st_uid, 1000);
+        assert_eq!(d[&name("file")], d[&name("hard")]);
+        match file.kind {
+            NodeKind::File(start) => assert_eq!(&archive[start..start + 5], b"hello"),
+            _ => panic!("not a file"),
+        }
+        let long = index.get(d[&name(&"x".repeat(150))]).unwrap();
+        assert_eq!(long.attr.st_size, 4);
+
+        // Directories are created for entries without one.
+        let e = index.get(root[&name("e")]).unwrap();
+        assert_eq!(e.attr.st_mode, libc::S_IFDIR | 0o755);
+        let link = index.get(index.entries(root[&name("e")]).unwrap()[&name("link")]);
+        match link.unwrap().kind {
+            NodeKind::Symlink(ref target) => assert_eq!(target, b"../d/file"),
+            _ => panic!("not a symlink"),
+        }
+
+        archive[148] ^= 1;
+        assert!(Index::parse(&archive).is_err());
+    }
+
+    #[test]
+    fn test_read() {
+        let mut archive = Vec::new();
+        entry(&mut archive, "file", b'0', b"hello world", "");
+        archive.extend(vec![0u8; 2 * BLOCK_SIZE]);
+
+        let path = std::env::temp_dir().join(format!("archive-{}.tar", std::process::id()));
+        std::fs::write(&path, &archive).unwrap();
+        let fs = ArchiveFs::new(Config {
+            archive: path.clone(),
+            ..Default::default()
+        })
+        .unwrap();
+        std::fs::remove_file(&path).unwrap();
+
+        let file = fs.lookup(ctx(), fuse::ROOT_ID, &name("file")).unwrap();
+        assert!(fs.open(ctx(), file.inode, libc::O_RDWR as u32).is_err());
+        let (handle, _) = fs.open(ctx(), file.inode, libc::O_RDONLY as u32).unwrap();
+
+        let mut buf = Vec::new();
+        let read = |buf: &mut Vec<u8>, size, offset| {
+            buf.clear();
+            fs.read(
+                ctx(),
+                file.inode,
+                handle.unwrap_or(0),
+                Dst(buf),
+                size,
+                offset,
+                None,
+                0,
+            )
+            .unwrap()
+        };
+        assert_eq!(read(&mut buf, 5, 6), 5);
+        assert_eq!(buf, b"world");
+        // Reads are cut short at the end of the file.
+        assert_eq!(read(&mut buf, 4096, 0), 11);
+        assert_eq!(buf, b"hello world");
+        assert_eq!(read(&mut buf, 4096, 11), 0);
+        assert!(fs.lookup(ctx(), fuse::ROOT_ID, &name("missing")).is_err());
+
+        let mut names = Vec::new();
+        fs.readdir(ctx(), fuse::ROOT_ID, 0, 4096, 1, |e| {
+            names.push(e.name.to_vec());
+            Ok(1)
+        })
+        .unwrap();
+        assert_eq!(names, vec![b"init.krun".to_vec()]);
+    }
+}
@@ -0,0 +1,517 @@
+use std::collections::hash_map::DefaultHasher;
+use std::collections::BTreeMap;
+use std::ffi::CStr;
+use std::hash::{Hash, Hasher};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use lru::LruCache;
+
+type Inode = u64;
+
+/// Maximum number of directory entries (positive and negative) kept in the cache.
+const MAX_DENTRIES: usize = 65536;
+
+/// Number of slots the invalidations are recorded in (see `CacheState::stamps`).
+const STAMP_SLOTS: usize = 4096;
+
+struct CachedAttr {
+    // `None` if the attributes have been invalidated and must be refreshed from the host.
+    st: Option<libc::stat64>,
+    expires: Instant,
+    // For anything but directories, the entry the inode was found through. Changes to the inode
+    // are reported by the watcher using this name, so the attributes are only valid as long as
+    // the entry is in the cache.
+    dentry: Option<(Inode, Vec<u8>)>,
+}
+
+// Whether changes to the inode described by `st` are always reported through the watch on its
+// parent directory, or on itself for directories. Links made to a file later on are only seen if
+// they're made in a watched directory, and otherwise left to the timeout.
+fn is_cacheable(st: &libc::stat64) -> bool {
+    st.st_mode & libc::S_IFMT == libc::S_IFDIR || st.st_nlink == 1
+}
+
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub enum CachedDentry {
+    /// The name resolves to this inode.
+    Positive(Inode),
+    /// The name is known not to exist in the parent directory.
+    Negative,
+}
+
+struct Dentry {
+    target: CachedDentry,
+    expires: Instant,
+}
+
+struct CacheState {
+    // Attributes of the inodes that are eligible for caching. An inode is eligible if every change
+    // to it is expected to be reported by the watcher.
+    attrs: BTreeMap<Inode, CachedAttr>,
+    dentries: LruCache<(Inode, Vec<u8>), Dentry>,
+    // Directories that are being watched for changes, and their watch descriptors. Dentries are
+    // only cached for these.
+    watched: BTreeMap<Inode, i32>,
+    wds: BTreeMap<i32, Inode>,
+    // Bumped on every invalidation, so a racing lookup doesn't insert data that was already stale
+    // by the time it was read from the host.
+    generation: u64,
+    // The generation of the last invalidation of each inode and entry, hashed into a fixed number
+    // of slots. Data read from the host is only inserted if nothing it depends on was invalidated
+    // since, so an invalidation only holds back the lookups racing with it on the same inodes or
+    // entries (or whatever they collide with).
+    stamps: Vec<u64>,
+    // The generation of the last invalidation of the whole cache.
+    cleared: u64,
+}
+
+// The slot the invalidations of `inode` are recorded in.
+fn inode_slot(inode: Inode) -> usize {
+    stamp_slot(&inode)
+}
+
+// The slot the invalidations of the entry `name` in `parent` are recorded in.
+fn entry_slot(parent: Inode, name: &CStr) -> usize {
+    stamp_slot(&(parent, name.to_bytes()))
+}
+
+fn stamp_slot<K: Hash>(key: &K) -> usize {
+    let mut hasher = DefaultHasher::new();
+    key.hash(&mut hasher);
+    hasher.finish() as usize % STAMP_SLOTS
+}
+
+impl CacheState {
+    // Records an invalidation of everything recorded in `slots`.
+    fn stamp(&mut self, slots: &[usize]) {
+        self.generation += 1;
+        for &slot in slots {
+            self.stamps[slot] = self.generation;
+        }
+    }
+
+    // Records an invalidation of the whole cache.
+    fn stamp_all(&mut self) {
+        self.generation += 1;
+        self.cleared = self.generation;
+    }
+
+    // Whether data read from the host at `generation`, and depending on what's recorded in
+    // `slots`, is still valid.
+    fn is_current(&self, generation: u64, slots: &[usize]) -> bool {
+        generation >= self.cleared && slots.iter().all(|&slot| self.stamps[slot] <= generation)
+    }
+}
+
+/// A host-side cache of inode attributes and directory entries (both positive and negative) for
+/// `PassthroughFs`. The cache itself has no knowledge of the host file system; it's kept coherent
+/// by `PassthroughFs` invalidating entries on the operations it performs, and by the inotify
+/// watcher invalidating entries on changes done by other processes on the host. Entries also
+/// expire after `timeout`, as a safety net for the changes inotify can't report (i.e. writes
+/// through shared mappings).
+pub struct MetadataCache {
+    timeout: Duration,
+    state: Mutex<CacheState>,
+}
+
+impl MetadataCache {
+    pub fn new(timeout: Duration) -> Self {
+        MetadataCache {
+            timeout,
+            state: Mutex::new(CacheState {
+                attrs: BTreeMap::new(),
+                dentries: LruCache::new(MAX_DENTRIES),
+                watched: BTreeMap::new(),
+                wds: BTreeMap::new(),
+                generation: 0,
+                stamps: vec![0; STAMP_SLOTS],
+                cleared: 0,
+            }),
+        }
+    }
+
+    /// Returns the current generation. It must be obtained before reading anything from the host
+    /// and then passed to the `insert_*` methods.
+    pub fn generation(&self) -> u64 {
+        self.state.lock().unwrap().generation
+    }
+
+    /// Registers `dir` as being watched with the watch descriptor `wd`.
+    pub fn set_watched(&self, dir: Inode, wd: i32) {
+        let mut state = self.state.lock().unwrap();
+        state.watched.insert(dir, wd);
+        state.wds.insert(wd, dir);
+    }
+
+    #[cfg(test)]
+    pub fn is_watched(&self, dir: Inode) -> bool {
+        self.state.lock().unwrap().watched.contains_key(&dir)
+    }
+
+    /// Returns whether changes to the attributes and xattrs of `inode` on the host are reported
+    /// by the watcher, which is the case for the inodes eligible for caching (see `insert_attr`).
+    pub fn is_tracked(&self, inode: Inode) -> bool {
+        let state = self.state.lock().unwrap();
+        match state.attrs.get(&inode) {
+            Some(CachedAttr {
+                dentry: Some(ref key),
+                ..
+            }) => state.dentries.contains(key),
+            Some(_) => true,
+            None => false,
+        }
+    }
+
+    /// Returns the directory associated with the watch descriptor `wd`, if any.
+    pub fn watched_dir(&self, wd: i32) -> Option<Inode> {
+        self.state.lock().unwrap().wds.get(&wd).copied()
+    }
+
+    pub fn get_attr(&self, inode: Inode) -> Option<libc::stat64> {
+        let state = self.state.lock().unwrap();
+        let attr = state.attrs.get(&inode)?;
+        if attr.expires <= Instant::now() {
+            return None;
+        }
+        match attr.dentry {
+            Some(ref key) if !state.dentries.contains(key) => None,
+            _ => attr.st,
+        }
+    }
+
+    /// Marks `inode` as eligible for caching and stores its attributes. `parent` and `name` are
+    /// the entry through which the inode was found. Directories are only eligible if they are
+    /// watched, and anything else only if it has a single link in a watched directory.
+    pub fn insert_attr(
+        &self,
+        generation: u64,
+        inode: Inode,
+        st: libc::stat64,
+        parent: Inode,
+        name: &CStr,
+    ) {
+        let mut state = self.state.lock().unwrap();
+        let slots = [inode_slot(inode), entry_slot(parent, name)];
+        if !state.is_current(generation, &slots) || !is_cacheable(&st) {
+            return;
+        }
+
+        let dentry = if st.st_mode & libc::S_IFMT == libc::S_IFDIR {
+            if !state.watched.contains_key(&inode) {
+                return;
+            }
+            None
+        } else {
+            if !state.watched.contains_key(&parent) {
+                return;
+            }
+            Some((parent, name.to_bytes().to_vec()))
+        };
+
+        let attr = CachedAttr {
+            st: Some(st),
+            expires: Instant::now() + self.timeout,
+            dentry,
+        };
+        state.attrs.insert(inode, attr);
+    }
+
+    /// Updates the attributes of `inode`, but only if it was already eligible for caching.
+    pub fn refresh_attr(&self, generation: u64, inode: Inode, st: libc::stat64) {
+        let mut state = self.state.lock().unwrap();
+        if !state.is_current(generation, &[inode_slot(inode)]) {
+            return;
+        }
+
+        if !is_cacheable(&st) {
+            state.attrs.remove(&inode);
+        } else if let Some(attr) = state.attrs.get_mut(&inode) {
+            attr.st = Some(st);
+            attr.expires = Instant::now() + self.timeout;
+        }
+    }
+
+    pub fn get_dentry(&self, parent: Inode, name: &CStr) -> Option<CachedDentry> {
+        let mut state = self.state.lock().unwrap();
+        let key = (parent, name.to_bytes().to_vec());
+        let now = Instant::now();
+        match state
+            .dentries
+            .get(&key)
+            .map(|d| (d.target, d.expires > now))
+        {
+            Some((target, true)) => Some(target),
+            Some((_, false)) => {
+                state.dentries.pop(&key);
+                None
+            }
+            None => None,
+        }
+    }
+
+    pub fn insert_dentry(&self, generation: u64, parent: Inode, name: &CStr, target: CachedDentry) {
+        let mut state = self.state.lock().unwrap();
+        if state.is_current(generation, &[entry_slot(parent, name)])
+            && state.watched.contains_key(&parent)
+        {
+            let expires = Instant::now() + self.timeout;
+            state.dentries.put(
+                (parent, name.to_bytes().to_vec()),
+                Dentry { target, expires },
+            );
+        }
+    }
+
+    /// Invalidates the attributes of `inode`.
+    pub fn invalidate_attr(&self, inode: Inode) {
+        let mut state = self.state.lock().unwrap();
+        state.stamp(&[inode_slot(inode)]);
+        if let Some(attr) = state.attrs.get_mut(&inode) {
+            attr.st = None;
+        }
+    }
+
+    /// Invalidates the entry `name` in `parent`, the attributes of the inode it pointed to, and
+    /// the attributes of `parent` itself, as its timestamps (and maybe its link count) changed.
+    pub fn invalidate_entry(&self, parent: Inode, name: &CStr) {
+        let mut state = self.state.lock().unwrap();
+        state.stamp(&[inode_slot(parent), entry_slot(parent, name)]);
+        if let Some(Dentry {
+            target: CachedDentry::Positive(inode),
+            ..
+        }) = state.dentries.pop(&(parent, name.to_bytes().to_vec()))
+        {
+            state.stamp(&[inode_slot(inode)]);
+            if let Some(attr) = state.attrs.get_mut(&inode) {
+                attr.st = None;
+            }
+        }
+        if let Some(attr) = state.attrs.get_mut(&parent) {
+            attr.st = None;
+        }
+    }
+
+    /// Stops considering the directory associated with `wd` as watched, as its watch is gone.
+    pub fn unwatch(&self, wd: i32) {
+        let mut state = self.state.lock().unwrap();
+        if let Some(dir) = state.wds.remove(&wd) {
+            // Changes to its entries may have been missed since the watch went away.
+            state.stamp_all();
+            state.watched.remove(&dir);
+            state.attrs.remove(&dir);
+        }
+    }
+
+    /// Drops every trace of `inode` from the cache. Called when the inode is removed from the
+    /// inode table. Returns the watch descriptor associated with it, if there was one.
+    pub fn forget(&self, inode: Inode) -> Option<i32> {
+        let mut state = self.state.lock().unwrap();
+        state.stamp(&[inode_slot(inode)]);
+        state.attrs.remove(&inode);
+        let wd = state.watched.remove(&inode);
+        if let Some(wd) = wd {
+            state.wds.remove(&wd);
+        }
+        wd
+    }
+
+    /// Drops everything, returning the watch descriptors of the directories that were watched.
+    pub fn reset(&self) -> Vec<i32> {
+        let mut state = self.state.lock().unwrap();
+        state.stamp_all();
+        state.attrs.clear();
+        state.dentries.clear();
+        state.watched.clear();
+        let wds = state.wds.keys().copied().collect();
+        state.wds.clear();
+        wds
+    }
+
+    /// Drops everything but the list of watched directories. Used when the watcher lost track of
+    /// the changes on the host (i.e. its event queue overflowed).
+    pub fn clear(&self) {
+        let mut state = self.state.lock().unwrap();
+        state.stamp_all();
+        for attr in state.attrs.values_mut() {
+            attr.st = None;
+        }
+        state.dentries.clear();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn cstr(s: &[u8]) -> &CStr {
+        CStr::from_bytes_with_nul(s).unwrap()
+    }
+
+    fn file_attr(ino: u64, nlink: u64) -> libc::stat64 {
+        let mut st: libc::stat64 = unsafe { std::mem::zeroed() };
+        st.st_ino = ino;
+        st.st_mode = libc::S_IFREG | 0o644;
+        st.st_nlink = nlink;
+        st
+    }
+
+    fn dir_attr(ino: u64) -> libc::stat64 {
+        let mut st = file_attr(ino, 2);
+        st.st_mode = libc::S_IFDIR | 0o755;
+        st
+    }
+
+    #[test]
+    fn test_attr_cache() {
+        let cache = MetadataCache::new(Duration::from_secs(60));
+        let name = cstr(b"foo\0");
+
+        // Nothing is cached for entries in directories that aren't watched.
+        cache.insert_attr(cache.generation(), 2, file_attr(20, 1), 1, name);
+        assert!(cache.get_attr(2).is_none());
+
+        cache.set_watched(1, 7);
+        let gen = cache.generation();
+        cache.refresh_attr(gen, 2, file_attr(20, 1));
+        // Inodes not eligible for caching aren't stored on refresh.
+        assert!(cache.get_attr(2).is_none());
+
+        cache.insert_dentry(gen, 1, name, CachedDentry::Positive(2));
+        cache.insert_attr(gen, 2, file_attr(20, 1), 1, name);
+        assert_eq!(cache.get_attr(2).unwrap().st_ino, 20);
+
+        cache.invalidate_attr(2);
+        assert!(cache.get_attr(2).is_none());
+
+        // A stale generation must not repopulate the cache.
+        cache.refresh_attr(gen, 2, file_attr(21, 1));
+        assert!(cache.get_attr(2).is_none());
+
+        cache.refresh_attr(cache.generation(), 2, file_attr(22, 1));
+        assert_eq!(cache.get_attr(2).unwrap().st_ino, 22);
+
+        // Once the inode has more than one link, changes may happen through other entries.
+        cache.refresh_attr(cache.generation(), 2, file_attr(22, 2));
+        assert!(cache.get_attr(2).is_none());
+        cache.refresh_attr(cache.generation(), 2, file_attr(22, 1));
+        assert!(cache.get_attr(2).is_none());
+
+        assert!(cache.forget(2).is_none());
+        assert!(cache.get_attr(2).is_none());
+    }
+
+    #[test]
+    fn test_dir_attr_cache() {
+        let cache = MetadataCache::new(Duration::from_secs(60));
+        let name = cstr(b"dir\0");
+
+        // Directories are only cached if they are watched themselves.
+        cache.set_watched(1, 7);
+        cache.insert_attr(cache.generation(), 3, dir_attr(30), 1, name);
+        assert!(cache.get_attr(3).is_none());
+
+        cache.set_watched(3, 8);
+        cache.insert_attr(cache.generation(), 3, dir_attr(30), 1, name);
+        assert_eq!(cache.get_attr(3).unwrap().st_ino, 30);
+
+        cache.unwatch(8);
+        assert!(!cache.is_watched(3));
+        assert!(cache.get_attr(3).is_none());
+    }
+
+    #[test]
+    fn test_dentry_cache() {
+        let cache = MetadataCache::new(Duration::from_secs(60));
+        let name = cstr(b"foo\0");
+
+        // Entries are only cached for watched directories.
+        cache.insert_dentry(cache.generation(), 1, name, CachedDentry::Negative);
+        assert!(cache.get_dentry(1, name).is_none());
+
+        cache.set_watched(1, 7);
+        assert!(cache.is_watched(1));
+        assert_eq!(cache.watched_dir(7), Some(1));
+
+        cache.insert_dentry(cache.generation(), 1, name, CachedDentry::Negative);
+        assert_eq!(cache.get_dentry(1, name), Some(CachedDentry::Negative));
+
+        cache.invalidate_entry(1, name);
+        assert!(cache.get_dentry(1, name).is_none());
+
+        let gen = cache.generation();
+        cache.insert_dentry(gen, 1, name, CachedDentry::Positive(3));
+        cache.insert_attr(gen, 3, file_attr(30, 1), 1, name);
+        cache.insert_attr(gen, 1, dir_attr(10), 1, name);
+        assert_eq!(cache.get_dentry(1, name), Some(CachedDentry::Positive(3)));
+        assert!(cache.get_attr(1).is_some());
+
+        // Invalidating the entry also invalidates both the target and the parent attributes.
+        cache.invalidate_entry(1, name);
+        assert!(cache.get_dentry(1, name).is_none());
+        assert!(cache.get_attr(3).is_none());
+        assert!(cache.get_attr(1).is_none());
+
+        // Attributes of files aren't valid without the entry they were found through.
+        cache.refresh_attr(cache.generation(), 3, file_attr(31, 1));
+        assert!(cache.get_attr(3).is_none());
+
+        assert_eq!(cache.forget(1), Some(7));
+        assert!(!cache.is_watched(1));
+        assert!(cache.watched_dir(7).is_none());
+    }
+
+    #[test]
+    fn test_racing_invalidations() {
+        let cache = MetadataCache::new(Duration::from_secs(60));
+        let foo = cstr(b"foo\0");
+        let bar = cstr(b"bar\0");
+
+        cache.set_watched(1, 7);
+        let gen = cache.generation();
+
+        // An invalidation only holds back the data read before it about the same entries and
+        // inodes.
+        cache.invalidate_entry(1, foo);
+        cache.insert_dentry(gen, 1, foo, CachedDentry::Positive(2));
+        cache.insert_attr(gen, 2, file_attr(20, 1), 1, foo);
+        assert!(cache.get_dentry(1, foo).is_none());
+        assert!(cache.get_attr(2).is_none());
+
+        cache.invalidate_attr(4);
+        cache.insert_dentry(gen, 1, bar, CachedDentry::Positive(3));
+        cache.insert_attr(gen, 3, file_attr(30, 1), 1, bar);
+        assert_eq!(cache.get_dentry(1, bar), Some(CachedDentry::Positive(3)));
+        assert_eq!(cache.get_attr(3).unwrap().st_ino, 30);
+
+        // Clearing the cache holds back everything.
+        cache.clear();
+        cache.insert_dentry(gen, 1, bar, CachedDentry::Positive(3));
+        assert!(cache.get_dentry(1, bar).is_none());
+    }
+
+    #[test]
+    fn test_clear_and_expiration() {
+        let cache = MetadataCache::new(Duration::from_secs(60));
+        let name = cstr(b"foo\0");
+
+        cache.set_watched(1, 7);
+        let gen = cache.generation();
+        cache.insert_dentry(gen, 1, name, CachedDentry::Positive(2));
+        cache.insert_attr(gen, 2, file_attr(20, 1), 1, name);
+
+        cache.clear();
+        assert!(cache.get_dentry(1, name).is_none());
+        assert!(cache.get_attr(2).is_none());
+        assert!(cache.is_watched(1));
+
+        let cache = MetadataCache::new(Duration::from_secs(0));
+        cache.set_watched(1, 7);
+        let gen = cache.generation();
+        cache.insert_dentry(gen, 1, name, CachedDentry::Positive(2));
+        cache.insert_attr(gen, 2, file_attr(20, 1), 1, name);
+
+        assert!(cache.get_attr(2).is_none());
+        assert!(cache.get_dentry(1, name).is_none());
+    }
+}
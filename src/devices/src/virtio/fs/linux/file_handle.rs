@@ -0,0 +1,93 @@
+use std::ffi::CStr;
+use std::fs::File;
+use std::io;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+
+const EMPTY_CSTR: &[u8] = b"\0";
+
+// Maximum size of a file handle, as defined in fcntl.h.
+const MAX_HANDLE_SZ: usize = 128;
+
+#[repr(C)]
+struct CFileHandle {
+    handle_bytes: u32,
+    handle_type: libc::c_int,
+    f_handle: [u8; MAX_HANDLE_SZ],
+}
+
+/// A reference to a file in the host that, unlike a file descriptor, doesn't keep anything open
+/// in the kernel. Opening the file again requires CAP_DAC_READ_SEARCH.
+pub struct FileHandle {
+    mount_id: libc::c_int,
+    handle_type: libc::c_int,
+    handle: Box<[u8]>,
+}
+
+impl FileHandle {
+    /// Gets the handle of the file referred by `f`, which may be an `O_PATH` fd.
+    pub fn from_file(f: &File) -> io::Result<FileHandle> {
+        let mut fh = CFileHandle {
+            handle_bytes: MAX_HANDLE_SZ as u32,
+            handle_type: 0,
+            f_handle: [0; MAX_HANDLE_SZ],
+        };
+        let mut mount_id: libc::c_int = 0;
+
+        // Safe because this is a constant value and a valid C string.
+        let empty = unsafe { CStr::from_bytes_with_nul_unchecked(EMPTY_CSTR) };
+
+        // Safe because the kernel will only write to `fh`, within the size we told it, and to
+        // `mount_id`, and we check the return value.
+        let res = unsafe {
+            libc::syscall(
+                libc::SYS_name_to_handle_at,
+                f.as_raw_fd(),
+                empty.as_ptr(),
+                &mut fh as *mut CFileHandle,
+                &mut mount_id as *mut libc::c_int,
+                libc::AT_EMPTY_PATH,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(FileHandle {
+            mount_id,
+            handle_type: fh.handle_type,
+            handle: fh.f_handle[..fh.handle_bytes as usize].into(),
+        })
+    }
+
+    /// The id of the mount the file belongs to.
+    pub fn mount_id(&self) -> libc::c_int {
+        self.mount_id
+    }
+
+    /// Opens the file referred by this handle with `flags`. `mount_fd` can be any fd on the same
+    /// mount as the file.
+    pub fn open(&self, mount_fd: &File, flags: libc::c_int) -> io::Result<File> {
+        let mut fh = CFileHandle {
+            handle_bytes: self.handle.len() as u32,
+            handle_type: self.handle_type,
+            f_handle: [0; MAX_HANDLE_SZ],
+        };
+        fh.f_handle[..self.handle.len()].copy_from_slice(&self.handle);
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let fd = unsafe {
+            libc::syscall(
+                libc::SYS_open_by_handle_at,
+                mount_fd.as_raw_fd(),
+                &fh as *const CFileHandle,
+                flags,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // Safe because we just opened this fd.
+        Ok(unsafe { File::from_raw_fd(fd as RawFd) })
+    }
+}
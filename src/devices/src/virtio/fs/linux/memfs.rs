@@ -0,0 +1,1223 @@
+use std::cmp;
+use std::collections::btree_map;
+use std::collections::BTreeMap;
+use std::ffi::{CStr, CString};
+use std::io;
+use std::mem;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+use super::super::filesystem::{
+    Context, DirEntry, Entry, FileSystem, FsOptions, GetxattrReply, ListxattrReply, OpenOptions,
+    SetattrValid, ZeroCopyReader, ZeroCopyWriter,
+};
+use super::super::fuse;
+use super::passthrough::ebadf;
+
+// The unit file contents are stored and accounted in.
+const CHUNK_SIZE: usize = 4096;
+
+// Stands for the chunks that were never written, which read as zeroes.
+static ZERO_CHUNK: [u8; CHUNK_SIZE] = [0; CHUNK_SIZE];
+
+// Maximum length of a file name, as defined in linux/limits.h.
+const NAME_MAX: usize = 255;
+
+// Not available in the libc crate version we use.
+const RENAME_NOREPLACE: u32 = 1;
+
+type Inode = u64;
+type Handle = u64;
+
+type Chunk = Box<[u8]>;
+
+fn enoent() -> io::Error {
+    io::Error::from_raw_os_error(libc::ENOENT)
+}
+
+fn now() -> libc::timespec {
+    let t = SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .unwrap_or_default();
+
+    libc::timespec {
+        tv_sec: t.as_secs() as libc::time_t,
+        tv_nsec: libc::c_long::from(t.subsec_nanos() as i32),
+    }
+}
+
+fn set_mtime(attr: &mut libc::stat64, t: libc::timespec) {
+    attr.st_mtime = t.tv_sec;
+    attr.st_mtime_nsec = t.tv_nsec;
+    set_ctime(attr, t);
+}
+
+fn set_ctime(attr: &mut libc::stat64, t: libc::timespec) {
+    attr.st_ctime = t.tv_sec;
+    attr.st_ctime_nsec = t.tv_nsec;
+}
+
+enum NodeKind {
+    Dir(RwLock<BTreeMap<CString, Inode>>),
+    // The contents of the file, in `CHUNK_SIZE` pieces by index. Holes have no chunk, so they
+    // take no memory. The size is in the attributes, since there may be fewer chunks than it
+    // needs.
+    File(RwLock<BTreeMap<u64, Chunk>>),
+    Symlink(Vec<u8>),
+    // Devices, fifos and sockets.
+    Special,
+}
+
+struct Node {
+    // Locked after the contents of a file, if both are needed.
+    attr: Mutex<libc::stat64>,
+    kind: NodeKind,
+    xattrs: Mutex<BTreeMap<CString, Vec<u8>>>,
+    // References held by the guest kernel.
+    lookups: AtomicU64,
+}
+
+impl Node {
+    fn entries(&self) -> io::Result<&RwLock<BTreeMap<CString, Inode>>> {
+        match self.kind {
+            NodeKind::Dir(ref entries) => Ok(entries),
+            _ => Err(io::Error::from_raw_os_error(libc::ENOTDIR)),
+        }
+    }
+
+    fn chunks(&self) -> io::Result<&RwLock<BTreeMap<u64, Chunk>>> {
+        match self.kind {
+            NodeKind::File(ref chunks) => Ok(chunks),
+            NodeKind::Dir(_) => Err(io::Error::from_raw_os_error(libc::EISDIR)),
+            _ => Err(io::Error::from_raw_os_error(libc::EINVAL)),
+        }
+    }
+
+    fn is_dir(&self) -> bool {
+        matches!(self.kind, NodeKind::Dir(_))
+    }
+}
+
+/// Options that configure the behavior of the file system.
+#[derive(Debug, Clone)]
+pub struct Config {
+    /// How long the FUSE client should consider directory entries to be valid. Nothing but the
+    /// guest can change the file system, so it may as well cache them for as long as it wants.
+    ///
+    /// The default value for this option is 1 day.
+    pub entry_timeout: Duration,
+
+    /// How long the FUSE client should consider file and directory attributes to be valid.
+    ///
+    /// The default value for this option is 1 day.
+    pub attr_timeout: Duration,
+
+    /// The maximum amount of memory, in bytes, the contents of the files may take.
+    ///
+    /// The default value for this option is 64 MiB.
+    pub size_limit: u64,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            entry_timeout: Duration::from_secs(86400),
+            attr_timeout: Duration::from_secs(86400),
+            size_limit: 64 << 20,
+        }
+    }
+}
+
+/// A file system that keeps everything in the memory of the VMM, like tmpfs, meant for scratch
+/// space the guest doesn't need to keep. Requests are served without any syscall.
+///
+/// File contents are allocated in page-sized chunks as they are written, and `Config::size_limit`
+/// caps the total. The root is world-writable and sticky, as usual for /tmp.
+pub struct MemFs {
+    nodes: RwLock<BTreeMap<Inode, Arc<Node>>>,
+    next_inode: AtomicU64,
+
+    // Serializes the changes to the tree, which may involve several directories.
+    ns_lock: Mutex<()>,
+
+    // Bytes taken by the chunks of all the files.
+    used: AtomicU64,
+
+    cfg: Config,
+}
+
+impl MemFs {
+    pub fn new(cfg: Config) -> io::Result<MemFs> {
+        Ok(MemFs {
+            nodes: RwLock::new(BTreeMap::new()),
+            next_inode: AtomicU64::new(fuse::ROOT_ID + 1),
+            ns_lock: Mutex::new(()),
+            used: AtomicU64::new(0),
+            cfg,
+        })
+    }
+
+    fn get(&self, inode: Inode) -> io::Result<Arc<Node>> {
+        self.nodes
+            .read()
+            .unwrap()
+            .get(&inode)
+            .map(Arc::clone)
+            .ok_or_else(ebadf)
+    }
+
+    fn entry(&self, node: &Node) -> Entry {
+        // Matches with the release store in `forget`.
+        node.lookups.fetch_add(1, Ordering::Acquire);
+        let attr = *node.attr.lock().unwrap();
+
+        Entry {
+            inode: attr.st_ino,
+            generation: 0,
+            attr,
+            attr_timeout: self.cfg.attr_timeout,
+            entry_timeout: self.cfg.entry_timeout,
+        }
+    }
+
+    // Reserves the memory for `count` chunks, failing if that would go over the limit.
+    fn reserve(&self, count: u64) -> io::Result<()> {
+        let size = count.checked_mul(CHUNK_SIZE as u64);
+        self.used
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |used| {
+                used.checked_add(size?)
+                    .filter(|u| *u <= self.cfg.size_limit)
+            })
+            .map(|_| ())
+            .map_err(|_| io::Error::from_raw_os_error(libc::ENOSPC))
+    }
+
+    fn unreserve(&self, count: usize) {
+        self.used
+            .fetch_sub((count * CHUNK_SIZE) as u64, Ordering::Relaxed);
+    }
+
+    // Number of 512-byte blocks taken by `chunks`.
+    fn blocks(chunks: &BTreeMap<u64, Chunk>) -> i64 {
+        (chunks.len() * CHUNK_SIZE / 512) as i64
+    }
+
+    fn alloc_chunk(&self) -> io::Result<Chunk> {
+        self.reserve(1)?;
+        Ok(vec![0u8; CHUNK_SIZE].into_boxed_slice())
+    }
+
+    // Frees the chunks from index `first` on.
+    fn free_chunks(&self, chunks: &mut BTreeMap<u64, Chunk>, first: u64) {
+        let freed = chunks.split_off(&first);
+        self.unreserve(freed.len());
+    }
+
+    // Drops `node` once it's neither linked nor known by the guest. Must be called with the
+    // nodes map locked for writing.
+    fn maybe_remove(&self, nodes: &mut BTreeMap<Inode, Arc<Node>>, node: &Node) {
+        let (inode, nlink) = {
+            let attr = node.attr.lock().unwrap();
+            (attr.st_ino, attr.st_nlink)
+        };
+        if nlink != 0 || node.lookups.load(Ordering::Relaxed) != 0 {
+            return;
+        }
+
+        if let Ok(chunks) = node.chunks() {
+            self.free_chunks(&mut chunks.write().unwrap(), 0);
+        }
+        nodes.remove(&inode);
+    }
+
+    // Creates a node of `kind` named `name` in `parent`.
+    fn create_node(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        rdev: u64,
+        kind: NodeKind,
+    ) -> io::Result<Entry> {
+        if name.to_bytes().len() > NAME_MAX {
+            return Err(io::Error::from_raw_os_error(libc::ENAMETOOLONG));
+        }
+
+        let _guard = self.ns_lock.lock().unwrap();
+
+        let p = self.get(parent)?;
+        let mut entries = p.entries()?.write().unwrap();
+        if entries.contains_key(name) {
+            return Err(io::Error::from_raw_os_error(libc::EEXIST));
+        }
+
+        let is_dir = matches!(kind, NodeKind::Dir(_));
+        let size = match kind {
+            NodeKind::Symlink(ref link) => link.len() as i64,
+            _ => 0,
+        };
+
+        let mut pattr = p.attr.lock().unwrap();
+
+        // Like in most file systems, the group is inherited from directories with the setgid bit,
+        // and so is the bit itself by new directories.
+        let (gid, mut mode) = if pattr.st_mode & libc::S_ISGID != 0 {
+            let inherited = if is_dir { libc::S_ISGID } else { 0 };
+            (pattr.st_gid, mode | inherited)
+        } else {
+            (ctx.gid, mode)
+        };
+        if !is_dir && gid != ctx.gid && ctx.uid != 0 {
+            mode &= !libc::S_ISGID;
+        }
+
+        let inode = self.next_inode.fetch_add(1, Ordering::Relaxed);
+        let t = now();
+
+        // Safe because a zeroed stat64 is a valid value.
+        let mut attr: libc::stat64 = unsafe { mem::zeroed() };
+        attr.st_ino = inode;
+        attr.st_mode = mode;
+        attr.st_nlink = if is_dir { 2 } else { 1 };
+        attr.st_uid = ctx.uid;
+        attr.st_gid = gid;
+        attr.st_rdev = rdev;
+        attr.st_size = size;
+        attr.st_blksize = CHUNK_SIZE as libc::blksize_t;
+        attr.st_atime = t.tv_sec;
+        attr.st_atime_nsec = t.tv_nsec;
+        set_mtime(&mut attr, t);
+
+        let node = Arc::new(Node {
+            attr: Mutex::new(attr),
+            kind,
+            xattrs: Mutex::new(BTreeMap::new()),
+            lookups: AtomicU64::new(0),
+        });
+
+        self.nodes.write().unwrap().insert(inode, node.clone());
+        entries.insert(name.to_owned(), inode);
+
+        if is_dir {
+            pattr.st_nlink += 1;
+        }
+        set_mtime(&mut pattr, t);
+
+        Ok(self.entry(&node))
+    }
+
+    fn do_unlink(&self, parent: Inode, name: &CStr, rmdir: bool) -> io::Result<()> {
+        let _guard = self.ns_lock.lock().unwrap();
+
+        let p = self.get(parent)?;
+        let mut entries = p.entries()?.write().unwrap();
+        let node = self.get(*entries.get(name).ok_or_else(enoent)?)?;
+
+        if rmdir {
+            if !node.entries()?.read().unwrap().is_empty() {
+                return Err(io::Error::from_raw_os_error(libc::ENOTEMPTY));
+            }
+        } else if node.is_dir() {
+            return Err(io::Error::from_raw_os_error(libc::EISDIR));
+        }
+
+        entries.remove(name);
+        let t = now();
+        {
+            let mut pattr = p.attr.lock().unwrap();
+            if rmdir {
+                pattr.st_nlink -= 1;
+            }
+            set_mtime(&mut pattr, t);
+        }
+        self.unlinked(&node, t);
+
+        Ok(())
+    }
+
+    // Drops a link to `node`, which was just removed from its parent.
+    fn unlinked(&self, node: &Node, t: libc::timespec) {
+        {
+            let mut attr = node.attr.lock().unwrap();
+            attr.st_nlink = if node.is_dir() {
+                0
+            } else {
+                attr.st_nlink.saturating_sub(1)
+            };
+            set_ctime(&mut attr, t);
+        }
+
+        self.maybe_remove(&mut self.nodes.write().unwrap(), node);
+    }
+
+    fn do_getattr(&self, inode: Inode) -> io::Result<(libc::stat64, Duration)> {
+        let node = self.get(inode)?;
+        let attr = *node.attr.lock().unwrap();
+
+        Ok((attr, self.cfg.attr_timeout))
+    }
+
+    // Changes the size of a file, freeing the chunks past the end.
+    fn truncate(&self, node: &Node, size: u64) -> io::Result<()> {
+        let mut chunks = node.chunks()?.write().unwrap();
+        let mut attr = node.attr.lock().unwrap();
+
+        if size < attr.st_size as u64 {
+            let chunk_size = CHUNK_SIZE as u64;
+            self.free_chunks(&mut chunks, (size + chunk_size - 1) / chunk_size);
+
+            // What's left of the last chunk must read as zeroes if the file grows again.
+            if let Some(chunk) = chunks.get_mut(&(size / chunk_size)) {
+                for b in chunk[(size % chunk_size) as usize..].iter_mut() {
+                    *b = 0;
+                }
+            }
+        }
+
+        attr.st_size = size as i64;
+        attr.st_blocks = Self::blocks(&chunks);
+        set_mtime(&mut attr, now());
+
+        Ok(())
+    }
+}
+
+impl FileSystem for MemFs {
+    type Inode = Inode;
+    type Handle = Handle;
+
+    fn init(&self, _capable: FsOptions) -> io::Result<FsOptions> {
+        let t = now();
+
+        // Safe because a zeroed stat64 is a valid value.
+        let mut attr: libc::stat64 = unsafe { mem::zeroed() };
+        attr.st_ino = fuse::ROOT_ID;
+        attr.st_mode = libc::S_IFDIR | 0o1777;
+        attr.st_nlink = 2;
+        attr.st_blksize = CHUNK_SIZE as libc::blksize_t;
+        attr.st_atime = t.tv_sec;
+        attr.st_atime_nsec = t.tv_nsec;
+        set_mtime(&mut attr, t);
+
+        // Not sure why the root inode gets a refcount of 2 but that's what libfuse does.
+        self.nodes.write().unwrap().insert(
+            fuse::ROOT_ID,
+            Arc::new(Node {
+                attr: Mutex::new(attr),
+                kind: NodeKind::Dir(RwLock::new(BTreeMap::new())),
+                xattrs: Mutex::new(BTreeMap::new()),
+                lookups: AtomicU64::new(2),
+            }),
+        );
+
+        Ok(FsOptions::DO_READDIRPLUS
+            | FsOptions::READDIRPLUS_AUTO
+            | FsOptions::PARALLEL_DIROPS
+            | FsOptions::CACHE_SYMLINKS)
+    }
+
+    fn destroy(&self) {
+        self.nodes.write().unwrap().clear();
+        self.used.store(0, Ordering::Relaxed);
+    }
+
+    fn statfs(&self, _ctx: Context, _inode: Inode) -> io::Result<libc::statvfs64> {
+        let used = self.used.load(Ordering::Relaxed);
+
+        // Safe because a zeroed statvfs64 is a valid value.
+        let mut st: libc::statvfs64 = unsafe { mem::zeroed() };
+        st.f_bsize = CHUNK_SIZE as libc::c_ulong;
+        st.f_frsize = CHUNK_SIZE as libc::c_ulong;
+        st.f_blocks = self.cfg.size_limit / CHUNK_SIZE as u64;
+        st.f_bfree = self.cfg.size_limit.saturating_sub(used) / CHUNK_SIZE as u64;
+        st.f_bavail = st.f_bfree;
+        st.f_files = self.nodes.read().unwrap().len() as u64;
+        st.f_namemax = NAME_MAX as libc::c_ulong;
+
+        Ok(st)
+    }
+
+    fn lookup(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<Entry> {
+        let p = self.get(parent)?;
+        let inode = *p.entries()?.read().unwrap().get(name).ok_or_else(enoent)?;
+
+        Ok(self.entry(&*self.get(inode)?))
+    }
+
+    fn forget(&self, _ctx: Context, inode: Inode, count: u64) {
+        let mut nodes = self.nodes.write().unwrap();
+        if let Some(node) = nodes.get(&inode).map(Arc::clone) {
+            // Synchronizes with the acquire load in `entry`. Holding the write lock on the nodes
+            // map keeps new lookups from racing with the removal.
+            let _ = node
+                .lookups
+                .fetch_update(Ordering::Release, Ordering::Relaxed, |n| {
+                    Some(n.saturating_sub(count))
+                });
+            self.maybe_remove(&mut nodes, &node);
+        }
+    }
+
+    fn getattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Option<Handle>,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        self.do_getattr(inode)
+    }
+
+    fn setattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        attr: libc::stat64,
+        _handle: Option<Handle>,
+        valid: SetattrValid,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        let node = self.get(inode)?;
+
+        // The size goes first, since it needs to lock the contents before the attributes.
+        if valid.contains(SetattrValid::SIZE) {
+            self.truncate(&node, attr.st_size as u64)?;
+        }
+
+        let mut st = node.attr.lock().unwrap();
+        let t = now();
+
+        if valid.contains(SetattrValid::MODE) {
+            st.st_mode = (st.st_mode & libc::S_IFMT) | (attr.st_mode & !libc::S_IFMT);
+        }
+        if valid.contains(SetattrValid::UID) {
+            st.st_uid = attr.st_uid;
+        }
+        if valid.contains(SetattrValid::GID) {
+            st.st_gid = attr.st_gid;
+        }
+
+        if valid.contains(SetattrValid::ATIME_NOW) {
+            st.st_atime = t.tv_sec;
+            st.st_atime_nsec = t.tv_nsec;
+        } else if valid.contains(SetattrValid::ATIME) {
+            st.st_atime = attr.st_atime;
+            st.st_atime_nsec = attr.st_atime_nsec;
+        }
+
+        if valid.contains(SetattrValid::MTIME_NOW) {
+            st.st_mtime = t.tv_sec;
+            st.st_mtime_nsec = t.tv_nsec;
+        } else if valid.contains(SetattrValid::MTIME) {
+            st.st_mtime = attr.st_mtime;
+            st.st_mtime_nsec = attr.st_mtime_nsec;
+        }
+
+        set_ctime(&mut st, t);
+
+        Ok((*st, self.cfg.attr_timeout))
+    }
+
+    fn readlink(&self, _ctx: Context, inode: Inode) -> io::Result<Vec<u8>> {
+        match self.get(inode)?.kind {
+            NodeKind::Symlink(ref link) => Ok(link.clone()),
+            _ => Err(io::Error::from_raw_os_error(libc::EINVAL)),
+        }
+    }
+
+    fn symlink(
+        &self,
+        ctx: Context,
+        linkname: &CStr,
+        parent: Inode,
+        name: &CStr,
+    ) -> io::Result<Entry> {
+        let link = NodeKind::Symlink(linkname.to_bytes().to_vec());
+        self.create_node(ctx, parent, name, libc::S_IFLNK | 0o777, 0, link)
+    }
+
+    fn mknod(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        rdev: u32,
+        umask: u32,
+    ) -> io::Result<Entry> {
+        let kind = match mode & libc::S_IFMT {
+            libc::S_IFREG => NodeKind::File(RwLock::new(BTreeMap::new())),
+            libc::S_IFDIR => return Err(io::Error::from_raw_os_error(libc::EINVAL)),
+            _ => NodeKind::Special,
+        };
+        self.create_node(ctx, parent, name, mode & !umask, u64::from(rdev), kind)
+    }
+
+    fn mkdir(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        umask: u32,
+    ) -> io::Result<Entry> {
+        let mode = libc::S_IFDIR | (mode & !umask & 0o7777);
+        let dir = NodeKind::Dir(RwLock::new(BTreeMap::new()));
+        self.create_node(ctx, parent, name, mode, 0, dir)
+    }
+
+    fn unlink(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<()> {
+        self.do_unlink(parent, name, false)
+    }
+
+    fn rmdir(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<()> {
+        self.do_unlink(parent, name, true)
+    }
+
+    fn rename(
+        &self,
+        _ctx: Context,
+        olddir: Inode,
+        oldname: &CStr,
+        newdir: Inode,
+        newname: &CStr,
+        flags: u32,
+    ) -> io::Result<()> {
+        if flags & !RENAME_NOREPLACE != 0 {
+            return Err(io::Error::from_raw_os_error(libc::EINVAL));
+        }
+        if newname.to_bytes().len() > NAME_MAX {
+            return Err(io::Error::from_raw_os_error(libc::ENAMETOOLONG));
+        }
+
+        let _guard = self.ns_lock.lock().unwrap();
+
+        let old_p = self.get(olddir)?;
+        let new_p = self.get(newdir)?;
+        let src = *old_p
+            .entries()?
+            .read()
+            .unwrap()
+            .get(oldname)
+            .ok_or_else(enoent)?;
+        let src_node = self.get(src)?;
+        let dst = new_p.entries()?.read().unwrap().get(newname).copied();
+
+        let t = now();
+        let mut replaced = None;
+        if let Some(dst) = dst {
+            if flags & RENAME_NOREPLACE != 0 {
+                return Err(io::Error::from_raw_os_error(libc::EEXIST));
+            }
+            if dst == src {
+                return Ok(());
+            }
+
+            let dst_node = self.get(dst)?;
+            match (src_node.is_dir(), dst_node.is_dir()) {
+                (true, true) => {
+                    if !dst_node.entries()?.read().unwrap().is_empty() {
+                        return Err(io::Error::from_raw_os_error(libc::ENOTEMPTY));
+                    }
+                    new_p.attr.lock().unwrap().st_nlink -= 1;
+                }
+                (false, true) => return Err(io::Error::from_raw_os_error(libc::EISDIR)),
+                (true, false) => return Err(io::Error::from_raw_os_error(libc::ENOTDIR)),
+                (false, false) => {}
+            }
+            replaced = Some(dst_node);
+        }
+
+        old_p.entries()?.write().unwrap().remove(oldname);
+        new_p
+            .entries()?
+            .write()
+            .unwrap()
+            .insert(newname.to_owned(), src);
+
+        if src_node.is_dir() && olddir != newdir {
+            old_p.attr.lock().unwrap().st_nlink -= 1;
+            new_p.attr.lock().unwrap().st_nlink += 1;
+        }
+        set_mtime(&mut old_p.attr.lock().unwrap(), t);
+        set_mtime(&mut new_p.attr.lock().unwrap(), t);
+        set_ctime(&mut src_node.attr.lock().unwrap(), t);
+
+        if let Some(node) = replaced {
+            self.unlinked(&node, t);
+        }
+
+        Ok(())
+    }
+
+    fn link(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        newparent: Inode,
+        newname: &CStr,
+    ) -> io::Result<Entry> {
+        if newname.to_bytes().len() > NAME_MAX {
+            return Err(io::Error::from_raw_os_error(libc::ENAMETOOLONG));
+        }
+
+        let _guard = self.ns_lock.lock().unwrap();
+
+        let node = self.get(inode)?;
+        if node.is_dir() {
+            return Err(io::Error::from_raw_os_error(libc::EPERM));
+        }
+
+        let p = self.get(newparent)?;
+        let mut entries = p.entries()?.write().unwrap();
+        if entries.contains_key(newname) {
+            return Err(io::Error::from_raw_os_error(libc::EEXIST));
+        }
+        entries.insert(newname.to_owned(), inode);
+
+        let t = now();
+        set_mtime(&mut p.attr.lock().unwrap(), t);
+        {
+            let mut attr = node.attr.lock().unwrap();
+            attr.st_nlink += 1;
+            set_ctime(&mut attr, t);
+        }
+
+        Ok(self.entry(&node))
+    }
+
+    fn open(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        let node = self.get(inode)?;
+        if flags as i32 & libc::O_TRUNC != 0 {
+            self.truncate(&node, 0)?;
+        }
+
+        // Nothing but the guest changes the files, so what it has cached is always valid.
+        Ok((None, OpenOptions::KEEP_CACHE))
+    }
+
+    fn create(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        _flags: u32,
+        umask: u32,
+    ) -> io::Result<(Entry, Option<Handle>, OpenOptions)> {
+        let mode = libc::S_IFREG | (mode & !umask & 0o7777);
+        let file = NodeKind::File(RwLock::new(BTreeMap::new()));
+        let entry = self.create_node(ctx, parent, name, mode, 0, file)?;
+
+        Ok((entry, None, OpenOptions::KEEP_CACHE))
+    }
+
+    fn read<W: io::Write + ZeroCopyWriter>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        mut w: W,
+        size: u32,
+        offset: u64,
+        _lock_owner: Option<u64>,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        let node = self.get(inode)?;
+        let chunks = node.chunks()?.read().unwrap();
+        let file_size = node.attr.lock().unwrap().st_size as u64;
+
+        let end = cmp::min(offset.saturating_add(u64::from(size)), file_size);
+        let mut off = offset;
+        while off < end {
+            let index = off / CHUNK_SIZE as u64;
+            let start = (off % CHUNK_SIZE as u64) as usize;
+            let len = cmp::min(CHUNK_SIZE - start, (end - off) as usize);
+
+            let chunk = match chunks.get(&index) {
+                Some(chunk) => &chunk[..],
+                None => &ZERO_CHUNK[..],
+            };
+            w.write_all(&chunk[start..start + len])?;
+            off += len as u64;
+        }
+
+        Ok((off.saturating_sub(offset)) as usize)
+    }
+
+    fn write<R: io::Read + ZeroCopyReader>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        mut r: R,
+        size: u32,
+        offset: u64,
+        _lock_owner: Option<u64>,
+        _delayed_write: bool,
+        kill_priv: bool,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        let node = self.get(inode)?;
+        let mut chunks = node.chunks()?.write().unwrap();
+
+        let end = offset
+            .checked_add(u64::from(size))
+            .filter(|end| *end <= i64::MAX as u64)
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::EFBIG))?;
+        let mut off = offset;
+        let mut res = Ok(());
+        while off < end {
+            let index = off / CHUNK_SIZE as u64;
+            let start = (off % CHUNK_SIZE as u64) as usize;
+            let len = cmp::min(CHUNK_SIZE - start, (end - off) as usize);
+
+            let chunk = match chunks.entry(index) {
+                btree_map::Entry::Occupied(entry) => entry.into_mut(),
+                btree_map::Entry::Vacant(entry) => match self.alloc_chunk() {
+                    Ok(chunk) => entry.insert(chunk),
+                    Err(e) => {
+                        res = Err(e);
+                        break;
+                    }
+                },
+            };
+            if let Err(e) = r.read_exact(&mut chunk[start..start + len]) {
+                res = Err(e);
+                break;
+            }
+            off += len as u64;
+        }
+
+        let written = off - offset;
+        if written == 0 {
+            res?;
+        }
+
+        let mut attr = node.attr.lock().unwrap();
+        if off > attr.st_size as u64 {
+            attr.st_size = off as i64;
+        }
+        attr.st_blocks = Self::blocks(&chunks);
+        if kill_priv {
+            attr.st_mode &= !libc::S_ISUID;
+            if attr.st_mode & libc::S_IXGRP != 0 {
+                attr.st_mode &= !libc::S_ISGID;
+            }
+        }
+        set_mtime(&mut attr, now());
+
+        Ok(written as usize)
+    }
+
+    fn flush(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _handle: Handle,
+        _lock_owner: u64,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn fsync(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _datasync: bool,
+        _handle: Handle,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn fallocate(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        mode: u32,
+        offset: u64,
+        length: u64,
+    ) -> io::Result<()> {
+        let node = self.get(inode)?;
+        let end = offset
+            .checked_add(length)
+            .filter(|end| *end <= i64::MAX as u64)
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::EFBIG))?;
+
+        let mode = mode as i32;
+        let punch_hole = libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE;
+        if mode != 0 && mode != libc::FALLOC_FL_KEEP_SIZE && mode != punch_hole {
+            return Err(io::Error::from_raw_os_error(libc::EOPNOTSUPP));
+        }
+
+        let mut chunks = node.chunks()?.write().unwrap();
+        let first = offset / CHUNK_SIZE as u64;
+        let last = (end + CHUNK_SIZE as u64 - 1) / CHUNK_SIZE as u64;
+
+        if mode == punch_hole {
+            let mut freed = Vec::new();
+            for (&index, chunk) in chunks.range_mut(first..last) {
+                let chunk_start = index * CHUNK_SIZE as u64;
+                let start = offset.saturating_sub(chunk_start) as usize;
+                let stop = cmp::min(end - chunk_start, CHUNK_SIZE as u64) as usize;
+                if start == 0 && stop == CHUNK_SIZE {
+                    freed.push(index);
+                } else {
+                    for b in chunk[start..stop].iter_mut() {
+                        *b = 0;
+                    }
+                }
+            }
+            for index in freed.iter() {
+                chunks.remove(index);
+            }
+            self.unreserve(freed.len());
+        } else {
+            // The memory is reserved up front, so only ranges within the limit are walked.
+            let missing = (last - first) - chunks.range(first..last).count() as u64;
+            self.reserve(missing)?;
+            for index in first..last {
+                chunks
+                    .entry(index)
+                    .or_insert_with(|| vec![0u8; CHUNK_SIZE].into_boxed_slice());
+            }
+        }
+
+        let mut attr = node.attr.lock().unwrap();
+        if mode == 0 && end > attr.st_size as u64 {
+            attr.st_size = end as i64;
+        }
+        attr.st_blocks = Self::blocks(&chunks);
+        set_mtime(&mut attr, now());
+
+        Ok(())
+    }
+
+    fn release(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _flags: u32,
+        _handle: Handle,
+        _flush: bool,
+        _flock_release: bool,
+        _lock_owner: Option<u64>,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn opendir(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        self.get(inode)?.entries()?;
+
+        Ok((None, OpenOptions::CACHE_DIR))
+    }
+
+    fn readdir<F>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry) -> io::Result<usize>,
+    {
+        if size == 0 {
+            return Ok(());
+        }
+
+        let node = self.get(inode)?;
+        let entries = node.entries()?.read().unwrap();
+        for (i, (name, inode)) in entries.iter().enumerate().skip(offset as usize) {
+            let mode = self.get(*inode)?.attr.lock().unwrap().st_mode;
+            let res = add_entry(DirEntry {
+                ino: *inode,
+                offset: i as u64 + 1,
+                type_: (mode & libc::S_IFMT) >> 12,
+                name: name.to_bytes(),
+            })?;
+            if res == 0 {
+                break;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn readdirplus<F>(
+        &self,
+        ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry, Entry) -> io::Result<usize>,
+    {
+        self.readdir(ctx, inode, handle, size, offset, |dir_entry| {
+            let entry = self.entry(&*self.get(dir_entry.ino)?);
+            add_entry(dir_entry, entry)
+        })
+    }
+
+    fn releasedir(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _flags: u32,
+        _handle: Handle,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn fsyncdir(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _datasync: bool,
+        _handle: Handle,
+    ) -> io::Result<()> {
+        Ok(())
+    }
+
+    fn setxattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        name: &CStr,
+        value: &[u8],
+        flags: u32,
+    ) -> io::Result<()> {
+        let node = self.get(inode)?;
+        let mut xattrs = node.xattrs.lock().unwrap();
+        let flags = flags as i32;
+
+        if flags & libc::XATTR_CREATE != 0 && xattrs.contains_key(name) {
+            return Err(io::Error::from_raw_os_error(libc::EEXIST));
+        }
+        if flags & libc::XATTR_REPLACE != 0 && !xattrs.contains_key(name) {
+            return Err(io::Error::from_raw_os_error(libc::ENODATA));
+        }
+        xattrs.insert(name.to_owned(), value.to_vec());
+
+        Ok(())
+    }
+
+    fn getxattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        name: &CStr,
+        size: u32,
+    ) -> io::Result<GetxattrReply> {
+        let node = self.get(inode)?;
+        let xattrs = node.xattrs.lock().unwrap();
+        let value = xattrs
+            .get(name)
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::ENODATA))?;
+
+        if size == 0 {
+            Ok(GetxattrReply::Count(value.len() as u32))
+        } else if value.len() > size as usize {
+            Err(io::Error::from_raw_os_error(libc::ERANGE))
+        } else {
+            Ok(GetxattrReply::Value(value.clone()))
+        }
+    }
+
+    fn listxattr(&self, _ctx: Context, inode: Inode, size: u32) -> io::Result<ListxattrReply> {
+        let node = self.get(inode)?;
+        let mut names = Vec::new();
+        for name in node.xattrs.lock().unwrap().keys() {
+            names.extend_from_slice(name.to_bytes_with_nul());
+        }
+
+        if size == 0 {
+            Ok(ListxattrReply::Count(names.len() as u32))
+        } else if names.len() > size as usize {
+            Err(io::Error::from_raw_os_error(libc::ERANGE))
+        } else {
+            Ok(ListxattrReply::Names(names))
+        }
+    }
+
+    fn removexattr(&self, _ctx: Context, inode: Inode, name: &CStr) -> io::Result<()> {
+        let node = self.get(inode)?;
+        let mut xattrs = node.xattrs.lock().unwrap();
+
+        match xattrs.remove(name) {
+            Some(_) => Ok(()),
+            None => Err(io::Error::from_raw_os_error(libc::ENODATA)),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::test_utils::{ctx, name, Dst, Src};
+    use super::*;
+
+    fn new_fs(size_limit: u64) -> MemFs {
+        let fs = MemFs::new(Config {
+            size_limit,
+            ..Default::default()
+        })
+        .unwrap();
+        fs.init(FsOptions::empty()).unwrap();
+        fs
+    }
+
+    fn write(fs: &MemFs, inode: Inode, data: &[u8], offset: u64) -> io::Result<usize> {
+        let size = data.len() as u32;
+        fs.write(
+            ctx(),
+            inode,
+            0,
+            Src(data),
+            size,
+            offset,
+            None,
+            false,
+            false,
+            0,
+        )
+    }
+
+    fn read(fs: &MemFs, inode: Inode, size: u32, offset: u64) -> Vec<u8> {
+        let mut buf = Vec::new();
+        fs.read(ctx(), inode, 0, Dst(&mut buf), size, offset, None, 0)
+            .unwrap();
+        buf
+    }
+
+    #[test]
+    fn test_links() {
+        let fs = new_fs(1 << 20);
+        let dir = fs
+            .mkdir(ctx(), fuse::ROOT_ID, &name("dir"), 0o755, 0o022)
+            .unwrap();
+        let (file, _, _) = fs
+            .create(ctx(), dir.inode, &name("a"), 0o644, 0, 0o022)
+            .unwrap();
+        assert_eq!(fs.do_getattr(fuse::ROOT_ID).unwrap().0.st_nlink, 3);
+
+        fs.link(ctx(), file.inode, fuse::ROOT_ID, &name("b"))
+            .unwrap();
+        assert_eq!(fs.do_getattr(file.inode).unwrap().0.st_nlink, 2);
+        assert!(fs.rmdir(ctx(), fuse::ROOT_ID, &name("dir")).is_err());
+
+        write(&fs, file.inode, &[1; 3 * CHUNK_SIZE], 0).unwrap();
+        assert_eq!(read(&fs, file.inode, 4, CHUNK_SIZE as u64 - 2), vec![1; 4]);
+        fs.unlink(ctx(), dir.inode, &name("a")).unwrap();
+        fs.rmdir(ctx(), fuse::ROOT_ID, &name("dir")).unwrap();
+        assert_eq!(fs.used.load(Ordering::Relaxed), 3 * CHUNK_SIZE as u64);
+
+        // The contents go away with the last link, once the guest forgets about the file.
+        fs.rename(
+            ctx(),
+            fuse::ROOT_ID,
+            &name("b"),
+            fuse::ROOT_ID,
+            &name("c"),
+            0,
+        )
+        .unwrap();
+        fs.unlink(ctx(), fuse::ROOT_ID, &name("c")).unwrap();
+        assert_eq!(fs.used.load(Ordering::Relaxed), 3 * CHUNK_SIZE as u64);
+        fs.forget(ctx(), file.inode, 2);
+        fs.forget(ctx(), dir.inode, 1);
+        assert_eq!(fs.used.load(Ordering::Relaxed), 0);
+        assert_eq!(fs.nodes.read().unwrap().len(), 1);
+    }
+
+    #[test]
+    fn test_size_limit() {
+        let fs = new_fs(4 * CHUNK_SIZE as u64);
+        let (file, _, _) = fs
+            .create(ctx(), fuse::ROOT_ID, &name("f"), 0o644, 0, 0)
+            .unwrap();
+
+        // Holes don't take any memory.
+        write(&fs, file.inode, b"x", 100 * CHUNK_SIZE as u64).unwrap();
+        assert_eq!(
+            read(&fs, file.inode, 3, 100 * CHUNK_SIZE as u64 - 2),
+            b"\0\0x"
+        );
+        write(&fs, file.inode, &[7; 3 * CHUNK_SIZE], 0).unwrap();
+        assert!(write(&fs, file.inode, b"x", 50 * CHUNK_SIZE as u64).is_err());
+        assert_eq!(fs.statfs(ctx(), fuse::ROOT_ID).unwrap().f_bfree, 0);
+
+        fs.fallocate(
+            ctx(),
+            file.inode,
+            0,
+            (libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE) as u32,
+            CHUNK_SIZE as u64,
+            CHUNK_SIZE as u64,
+        )
+        .unwrap();
+        assert_eq!(fs.used.load(Ordering::Relaxed), 3 * CHUNK_SIZE as u64);
+
+        let mut attr: libc::stat64 = unsafe { mem::zeroed() };
+        attr.st_size = 10;
+        fs.setattr(ctx(), file.inode, attr, None, SetattrValid::SIZE)
+            .unwrap();
+        assert_eq!(fs.used.load(Ordering::Relaxed), CHUNK_SIZE as u64);
+        assert_eq!(read(&fs, file.inode, 4096, 0), vec![7; 10]);
+    }
+
+    #[test]
+    fn test_high_offsets() {
+        let fs = new_fs(4 * CHUNK_SIZE as u64);
+        let (file, _, _) = fs
+            .create(ctx(), fuse::ROOT_ID, &name("f"), 0o644, 0, 0)
+            .unwrap();
+
+        // Only the chunks that are written take memory, however far into the file they are.
+        let last = i64::MAX as u64 - 1;
+        write(&fs, file.inode, b"x", 1 << 40).unwrap();
+        write(&fs, file.inode, b"y", last).unwrap();
+        assert_eq!(fs.used.load(Ordering::Relaxed), 2 * CHUNK_SIZE as u64);
+        assert_eq!(read(&fs, file.inode, 2, (1 << 40) - 1), b"\0x");
+        assert_eq!(read(&fs, file.inode, 2, last), b"y");
+        assert!(write(&fs, file.inode, b"zz", last).is_err());
+
+        let (attr, _) = fs.do_getattr(file.inode).unwrap();
+        assert_eq!(attr.st_size, i64::MAX);
+        assert_eq!(attr.st_blocks, (2 * CHUNK_SIZE / 512) as i64);
+
+        // Preallocating over the limit fails before taking anything.
+        let err = fs
+            .fallocate(ctx(), file.inode, 0, 0, 1 << 30, 1 << 40)
+            .unwrap_err();
+        assert_eq!(err.raw_os_error(), Some(libc::ENOSPC));
+        assert_eq!(fs.used.load(Ordering::Relaxed), 2 * CHUNK_SIZE as u64);
+        fs.fallocate(
+            ctx(),
+            file.inode,
+            0,
+            (libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE) as u32,
+            0,
+            i64::MAX as u64,
+        )
+        .unwrap();
+        // The last chunk isn't covered whole, so it's only zeroed.
+        assert_eq!(fs.used.load(Ordering::Relaxed), CHUNK_SIZE as u64);
+        assert_eq!(read(&fs, file.inode, 1, last), b"\0");
+    }
+}
@@ -1 +1,10 @@
+pub mod archive;
+mod cache;
+mod file_handle;
+pub mod memfs;
+pub mod overlay;
 pub mod passthrough;
+mod prefetch;
+#[cfg(test)]
+mod test_utils;
+mod watcher;
@@ -0,0 +1,2298 @@
+use std::collections::btree_map;
+use std::collections::{BTreeMap, BTreeSet};
+use std::ffi::{CStr, CString};
+use std::fs::File;
+use std::io;
+use std::mem::{self, size_of, MaybeUninit};
+use std::os::unix::ffi::OsStringExt;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
+use std::time::Duration;
+
+use vm_memory::ByteValued;
+
+use super::super::filesystem::{
+    Context, DirEntry, Entry, FileSystem, FsOptions, GetxattrReply, ListxattrReply, OpenOptions,
+    SetattrValid, ZeroCopyReader, ZeroCopyWriter,
+};
+use super::super::fuse;
+use super::passthrough::{ebadf, is_dir, set_creds, stat, INIT_BINARY};
+
+const EMPTY_CSTR: &[u8] = b"\0";
+const PROC_CSTR: &[u8] = b"/proc/self/fd\0";
+const INIT_CSTR: &[u8] = b"init.krun\0";
+
+// Entries named with this prefix hide the entry with the rest of the name in the layers below,
+// following the whiteout format of OCI image layers. They are never shown to the guest.
+const WHITEOUT_PREFIX: &[u8] = b".wh.";
+// A directory containing this entry hides the directories with the same name in the layers below.
+const OPAQUE_CSTR: &[u8] = b".wh..wh..opq\0";
+// Name of the temporary entry a file is copied to before being moved into place.
+const COPY_UP_CSTR: &[u8] = b".wh..wh..copyup\0";
+
+// Not available in the libc crate version we use.
+const RENAME_NOREPLACE: u32 = 1;
+
+// Size of the buffer used to read directories from the host.
+const READDIR_BUF_SIZE: usize = 32 * 1024;
+
+// The writable layer. The read-only lower layers follow, from the topmost to the bottom one.
+const UPPER: usize = 0;
+
+// Inode numbers are only unique within a layer, so the index of the layer a file comes from is
+// folded into the upper bits of the number shown to the guest.
+const LAYER_INO_SHIFT: u32 = 48;
+
+type Inode = u64;
+type Handle = u64;
+
+// An instance of a file in one of the layers.
+#[derive(Clone)]
+struct Real {
+    layer: usize,
+    // Opened with `O_PATH`.
+    file: Arc<File>,
+}
+
+struct InodeData {
+    inode: Inode,
+    // The inode number shown to the guest, see `layer_ino`. It's the one of the file first found,
+    // so it doesn't change when the file is copied up.
+    ino: libc::ino64_t,
+    // Parent and name of the entry in the merged tree, needed to copy it up. Kept up to date by
+    // `rename` and cleared when the entry is removed. `None` for the root.
+    location: Mutex<Option<(Arc<InodeData>, CString)>>,
+    // The instances of the file that make up the merged view, from the topmost layer. Only
+    // directories may have more than one.
+    reals: RwLock<Vec<Real>>,
+    refcount: AtomicU64,
+}
+
+impl InodeData {
+    fn top(&self) -> Real {
+        self.reals.read().unwrap()[0].clone()
+    }
+
+    fn reals(&self) -> Vec<Real> {
+        self.reals.read().unwrap().clone()
+    }
+
+    fn is_at(&self, parent: Inode, name: &CStr) -> bool {
+        match *self.location.lock().unwrap() {
+            Some((ref p, ref n)) => p.inode == parent && n.as_c_str() == name,
+            None => false,
+        }
+    }
+}
+
+#[derive(Default)]
+struct InodeMap {
+    inodes: BTreeMap<Inode, Arc<InodeData>>,
+    // The inode each known entry resolves to, by parent and name. Several entries may resolve to
+    // the same inode when it has hard links.
+    dentries: BTreeMap<(Inode, CString), Inode>,
+}
+
+impl InodeMap {
+    fn get(&self, inode: Inode) -> Option<&Arc<InodeData>> {
+        self.inodes.get(&inode)
+    }
+
+    fn get_dentry(&self, parent: Inode, name: &CStr) -> Option<&Arc<InodeData>> {
+        self.dentries
+            .get(&(parent, name.to_owned()))
+            .and_then(|inode| self.inodes.get(inode))
+    }
+
+    fn insert(&mut self, parent: Inode, name: &CStr, data: Arc<InodeData>) {
+        self.dentries.insert((parent, name.to_owned()), data.inode);
+        self.inodes.insert(data.inode, data);
+    }
+
+    fn add_dentry(&mut self, parent: Inode, name: &CStr, inode: Inode) {
+        self.dentries.insert((parent, name.to_owned()), inode);
+    }
+
+    // Forgets the entry `name` in `parent`, which no longer exists or now refers to a different
+    // file.
+    fn remove_dentry(&mut self, parent: Inode, name: &CStr) -> Option<Arc<InodeData>> {
+        let inode = self.dentries.remove(&(parent, name.to_owned()))?;
+        let data = self.inodes.get(&inode).map(Arc::clone)?;
+        if data.is_at(parent, name) {
+            *data.location.lock().unwrap() = None;
+        }
+        Some(data)
+    }
+
+    fn remove(&mut self, inode: Inode) -> Option<Arc<InodeData>> {
+        let data = self.inodes.remove(&inode)?;
+        if let Some((ref parent, ref name)) = *data.location.lock().unwrap() {
+            let key = (parent.inode, name.clone());
+            if self.dentries.get(&key) == Some(&inode) {
+                self.dentries.remove(&key);
+            }
+        }
+        Some(data)
+    }
+
+    fn clear(&mut self) {
+        self.dentries.clear();
+        self.inodes.clear();
+    }
+}
+
+// An entry of a merged directory.
+struct DirEntryData {
+    name: CString,
+    ino: libc::ino64_t,
+    type_: u32,
+}
+
+enum HandleKind {
+    File(RwLock<File>),
+    // A snapshot of the merged directory, taken when it was opened.
+    Dir(Arc<Vec<DirEntryData>>),
+}
+
+struct HandleData {
+    inode: Inode,
+    kind: HandleKind,
+}
+
+impl HandleData {
+    fn file(&self) -> io::Result<&RwLock<File>> {
+        match self.kind {
+            HandleKind::File(ref file) => Ok(file),
+            HandleKind::Dir(_) => Err(ebadf()),
+        }
+    }
+}
+
+#[repr(C, packed)]
+#[derive(Clone, Copy, Debug, Default)]
+struct LinuxDirent64 {
+    d_ino: libc::ino64_t,
+    d_off: libc::off64_t,
+    d_reclen: libc::c_ushort,
+    d_ty: libc::c_uchar,
+}
+unsafe impl ByteValued for LinuxDirent64 {}
+
+fn is_hidden(name: &[u8]) -> bool {
+    name.starts_with(WHITEOUT_PREFIX)
+}
+
+fn whiteout_name(name: &CStr) -> CString {
+    let mut buf = WHITEOUT_PREFIX.to_vec();
+    buf.extend_from_slice(name.to_bytes());
+    // Safe because `name` doesn't have any interior nul byte and neither does the prefix.
+    unsafe { CString::from_vec_unchecked(buf) }
+}
+
+// The inode number shown to the guest for the file numbered `ino` in `layer`. Those of the upper
+// layer are kept as they are.
+fn layer_ino(layer: usize, ino: libc::ino64_t) -> libc::ino64_t {
+    ino ^ ((layer as u64) << LAYER_INO_SHIFT)
+}
+
+fn cstr(bytes: &[u8]) -> &CStr {
+    // All the callers pass constant values that are valid C strings.
+    CStr::from_bytes_with_nul(bytes).unwrap()
+}
+
+// Returns the attributes of `name` in `dir`, or `None` if it doesn't exist.
+fn lookup_at(dir: &File, name: &CStr) -> io::Result<Option<libc::stat64>> {
+    let mut st = MaybeUninit::<libc::stat64>::zeroed();
+
+    // Safe because the kernel will only write data in `st` and we check the return value.
+    let res = unsafe {
+        libc::fstatat64(
+            dir.as_raw_fd(),
+            name.as_ptr(),
+            st.as_mut_ptr(),
+            libc::AT_SYMLINK_NOFOLLOW,
+        )
+    };
+    if res >= 0 {
+        // Safe because the kernel guarantees that the struct is now fully initialized.
+        Ok(Some(unsafe { st.assume_init() }))
+    } else {
+        let err = io::Error::last_os_error();
+        match err.raw_os_error() {
+            Some(libc::ENOENT) | Some(libc::ENOTDIR) => Ok(None),
+            _ => Err(err),
+        }
+    }
+}
+
+fn open_at(dir: &File, name: &CStr, flags: libc::c_int, mode: libc::mode_t) -> io::Result<File> {
+    // Safe because this doesn't modify any memory and we check the return value.
+    let fd = unsafe {
+        libc::openat(
+            dir.as_raw_fd(),
+            name.as_ptr(),
+            flags | libc::O_CLOEXEC | libc::O_NOFOLLOW,
+            mode,
+        )
+    };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    // Safe because we just opened this fd.
+    Ok(unsafe { File::from_raw_fd(fd) })
+}
+
+fn unlink_at(dir: &File, name: &CStr, flags: libc::c_int) -> io::Result<()> {
+    // Safe because this doesn't modify any memory and we check the return value.
+    let res = unsafe { libc::unlinkat(dir.as_raw_fd(), name.as_ptr(), flags) };
+    if res == 0 {
+        Ok(())
+    } else {
+        Err(io::Error::last_os_error())
+    }
+}
+
+// Creates an empty regular file, used as a marker, named `name` in `dir`.
+fn create_marker(dir: &File, name: &CStr) -> io::Result<()> {
+    open_at(dir, name, libc::O_WRONLY | libc::O_CREAT, 0o600).map(|_| ())
+}
+
+fn read_link(f: &File) -> io::Result<Vec<u8>> {
+    let mut buf = vec![0; libc::PATH_MAX as usize];
+
+    // Safe because this will only modify the contents of `buf` and we check the return value.
+    let res = unsafe {
+        libc::readlinkat(
+            f.as_raw_fd(),
+            cstr(EMPTY_CSTR).as_ptr(),
+            buf.as_mut_ptr() as *mut libc::c_char,
+            buf.len(),
+        )
+    };
+    if res < 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    buf.resize(res as usize, 0);
+    Ok(buf)
+}
+
+// Reads all the entries of `dir`, which must be open for reading, except "." and "..".
+fn read_dir(dir: &File) -> io::Result<Vec<DirEntryData>> {
+    let mut entries = Vec::new();
+    let mut buf = vec![0u8; READDIR_BUF_SIZE];
+
+    loop {
+        // Safe because the kernel guarantees that it will only write to `buf` and we check the
+        // return value.
+        let res = unsafe {
+            libc::syscall(
+                libc::SYS_getdents64,
+                dir.as_raw_fd(),
+                buf.as_mut_ptr() as *mut LinuxDirent64,
+                buf.len() as libc::c_int,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        if res == 0 {
+            break;
+        }
+
+        let mut rem = &buf[..res as usize];
+        while !rem.is_empty() {
+            // We only use debug asserts here because these values are coming from the kernel and
+            // we trust them implicitly.
+            debug_assert!(
+                rem.len() >= size_of::<LinuxDirent64>(),
+                "not enough space left in `rem`"
+            );
+
+            let (front, back) = rem.split_at(size_of::<LinuxDirent64>());
+            let dirent64 =
+                LinuxDirent64::from_slice(front).expect("unable to get LinuxDirent64 from slice");
+            let reclen = dirent64.d_reclen as usize;
+
+            // The name is nul-terminated and then padded with more nul bytes.
+            let name = &back[..reclen - size_of::<LinuxDirent64>()];
+            let name = &name[..name.iter().position(|c| *c == 0).unwrap_or(name.len())];
+            if name != b"." && name != b".." {
+                entries.push(DirEntryData {
+                    name: CString::new(name)
+                        .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?,
+                    ino: dirent64.d_ino,
+                    type_: u32::from(dirent64.d_ty),
+                });
+            }
+
+            rem = &rem[reclen..];
+        }
+    }
+
+    Ok(entries)
+}
+
+// Copies the extended attributes of `src` to `dst`, skipping the ones that can't be set.
+fn copy_xattrs(src: &File, dst: &File) -> io::Result<()> {
+    // Safe because this doesn't modify any memory and we check the return value.
+    let res = unsafe { libc::flistxattr(src.as_raw_fd(), std::ptr::null_mut(), 0) };
+    if res <= 0 {
+        return if res < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(())
+        };
+    }
+
+    let mut names = vec![0u8; res as usize];
+
+    // Safe because this will only modify the contents of `names`.
+    let res = unsafe {
+        libc::flistxattr(
+            src.as_raw_fd(),
+            names.as_mut_ptr() as *mut libc::c_char,
+            names.len(),
+        )
+    };
+    if res < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    names.truncate(res as usize);
+
+    for name in names.split(|c| *c == 0).filter(|n| !n.is_empty()) {
+        let name = CString::new(name).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+        let mut value = vec![0u8; 64 * 1024];
+
+        // Safe because this will only modify the contents of `value`.
+        let len = unsafe {
+            libc::fgetxattr(
+                src.as_raw_fd(),
+                name.as_ptr(),
+                value.as_mut_ptr() as *mut libc::c_void,
+                value.len(),
+            )
+        };
+        if len < 0 {
+            debug!(
+                "overlay: can't get xattr {:?}: {}",
+                name,
+                io::Error::last_os_error()
+            );
+            continue;
+        }
+
+        // Safe because this doesn't modify any memory.
+        let res = unsafe {
+            libc::fsetxattr(
+                dst.as_raw_fd(),
+                name.as_ptr(),
+                value.as_ptr() as *const libc::c_void,
+                len as usize,
+                0,
+            )
+        };
+        if res < 0 {
+            // Some namespaces can only be written by privileged processes.
+            debug!(
+                "overlay: can't copy xattr {:?}: {}",
+                name,
+                io::Error::last_os_error()
+            );
+        }
+    }
+
+    Ok(())
+}
+
+/// Options that configure the behavior of the file system.
+#[derive(Debug, Clone)]
+pub struct Config {
+    /// How long the FUSE client should consider directory entries to be valid.
+    ///
+    /// The default value for this option is 5 seconds.
+    pub entry_timeout: Duration,
+
+    /// How long the FUSE client should consider file and directory attributes to be valid.
+    ///
+    /// The default value for this option is 5 seconds.
+    pub attr_timeout: Duration,
+
+    /// The directory where all the changes are stored. It's expected to be used by this file
+    /// system only.
+    pub upper_dir: String,
+
+    /// The read-only directories stacked below `upper_dir`, from the topmost to the bottom one.
+    /// They may be shared with other file systems, but must not change while in use.
+    pub lower_dirs: Vec<PathBuf>,
+
+    /// Whether the file system should support Extended Attributes (xattr).
+    ///
+    /// The default value for this option is `true`.
+    pub xattr: bool,
+
+    /// Optional file descriptor for /proc/self/fd, see `passthrough::Config::proc_sfd_rawfd`.
+    pub proc_sfd_rawfd: Option<RawFd>,
+}
+
+impl Default for Config {
+    fn default() -> Self {
+        Config {
+            entry_timeout: Duration::from_secs(5),
+            attr_timeout: Duration::from_secs(5),
+            upper_dir: String::from("/"),
+            lower_dirs: Vec::new(),
+            xattr: true,
+            proc_sfd_rawfd: None,
+        }
+    }
+}
+
+/// A file system that merges a stack of read-only directories (the lower layers) with a writable
+/// one (the upper layer), like overlayfs does. Entries in upper layers hide the ones with the same
+/// name below, except for directories, which are merged.
+///
+/// Changing a file from a lower layer copies it up first. Removing an entry that exists in a lower
+/// layer leaves a whiteout in the upper layer, using the format of OCI image layers, so unpacked
+/// image layers can be used as lower layers as they are.
+pub struct OverlayFs {
+    inodes: RwLock<InodeMap>,
+    next_inode: AtomicU64,
+    init_inode: u64,
+
+    handles: RwLock<BTreeMap<Handle, Arc<HandleData>>>,
+    next_handle: AtomicU64,
+    init_handle: u64,
+
+    // Merged view of the directories, built when they are first opened and dropped when they
+    // change.
+    dirs: Mutex<BTreeMap<Inode, Arc<Vec<DirEntryData>>>>,
+
+    // Serializes the changes to the upper layer. Copying up a file involves several steps and
+    // checking the state of several layers, which must not be interleaved with other changes.
+    write_lock: Mutex<()>,
+
+    // File descriptor pointing to the `/proc/self/fd` directory, used to reopen the `O_PATH` fds
+    // of the layers.
+    proc_self_fd: File,
+
+    cfg: Config,
+}
+
+impl OverlayFs {
+    pub fn new(cfg: Config) -> io::Result<OverlayFs> {
+        let fd = if let Some(fd) = cfg.proc_sfd_rawfd {
+            fd
+        } else {
+            // Safe because this doesn't modify any memory and we check the return value.
+            let fd = unsafe {
+                libc::openat(
+                    libc::AT_FDCWD,
+                    cstr(PROC_CSTR).as_ptr(),
+                    libc::O_PATH | libc::O_NOFOLLOW | libc::O_CLOEXEC,
+                )
+            };
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+
+            fd
+        };
+
+        Ok(OverlayFs {
+            inodes: RwLock::new(InodeMap::default()),
+            next_inode: AtomicU64::new(fuse::ROOT_ID + 2),
+            init_inode: fuse::ROOT_ID + 1,
+
+            handles: RwLock::new(BTreeMap::new()),
+            next_handle: AtomicU64::new(1),
+            init_handle: 0,
+
+            dirs: Mutex::new(BTreeMap::new()),
+            write_lock: Mutex::new(()),
+
+            // Safe because we just opened this fd or it was provided by our caller.
+            proc_self_fd: unsafe { File::from_raw_fd(fd) },
+
+            cfg,
+        })
+    }
+
+    fn get_inode(&self, inode: Inode) -> io::Result<Arc<InodeData>> {
+        self.inodes
+            .read()
+            .unwrap()
+            .get(inode)
+            .map(Arc::clone)
+            .ok_or_else(ebadf)
+    }
+
+    fn get_handle(&self, inode: Inode, handle: Handle) -> io::Result<Arc<HandleData>> {
+        self.handles
+            .read()
+            .unwrap()
+            .get(&handle)
+            .filter(|hd| hd.inode == inode)
+            .map(Arc::clone)
+            .ok_or_else(ebadf)
+    }
+
+    // Opens the file referred by the `O_PATH` fd `file` with `flags`.
+    fn reopen(&self, file: &File, flags: libc::c_int) -> io::Result<File> {
+        let pathname = CString::new(format!("{}", file.as_raw_fd()))
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        // Safe because this doesn't modify any memory and we check the return value. Clear the
+        // `O_NOFOLLOW` flag since we need to follow the `/proc/self/fd` symlink.
+        let fd = unsafe {
+            libc::openat(
+                self.proc_self_fd.as_raw_fd(),
+                pathname.as_ptr(),
+                (flags | libc::O_CLOEXEC) & !libc::O_NOFOLLOW,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // Safe because we just opened this fd.
+        Ok(unsafe { File::from_raw_fd(fd) })
+    }
+
+    // Finds the instances of `name` in the layers that make up the directory `parent`.
+    fn resolve(&self, parent: &InodeData, name: &CStr) -> io::Result<Vec<Real>> {
+        let whiteout = whiteout_name(name);
+        let mut reals: Vec<Real> = Vec::new();
+
+        for dir in parent.reals() {
+            if let Some(st) = lookup_at(&dir.file, name)? {
+                // Anything but a directory below a directory is hidden by it.
+                if !reals.is_empty() && !is_dir(&st) {
+                    break;
+                }
+
+                let file = open_at(&dir.file, name, libc::O_PATH, 0)?;
+                let opaque = is_dir(&st) && lookup_at(&file, cstr(OPAQUE_CSTR))?.is_some();
+                reals.push(Real {
+                    layer: dir.layer,
+                    file: Arc::new(file),
+                });
+
+                if !is_dir(&st) || opaque {
+                    break;
+                }
+            }
+
+            if lookup_at(&dir.file, &whiteout)?.is_some() {
+                break;
+            }
+        }
+
+        if reals.is_empty() {
+            Err(io::Error::from_raw_os_error(libc::ENOENT))
+        } else {
+            Ok(reals)
+        }
+    }
+
+    // Whether `name` in `parent` exists in a lower layer, and so needs a whiteout to be removed.
+    fn in_lower(&self, parent: &InodeData, name: &CStr) -> io::Result<bool> {
+        let whiteout = whiteout_name(name);
+
+        for dir in parent.reals().iter().filter(|r| r.layer != UPPER) {
+            if lookup_at(&dir.file, name)?.is_some() {
+                return Ok(true);
+            }
+            if lookup_at(&dir.file, &whiteout)?.is_some() {
+                break;
+            }
+        }
+
+        Ok(false)
+    }
+
+    // Builds the merged view of a directory made of `reals`.
+    fn merge_dir(&self, reals: &[Real]) -> io::Result<Vec<DirEntryData>> {
+        let mut seen = BTreeSet::new();
+        let mut entries = Vec::new();
+
+        for real in reals {
+            let dir = self.reopen(&real.file, libc::O_RDONLY | libc::O_DIRECTORY)?;
+            let mut whiteouts = Vec::new();
+
+            for mut entry in read_dir(&dir)? {
+                entry.ino = layer_ino(real.layer, entry.ino);
+                let name = entry.name.to_bytes();
+                if is_hidden(name) {
+                    // Whiteouts only hide the entries in the layers below.
+                    let target = &name[WHITEOUT_PREFIX.len()..];
+                    if !is_hidden(target) {
+                        whiteouts.push(target.to_vec());
+                    }
+                } else if seen.insert(name.to_vec()) {
+                    entries.push(entry);
+                }
+            }
+
+            seen.extend(whiteouts);
+        }
+
+        Ok(entries)
+    }
+
+    fn dir_entries(&self, data: &InodeData) -> io::Result<Arc<Vec<DirEntryData>>> {
+        if let Some(entries) = self.dirs.lock().unwrap().get(&data.inode) {
+            return Ok(entries.clone());
+        }
+
+        let entries = Arc::new(self.merge_dir(&data.reals())?);
+        self.dirs
+            .lock()
+            .unwrap()
+            .insert(data.inode, entries.clone());
+
+        Ok(entries)
+    }
+
+    // Must be called after any change to the entries of the directory `inode`.
+    fn invalidate_dir(&self, inode: Inode) {
+        self.dirs.lock().unwrap().remove(&inode);
+    }
+
+    fn entry(&self, data: &InodeData, mut st: libc::stat64) -> Entry {
+        st.st_ino = data.ino;
+
+        Entry {
+            inode: data.inode,
+            generation: 0,
+            attr: st,
+            attr_timeout: self.cfg.attr_timeout,
+            entry_timeout: self.cfg.entry_timeout,
+        }
+    }
+
+    fn do_lookup(&self, parent: Inode, name: &CStr) -> io::Result<Entry> {
+        if is_hidden(name.to_bytes()) {
+            return Err(io::Error::from_raw_os_error(libc::ENOENT));
+        }
+
+        let known = self
+            .inodes
+            .read()
+            .unwrap()
+            .get_dentry(parent, name)
+            .map(Arc::clone);
+        if let Some(data) = known {
+            let st = stat(&data.top().file)?;
+            // Matches with the release store in `forget`.
+            data.refcount.fetch_add(1, Ordering::Acquire);
+            return Ok(self.entry(&data, st));
+        }
+
+        let p = self.get_inode(parent)?;
+        let reals = self.resolve(&p, name)?;
+        let st = stat(&reals[0].file)?;
+
+        let mut inodes = self.inodes.write().unwrap();
+
+        // Another thread may have looked up the same entry in the meantime.
+        if let Some(data) = inodes.get_dentry(parent, name) {
+            data.refcount.fetch_add(1, Ordering::Acquire);
+            return Ok(self.entry(data, st));
+        }
+
+        let inode = self.next_inode.fetch_add(1, Ordering::Relaxed);
+        let data = Arc::new(InodeData {
+            inode,
+            ino: layer_ino(reals[0].layer, st.st_ino),
+            location: Mutex::new(Some((p, name.to_owned()))),
+            reals: RwLock::new(reals),
+            refcount: AtomicU64::new(1),
+        });
+        inodes.insert(parent, name, data.clone());
+
+        Ok(self.entry(&data, st))
+    }
+
+    fn do_getattr(&self, inode: Inode) -> io::Result<(libc::stat64, Duration)> {
+        let data = self.get_inode(inode)?;
+        let mut st = stat(&data.top().file)?;
+        st.st_ino = data.ino;
+
+        Ok((st, self.cfg.attr_timeout))
+    }
+
+    // Makes sure the file of `data` is in the upper layer, copying it up from the lower layer
+    // it's in otherwise, and returns it. Must be called with `write_lock` held.
+    fn copy_up(&self, data: &InodeData) -> io::Result<Arc<File>> {
+        let top = data.top();
+        if top.layer == UPPER {
+            return Ok(top.file);
+        }
+
+        let (parent, name) = data
+            .location
+            .lock()
+            .unwrap()
+            .clone()
+            .ok_or_else(|| io::Error::from_raw_os_error(libc::ENOENT))?;
+        let (upper, dir) = self.copy_up_entry(&parent, &name, &top)?;
+
+        let real = Real {
+            layer: UPPER,
+            file: upper.clone(),
+        };
+        let mut reals = data.reals.write().unwrap();
+        if dir {
+            // The copy in the upper layer is merged with the ones below.
+            reals.insert(0, real);
+        } else {
+            *reals = vec![real];
+        }
+
+        Ok(upper)
+    }
+
+    // Copies `src`, the topmost instance of `name` in `parent`, to the upper layer. Returns the
+    // copy and whether it's a directory. Must be called with `write_lock` held.
+    fn copy_up_entry(
+        &self,
+        parent: &InodeData,
+        name: &CStr,
+        src: &Real,
+    ) -> io::Result<(Arc<File>, bool)> {
+        let dir = self.copy_up(parent)?;
+        let st = stat(&src.file)?;
+
+        // The entry may have been copied up already through an inode that was forgotten since.
+        if let Some(upper) = lookup_at(&dir, name)? {
+            let file = open_at(&dir, name, libc::O_PATH, 0)?;
+            return Ok((Arc::new(file), is_dir(&upper)));
+        }
+
+        // Everything but directories is created with a temporary name and moved into place
+        // once complete, so a failure never leaves a partial copy behind.
+        let tmp = cstr(COPY_UP_CSTR);
+        let target = if is_dir(&st) { name } else { tmp };
+        if !is_dir(&st) {
+            // Left behind by a previous run that didn't finish.
+            let _ = unlink_at(&dir, tmp, 0);
+        }
+
+        // Safe because these calls don't modify any memory and we check the return values.
+        let res = match st.st_mode & libc::S_IFMT {
+            libc::S_IFDIR => unsafe { libc::mkdirat(dir.as_raw_fd(), name.as_ptr(), 0o700) },
+            libc::S_IFREG => {
+                let mut from = self.reopen(&src.file, libc::O_RDONLY)?;
+                let mut to = open_at(
+                    &dir,
+                    tmp,
+                    libc::O_WRONLY | libc::O_CREAT | libc::O_EXCL,
+                    0o600,
+                )?;
+                // This uses `copy_file_range`, which shares the data instead of copying it
+                // when the file system supports it.
+                io::copy(&mut from, &mut to)?;
+                0
+            }
+            libc::S_IFLNK => {
+                let link = CString::new(read_link(&src.file)?)
+                    .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+                unsafe { libc::symlinkat(link.as_ptr(), dir.as_raw_fd(), tmp.as_ptr()) }
+            }
+            fmt => unsafe { libc::mknodat(dir.as_raw_fd(), tmp.as_ptr(), fmt | 0o600, st.st_rdev) },
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        let file = open_at(&dir, target, libc::O_PATH, 0)?;
+        self.copy_metadata(&src.file, &file, &st)?;
+
+        if !is_dir(&st) {
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe {
+                libc::renameat(
+                    dir.as_raw_fd(),
+                    tmp.as_ptr(),
+                    dir.as_raw_fd(),
+                    name.as_ptr(),
+                )
+            };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        Ok((Arc::new(file), is_dir(&st)))
+    }
+
+    // Gives `dst`, the copy of `src` in the upper layer, the attributes in `st`.
+    fn copy_metadata(&self, src: &File, dst: &File, st: &libc::stat64) -> io::Result<()> {
+        // The ownership goes first, since changing it clears the setuid and setgid bits. It can
+        // only be preserved if we are privileged enough.
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::fchownat(
+                dst.as_raw_fd(),
+                cstr(EMPTY_CSTR).as_ptr(),
+                st.st_uid,
+                st.st_gid,
+                libc::AT_EMPTY_PATH | libc::AT_SYMLINK_NOFOLLOW,
+            )
+        };
+        if res < 0 {
+            debug!(
+                "overlay: can't preserve ownership: {}",
+                io::Error::last_os_error()
+            );
+        }
+
+        // There's no way to change the rest for a symlink without following it.
+        if st.st_mode & libc::S_IFMT == libc::S_IFLNK {
+            return Ok(());
+        }
+
+        let pathname = CString::new(format!("{}", dst.as_raw_fd()))
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::fchmodat(
+                self.proc_self_fd.as_raw_fd(),
+                pathname.as_ptr(),
+                st.st_mode & 0o7777,
+                0,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        if self.cfg.xattr {
+            let flags = libc::O_RDONLY | libc::O_NONBLOCK;
+            let res = self
+                .reopen(src, flags)
+                .and_then(|from| copy_xattrs(&from, &self.reopen(dst, flags)?));
+            if let Err(e) = res {
+                debug!("overlay: can't copy xattrs: {}", e);
+            }
+        }
+
+        let times = [
+            libc::timespec {
+                tv_sec: st.st_atime,
+                tv_nsec: st.st_atime_nsec,
+            },
+            libc::timespec {
+                tv_sec: st.st_mtime,
+                tv_nsec: st.st_mtime_nsec,
+            },
+        ];
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::utimensat(
+                self.proc_self_fd.as_raw_fd(),
+                pathname.as_ptr(),
+                times.as_ptr(),
+                0,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(())
+    }
+
+    // Gets the upper layer of `parent` ready for creating `name` in it. Returns the directory in
+    // the upper layer and whether `name` is whited out there. Must be called with `write_lock`
+    // held.
+    fn prepare_create(&self, parent: &InodeData, name: &CStr) -> io::Result<(Arc<File>, bool)> {
+        if is_hidden(name.to_bytes()) {
+            return Err(io::Error::from_raw_os_error(libc::EINVAL));
+        }
+
+        match self.resolve(parent, name) {
+            Ok(_) => return Err(io::Error::from_raw_os_error(libc::EEXIST)),
+            Err(e) if e.raw_os_error() == Some(libc::ENOENT) => {}
+            Err(e) => return Err(e),
+        }
+
+        // The layers are the reference, whatever was known about the name before doesn't hold
+        // anymore.
+        self.inodes
+            .write()
+            .unwrap()
+            .remove_dentry(parent.inode, name);
+        self.invalidate_dir(parent.inode);
+
+        let dir = self.copy_up(parent)?;
+        let whited_out = lookup_at(&dir, &whiteout_name(name))?.is_some();
+
+        Ok((dir, whited_out))
+    }
+
+    // Completes the creation of `name` in the upper directory `dir` of `parent`. Must be called
+    // with `write_lock` held.
+    fn finish_create(
+        &self,
+        parent: Inode,
+        dir: &File,
+        name: &CStr,
+        whited_out: bool,
+    ) -> io::Result<()> {
+        if whited_out {
+            // A new directory must not be merged with the one that was removed.
+            if let Some(st) = lookup_at(dir, name)? {
+                if is_dir(&st) {
+                    let new_dir = open_at(dir, name, libc::O_PATH, 0)?;
+                    create_marker(&new_dir, cstr(OPAQUE_CSTR))?;
+                }
+            }
+            unlink_at(dir, &whiteout_name(name), 0)?;
+        }
+
+        self.inodes.write().unwrap().remove_dentry(parent, name);
+        self.invalidate_dir(parent);
+
+        Ok(())
+    }
+
+    // Removes the entries only used by the overlay, such as whiteouts, from a directory in the
+    // upper layer, so it can be removed.
+    fn clear_hidden(&self, dir: &File) -> io::Result<()> {
+        let dir = self.reopen(dir, libc::O_RDONLY | libc::O_DIRECTORY)?;
+        for entry in read_dir(&dir)? {
+            if is_hidden(entry.name.to_bytes()) {
+                unlink_at(&dir, &entry.name, 0)?;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn do_unlink(&self, parent: Inode, name: &CStr, rmdir: bool) -> io::Result<()> {
+        if is_hidden(name.to_bytes()) {
+            return Err(io::Error::from_raw_os_error(libc::ENOENT));
+        }
+
+        let _guard = self.write_lock.lock().unwrap();
+
+        let p = self.get_inode(parent)?;
+        let reals = self.resolve(&p, name)?;
+        let st = stat(&reals[0].file)?;
+
+        if rmdir {
+            if !is_dir(&st) {
+                return Err(io::Error::from_raw_os_error(libc::ENOTDIR));
+            }
+            if !self.merge_dir(&reals)?.is_empty() {
+                return Err(io::Error::from_raw_os_error(libc::ENOTEMPTY));
+            }
+        } else if is_dir(&st) {
+            return Err(io::Error::from_raw_os_error(libc::EISDIR));
+        }
+
+        let dir = self.copy_up(&p)?;
+
+        if reals[0].layer == UPPER {
+            if rmdir {
+                self.clear_hidden(&reals[0].file)?;
+                unlink_at(&dir, name, libc::AT_REMOVEDIR)?;
+            } else {
+                unlink_at(&dir, name, 0)?;
+            }
+        }
+
+        if self.in_lower(&p, name)? {
+            create_marker(&dir, &whiteout_name(name))?;
+        }
+
+        self.inodes.write().unwrap().remove_dentry(parent, name);
+        self.invalidate_dir(parent);
+
+        Ok(())
+    }
+
+    fn do_open(&self, inode: Inode, flags: u32) -> io::Result<(Option<Handle>, OpenOptions)> {
+        let data = self.get_inode(inode)?;
+        let flags = flags as i32;
+
+        let real = if flags & libc::O_ACCMODE != libc::O_RDONLY || flags & libc::O_TRUNC != 0 {
+            let _guard = self.write_lock.lock().unwrap();
+            self.copy_up(&data)?;
+            data.top()
+        } else {
+            data.top()
+        };
+
+        let file = self.reopen(&real.file, flags & !(libc::O_CREAT | libc::O_EXCL))?;
+
+        let handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
+        let hd = HandleData {
+            inode,
+            kind: HandleKind::File(RwLock::new(file)),
+        };
+        self.handles.write().unwrap().insert(handle, Arc::new(hd));
+
+        // The lower layers don't change, so there's no need to drop the cached data when the
+        // file is opened again.
+        let mut opts = OpenOptions::empty();
+        if real.layer != UPPER {
+            opts |= OpenOptions::KEEP_CACHE;
+        }
+
+        Ok((Some(handle), opts))
+    }
+
+    fn do_release(&self, inode: Inode, handle: Handle) -> io::Result<()> {
+        let mut handles = self.handles.write().unwrap();
+
+        if let btree_map::Entry::Occupied(e) = handles.entry(handle) {
+            if e.get().inode == inode {
+                e.remove();
+                return Ok(());
+            }
+        }
+
+        Err(ebadf())
+    }
+
+    fn forget_one(&self, inodes: &mut InodeMap, inode: Inode, count: u64) {
+        if let Some(data) = inodes.get(inode) {
+            // See `passthrough::forget_one` for why this needs to loop.
+            loop {
+                let refcount = data.refcount.load(Ordering::Relaxed);
+                let new_count = refcount.saturating_sub(count);
+
+                // Synchronizes with the acquire load in `do_lookup`.
+                if data
+                    .refcount
+                    .compare_exchange(refcount, new_count, Ordering::Release, Ordering::Relaxed)
+                    .unwrap()
+                    == refcount
+                {
+                    if new_count == 0 {
+                        inodes.remove(inode);
+                        self.invalidate_dir(inode);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+impl FileSystem for OverlayFs {
+    type Inode = Inode;
+    type Handle = Handle;
+
+    fn init(&self, _capable: FsOptions) -> io::Result<FsOptions> {
+        let mut reals = Vec::new();
+
+        let dirs = std::iter::once(PathBuf::from(&self.cfg.upper_dir))
+            .chain(self.cfg.lower_dirs.iter().cloned());
+        for (layer, path) in dirs.enumerate() {
+            let path = CString::new(path.into_os_string().into_vec())
+                .map_err(|e| io::Error::new(io::ErrorKind::InvalidInput, e))?;
+
+            // Safe because this doesn't modify any memory and we check the return value.
+            let fd = unsafe {
+                libc::openat(
+                    libc::AT_FDCWD,
+                    path.as_ptr(),
+                    libc::O_PATH | libc::O_DIRECTORY | libc::O_CLOEXEC,
+                )
+            };
+            if fd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+
+            // Safe because we just opened this fd.
+            let file = unsafe { File::from_raw_fd(fd) };
+            let opaque = lookup_at(&file, cstr(OPAQUE_CSTR))?.is_some();
+            reals.push(Real {
+                layer,
+                file: Arc::new(file),
+            });
+
+            if opaque {
+                break;
+            }
+        }
+
+        let st = stat(&reals[0].file)?;
+
+        // Safe because this doesn't modify any memory and there is no need to check the return
+        // value because this system call always succeeds. We need to clear the umask here because
+        // we want the client to be able to set all the bits in the mode.
+        unsafe { libc::umask(0o000) };
+
+        // Not sure why the root inode gets a refcount of 2 but that's what libfuse does.
+        let mut inodes = self.inodes.write().unwrap();
+        inodes.inodes.insert(
+            fuse::ROOT_ID,
+            Arc::new(InodeData {
+                inode: fuse::ROOT_ID,
+                ino: layer_ino(UPPER, st.st_ino),
+                location: Mutex::new(None),
+                reals: RwLock::new(reals),
+                refcount: AtomicU64::new(2),
+            }),
+        );
+
+        Ok(FsOptions::DO_READDIRPLUS | FsOptions::READDIRPLUS_AUTO)
+    }
+
+    fn destroy(&self) {
+        self.handles.write().unwrap().clear();
+        self.inodes.write().unwrap().clear();
+        self.dirs.lock().unwrap().clear();
+    }
+
+    fn statfs(&self, _ctx: Context, _inode: Inode) -> io::Result<libc::statvfs64> {
+        // Only the space in the upper layer is available.
+        let root = self.get_inode(fuse::ROOT_ID)?;
+        let mut out = MaybeUninit::<libc::statvfs64>::zeroed();
+
+        // Safe because this will only modify `out` and we check the return value.
+        let res = unsafe { libc::fstatvfs64(root.top().file.as_raw_fd(), out.as_mut_ptr()) };
+        if res == 0 {
+            // Safe because the kernel guarantees that `out` has been initialized.
+            Ok(unsafe { out.assume_init() })
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    fn lookup(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<Entry> {
+        if parent == fuse::ROOT_ID && name == cstr(INIT_CSTR) {
+            // Safe because a zeroed stat64 is a valid value.
+            let mut st: libc::stat64 = unsafe { mem::zeroed() };
+            st.st_size = INIT_BINARY.len() as i64;
+            st.st_ino = self.init_inode;
+            st.st_mode = 0o100_755;
+
+            Ok(Entry {
+                inode: self.init_inode,
+                generation: 0,
+                attr: st,
+                attr_timeout: self.cfg.attr_timeout,
+                entry_timeout: self.cfg.entry_timeout,
+            })
+        } else {
+            self.do_lookup(parent, name)
+        }
+    }
+
+    fn forget(&self, _ctx: Context, inode: Inode, count: u64) {
+        let mut inodes = self.inodes.write().unwrap();
+
+        self.forget_one(&mut inodes, inode, count)
+    }
+
+    fn batch_forget(&self, _ctx: Context, requests: Vec<(Inode, u64)>) {
+        let mut inodes = self.inodes.write().unwrap();
+
+        for (inode, count) in requests {
+            self.forget_one(&mut inodes, inode, count)
+        }
+    }
+
+    fn getattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _handle: Option<Handle>,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        self.do_getattr(inode)
+    }
+
+    fn setattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        attr: libc::stat64,
+        _handle: Option<Handle>,
+        valid: SetattrValid,
+    ) -> io::Result<(libc::stat64, Duration)> {
+        let data = self.get_inode(inode)?;
+        let file = {
+            let _guard = self.write_lock.lock().unwrap();
+            self.copy_up(&data)?
+        };
+
+        let pathname = CString::new(format!("{}", file.as_raw_fd()))
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        if valid.contains(SetattrValid::MODE) {
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe {
+                libc::fchmodat(
+                    self.proc_self_fd.as_raw_fd(),
+                    pathname.as_ptr(),
+                    attr.st_mode,
+                    0,
+                )
+            };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        if valid.intersects(SetattrValid::UID | SetattrValid::GID) {
+            let uid = if valid.contains(SetattrValid::UID) {
+                attr.st_uid
+            } else {
+                // Cannot use -1 here because these are unsigned values.
+                ::std::u32::MAX
+            };
+            let gid = if valid.contains(SetattrValid::GID) {
+                attr.st_gid
+            } else {
+                // Cannot use -1 here because these are unsigned values.
+                ::std::u32::MAX
+            };
+
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe {
+                libc::fchownat(
+                    file.as_raw_fd(),
+                    cstr(EMPTY_CSTR).as_ptr(),
+                    uid,
+                    gid,
+                    libc::AT_EMPTY_PATH | libc::AT_SYMLINK_NOFOLLOW,
+                )
+            };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        if valid.contains(SetattrValid::SIZE) {
+            // There is no `ftruncateat` so we need to get a new fd and truncate it.
+            let f = self.reopen(&file, libc::O_NONBLOCK | libc::O_RDWR)?;
+
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe { libc::ftruncate(f.as_raw_fd(), attr.st_size) };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        if valid.intersects(SetattrValid::ATIME | SetattrValid::MTIME) {
+            let mut tvs = [
+                libc::timespec {
+                    tv_sec: 0,
+                    tv_nsec: libc::UTIME_OMIT,
+                },
+                libc::timespec {
+                    tv_sec: 0,
+                    tv_nsec: libc::UTIME_OMIT,
+                },
+            ];
+
+            if valid.contains(SetattrValid::ATIME_NOW) {
+                tvs[0].tv_nsec = libc::UTIME_NOW;
+            } else if valid.contains(SetattrValid::ATIME) {
+                tvs[0].tv_sec = attr.st_atime;
+                tvs[0].tv_nsec = attr.st_atime_nsec;
+            }
+
+            if valid.contains(SetattrValid::MTIME_NOW) {
+                tvs[1].tv_nsec = libc::UTIME_NOW;
+            } else if valid.contains(SetattrValid::MTIME) {
+                tvs[1].tv_sec = attr.st_mtime;
+                tvs[1].tv_nsec = attr.st_mtime_nsec;
+            }
+
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe {
+                libc::utimensat(
+                    self.proc_self_fd.as_raw_fd(),
+                    pathname.as_ptr(),
+                    tvs.as_ptr(),
+                    0,
+                )
+            };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+        }
+
+        self.do_getattr(inode)
+    }
+
+    fn readlink(&self, _ctx: Context, inode: Inode) -> io::Result<Vec<u8>> {
+        read_link(&self.get_inode(inode)?.top().file)
+    }
+
+    fn symlink(
+        &self,
+        ctx: Context,
+        linkname: &CStr,
+        parent: Inode,
+        name: &CStr,
+    ) -> io::Result<Entry> {
+        let p = self.get_inode(parent)?;
+        {
+            let _guard = self.write_lock.lock().unwrap();
+            let (dir, whited_out) = self.prepare_create(&p, name)?;
+            {
+                let (_uid, _gid) = set_creds(ctx.uid, ctx.gid)?;
+
+                // Safe because this doesn't modify any memory and we check the return value.
+                let res =
+                    unsafe { libc::symlinkat(linkname.as_ptr(), dir.as_raw_fd(), name.as_ptr()) };
+                if res < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+            }
+            self.finish_create(parent, &dir, name, whited_out)?;
+        }
+
+        self.do_lookup(parent, name)
+    }
+
+    fn mknod(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        rdev: u32,
+        umask: u32,
+    ) -> io::Result<Entry> {
+        let p = self.get_inode(parent)?;
+        {
+            let _guard = self.write_lock.lock().unwrap();
+            let (dir, whited_out) = self.prepare_create(&p, name)?;
+            {
+                let (_uid, _gid) = set_creds(ctx.uid, ctx.gid)?;
+
+                // Safe because this doesn't modify any memory and we check the return value.
+                let res = unsafe {
+                    libc::mknodat(
+                        dir.as_raw_fd(),
+                        name.as_ptr(),
+                        (mode & !umask) as libc::mode_t,
+                        u64::from(rdev),
+                    )
+                };
+                if res < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+            }
+            self.finish_create(parent, &dir, name, whited_out)?;
+        }
+
+        self.do_lookup(parent, name)
+    }
+
+    fn mkdir(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        umask: u32,
+    ) -> io::Result<Entry> {
+        let p = self.get_inode(parent)?;
+        {
+            let _guard = self.write_lock.lock().unwrap();
+            let (dir, whited_out) = self.prepare_create(&p, name)?;
+            {
+                let (_uid, _gid) = set_creds(ctx.uid, ctx.gid)?;
+
+                // Safe because this doesn't modify any memory and we check the return value.
+                let res = unsafe { libc::mkdirat(dir.as_raw_fd(), name.as_ptr(), mode & !umask) };
+                if res < 0 {
+                    return Err(io::Error::last_os_error());
+                }
+            }
+            self.finish_create(parent, &dir, name, whited_out)?;
+        }
+
+        self.do_lookup(parent, name)
+    }
+
+    fn unlink(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<()> {
+        self.do_unlink(parent, name, false)
+    }
+
+    fn rmdir(&self, _ctx: Context, parent: Inode, name: &CStr) -> io::Result<()> {
+        self.do_unlink(parent, name, true)
+    }
+
+    fn rename(
+        &self,
+        _ctx: Context,
+        olddir: Inode,
+        oldname: &CStr,
+        newdir: Inode,
+        newname: &CStr,
+        flags: u32,
+    ) -> io::Result<()> {
+        if flags & !RENAME_NOREPLACE != 0 {
+            return Err(io::Error::from_raw_os_error(libc::EINVAL));
+        }
+        if is_hidden(oldname.to_bytes()) || is_hidden(newname.to_bytes()) {
+            return Err(io::Error::from_raw_os_error(libc::ENOENT));
+        }
+
+        let _guard = self.write_lock.lock().unwrap();
+
+        let old_p = self.get_inode(olddir)?;
+        let new_p = self.get_inode(newdir)?;
+
+        let src = self.resolve(&old_p, oldname)?;
+        let src_is_dir = is_dir(&stat(&src[0].file)?);
+        let src_in_lower = self.in_lower(&old_p, oldname)?;
+
+        // Moving a merged directory would need to move its contents in the lower layers too.
+        // Like overlayfs does, let the guest fall back to copying it.
+        if src_is_dir && src.iter().any(|r| r.layer != UPPER) {
+            return Err(io::Error::from_raw_os_error(libc::EXDEV));
+        }
+
+        match self.resolve(&new_p, newname) {
+            Ok(dst) => {
+                if flags & RENAME_NOREPLACE != 0 {
+                    return Err(io::Error::from_raw_os_error(libc::EEXIST));
+                }
+
+                if is_dir(&stat(&dst[0].file)?) {
+                    if !src_is_dir {
+                        return Err(io::Error::from_raw_os_error(libc::EISDIR));
+                    }
+                    if !self.merge_dir(&dst)?.is_empty() {
+                        return Err(io::Error::from_raw_os_error(libc::ENOTEMPTY));
+                    }
+                    if dst.iter().any(|r| r.layer != UPPER) {
+                        return Err(io::Error::from_raw_os_error(libc::EXDEV));
+                    }
+                    self.clear_hidden(&dst[0].file)?;
+                } else if src_is_dir {
+                    return Err(io::Error::from_raw_os_error(libc::ENOTDIR));
+                }
+            }
+            Err(e) if e.raw_os_error() == Some(libc::ENOENT) => {}
+            Err(e) => return Err(e),
+        }
+
+        let src_data = self
+            .inodes
+            .read()
+            .unwrap()
+            .get_dentry(olddir, oldname)
+            .map(Arc::clone);
+        match src_data {
+            Some(ref data) => {
+                self.copy_up(data)?;
+            }
+            None => {
+                if src[0].layer != UPPER {
+                    self.copy_up_entry(&old_p, oldname, &src[0])?;
+                }
+            }
+        }
+
+        let old_upper = self.copy_up(&old_p)?;
+        let new_upper = self.copy_up(&new_p)?;
+        let whited_out = lookup_at(&new_upper, &whiteout_name(newname))?.is_some();
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::renameat(
+                old_upper.as_raw_fd(),
+                oldname.as_ptr(),
+                new_upper.as_raw_fd(),
+                newname.as_ptr(),
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        if src_in_lower {
+            create_marker(&old_upper, &whiteout_name(oldname))?;
+        }
+        if whited_out {
+            if src_is_dir {
+                let moved = open_at(&new_upper, newname, libc::O_PATH, 0)?;
+                create_marker(&moved, cstr(OPAQUE_CSTR))?;
+            }
+            unlink_at(&new_upper, &whiteout_name(newname), 0)?;
+        }
+
+        let mut inodes = self.inodes.write().unwrap();
+        inodes.remove_dentry(newdir, newname);
+        if let Some(data) = src_data {
+            inodes.remove_dentry(olddir, oldname);
+            inodes.add_dentry(newdir, newname, data.inode);
+            *data.location.lock().unwrap() = Some((new_p, newname.to_owned()));
+        }
+        mem::drop(inodes);
+
+        self.invalidate_dir(olddir);
+        self.invalidate_dir(newdir);
+
+        Ok(())
+    }
+
+    fn link(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        newparent: Inode,
+        newname: &CStr,
+    ) -> io::Result<Entry> {
+        let data = self.get_inode(inode)?;
+        let p = self.get_inode(newparent)?;
+
+        let _guard = self.write_lock.lock().unwrap();
+
+        // Links to a file in a lower layer end up pointing to its copy.
+        let file = self.copy_up(&data)?;
+        let (dir, whited_out) = self.prepare_create(&p, newname)?;
+
+        let procname = CString::new(format!("{}", file.as_raw_fd()))
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::linkat(
+                self.proc_self_fd.as_raw_fd(),
+                procname.as_ptr(),
+                dir.as_raw_fd(),
+                newname.as_ptr(),
+                libc::AT_SYMLINK_FOLLOW,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        self.finish_create(newparent, &dir, newname, whited_out)?;
+
+        // Both names refer to the same inode.
+        let st = stat(&file)?;
+        self.inodes
+            .write()
+            .unwrap()
+            .add_dentry(newparent, newname, inode);
+        // Matches with the release store in `forget`.
+        data.refcount.fetch_add(1, Ordering::Acquire);
+
+        Ok(self.entry(&data, st))
+    }
+
+    fn open(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        if inode == self.init_inode {
+            Ok((Some(self.init_handle), OpenOptions::empty()))
+        } else {
+            self.do_open(inode, flags)
+        }
+    }
+
+    fn create(
+        &self,
+        ctx: Context,
+        parent: Inode,
+        name: &CStr,
+        mode: u32,
+        flags: u32,
+        umask: u32,
+    ) -> io::Result<(Entry, Option<Handle>, OpenOptions)> {
+        let p = self.get_inode(parent)?;
+
+        let file = {
+            let _guard = self.write_lock.lock().unwrap();
+            let (dir, whited_out) = self.prepare_create(&p, name)?;
+            let file = {
+                let (_uid, _gid) = set_creds(ctx.uid, ctx.gid)?;
+                open_at(
+                    &dir,
+                    name,
+                    flags as i32 | libc::O_CREAT,
+                    mode & !(umask & 0o777),
+                )?
+            };
+            self.finish_create(parent, &dir, name, whited_out)?;
+            file
+        };
+
+        let entry = self.do_lookup(parent, name)?;
+
+        let handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
+        let hd = HandleData {
+            inode: entry.inode,
+            kind: HandleKind::File(RwLock::new(file)),
+        };
+        self.handles.write().unwrap().insert(handle, Arc::new(hd));
+
+        Ok((entry, Some(handle), OpenOptions::empty()))
+    }
+
+    fn read<W: io::Write + ZeroCopyWriter>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        mut w: W,
+        size: u32,
+        offset: u64,
+        _lock_owner: Option<u64>,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        if inode == self.init_inode {
+            let start = std::cmp::min(offset as usize, INIT_BINARY.len());
+            let end = std::cmp::min(start + size as usize, INIT_BINARY.len());
+            return w.write(&INIT_BINARY[start..end]);
+        }
+
+        let data = self.get_handle(inode, handle)?;
+
+        // This is safe because write_from uses preadv64, so the underlying file descriptor
+        // offset is not affected by this operation.
+        let mut f = data.file()?.read().unwrap().try_clone()?;
+        w.write_from(&mut f, size as usize, offset)
+    }
+
+    fn write<R: io::Read + ZeroCopyReader>(
+        &self,
+        ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        mut r: R,
+        size: u32,
+        offset: u64,
+        _lock_owner: Option<u64>,
+        _delayed_write: bool,
+        kill_priv: bool,
+        _flags: u32,
+    ) -> io::Result<usize> {
+        let data = self.get_handle(inode, handle)?;
+
+        // This is safe because read_to uses pwritev64, so the underlying file descriptor
+        // offset is not affected by this operation.
+        let mut f = data.file()?.read().unwrap().try_clone()?;
+
+        // Change credentials so the kernel removes the setuid and setgid bits when the file is
+        // written by someone other than the owner.
+        let _creds = if kill_priv && stat(&f)?.st_mode & (libc::S_ISUID | libc::S_ISGID) != 0 {
+            Some(set_creds(ctx.uid, ctx.gid)?)
+        } else {
+            None
+        };
+
+        r.read_to(&mut f, size as usize, offset)
+    }
+
+    fn flush(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        _lock_owner: u64,
+    ) -> io::Result<()> {
+        if inode == self.init_inode {
+            return Ok(());
+        }
+
+        let data = self.get_handle(inode, handle)?;
+
+        // Emulate the close done by the client by closing a duplicate of the fd. Safe because
+        // this doesn't modify any memory and we check the return values.
+        unsafe {
+            let newfd = libc::dup(data.file()?.write().unwrap().as_raw_fd());
+            if newfd < 0 {
+                return Err(io::Error::last_os_error());
+            }
+
+            if libc::close(newfd) < 0 {
+                Err(io::Error::last_os_error())
+            } else {
+                Ok(())
+            }
+        }
+    }
+
+    fn fsync(&self, _ctx: Context, inode: Inode, datasync: bool, handle: Handle) -> io::Result<()> {
+        let data = self.get_handle(inode, handle)?;
+        let fd = data.file()?.write().unwrap().as_raw_fd();
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            if datasync {
+                libc::fdatasync(fd)
+            } else {
+                libc::fsync(fd)
+            }
+        };
+
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    fn fallocate(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        mode: u32,
+        offset: u64,
+        length: u64,
+    ) -> io::Result<()> {
+        let data = self.get_handle(inode, handle)?;
+        let fd = data.file()?.write().unwrap().as_raw_fd();
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::fallocate64(
+                fd,
+                mode as libc::c_int,
+                offset as libc::off64_t,
+                length as libc::off64_t,
+            )
+        };
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    fn lseek(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        offset: u64,
+        whence: u32,
+    ) -> io::Result<u64> {
+        let data = self.get_handle(inode, handle)?;
+        let fd = data.file()?.write().unwrap().as_raw_fd();
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe { libc::lseek(fd, offset as libc::off64_t, whence as libc::c_int) };
+        if res < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(res as u64)
+        }
+    }
+
+    fn release(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _flags: u32,
+        handle: Handle,
+        _flush: bool,
+        _flock_release: bool,
+        _lock_owner: Option<u64>,
+    ) -> io::Result<()> {
+        if inode == self.init_inode {
+            return Ok(());
+        }
+
+        self.do_release(inode, handle)
+    }
+
+    fn opendir(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _flags: u32,
+    ) -> io::Result<(Option<Handle>, OpenOptions)> {
+        let data = self.get_inode(inode)?;
+        if !is_dir(&stat(&data.top().file)?) {
+            return Err(io::Error::from_raw_os_error(libc::ENOTDIR));
+        }
+
+        let hd = HandleData {
+            inode,
+            kind: HandleKind::Dir(self.dir_entries(&data)?),
+        };
+        let handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
+        self.handles.write().unwrap().insert(handle, Arc::new(hd));
+
+        Ok((Some(handle), OpenOptions::empty()))
+    }
+
+    fn readdir<F>(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry) -> io::Result<usize>,
+    {
+        if size == 0 {
+            return Ok(());
+        }
+
+        let data = self.get_handle(inode, handle)?;
+        let entries = match data.kind {
+            HandleKind::Dir(ref entries) => entries,
+            HandleKind::File(_) => return Err(ebadf()),
+        };
+
+        for (i, entry) in entries.iter().enumerate().skip(offset as usize) {
+            // The number of a known inode doesn't change when it's copied up, but the entry in
+            // the snapshot may come from the copy.
+            let ino = self
+                .inodes
+                .read()
+                .unwrap()
+                .get_dentry(inode, &entry.name)
+                .map_or(entry.ino, |data| data.ino);
+            let res = add_entry(DirEntry {
+                ino,
+                offset: i as u64 + 1,
+                type_: entry.type_,
+                name: entry.name.to_bytes(),
+            })?;
+            if res == 0 {
+                break;
+            }
+        }
+
+        Ok(())
+    }
+
+    fn readdirplus<F>(
+        &self,
+        ctx: Context,
+        inode: Inode,
+        handle: Handle,
+        size: u32,
+        offset: u64,
+        mut add_entry: F,
+    ) -> io::Result<()>
+    where
+        F: FnMut(DirEntry, Entry) -> io::Result<usize>,
+    {
+        self.readdir(ctx, inode, handle, size, offset, |dir_entry| {
+            let name = CString::new(dir_entry.name)
+                .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+            let entry = self.do_lookup(inode, &name)?;
+            let dir_entry = DirEntry {
+                ino: entry.attr.st_ino,
+                ..dir_entry
+            };
+
+            add_entry(dir_entry, entry)
+        })
+    }
+
+    fn fsyncdir(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        datasync: bool,
+        _handle: Handle,
+    ) -> io::Result<()> {
+        // Only the directory in the upper layer can have pending changes.
+        let top = self.get_inode(inode)?.top();
+        if top.layer != UPPER {
+            return Ok(());
+        }
+
+        let dir = self.reopen(&top.file, libc::O_RDONLY | libc::O_DIRECTORY)?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            if datasync {
+                libc::fdatasync(dir.as_raw_fd())
+            } else {
+                libc::fsync(dir.as_raw_fd())
+            }
+        };
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    fn releasedir(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        _flags: u32,
+        handle: Handle,
+    ) -> io::Result<()> {
+        self.do_release(inode, handle)
+    }
+
+    fn access(&self, ctx: Context, inode: Inode, mask: u32) -> io::Result<()> {
+        let data = self.get_inode(inode)?;
+        let st = stat(&data.top().file)?;
+        let mode = mask as i32 & (libc::R_OK | libc::W_OK | libc::X_OK);
+
+        if mode == libc::F_OK {
+            return Ok(());
+        }
+
+        if (mode & libc::R_OK) != 0
+            && ctx.uid != 0
+            && (st.st_uid != ctx.uid || st.st_mode & 0o400 == 0)
+            && (st.st_gid != ctx.gid || st.st_mode & 0o040 == 0)
+            && st.st_mode & 0o004 == 0
+        {
+            return Err(io::Error::from_raw_os_error(libc::EACCES));
+        }
+
+        if (mode & libc::W_OK) != 0
+            && ctx.uid != 0
+            && (st.st_uid != ctx.uid || st.st_mode & 0o200 == 0)
+            && (st.st_gid != ctx.gid || st.st_mode & 0o020 == 0)
+            && st.st_mode & 0o002 == 0
+        {
+            return Err(io::Error::from_raw_os_error(libc::EACCES));
+        }
+
+        // root can only execute something if it is executable by one of the owner, the group, or
+        // everyone.
+        if (mode & libc::X_OK) != 0
+            && (ctx.uid != 0 || st.st_mode & 0o111 == 0)
+            && (st.st_uid != ctx.uid || st.st_mode & 0o100 == 0)
+            && (st.st_gid != ctx.gid || st.st_mode & 0o010 == 0)
+            && st.st_mode & 0o001 == 0
+        {
+            return Err(io::Error::from_raw_os_error(libc::EACCES));
+        }
+
+        Ok(())
+    }
+
+    fn setxattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        name: &CStr,
+        value: &[u8],
+        flags: u32,
+    ) -> io::Result<()> {
+        if !self.cfg.xattr {
+            return Err(io::Error::from_raw_os_error(libc::ENOSYS));
+        }
+
+        let data = self.get_inode(inode)?;
+        let upper = {
+            let _guard = self.write_lock.lock().unwrap();
+            self.copy_up(&data)?
+        };
+
+        // The f{set,get,remove,list}xattr functions don't work on an fd opened with `O_PATH` so we
+        // need to get a new fd.
+        let file = self.reopen(&upper, libc::O_RDONLY | libc::O_NONBLOCK)?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::fsetxattr(
+                file.as_raw_fd(),
+                name.as_ptr(),
+                value.as_ptr() as *const libc::c_void,
+                value.len(),
+                flags as libc::c_int,
+            )
+        };
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+
+    fn getxattr(
+        &self,
+        _ctx: Context,
+        inode: Inode,
+        name: &CStr,
+        size: u32,
+    ) -> io::Result<GetxattrReply> {
+        if !self.cfg.xattr {
+            return Err(io::Error::from_raw_os_error(libc::ENOSYS));
+        }
+        if inode == self.init_inode {
+            return Err(io::Error::from_raw_os_error(libc::ENODATA));
+        }
+
+        let top = self.get_inode(inode)?.top();
+        let file = self.reopen(&top.file, libc::O_RDONLY | libc::O_NONBLOCK)?;
+
+        let mut buf = vec![0; size as usize];
+
+        // Safe because this will only modify the contents of `buf`.
+        let res = unsafe {
+            libc::fgetxattr(
+                file.as_raw_fd(),
+                name.as_ptr(),
+                buf.as_mut_ptr() as *mut libc::c_void,
+                size as libc::size_t,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        if size == 0 {
+            Ok(GetxattrReply::Count(res as u32))
+        } else {
+            buf.resize(res as usize, 0);
+            Ok(GetxattrReply::Value(buf))
+        }
+    }
+
+    fn listxattr(&self, _ctx: Context, inode: Inode, size: u32) -> io::Result<ListxattrReply> {
+        if !self.cfg.xattr {
+            return Err(io::Error::from_raw_os_error(libc::ENOSYS));
+        }
+
+        let top = self.get_inode(inode)?.top();
+        let file = self.reopen(&top.file, libc::O_RDONLY | libc::O_NONBLOCK)?;
+
+        let mut buf = vec![0; size as usize];
+
+        // Safe because this will only modify the contents of `buf`.
+        let res = unsafe {
+            libc::flistxattr(
+                file.as_raw_fd(),
+                buf.as_mut_ptr() as *mut libc::c_char,
+                size as libc::size_t,
+            )
+        };
+        if res < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        if size == 0 {
+            Ok(ListxattrReply::Count(res as u32))
+        } else {
+            buf.resize(res as usize, 0);
+            Ok(ListxattrReply::Names(buf))
+        }
+    }
+
+    fn removexattr(&self, _ctx: Context, inode: Inode, name: &CStr) -> io::Result<()> {
+        if !self.cfg.xattr {
+            return Err(io::Error::from_raw_os_error(libc::ENOSYS));
+        }
+
+        let data = self.get_inode(inode)?;
+        let upper = {
+            let _guard = self.write_lock.lock().unwrap();
+            self.copy_up(&data)?
+        };
+
+        let file = self.reopen(&upper, libc::O_RDONLY | libc::O_NONBLOCK)?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe { libc::fremovexattr(file.as_raw_fd(), name.as_ptr()) };
+        if res == 0 {
+            Ok(())
+        } else {
+            Err(io::Error::last_os_error())
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::test_utils::{ctx, name, tmpdir};
+    use super::*;
+
+    use std::fs;
+    use std::os::unix::fs::MetadataExt;
+    use std::path::Path;
+
+    fn new_fs(upper: &Path, lower: &[&Path]) -> OverlayFs {
+        let fs = OverlayFs::new(Config {
+            upper_dir: upper.to_str().unwrap().to_string(),
+            lower_dirs: lower.iter().map(|p| p.to_path_buf()).collect(),
+            ..Default::default()
+        })
+        .unwrap();
+        fs.init(FsOptions::empty()).unwrap();
+        fs
+    }
+
+    fn list_ino(fs: &OverlayFs, inode: Inode) -> Vec<(String, libc::ino64_t)> {
+        let (handle, _) = fs.opendir(ctx(), inode, 0).unwrap();
+        let mut entries = Vec::new();
+        fs.readdir(ctx(), inode, handle.unwrap(), 4096, 0, |e| {
+            entries.push((String::from_utf8(e.name.to_vec()).unwrap(), e.ino));
+            Ok(1)
+        })
+        .unwrap();
+        fs.releasedir(ctx(), inode, 0, handle.unwrap()).unwrap();
+        entries.sort();
+        entries
+    }
+
+    fn list(fs: &OverlayFs, inode: Inode) -> Vec<String> {
+        list_ino(fs, inode)
+            .into_iter()
+            .map(|(name, _)| name)
+            .collect()
+    }
+
+    #[test]
+    fn test_merge_and_whiteout() {
+        let base = tmpdir("merge");
+        let (upper, mid, low) = (base.join("upper"), base.join("mid"), base.join("low"));
+        fs::create_dir_all(upper.join("etc")).unwrap();
+        fs::create_dir_all(mid.join("etc")).unwrap();
+        fs::create_dir_all(low.join("etc")).unwrap();
+        fs::write(low.join("etc/passwd"), b"low").unwrap();
+        fs::write(low.join("etc/gone"), b"low").unwrap();
+        fs::write(mid.join("etc/passwd"), b"mid").unwrap();
+        fs::write(mid.join("etc/.wh.gone"), b"").unwrap();
+        fs::write(upper.join("etc/hosts"), b"upper").unwrap();
+
+        let fs = new_fs(&upper, &[&mid, &low]);
+        let etc = fs.lookup(ctx(), fuse::ROOT_ID, &name("etc")).unwrap();
+        assert_eq!(list(&fs, etc.inode), vec!["hosts", "passwd"]);
+        assert!(fs.lookup(ctx(), etc.inode, &name("gone")).is_err());
+        assert!(fs.lookup(ctx(), etc.inode, &name(".wh.gone")).is_err());
+
+        // The topmost instance of a file hides the others.
+        let passwd = fs.lookup(ctx(), etc.inode, &name("passwd")).unwrap();
+        assert_eq!(passwd.attr.st_size, 3);
+        let real = fs.get_inode(passwd.inode).unwrap().top();
+        assert_eq!(real.layer, 1);
+
+        fs.unlink(ctx(), etc.inode, &name("passwd")).unwrap();
+        assert!(upper.join("etc/.wh.passwd").exists());
+        assert!(fs.lookup(ctx(), etc.inode, &name("passwd")).is_err());
+        assert_eq!(list(&fs, etc.inode), vec!["hosts"]);
+
+        // Creating it again hides the whiteout.
+        let (entry, handle, _) = fs
+            .create(
+                ctx(),
+                etc.inode,
+                &name("passwd"),
+                0o644,
+                libc::O_RDWR as u32,
+                0,
+            )
+            .unwrap();
+        fs.release(ctx(), entry.inode, 0, handle.unwrap(), false, false, None)
+            .unwrap();
+        assert!(!upper.join("etc/.wh.passwd").exists());
+        assert_eq!(list(&fs, etc.inode), vec!["hosts", "passwd"]);
+
+        let _ = fs::remove_dir_all(&base);
+    }
+
+    #[test]
+    fn test_copy_up() {
+        let base = tmpdir("copyup");
+        let (upper, low) = (base.join("upper"), base.join("low"));
+        fs::create_dir_all(&upper).unwrap();
+        fs::create_dir_all(low.join("a/b")).unwrap();
+        fs::write(low.join("a/b/file"), b"data").unwrap();
+
+        let fs = new_fs(&upper, &[&low]);
+        let a = fs.lookup(ctx(), fuse::ROOT_ID, &name("a")).unwrap();
+        let b = fs.lookup(ctx(), a.inode, &name("b")).unwrap();
+        let file = fs.lookup(ctx(), b.inode, &name("file")).unwrap();
+
+        // Reading doesn't change the upper layer.
+        let (handle, _) = fs.open(ctx(), file.inode, libc::O_RDONLY as u32).unwrap();
+        fs.release(ctx(), file.inode, 0, handle.unwrap(), false, false, None)
+            .unwrap();
+        assert!(!upper.join("a").exists());
+
+        // Opening it for writing copies the file and its parents up.
+        let (handle, _) = fs.open(ctx(), file.inode, libc::O_RDWR as u32).unwrap();
+        fs.release(ctx(), file.inode, 0, handle.unwrap(), false, false, None)
+            .unwrap();
+        assert_eq!(fs::read(upper.join("a/b/file")).unwrap(), b"data");
+        assert_eq!(fs::read(low.join("a/b/file")).unwrap(), b"data");
+
+        // The inode number doesn't change.
+        let (st, _) = fs.getattr(ctx(), file.inode, None).unwrap();
+        assert_eq!(st.st_ino, file.attr.st_ino);
+
+        // Removing a merged directory leaves a whiteout.
+        fs.unlink(ctx(), b.inode, &name("file")).unwrap();
+        fs.rmdir(ctx(), a.inode, &name("b")).unwrap();
+        assert!(!upper.join("a/b").exists());
+        assert!(upper.join("a/.wh.b").exists());
+
+        // A new directory with the same name is opaque.
+        let b = fs.mkdir(ctx(), a.inode, &name("b"), 0o755, 0).unwrap();
+        assert!(upper.join("a/b/.wh..wh..opq").exists());
+        assert!(list(&fs, b.inode).is_empty());
+
+        let _ = fs::remove_dir_all(&base);
+    }
+
+    #[test]
+    fn test_inode_numbers() {
+        let base = tmpdir("ino");
+        let (upper, low) = (base.join("upper"), base.join("low"));
+        fs::create_dir_all(&upper).unwrap();
+        fs::create_dir_all(&low).unwrap();
+        fs::write(upper.join("a"), b"upper").unwrap();
+        fs::write(low.join("b"), b"low").unwrap();
+
+        let fs = new_fs(&upper, &[&low]);
+        let a = fs.lookup(ctx(), fuse::ROOT_ID, &name("a")).unwrap();
+        let b = fs.lookup(ctx(), fuse::ROOT_ID, &name("b")).unwrap();
+
+        // The layer is part of the number, so files of different layers never share one.
+        let ino = |path: PathBuf| fs::metadata(path).unwrap().ino();
+        assert_eq!(a.attr.st_ino, layer_ino(UPPER, ino(upper.join("a"))));
+        assert_eq!(b.attr.st_ino, layer_ino(1, ino(low.join("b"))));
+
+        // readdir agrees with lookup, also once the file is copied up.
+        let expected = vec![
+            ("a".to_string(), a.attr.st_ino),
+            ("b".to_string(), b.attr.st_ino),
+        ];
+        assert_eq!(list_ino(&fs, fuse::ROOT_ID), expected);
+        let (handle, _) = fs.open(ctx(), b.inode, libc::O_RDWR as u32).unwrap();
+        fs.release(ctx(), b.inode, 0, handle.unwrap(), false, false, None)
+            .unwrap();
+        assert!(upper.join("b").exists());
+        assert_eq!(list_ino(&fs, fuse::ROOT_ID), expected);
+
+        // A name that wasn't found can be created, once.
+        assert!(fs.lookup(ctx(), fuse::ROOT_ID, &name("c")).is_err());
+        let c = fs
+            .mkdir(ctx(), fuse::ROOT_ID, &name("c"), 0o755, 0)
+            .unwrap();
+        assert_eq!(
+            fs.lookup(ctx(), fuse::ROOT_ID, &name("c")).unwrap().inode,
+            c.inode
+        );
+        let err = fs
+            .mkdir(ctx(), fuse::ROOT_ID, &name("c"), 0o755, 0)
+            .unwrap_err();
+        assert_eq!(err.raw_os_error(), Some(libc::EEXIST));
+
+        let _ = fs::remove_dir_all(&base);
+    }
+}
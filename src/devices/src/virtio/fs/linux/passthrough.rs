@@ -2,6 +2,7 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+use std::cmp;
 use std::collections::btree_map;
 use std::collections::BTreeMap;
 use std::convert::TryInto;
@@ -11,20 +12,27 @@ use std::io;
 use std::mem::{self, size_of, MaybeUninit};
 use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
 use std::path::PathBuf;
+use std::ptr;
 use std::str::FromStr;
-use std::sync::atomic::{AtomicBool, AtomicU64, Ordering};
-use std::sync::{Arc, RwLock};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicU8, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex, RwLock};
 use std::time::Duration;
 use std::collections::HashMap;
 
+use lru::LruCache;
 use vm_memory::ByteValued;
 
 use super::super::filesystem::{
-    Context, DirEntry, Entry, FileSystem, FsOptions, GetxattrReply, ListxattrReply, OpenOptions,
-    SetattrValid, ZeroCopyReader, ZeroCopyWriter,
+    Context, DirEntry, Entry, FileSystem, FsOptions, GetxattrReply, IoctlFlags, ListxattrReply,
+    OpenOptions, SetattrValid, ZeroCopyReader, ZeroCopyWriter,
 };
 use super::super::fuse;
 use super::super::multikey::MultikeyBTreeMap;
+use super::super::notify::Notifier;
+use super::cache::{CachedDentry, MetadataCache};
+use super::file_handle::FileHandle;
+use super::prefetch::{self, Recorder};
+use super::watcher::{WatchEvent, Watcher};
 
 const CURRENT_DIR_CSTR: &[u8] = b".\0";
 const PARENT_DIR_CSTR: &[u8] = b"..\0";
@@ -32,7 +40,19 @@ const EMPTY_CSTR: &[u8] = b"\0";
 const PROC_CSTR: &[u8] = b"/proc/self/fd\0";
 const INIT_CSTR: &[u8] = b"init.krun\0";
 
-static INIT_BINARY: &[u8] = include_bytes!("../../../../../../init/init");
+// Not yet exported by the libc crate, from linux/fs.h.
+const FICLONE: u32 = 0x4004_9409;
+const FICLONERANGE: u32 = 0x4020_940d;
+
+#[repr(C)]
+struct FileCloneRange {
+    src_fd: i64,
+    src_offset: u64,
+    src_length: u64,
+    dest_offset: u64,
+}
+
+pub(super) static INIT_BINARY: &[u8] = include_bytes!("../../../../../../init/init");
 
 type Inode = u64;
 type Handle = u64;
@@ -43,11 +63,115 @@ struct InodeAltKey {
     dev: libc::dev_t,
 }
 
+// How an inode refers to its file in the host.
+enum InodeFile {
+    // An `O_PATH` fd, kept open for as long as the inode exists.
+    Fd(Arc<File>),
+    // A file handle, reopened on demand. The `O_PATH` fds of recently used inodes are kept in
+    // `fds`.
+    Handle {
+        handle: FileHandle,
+        mount_fd: Arc<File>,
+        fds: Arc<Mutex<LruCache<Inode, Arc<File>>>>,
+    },
+}
+
+const SECURITY_XATTR_PREFIX: &[u8] = b"security.";
+
+// Values for `InodeData::security_xattrs`.
+const SECURITY_XATTRS_UNKNOWN: u8 = 0;
+const SECURITY_XATTRS_NONE: u8 = 1;
+const SECURITY_XATTRS_SOME: u8 = 2;
+
 struct InodeData {
     inode: Inode,
     // Most of these aren't actually files but ¯\_(ツ)_/¯.
-    file: File,
+    file: InodeFile,
     refcount: AtomicU64,
+    // Whether the file has any xattr in the "security." namespace, so the probes for them done by
+    // the FUSE client around writes can be answered without going to the host.
+    security_xattrs: AtomicU8,
+    // Value of `PassthroughFs::lookup_tick` when the inode was last looked up, to tell the cold
+    // inodes apart when the table goes over its budget.
+    last_lookup: AtomicU64,
+    // The parent and name the inode was last looked up by, needed to ask the FUSE client to drop
+    // its entry. `None` for the root.
+    dentry: Mutex<Option<(Inode, CString)>>,
+    // Set before the file's data is modified on behalf of the FUSE client, so the watcher can
+    // tell the resulting event from the changes made by other processes on the host.
+    own_modify: AtomicBool,
+}
+
+impl InodeData {
+    fn new(inode: Inode, file: InodeFile, refcount: u64) -> InodeData {
+        InodeData {
+            inode,
+            file,
+            refcount: AtomicU64::new(refcount),
+            security_xattrs: AtomicU8::new(SECURITY_XATTRS_UNKNOWN),
+            last_lookup: AtomicU64::new(0),
+            dentry: Mutex::new(None),
+            own_modify: AtomicBool::new(false),
+        }
+    }
+
+    // Records a lookup of the inode as `name` in `parent`.
+    fn looked_up(&self, tick: u64, parent: Inode, name: &CStr) {
+        self.last_lookup.store(tick, Ordering::Relaxed);
+
+        let mut dentry = self.dentry.lock().unwrap();
+        match *dentry {
+            Some((p, ref n)) if p == parent && n.as_c_str() == name => {}
+            _ => *dentry = Some((parent, name.to_owned())),
+        }
+    }
+
+    fn forget_security_xattrs(&self) {
+        self.security_xattrs
+            .store(SECURITY_XATTRS_UNKNOWN, Ordering::Relaxed);
+    }
+
+    // Records whether a modification of the file's data on behalf of the FUSE client, flagged
+    // with `own_modify` beforehand, went through.
+    fn modify_done(&self, modified: bool) {
+        if !modified {
+            self.own_modify.store(false, Ordering::Release);
+        }
+    }
+
+    // Whether a modification of the file's data reported by the watcher is one made on behalf of
+    // the FUSE client, which then already knows about it.
+    fn take_own_modify(&self) -> bool {
+        self.own_modify.swap(false, Ordering::AcqRel)
+    }
+
+    // Returns an `O_PATH` fd for this inode, which stays valid for as long as it's held.
+    fn get_file(&self) -> io::Result<Arc<File>> {
+        match self.file {
+            InodeFile::Fd(ref f) => Ok(f.clone()),
+            InodeFile::Handle {
+                ref handle,
+                ref mount_fd,
+                ref fds,
+            } => {
+                if let Some(f) = fds.lock().unwrap().get(&self.inode) {
+                    return Ok(f.clone());
+                }
+
+                let f = Arc::new(handle.open(mount_fd, libc::O_PATH | libc::O_CLOEXEC)?);
+                fds.lock().unwrap().put(self.inode, f.clone());
+                Ok(f)
+            }
+        }
+    }
+}
+
+impl Drop for InodeData {
+    fn drop(&mut self) {
+        if let InodeFile::Handle { ref fds, .. } = self.file {
+            fds.lock().unwrap().pop(&self.inode);
+        }
+    }
 }
 
 struct HandleData {
@@ -68,7 +192,7 @@ unsafe impl ByteValued for LinuxDirent64 {}
 macro_rules! scoped_cred {
     ($name:ident, $ty:ty, $syscall_nr:expr) => {
         #[derive(Debug)]
-        struct $name;
+        pub(super) struct $name;
 
         impl $name {
             // Changes the effective uid/gid of the current thread to `val`.  Changes
@@ -118,7 +242,7 @@ macro_rules! scoped_cred {
 scoped_cred!(ScopedUid, libc::uid_t, libc::SYS_setresuid);
 scoped_cred!(ScopedGid, libc::gid_t, libc::SYS_setresgid);
 
-fn set_creds(
+pub(super) fn set_creds(
     uid: libc::uid_t,
     gid: libc::gid_t,
 ) -> io::Result<(Option<ScopedUid>, Option<ScopedGid>)> {
@@ -127,11 +251,11 @@ fn set_creds(
     ScopedGid::new(gid).and_then(|gid| Ok((ScopedUid::new(uid)?, gid)))
 }
 
-fn ebadf() -> io::Error {
+pub(super) fn ebadf() -> io::Error {
     io::Error::from_raw_os_error(libc::EBADF)
 }
 
-fn stat(f: &File) -> io::Result<libc::stat64> {
+pub(super) fn stat(f: &File) -> io::Result<libc::stat64> {
     let mut st = MaybeUninit::<libc::stat64>::zeroed();
 
     // Safe because this is a constant value and a valid C string.
@@ -238,9 +362,10 @@ pub struct Config {
 
     /// Whether the file system should support Extended Attributes (xattr). Enabling this feature may
     /// have a significant impact on performance, especially on write parallelism. This is the result
-    /// of FUSE attempting to remove the special file privileges after each write request.
+    /// of FUSE attempting to remove the special file privileges after each write request, which is
+    /// mitigated by remembering which inodes have no "security." xattrs at all.
     ///
-    /// The default value for this options is `false`.
+    /// The default value for this options is `true`.
     pub xattr: bool,
 
     /// Optional file descriptor for /proc/self/fd. Callers can obtain a file descriptor and pass it
@@ -255,6 +380,62 @@ pub struct Config {
     ///
     /// The default in `None`.
     pub mapped_volumes: Option<Vec<(PathBuf, PathBuf)>>,
+
+    /// Whether the file system should keep a host-side cache of attributes and directory entries,
+    /// including negative ones. The cache is kept coherent with changes done on the host by other
+    /// processes by watching the directories with inotify, so it's only used for directories
+    /// that could be watched.
+    ///
+    /// The default value for this option is `true`.
+    pub host_cache: bool,
+
+    /// How long entries in the host-side cache are considered valid, even if no change was
+    /// reported for them. This is a safety net for the changes inotify can't report (i.e. writes
+    /// through shared mappings).
+    ///
+    /// The default value for this option is 60 seconds.
+    pub host_cache_timeout: Duration,
+
+    /// Handle used to tell the FUSE client about changes done on the host, so it can drop its own
+    /// cached entries, attributes and data. Changes are detected by the same watcher used for
+    /// the host-side cache, so this has no effect if `host_cache` is disabled.
+    ///
+    /// The default is `None`.
+    pub notifier: Option<Notifier>,
+
+    /// Whether inodes should be kept as file handles instead of `O_PATH` fds, so the number of
+    /// open fds doesn't grow with the number of inodes the FUSE client knows about. This requires
+    /// CAP_DAC_READ_SEARCH, and falls back to fds if file handles can't be used.
+    ///
+    /// The default value for this option is `false`.
+    pub inode_file_handles: bool,
+
+    /// How many `O_PATH` fds to keep open for recently used inodes when `inode_file_handles` is
+    /// enabled.
+    ///
+    /// The default value for this option is 1024.
+    pub inode_fd_cache_size: usize,
+
+    /// How many inodes the FUSE client can keep referenced before it's asked, through `notifier`,
+    /// to drop the directory entries of the ones it looked up least recently. This bounds the
+    /// memory and fds used by the inode table on the host, as long as the client is able to let go
+    /// of the entries. Has no effect without a `notifier`.
+    ///
+    /// The default value for this option is 262144. 0 means no limit.
+    pub inode_budget: usize,
+
+    /// File where the files read by the guest during the first `prefetch_window` are recorded. If
+    /// it already exists, the files recorded on the previous boot are read into the host page
+    /// cache in the background, ahead of the guest asking for them.
+    ///
+    /// The default is `None`.
+    pub prefetch_profile: Option<PathBuf>,
+
+    /// For how long after the file system is created the files read by the guest are recorded in
+    /// `prefetch_profile`.
+    ///
+    /// The default value for this option is 10 seconds.
+    pub prefetch_window: Duration,
 }
 
 impl Default for Config {
@@ -268,6 +449,282 @@ impl Default for Config {
             xattr: true,
             proc_sfd_rawfd: None,
             mapped_volumes: None,
+            host_cache: true,
+            host_cache_timeout: Duration::from_secs(60),
+            notifier: None,
+            inode_file_handles: false,
+            inode_fd_cache_size: 1024,
+            inode_budget: 1 << 18,
+            prefetch_profile: None,
+            prefetch_window: Duration::from_secs(10),
+        }
+    }
+}
+
+// The host-side metadata cache and the watcher that keeps it coherent.
+struct HostCache {
+    cache: Arc<MetadataCache>,
+    watcher: Watcher,
+}
+
+impl HostCache {
+    fn new(
+        timeout: Duration,
+        inodes: Arc<RwLock<MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>>>,
+        notifier: Option<Notifier>,
+    ) -> io::Result<HostCache> {
+        let cache = Arc::new(MetadataCache::new(timeout));
+        let watcher = Watcher::new()?;
+
+        let watched_cache = cache.clone();
+        watcher.start(move |event| {
+            // Host changes aren't read any further while the guest is behind on notifications,
+            // so the ones it hasn't taken yet don't pile up.
+            if let Some(ref notifier) = notifier {
+                notifier.wait_for_room();
+            }
+            match event {
+                WatchEvent::Changed { wd, mask, name } => {
+                    if let Some(dir) = watched_cache.watched_dir(wd) {
+                        match name {
+                            // Our own writes are the most common change, and need nothing.
+                            Some(name)
+                                if mask == libc::IN_MODIFY
+                                    && is_own_modify(&inodes, &watched_cache, dir, name) => {}
+                            Some(name) => {
+                                watched_cache.invalidate_entry(dir, name);
+                                entry_changed(
+                                    &inodes,
+                                    &watched_cache,
+                                    notifier.as_ref(),
+                                    dir,
+                                    mask,
+                                    name,
+                                );
+                            }
+                            None => {
+                                watched_cache.invalidate_attr(dir);
+                                if let Some(data) = inodes.read().unwrap().get(&dir) {
+                                    data.forget_security_xattrs();
+                                }
+                                if let Some(ref notifier) = notifier {
+                                    notifier.inval_inode(dir, -1, 0);
+                                }
+                            }
+                        }
+                    }
+                }
+                WatchEvent::Removed { wd } => watched_cache.unwatch(wd),
+                WatchEvent::Overflow => {
+                    watched_cache.clear();
+                    for data in inodes.read().unwrap().values() {
+                        data.forget_security_xattrs();
+                    }
+                    if notifier.as_ref().map_or(false, |n| n.is_enabled()) {
+                        warn!("fs: lost track of host changes, guest caches may be stale");
+                    }
+                }
+            }
+        })?;
+
+        Ok(HostCache { cache, watcher })
+    }
+
+    // Starts watching the directory `inode`, so its entries can be cached.
+    fn watch(&self, inode: Inode, dir: &File) {
+        match self.watcher.add_watch(dir.as_raw_fd()) {
+            Ok(wd) => self.cache.set_watched(inode, wd),
+            Err(e) => debug!("can't watch inode {}: {:?}", inode, e),
+        }
+    }
+
+    fn forget(&self, inode: Inode) {
+        if let Some(wd) = self.cache.forget(inode) {
+            self.watcher.remove_watch(wd);
+        }
+    }
+
+    fn reset(&self) {
+        for wd in self.cache.reset() {
+            self.watcher.remove_watch(wd);
+        }
+    }
+}
+
+// Makes the range in `fd_out` share the extents of the range in `fd_in`, which only updates
+// metadata on file systems supporting reflinks (i.e. btrfs, xfs). Returns the number of bytes
+// cloned, or `None` if the range can't be cloned and must be copied instead.
+fn clone_range(
+    fd_in: RawFd,
+    offset_in: u64,
+    fd_out: RawFd,
+    offset_out: u64,
+    len: u64,
+) -> Option<usize> {
+    let mut st = MaybeUninit::<libc::stat64>::zeroed();
+
+    // Safe because the kernel will only write data in `st` and we check the return value.
+    if unsafe { libc::fstat64(fd_in, st.as_mut_ptr()) } < 0 {
+        return None;
+    }
+    // Safe because the kernel guarantees that the struct is now fully initialized.
+    let size = unsafe { st.assume_init() }.st_size as u64;
+
+    // Reflinks can't go past the end of the source, so leave this case to copy_file_range.
+    if offset_in >= size || len == 0 {
+        return None;
+    }
+    let len = cmp::min(len, size - offset_in);
+
+    let range = FileCloneRange {
+        src_fd: fd_in as i64,
+        src_offset: offset_in,
+        src_length: len,
+        dest_offset: offset_out,
+    };
+
+    // Safe because this only reads `range` and we check the return value. Unsupported file
+    // systems, ranges not aligned to the block size and files on different file systems are
+    // all reported as errors, and handled by falling back to a regular copy.
+    let res = unsafe { libc::ioctl(fd_out, FICLONERANGE as _, &range as *const FileCloneRange) };
+    if res < 0 {
+        None
+    } else {
+        Some(len as usize)
+    }
+}
+
+// Checks that inodes can be kept as file handles, which requires both the file system holding
+// `root_dir` to support them and us to have CAP_DAC_READ_SEARCH.
+fn check_file_handles(root_dir: &str) -> io::Result<()> {
+    let root = CString::new(root_dir).map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+    // Safe because this doesn't modify any memory and we check the return value. Handles can't
+    // be opened through an `O_PATH` fd, so this one is opened for reading.
+    let fd = unsafe {
+        libc::openat(
+            libc::AT_FDCWD,
+            root.as_ptr(),
+            libc::O_RDONLY | libc::O_DIRECTORY | libc::O_NOFOLLOW | libc::O_CLOEXEC,
+        )
+    };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    // Safe because we just opened this fd.
+    let f = unsafe { File::from_raw_fd(fd) };
+
+    FileHandle::from_file(&f)?.open(&f, libc::O_PATH | libc::O_CLOEXEC)?;
+    Ok(())
+}
+
+pub(super) fn is_dir(st: &libc::stat64) -> bool {
+    st.st_mode & libc::S_IFMT == libc::S_IFDIR
+}
+
+// Whether the data change reported by the watcher for `name` in `parent` is one made on behalf
+// of the FUSE client, as far as the entries in `cache` can tell without going to the host.
+fn is_own_modify(
+    inodes: &RwLock<MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>>,
+    cache: &MetadataCache,
+    parent: Inode,
+    name: &CStr,
+) -> bool {
+    match cache.get_dentry(parent, name) {
+        Some(CachedDentry::Positive(inode)) => inodes
+            .read()
+            .unwrap()
+            .get(&inode)
+            .map_or(false, |data| data.take_own_modify()),
+        _ => false,
+    }
+}
+
+// Updates what we know about the inode for `name` in `parent`, which was changed on the host,
+// and tells the FUSE client about it.
+fn entry_changed(
+    inodes: &RwLock<MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>>,
+    cache: &MetadataCache,
+    notifier: Option<&Notifier>,
+    parent: Inode,
+    mask: u32,
+    name: &CStr,
+) {
+    if let Some(notifier) = notifier {
+        if mask & (libc::IN_CREATE | libc::IN_DELETE | libc::IN_MOVED_FROM | libc::IN_MOVED_TO) != 0
+        {
+            notifier.inval_entry(parent, name);
+        }
+    }
+
+    // A new entry may be a hard link to an inode we know about. Its link count changed, which
+    // is only reported to the watchers of the inode itself, not to those of its directories.
+    if mask & (libc::IN_ATTRIB | libc::IN_CREATE) == 0
+        && (mask & libc::IN_MODIFY == 0 || notifier.is_none())
+    {
+        return;
+    }
+
+    let p = match inodes.read().unwrap().get(&parent).map(Arc::clone) {
+        Some(p) => p,
+        None => return,
+    };
+    let pf = match p.get_file() {
+        Ok(pf) => pf,
+        Err(_) => return,
+    };
+
+    let mut st = MaybeUninit::<libc::stat64>::zeroed();
+
+    // Safe because the kernel will only write data in `st` and we check the return value.
+    let res = unsafe {
+        libc::fstatat64(
+            pf.as_raw_fd(),
+            name.as_ptr(),
+            st.as_mut_ptr(),
+            libc::AT_SYMLINK_NOFOLLOW,
+        )
+    };
+    if res < 0 {
+        // The entry is already gone, and a removal event will follow.
+        return;
+    }
+
+    // Safe because the kernel guarantees that the struct is now fully initialized.
+    let st = unsafe { st.assume_init() };
+    let altkey = InodeAltKey {
+        ino: st.st_ino,
+        dev: st.st_dev,
+    };
+
+    // Only the inodes the client knows about can be cached there.
+    if let Some(data) = inodes.read().unwrap().get_alt(&altkey) {
+        if mask & libc::IN_CREATE != 0 {
+            if is_dir(&st) || st.st_nlink < 2 {
+                return;
+            }
+            // The inode is no longer eligible for caching, since changes to it may now be done
+            // through the new link.
+            cache.invalidate_attr(data.inode);
+        }
+
+        // Extended attributes may have changed.
+        if mask & libc::IN_ATTRIB != 0 {
+            data.forget_security_xattrs();
+        }
+
+        // The FUSE client already knows about the changes made on its behalf.
+        let modified = mask & libc::IN_MODIFY != 0 && !data.take_own_modify();
+        if mask & !libc::IN_MODIFY == 0 && !modified {
+            return;
+        }
+
+        if let Some(notifier) = notifier {
+            // Data changes invalidate the whole page cache, attribute changes only the
+            // attributes.
+            let off = if modified { 0 } else { -1 };
+            notifier.inval_inode(data.inode, off, 0);
         }
     }
 }
@@ -282,7 +739,7 @@ pub struct PassthroughFs {
     // the `O_PATH` option so they cannot be used for reading or writing any data. See the
     // documentation of the `O_PATH` flag in `open(2)` for more details on what one can and cannot
     // do with an fd opened with this flag.
-    inodes: RwLock<MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>>,
+    inodes: Arc<RwLock<MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>>>,
     next_inode: AtomicU64,
     init_inode: u64,
 
@@ -303,6 +760,31 @@ pub struct PassthroughFs {
     writeback: AtomicBool,
 
     fd_mm_map: HashMap<String, i64>, 
+
+    // Host-side cache of attributes and directory entries. `None` if disabled in the config or
+    // if inotify is not available.
+    host_cache: Option<HostCache>,
+
+    // Cache of `O_PATH` fds for the inodes kept as file handles. `None` if inodes are kept as
+    // fds.
+    inode_fds: Option<Arc<Mutex<LruCache<Inode, Arc<File>>>>>,
+
+    // An fd for each of the mounts with inodes kept as file handles, needed to open them. An
+    // entry is dropped along with the last inode in its mount, except for the root's mount, which
+    // is also kept in `root_mount_fd`.
+    mount_fds: RwLock<BTreeMap<libc::c_int, Arc<File>>>,
+    root_mount_fd: Mutex<Option<Arc<File>>>,
+
+    // Incremented on every lookup, to order the inodes by how recently they were looked up.
+    lookup_tick: AtomicU64,
+    // Records the files read right after boot, if `cfg.prefetch_profile` is set.
+    recorder: Option<Arc<Recorder>>,
+
+    // Size of the inode table above which the cold inodes are evicted, and whether an eviction is
+    // already in progress.
+    eviction_at: AtomicUsize,
+    evicting: AtomicBool,
+
     cfg: Config,
 }
 
@@ -332,8 +814,49 @@ impl PassthroughFs {
         // Safe because we just opened this fd or it was provided by our caller.
         let proc_self_fd = unsafe { File::from_raw_fd(fd) };
 
+        let inodes = Arc::new(RwLock::new(MultikeyBTreeMap::new()));
+
+        let host_cache = if cfg.host_cache {
+            HostCache::new(cfg.host_cache_timeout, inodes.clone(), cfg.notifier.clone())
+                .map_err(|e| warn!("fs: disabling host-side cache: {:?}", e))
+                .ok()
+        } else {
+            None
+        };
+
+        let inode_fds = if cfg.inode_file_handles {
+            match check_file_handles(&cfg.root_dir) {
+                Ok(()) => {
+                    let cache_size = cmp::max(cfg.inode_fd_cache_size, 1);
+                    Some(Arc::new(Mutex::new(LruCache::new(cache_size))))
+                }
+                Err(e) => {
+                    warn!(
+                        "fs: can't use file handles, keeping an fd per inode: {:?}",
+                        e
+                    );
+                    None
+                }
+            }
+        } else {
+            None
+        };
+
+        let recorder = cfg.prefetch_profile.clone().and_then(|profile| {
+            let recorder = Arc::new(Recorder::new(&cfg.root_dir));
+            prefetch::start(
+                &cfg.root_dir,
+                profile,
+                cfg.prefetch_window,
+                recorder.clone(),
+            )
+            .map_err(|e| warn!("fs: can't start prefetch thread: {:?}", e))
+            .ok()
+            .map(|()| recorder)
+        });
+
         Ok(PassthroughFs {
-            inodes: RwLock::new(MultikeyBTreeMap::new()),
+            inodes,
             next_inode: AtomicU64::new(fuse::ROOT_ID + 2),
             init_inode: fuse::ROOT_ID + 1,
 
@@ -347,10 +870,95 @@ impl PassthroughFs {
 
             fd_mm_map: HashMap::new(),
 
+            host_cache,
+
+            inode_fds,
+            mount_fds: RwLock::new(BTreeMap::new()),
+            root_mount_fd: Mutex::new(None),
+
+            recorder,
+
+            lookup_tick: AtomicU64::new(0),
+            eviction_at: AtomicUsize::new(cfg.inode_budget),
+            evicting: AtomicBool::new(false),
+
             cfg,
         })
     }
 
+    // Turns `f`, just opened for the new inode `inode` with attributes `st`, into the form it's kept
+    // in the inode table.
+    fn new_inode_file(&self, inode: Inode, f: File, st: &libc::stat64) -> InodeFile {
+        let fds = match self.inode_fds {
+            Some(ref fds) => fds,
+            None => return InodeFile::Fd(Arc::new(f)),
+        };
+
+        let handle = match FileHandle::from_file(&f) {
+            Ok(handle) => handle,
+            Err(e) => {
+                // Not all file systems support file handles.
+                debug!("can't get file handle for inode {}: {:?}", inode, e);
+                return InodeFile::Fd(Arc::new(f));
+            }
+        };
+
+        let mount_fd = match self.mount_fd(handle.mount_id(), &f, st) {
+            Some(mount_fd) => mount_fd,
+            // There's nothing to reopen the handle through yet.
+            None => return InodeFile::Fd(Arc::new(f)),
+        };
+        fds.lock().unwrap().put(inode, Arc::new(f));
+
+        InodeFile::Handle {
+            handle,
+            mount_fd,
+            fds: fds.clone(),
+        }
+    }
+
+    // Returns the fd the handles of the files in the mount `mount_id` are reopened through. If
+    // there's none yet, it's taken from `f`, with attributes `st`, as long as it's a directory.
+    // Handles can't be reopened through `O_PATH` fds, so the directory is reopened for reading.
+    fn mount_fd(&self, mount_id: libc::c_int, f: &File, st: &libc::stat64) -> Option<Arc<File>> {
+        if let Some(mount_fd) = self.mount_fds.read().unwrap().get(&mount_id) {
+            return Some(mount_fd.clone());
+        }
+        if !is_dir(st) {
+            return None;
+        }
+
+        let pathname = CString::new(format!("{}", f.as_raw_fd())).ok()?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let fd = unsafe {
+            libc::openat(
+                self.proc_self_fd.as_raw_fd(),
+                pathname.as_ptr(),
+                libc::O_RDONLY | libc::O_DIRECTORY | libc::O_CLOEXEC,
+            )
+        };
+        if fd < 0 {
+            debug!(
+                "can't open mount fd for mount {}: {:?}",
+                mount_id,
+                io::Error::last_os_error()
+            );
+            return None;
+        }
+
+        // Safe because we just opened this fd.
+        let mount_fd = Arc::new(unsafe { File::from_raw_fd(fd) });
+        Some(
+            self.mount_fds
+                .write()
+                .unwrap()
+                .entry(mount_id)
+                .or_insert(mount_fd)
+                .clone(),
+        )
+    }
+
     fn open_inode(&self, inode: Inode, mut flags: i32) -> io::Result<File> {
         let data = self
             .inodes
@@ -360,7 +968,8 @@ impl PassthroughFs {
             .map(Arc::clone)
             .ok_or_else(ebadf)?;
 
-        let pathname = CString::new(format!("{}", data.file.as_raw_fd()))
+        let file = data.get_file()?;
+        let pathname = CString::new(format!("{}", file.as_raw_fd()))
             .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
 
         // When writeback caching is enabled, the kernel may send read requests even if the
@@ -401,7 +1010,165 @@ impl PassthroughFs {
         Ok(unsafe { File::from_raw_fd(fd) })
     }
 
+    // Tries to resolve `name` in `parent` using only the host-side cache. Returns `Ok(None)` if
+    // the cache doesn't know enough to answer.
+    fn cached_lookup(&self, parent: Inode, name: &CStr) -> io::Result<Option<Entry>> {
+        let hc = match self.host_cache {
+            Some(ref hc) => hc,
+            None => return Ok(None),
+        };
+
+        let inode = match hc.cache.get_dentry(parent, name) {
+            Some(CachedDentry::Positive(inode)) => inode,
+            Some(CachedDentry::Negative) => {
+                return Err(io::Error::from_raw_os_error(libc::ENOENT));
+            }
+            None => return Ok(None),
+        };
+
+        let st = match hc.cache.get_attr(inode) {
+            Some(st) => st,
+            None => return Ok(None),
+        };
+
+        let data = match self.inodes.read().unwrap().get(&inode).map(Arc::clone) {
+            Some(data) => data,
+            None => return Ok(None),
+        };
+
+        // Matches with the release store in `forget`.
+        data.refcount.fetch_add(1, Ordering::Acquire);
+        data.looked_up(self.next_lookup_tick(), parent, name);
+
+        Ok(Some(Entry {
+            inode,
+            generation: 0,
+            attr: st,
+            attr_timeout: self.cfg.attr_timeout,
+            entry_timeout: self.cfg.entry_timeout,
+        }))
+    }
+
+    // Releases the inodes just removed from the table. This closes their fds and drops their
+    // watches, so it's done without holding the lock on the table.
+    fn release_inodes(&self, removed: Vec<Arc<InodeData>>) {
+        if let Some(ref hc) = self.host_cache {
+            for data in removed.iter() {
+                hc.forget(data.inode);
+            }
+        }
+
+        let mount_ids: Vec<libc::c_int> = removed
+            .iter()
+            .filter_map(|data| match data.file {
+                InodeFile::Handle { ref handle, .. } => Some(handle.mount_id()),
+                InodeFile::Fd(_) => None,
+            })
+            .collect();
+        if mount_ids.is_empty() {
+            return;
+        }
+        drop(removed);
+
+        // Holding the write lock keeps `mount_fd` from handing out the fds being dropped, so the
+        // only references left are those of the inodes still in the mount. An inode whose data
+        // is still borrowed by another thread keeps its mount's fd until the next release.
+        let mut mount_fds = self.mount_fds.write().unwrap();
+        for mount_id in mount_ids {
+            if let Some(mount_fd) = mount_fds.get(&mount_id) {
+                if Arc::strong_count(mount_fd) == 1 {
+                    debug!("dropping mount fd for mount {}", mount_id);
+                    mount_fds.remove(&mount_id);
+                }
+            }
+        }
+    }
+
+    fn next_lookup_tick(&self) -> u64 {
+        self.lookup_tick.fetch_add(1, Ordering::Relaxed)
+    }
+
+    // Asks the FUSE client to drop the entries of the least recently looked up inodes, so that it
+    // forgets them and the table goes back under `cfg.inode_budget`. `len` is the current size of
+    // the table. No more are evicted than fit in the notification queue, so when the client is
+    // slow to take them, eviction is spread over several scans.
+    fn evict_cold_inodes(&self, len: usize) {
+        let budget = self.cfg.inode_budget;
+        let notifier = match self.cfg.notifier {
+            Some(ref notifier) if budget != 0 && notifier.is_enabled() => notifier,
+            _ => return,
+        };
+
+        // The client is behind on notifications, try again on the next lookup.
+        let room = notifier.room();
+        if room == 0 {
+            return;
+        }
+
+        // One scan at a time is enough, the other threads can carry on with their lookups.
+        if self.evicting.swap(true, Ordering::Acquire) {
+            return;
+        }
+
+        // Evicting some more than the excess leaves room for a batch of new inodes before the
+        // next scan.
+        let batch = self.eviction_batch();
+
+        // Only the victims' names are needed, so they're picked before copying any.
+        let mut cold: Vec<(u64, Arc<InodeData>)> = self
+            .inodes
+            .read()
+            .unwrap()
+            .values()
+            .filter(|data| data.dentry.lock().unwrap().is_some())
+            .map(|data| (data.last_lookup.load(Ordering::Relaxed), data.clone()))
+            .collect();
+
+        let wanted = cmp::min(len.saturating_sub(budget) + batch, cold.len());
+        let count = cmp::min(wanted, room);
+        if count > 0 && count < cold.len() {
+            cold.select_nth_unstable_by_key(count, |&(tick, _)| tick);
+        }
+
+        debug!("evicting {} of {} inodes", count, len);
+        for (_, data) in cold.drain(..count) {
+            let dentry = data.dentry.lock().unwrap().clone();
+            if let Some((parent, name)) = dentry {
+                notifier.inval_entry(parent, &name);
+            }
+        }
+
+        // The client drops the entries asynchronously, and may keep those still in use, so wait
+        // for another batch of inodes before trying again, or as many as were evicted if the
+        // queue cut the scan short.
+        let next = if count < wanted { count } else { batch };
+        self.eviction_at.store(len + next, Ordering::Relaxed);
+        self.evicting.store(false, Ordering::Release);
+    }
+
+    // Number of inodes evicted on top of the excess over `cfg.inode_budget`.
+    fn eviction_batch(&self) -> usize {
+        cmp::max(self.cfg.inode_budget / 8, 1)
+    }
+
+    // Brings the eviction threshold back down as the client forgets inodes and the table, now
+    // `len` long, shrinks, so that eviction starts again at the budget.
+    fn lower_eviction_at(&self, len: usize) {
+        let budget = self.cfg.inode_budget;
+        if budget != 0 {
+            let at = cmp::max(budget, len + self.eviction_batch());
+            self.eviction_at.fetch_min(at, Ordering::Relaxed);
+        }
+    }
+
     fn do_lookup(&self, parent: Inode, name: &CStr) -> io::Result<Entry> {
+        if let Some(entry) = self.cached_lookup(parent, name)? {
+            return Ok(entry);
+        }
+
+        // Must be obtained before reading anything from the host.
+        let generation = self.host_cache.as_ref().map(|hc| hc.cache.generation());
+
         let p = self
             .inodes
             .read()
@@ -413,13 +1180,20 @@ impl PassthroughFs {
         // Safe because this doesn't modify any memory and we check the return value.
         let fd = unsafe {
             libc::openat(
-                p.file.as_raw_fd(),
+                p.get_file()?.as_raw_fd(),
                 name.as_ptr(),
                 libc::O_PATH | libc::O_NOFOLLOW | libc::O_CLOEXEC,
             )
         };
         if fd < 0 {
-            return Err(io::Error::last_os_error());
+            let err = io::Error::last_os_error();
+            if let (Some(hc), Some(generation)) = (&self.host_cache, generation) {
+                if err.raw_os_error() == Some(libc::ENOENT) {
+                    hc.cache
+                        .insert_dentry(generation, parent, name, CachedDentry::Negative);
+                }
+            }
+            return Err(err);
         }
 
         // Safe because we just opened this fd.
@@ -433,31 +1207,50 @@ impl PassthroughFs {
         };
         let data = self.inodes.read().unwrap().get_alt(&altkey).map(Arc::clone);
 
+        let tick = self.next_lookup_tick();
         let inode = if let Some(data) = data {
             // Matches with the release store in `forget`.
             data.refcount.fetch_add(1, Ordering::Acquire);
+            data.looked_up(tick, parent, name);
             data.inode
         } else {
             // There is a possible race here where 2 threads end up adding the same file
             // into the inode list.  However, since each of those will get a unique Inode
             // value and unique file descriptors this shouldn't be that much of a problem.
             let inode = self.next_inode.fetch_add(1, Ordering::Relaxed);
-            self.inodes.write().unwrap().insert(
-                inode,
-                InodeAltKey {
-                    ino: st.st_ino,
-                    dev: st.st_dev,
-                },
-                Arc::new(InodeData {
+            if let Some(ref hc) = self.host_cache {
+                if is_dir(&st) {
+                    hc.watch(inode, &f);
+                }
+            }
+            let data = InodeData::new(inode, self.new_inode_file(inode, f, &st), 1);
+            data.looked_up(tick, parent, name);
+
+            let len = {
+                let mut inodes = self.inodes.write().unwrap();
+                inodes.insert(
                     inode,
-                    file: f,
-                    refcount: AtomicU64::new(1),
-                }),
-            );
+                    InodeAltKey {
+                        ino: st.st_ino,
+                        dev: st.st_dev,
+                    },
+                    Arc::new(data),
+                );
+                inodes.len()
+            };
+            if len > self.eviction_at.load(Ordering::Relaxed) {
+                self.evict_cold_inodes(len);
+            }
 
             inode
         };
 
+        if let (Some(hc), Some(generation)) = (&self.host_cache, generation) {
+            hc.cache
+                .insert_dentry(generation, parent, name, CachedDentry::Positive(inode));
+            hc.cache.insert_attr(generation, inode, st, parent, name);
+        }
+
         debug!("do_lookup: {}, inode: {:?}", name.to_str().unwrap(), inode);
 
         Ok(Entry {
@@ -577,6 +1370,10 @@ impl PassthroughFs {
         debug!("do_open: {:?}", inode);
         let file = RwLock::new(self.open_inode(inode, flags as i32)?);
 
+        if flags & (libc::O_TRUNC as u32) != 0 {
+            self.invalidate_attr(inode);
+        }
+
         let handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
         let data = HandleData { inode, file };
 
@@ -618,6 +1415,15 @@ impl PassthroughFs {
     }
 
     fn do_getattr(&self, inode: Inode) -> io::Result<(libc::stat64, Duration)> {
+        if let Some(ref hc) = self.host_cache {
+            if let Some(st) = hc.cache.get_attr(inode) {
+                return Ok((st, self.cfg.attr_timeout));
+            }
+        }
+
+        // Must be obtained before reading anything from the host.
+        let generation = self.host_cache.as_ref().map(|hc| hc.cache.generation());
+
         let data = self
             .inodes
             .read()
@@ -626,11 +1432,147 @@ impl PassthroughFs {
             .map(Arc::clone)
             .ok_or_else(ebadf)?;
 
-        let st = stat(&data.file)?;
+        let file = data.get_file()?;
+        let st = stat(&file)?;
+
+        if let (Some(hc), Some(generation)) = (&self.host_cache, generation) {
+            hc.cache.refresh_attr(generation, inode, st);
+        }
 
         Ok((st, self.cfg.attr_timeout))
     }
 
+    // Returns whether the file `f`, for `inode`, has the setuid or setgid bits set. Uses the
+    // attributes in the host-side cache if they're there.
+    fn has_setid_bits(&self, inode: Inode, f: &File) -> io::Result<bool> {
+        let cached = self
+            .host_cache
+            .as_ref()
+            .and_then(|hc| hc.cache.get_attr(inode));
+        let st = match cached {
+            Some(st) => st,
+            None => stat(f)?,
+        };
+
+        Ok(st.st_mode & (libc::S_ISUID | libc::S_ISGID) != 0)
+    }
+
+    // Returns whether `name` is a security xattr that `inode` is known not to have. The FUSE client
+    // asks for "security.capability" before every write to clear it, so the answer is cached per
+    // inode, filled in on the first such probe. That's only done for the inodes whose changes on
+    // the host are reported by the watcher, as nothing else would tell us the answer went stale.
+    fn lacks_security_xattr(&self, inode: Inode, name: &CStr) -> bool {
+        if !name.to_bytes().starts_with(SECURITY_XATTR_PREFIX) {
+            return false;
+        }
+
+        match self.host_cache {
+            Some(ref hc) if hc.cache.is_tracked(inode) => {}
+            _ => return false,
+        }
+
+        let data = match self.inodes.read().unwrap().get(&inode) {
+            Some(data) => Arc::clone(data),
+            None => return false,
+        };
+
+        match data.security_xattrs.load(Ordering::Relaxed) {
+            SECURITY_XATTRS_NONE => true,
+            SECURITY_XATTRS_SOME => false,
+            _ => match self.has_security_xattrs(inode) {
+                Ok(has) => {
+                    let state = if has {
+                        SECURITY_XATTRS_SOME
+                    } else {
+                        SECURITY_XATTRS_NONE
+                    };
+                    // Don't overwrite a reset done by a concurrent change.
+                    let _ = data.security_xattrs.compare_exchange(
+                        SECURITY_XATTRS_UNKNOWN,
+                        state,
+                        Ordering::Relaxed,
+                        Ordering::Relaxed,
+                    );
+                    !has
+                }
+                // Let the actual request deal with the error.
+                Err(_) => false,
+            },
+        }
+    }
+
+    fn has_security_xattrs(&self, inode: Inode) -> io::Result<bool> {
+        // The f{set,get,remove,list}xattr functions don't work on an fd opened with `O_PATH` so we
+        // need to get a new fd.
+        let file = self.open_inode(inode, libc::O_RDONLY | libc::O_NONBLOCK)?;
+
+        loop {
+            // Safe because this doesn't modify any memory and we check the return value.
+            let res = unsafe { libc::flistxattr(file.as_raw_fd(), ptr::null_mut(), 0) };
+            if res < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            if res == 0 {
+                return Ok(false);
+            }
+
+            let mut buf = vec![0u8; res as usize];
+
+            // Safe because this will only modify the contents of `buf`.
+            let res = unsafe {
+                libc::flistxattr(
+                    file.as_raw_fd(),
+                    buf.as_mut_ptr() as *mut libc::c_char,
+                    buf.len(),
+                )
+            };
+            if res < 0 {
+                let err = io::Error::last_os_error();
+                // The list grew since we asked for its size.
+                if err.raw_os_error() == Some(libc::ERANGE) {
+                    continue;
+                }
+                return Err(err);
+            }
+            buf.truncate(res as usize);
+
+            return Ok(buf
+                .split(|c| *c == 0)
+                .any(|name| name.starts_with(SECURITY_XATTR_PREFIX)));
+        }
+    }
+
+    // Must be called after any operation that may add or remove xattrs of `inode`.
+    fn forget_security_xattrs(&self, inode: Inode) {
+        if let Some(data) = self.inodes.read().unwrap().get(&inode) {
+            data.forget_security_xattrs();
+        }
+    }
+
+    // Must be called before any operation that modifies the data of `inode` on behalf of the
+    // FUSE client, so the watcher doesn't report the change back to it. The operation's outcome
+    // must then be passed to `modify_done()` on the inode returned, if any.
+    fn own_modify(&self, inode: Inode) -> Option<Arc<InodeData>> {
+        self.host_cache.as_ref()?;
+        let data = self.inodes.read().unwrap().get(&inode).map(Arc::clone)?;
+        data.own_modify.store(true, Ordering::Release);
+        Some(data)
+    }
+
+    // Must be called after any operation that changes the attributes of `inode`.
+    fn invalidate_attr(&self, inode: Inode) {
+        if let Some(ref hc) = self.host_cache {
+            hc.cache.invalidate_attr(inode);
+        }
+    }
+
+    // Must be called after any operation that adds, removes or replaces `name` in `parent`.
+    fn invalidate_entry(&self, parent: Inode, name: &CStr) {
+        if let Some(ref hc) = self.host_cache {
+            hc.cache.invalidate_entry(parent, name);
+        }
+    }
+
     fn do_unlink(&self, parent: Inode, name: &CStr, flags: libc::c_int) -> io::Result<()> {
         let data = self
             .inodes
@@ -641,8 +1583,9 @@ impl PassthroughFs {
             .ok_or_else(ebadf)?;
 
         // Safe because this doesn't modify any memory and we check the return value.
-        let res = unsafe { libc::unlinkat(data.file.as_raw_fd(), name.as_ptr(), flags) };
+        let res = unsafe { libc::unlinkat(data.get_file()?.as_raw_fd(), name.as_ptr(), flags) };
         if res == 0 {
+            self.invalidate_entry(parent, name);
             Ok(())
         } else {
             Err(io::Error::last_os_error())
@@ -650,11 +1593,13 @@ impl PassthroughFs {
     }
 }
 
+// Drops `count` references to `inode`, returning its data if it was removed from `inodes`, so it
+// can be released once the lock on the table is dropped.
 fn forget_one(
     inodes: &mut MultikeyBTreeMap<Inode, InodeAltKey, Arc<InodeData>>,
     inode: Inode,
     count: u64,
-) {
+) -> Option<Arc<InodeData>> {
     if let Some(data) = inodes.get(&inode) {
         // Acquiring the write lock on the inode map prevents new lookups from incrementing the
         // refcount but there is the possibility that a previous lookup already acquired a
@@ -680,12 +1625,14 @@ fn forget_one(
                     // thread that is waiting to do a forget on the same inode will have to wait
                     // until we release the lock. So there's is no other release store for us to
                     // synchronize with before deleting the entry.
-                    inodes.remove(&inode);
+                    return inodes.remove(&inode);
                 }
                 break;
             }
         }
     }
+
+    None
 }
 
 impl FileSystem for PassthroughFs {
@@ -719,6 +1666,17 @@ impl FileSystem for PassthroughFs {
         // we want the client to be able to set all the bits in the mode.
         unsafe { libc::umask(0o000) };
 
+        if let Some(ref hc) = self.host_cache {
+            hc.watch(fuse::ROOT_ID, &f);
+        }
+
+        // The handles of the files in the root directory are reopened through it.
+        if self.inode_fds.is_some() {
+            if let Ok(handle) = FileHandle::from_file(&f) {
+                *self.root_mount_fd.lock().unwrap() = self.mount_fd(handle.mount_id(), &f, &st);
+            }
+        }
+
         let mut inodes = self.inodes.write().unwrap();
 
         // Not sure why the root inode gets a refcount of 2 but that's what libfuse does.
@@ -728,11 +1686,7 @@ impl FileSystem for PassthroughFs {
                 ino: st.st_ino,
                 dev: st.st_dev,
             },
-            Arc::new(InodeData {
-                inode: fuse::ROOT_ID,
-                file: f,
-                refcount: AtomicU64::new(2),
-            }),
+            Arc::new(InodeData::new(fuse::ROOT_ID, InodeFile::Fd(Arc::new(f)), 2)),
         );
 
         let mut opts = FsOptions::DO_READDIRPLUS | FsOptions::READDIRPLUS_AUTO;
@@ -746,6 +1700,11 @@ impl FileSystem for PassthroughFs {
     fn destroy(&self) {
         self.handles.write().unwrap().clear();
         self.inodes.write().unwrap().clear();
+        self.root_mount_fd.lock().unwrap().take();
+        self.mount_fds.write().unwrap().clear();
+        if let Some(ref hc) = self.host_cache {
+            hc.reset();
+        }
     }
 
     fn statfs(&self, _ctx: Context, inode: Inode) -> io::Result<libc::statvfs64> {
@@ -760,7 +1719,7 @@ impl FileSystem for PassthroughFs {
         let mut out = MaybeUninit::<libc::statvfs64>::zeroed();
 
         // Safe because this will only modify `out` and we check the return value.
-        let res = unsafe { libc::fstatvfs64(data.file.as_raw_fd(), out.as_mut_ptr()) };
+        let res = unsafe { libc::fstatvfs64(data.get_file()?.as_raw_fd(), out.as_mut_ptr()) };
         if res == 0 {
             // Safe because the kernel guarantees that `out` has been initialized.
             Ok(unsafe { out.assume_init() })
@@ -792,17 +1751,31 @@ impl FileSystem for PassthroughFs {
     }
 
     fn forget(&self, _ctx: Context, inode: Inode, count: u64) {
-        let mut inodes = self.inodes.write().unwrap();
+        let (removed, len) = {
+            let mut inodes = self.inodes.write().unwrap();
+            (forget_one(&mut inodes, inode, count), inodes.len())
+        };
 
-        forget_one(&mut inodes, inode, count)
+        if let Some(data) = removed {
+            self.lower_eviction_at(len);
+            self.release_inodes(vec![data]);
+        }
     }
 
     fn batch_forget(&self, _ctx: Context, requests: Vec<(Inode, u64)>) {
-        let mut inodes = self.inodes.write().unwrap();
+        let (removed, len) = {
+            let mut inodes = self.inodes.write().unwrap();
+            let removed: Vec<Arc<InodeData>> = requests
+                .into_iter()
+                .filter_map(|(inode, count)| forget_one(&mut inodes, inode, count))
+                .collect();
+            (removed, inodes.len())
+        };
 
-        for (inode, count) in requests {
-            forget_one(&mut inodes, inode, count)
+        if !removed.is_empty() {
+            self.lower_eviction_at(len);
         }
+        self.release_inodes(removed);
     }
 
     fn opendir(
@@ -842,8 +1815,10 @@ impl FileSystem for PassthroughFs {
             .ok_or_else(ebadf)?;
 
         // Safe because this doesn't modify any memory and we check the return value.
-        let res = unsafe { libc::mkdirat(data.file.as_raw_fd(), name.as_ptr(), mode & !umask) };
+        let res =
+            unsafe { libc::mkdirat(data.get_file()?.as_raw_fd(), name.as_ptr(), mode & !umask) };
         if res == 0 {
+            self.invalidate_entry(parent, name);
             self.do_lookup(parent, name)
         } else {
             Err(io::Error::last_os_error())
@@ -944,7 +1919,7 @@ impl FileSystem for PassthroughFs {
         // have much bigger problems.
         let fd = unsafe {
             libc::openat(
-                data.file.as_raw_fd(),
+                data.get_file()?.as_raw_fd(),
                 name.as_ptr(),
                 flags as i32 | libc::O_CREAT | libc::O_CLOEXEC | libc::O_NOFOLLOW,
                 mode & !(umask & 0o777),
@@ -957,6 +1932,7 @@ impl FileSystem for PassthroughFs {
         // Safe because we just opened this fd.
         let file = RwLock::new(unsafe { File::from_raw_fd(fd) });
 
+        self.invalidate_entry(parent, name);
         let entry = self.do_lookup(parent, name)?;
 
         let handle = self.next_handle.fetch_add(1, Ordering::Relaxed);
@@ -1010,6 +1986,10 @@ impl FileSystem for PassthroughFs {
         // offset is not affected by this operation.
         let mut f = data.file.read().unwrap().try_clone().unwrap();
 
+        if let Some(ref recorder) = self.recorder {
+            recorder.record(inode, &f, offset, u64::from(size));
+        }
+
         // let mut mm_addr = self.fd_mm_map.get(&String::from(f.as_raw_fd().to_string())).unwrap();
         // let mut fd_mm_addr;
         // match self.fd_mm_map.get(&f.as_raw_fd().to_string()){
@@ -1042,12 +2022,6 @@ impl FileSystem for PassthroughFs {
         kill_priv: bool,
         _flags: u32,
     ) -> io::Result<usize> {
-        if kill_priv {
-            // We need to change credentials during a write so that the kernel will remove setuid
-            // or setgid bits from the file if it was written to by someone other than the owner.
-            let (_uid, _gid) = set_creds(ctx.uid, ctx.gid)?;
-        }
-
         let data = self
             .handles
             .read()
@@ -1060,7 +2034,23 @@ impl FileSystem for PassthroughFs {
         // This is safe because read_to uses pwritev64, so the underlying file descriptor
         // offset is not affected by this operation.
         let mut f = data.file.read().unwrap().try_clone().unwrap();
-        r.read_to(&mut f, size as usize, offset)
+
+        // We need to change credentials during a write so that the kernel will remove setuid
+        // or setgid bits from the file if it was written to by someone other than the owner.
+        // That's only needed if the file has any of those bits set, which is rarely the case.
+        let _creds = if kill_priv && self.has_setid_bits(inode, &f)? {
+            Some(set_creds(ctx.uid, ctx.gid)?)
+        } else {
+            None
+        };
+
+        let own = self.own_modify(inode);
+        let res = r.read_to(&mut f, size as usize, offset);
+        if let Some(data) = own {
+            data.modify_done(matches!(res, Ok(n) if n > 0));
+        }
+        self.invalidate_attr(inode);
+        res
     }
 
     fn getattr(
@@ -1087,6 +2077,7 @@ impl FileSystem for PassthroughFs {
             .get(&inode)
             .map(Arc::clone)
             .ok_or_else(ebadf)?;
+        let inode_file = inode_data.get_file()?;
 
         enum Data {
             Handle(Arc<HandleData>, RawFd),
@@ -1107,7 +2098,7 @@ impl FileSystem for PassthroughFs {
             let fd = hd.file.write().unwrap().as_raw_fd();
             Data::Handle(hd, fd)
         } else {
-            let pathname = CString::new(format!("{}", inode_data.file.as_raw_fd()))
+            let pathname = CString::new(format!("{}", inode_file.as_raw_fd()))
                 .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
             Data::ProcPath(pathname)
         };
@@ -1147,7 +2138,7 @@ impl FileSystem for PassthroughFs {
             // Safe because this doesn't modify any memory and we check the return value.
             let res = unsafe {
                 libc::fchownat(
-                    inode_data.file.as_raw_fd(),
+                    inode_file.as_raw_fd(),
                     empty.as_ptr(),
                     uid,
                     gid,
@@ -1160,6 +2151,7 @@ impl FileSystem for PassthroughFs {
         }
 
         if valid.contains(SetattrValid::SIZE) {
+            let own = self.own_modify(inode);
             // Safe because this doesn't modify any memory and we check the return value.
             let res = match data {
                 Data::Handle(_, fd) => unsafe { libc::ftruncate(fd, attr.st_size) },
@@ -1169,6 +2161,9 @@ impl FileSystem for PassthroughFs {
                     unsafe { libc::ftruncate(f.as_raw_fd(), attr.st_size) }
                 }
             };
+            if let Some(data) = own {
+                data.modify_done(res == 0);
+            }
             if res < 0 {
                 return Err(io::Error::last_os_error());
             }
@@ -1212,6 +2207,7 @@ impl FileSystem for PassthroughFs {
             }
         }
 
+        self.invalidate_attr(inode);
         self.do_getattr(inode)
     }
 
@@ -1245,14 +2241,16 @@ impl FileSystem for PassthroughFs {
         let res = unsafe {
             libc::syscall(
                 libc::SYS_renameat2,
-                old_inode.file.as_raw_fd(),
+                old_inode.get_file()?.as_raw_fd(),
                 oldname.as_ptr(),
-                new_inode.file.as_raw_fd(),
+                new_inode.get_file()?.as_raw_fd(),
                 newname.as_ptr(),
                 flags,
             )
         };
         if res == 0 {
+            self.invalidate_entry(olddir, oldname);
+            self.invalidate_entry(newdir, newname);
             Ok(())
         } else {
             Err(io::Error::last_os_error())
@@ -1280,7 +2278,7 @@ impl FileSystem for PassthroughFs {
         // Safe because this doesn't modify any memory and we check the return value.
         let res = unsafe {
             libc::mknodat(
-                data.file.as_raw_fd(),
+                data.get_file()?.as_raw_fd(),
                 name.as_ptr(),
                 (mode & !umask) as libc::mode_t,
                 u64::from(rdev),
@@ -1290,6 +2288,7 @@ impl FileSystem for PassthroughFs {
         if res < 0 {
             Err(io::Error::last_os_error())
         } else {
+            self.invalidate_entry(parent, name);
             self.do_lookup(parent, name)
         }
     }
@@ -1316,7 +2315,8 @@ impl FileSystem for PassthroughFs {
             .map(Arc::clone)
             .ok_or_else(ebadf)?;
 
-        let procname = CString::new(format!("{}", data.file.as_raw_fd()))
+        let file = data.get_file()?;
+        let procname = CString::new(format!("{}", file.as_raw_fd()))
             .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
 
         // Safe because this doesn't modify any memory and we check the return value.
@@ -1324,12 +2324,14 @@ impl FileSystem for PassthroughFs {
             libc::linkat(
                 self.proc_self_fd.as_raw_fd(),
                 procname.as_ptr(),
-                new_inode.file.as_raw_fd(),
+                new_inode.get_file()?.as_raw_fd(),
                 newname.as_ptr(),
                 libc::AT_SYMLINK_FOLLOW,
             )
         };
         if res == 0 {
+            self.invalidate_attr(inode);
+            self.invalidate_entry(newparent, newname);
             self.do_lookup(newparent, newname)
         } else {
             Err(io::Error::last_os_error())
@@ -1353,9 +2355,15 @@ impl FileSystem for PassthroughFs {
             .ok_or_else(ebadf)?;
 
         // Safe because this doesn't modify any memory and we check the return value.
-        let res =
-            unsafe { libc::symlinkat(linkname.as_ptr(), data.file.as_raw_fd(), name.as_ptr()) };
+        let res = unsafe {
+            libc::symlinkat(
+                linkname.as_ptr(),
+                data.get_file()?.as_raw_fd(),
+                name.as_ptr(),
+            )
+        };
         if res == 0 {
+            self.invalidate_entry(parent, name);
             self.do_lookup(parent, name)
         } else {
             Err(io::Error::last_os_error())
@@ -1379,7 +2387,7 @@ impl FileSystem for PassthroughFs {
         // Safe because this will only modify the contents of `buf` and we check the return value.
         let res = unsafe {
             libc::readlinkat(
-                data.file.as_raw_fd(),
+                data.get_file()?.as_raw_fd(),
                 empty.as_ptr(),
                 buf.as_mut_ptr() as *mut libc::c_char,
                 buf.len(),
@@ -1473,7 +2481,8 @@ impl FileSystem for PassthroughFs {
             .map(Arc::clone)
             .ok_or_else(ebadf)?;
 
-        let st = stat(&data.file)?;
+        let file = data.get_file()?;
+        let st = stat(&file)?;
         let mode = mask as i32 & (libc::R_OK | libc::W_OK | libc::X_OK);
 
         if mode == libc::F_OK {
@@ -1540,6 +2549,8 @@ impl FileSystem for PassthroughFs {
             )
         };
         if res == 0 {
+            self.forget_security_xattrs(inode);
+            self.invalidate_attr(inode);
             Ok(())
         } else {
             Err(io::Error::last_os_error())
@@ -1557,7 +2568,7 @@ impl FileSystem for PassthroughFs {
             return Err(io::Error::from_raw_os_error(libc::ENOSYS));
         }
 
-        if inode == self.init_inode {
+        if inode == self.init_inode || self.lacks_security_xattr(inode, name) {
             return Err(io::Error::from_raw_os_error(libc::ENODATA));
         }
 
@@ -1624,6 +2635,10 @@ impl FileSystem for PassthroughFs {
             return Err(io::Error::from_raw_os_error(libc::ENOSYS));
         }
 
+        if self.lacks_security_xattr(inode, name) {
+            return Err(io::Error::from_raw_os_error(libc::ENODATA));
+        }
+
         // The f{set,get,remove,list}xattr functions don't work on an fd opened with `O_PATH` so we
         // need to get a new fd.
         let file = self.open_inode(inode, libc::O_RDONLY | libc::O_NONBLOCK)?;
@@ -1632,6 +2647,8 @@ impl FileSystem for PassthroughFs {
         let res = unsafe { libc::fremovexattr(file.as_raw_fd(), name.as_ptr()) };
 
         if res == 0 {
+            self.forget_security_xattrs(inode);
+            self.invalidate_attr(inode);
             Ok(())
         } else {
             Err(io::Error::last_os_error())
@@ -1657,6 +2674,7 @@ impl FileSystem for PassthroughFs {
             .ok_or_else(ebadf)?;
 
         let fd = data.file.write().unwrap().as_raw_fd();
+        let own = self.own_modify(inode);
         // Safe because this doesn't modify any memory and we check the return value.
         let res = unsafe {
             libc::fallocate64(
@@ -1666,7 +2684,11 @@ impl FileSystem for PassthroughFs {
                 length as libc::off64_t,
             )
         };
+        if let Some(data) = own {
+            data.modify_done(res == 0);
+        }
         if res == 0 {
+            self.invalidate_attr(inode);
             Ok(())
         } else {
             Err(io::Error::last_os_error())
@@ -1737,6 +2759,17 @@ impl FileSystem for PassthroughFs {
         // Take just a read lock as we're not going to alter the file descriptor offset.
         let fd_out = data_out.file.read().unwrap().as_raw_fd();
 
+        let own = self.own_modify(inode_out);
+        if flags == 0 {
+            if let Some(cloned) = clone_range(fd_in, offset_in, fd_out, offset_out, len) {
+                if let Some(data) = own {
+                    data.modify_done(true);
+                }
+                self.invalidate_attr(inode_out);
+                return Ok(cloned);
+            }
+        }
+
         // Safe because this will only modify `offset_in` and `offset_out` and we check
         // the return value.
         let res = unsafe {
@@ -1749,13 +2782,38 @@ impl FileSystem for PassthroughFs {
                 flags.try_into().unwrap(),
             )
         };
+        if let Some(data) = own {
+            data.modify_done(res > 0);
+        }
         if res < 0 {
             Err(io::Error::last_os_error())
         } else {
+            self.invalidate_attr(inode_out);
             Ok(res as usize)
         }
     }
 
+    fn ioctl<R: io::Read>(
+        &self,
+        _ctx: Context,
+        _inode: Inode,
+        _handle: Handle,
+        _flags: IoctlFlags,
+        cmd: u32,
+        _arg: u64,
+        _in_size: u32,
+        _out_size: u32,
+        _r: R,
+    ) -> io::Result<Vec<u8>> {
+        match cmd {
+            // The source of the clone is a file descriptor in the guest, which means nothing to
+            // us. Report it as unsupported so the guest falls back to copy_file_range, which
+            // also tries to reflink the files.
+            FICLONE | FICLONERANGE => Err(io::Error::from_raw_os_error(libc::EOPNOTSUPP)),
+            _ => Err(io::Error::from_raw_os_error(libc::ENOTTY)),
+        }
+    }
+
     fn setupmapping(
         &self,
         _ctx: Context,
@@ -1874,3 +2932,389 @@ impl FileSystem for PassthroughFs {
         Ok(())
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::super::test_utils::{ctx, name, tmpdir, Src};
+    use super::*;
+
+    use std::fs;
+    use std::os::unix::fs::PermissionsExt;
+    use std::path::Path;
+
+    // Some tests switch credentials, which can only be done as root.
+    fn is_root() -> bool {
+        // Safe because this call doesn't modify any memory.
+        let root = unsafe { libc::geteuid() } == 0;
+        if !root {
+            eprintln!("skipping test, it needs to be run as root");
+        }
+        root
+    }
+
+    fn new_fs(root: &Path, cfg: Config) -> PassthroughFs {
+        let fs = PassthroughFs::new(Config {
+            root_dir: root.to_str().unwrap().to_string(),
+            ..cfg
+        })
+        .unwrap();
+        fs.init(FsOptions::empty()).unwrap();
+        fs
+    }
+
+    fn open(fs: &PassthroughFs, name: &str) -> (Inode, Handle) {
+        let entry = fs.lookup(ctx(), fuse::ROOT_ID, &self::name(name)).unwrap();
+        let (handle, _) = fs.open(ctx(), entry.inode, libc::O_RDWR as u32).unwrap();
+        (entry.inode, handle.unwrap())
+    }
+
+    #[test]
+    fn test_inode_file_handles() {
+        let dir = tmpdir("handles");
+        fs::write(dir.join("a"), b"aaaa").unwrap();
+        fs::write(dir.join("b"), b"bb").unwrap();
+        fs::set_permissions(dir.join("b"), fs::Permissions::from_mode(0o600)).unwrap();
+
+        let fs = new_fs(
+            &dir,
+            Config {
+                inode_file_handles: true,
+                inode_fd_cache_size: 1,
+                host_cache: false,
+                ..Default::default()
+            },
+        );
+        let fds = match fs.inode_fds {
+            Some(ref fds) => fds.clone(),
+            // The host file system doesn't support file handles.
+            None => return,
+        };
+
+        let a = fs.lookup(ctx(), fuse::ROOT_ID, &name("a")).unwrap().inode;
+        let b = fs.lookup(ctx(), fuse::ROOT_ID, &name("b")).unwrap().inode;
+        // Only the fd of the inode used last is kept open.
+        assert!(!fds.lock().unwrap().contains(&a));
+
+        // The attributes and permissions of an inode without an open fd are those of the file
+        // its handle is reopened to.
+        assert_eq!(fs.getattr(ctx(), a, None).unwrap().0.st_size, 4);
+        assert!(fds.lock().unwrap().contains(&a));
+        assert!(!fds.lock().unwrap().contains(&b));
+
+        let other = Context {
+            uid: ctx().uid + 1,
+            ..ctx()
+        };
+        assert!(fs.access(other, b, libc::F_OK as u32).is_ok());
+        assert_eq!(
+            fs.access(other, b, libc::R_OK as u32)
+                .unwrap_err()
+                .raw_os_error(),
+            Some(libc::EACCES)
+        );
+        assert!(fs.access(ctx(), b, libc::R_OK as u32).is_ok());
+        assert_eq!(fs.getattr(ctx(), b, None).unwrap().0.st_size, 2);
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_set_creds() {
+        if !is_root() {
+            return;
+        }
+
+        // Credentials are per thread, so switching them doesn't affect the other tests.
+        std::thread::spawn(|| {
+            let creds = set_creds(1000, 1001).unwrap();
+            // Safe because these calls don't modify any memory.
+            assert_eq!(unsafe { (libc::geteuid(), libc::getegid()) }, (1000, 1001));
+
+            // Dropping them goes back to root.
+            drop(creds);
+            assert_eq!(unsafe { (libc::geteuid(), libc::getegid()) }, (0, 0));
+
+            let (uid, gid) = set_creds(0, 0).unwrap();
+            assert!(uid.is_none() && gid.is_none());
+        })
+        .join()
+        .unwrap();
+    }
+
+    #[test]
+    fn test_write_kill_priv() {
+        if !is_root() {
+            return;
+        }
+
+        let dir = tmpdir("killpriv");
+        for file in ["setuid", "plain"] {
+            fs::write(dir.join(file), b"").unwrap();
+        }
+        fs::set_permissions(dir.join("setuid"), fs::Permissions::from_mode(0o4777)).unwrap();
+        fs::set_permissions(dir.join("plain"), fs::Permissions::from_mode(0o666)).unwrap();
+
+        let fs = new_fs(&dir, Config::default());
+        let other = Context {
+            uid: 1000,
+            gid: 1000,
+            pid: 0,
+        };
+        let write = |file, ctx, kill_priv| {
+            let (inode, handle) = open(&fs, file);
+            fs.write(
+                ctx,
+                inode,
+                handle,
+                Src(b"data"),
+                4,
+                0,
+                None,
+                false,
+                kill_priv,
+                0,
+            )
+            .unwrap();
+            fs.getattr(ctx, inode, None).unwrap().0.st_mode & 0o7777
+        };
+
+        // Only a write done on behalf of someone else removes the setuid bit.
+        assert_eq!(write("setuid", ctx(), true), 0o4777);
+        assert_eq!(write("setuid", other, false), 0o4777);
+        assert_eq!(write("setuid", other, true), 0o777);
+        // The credentials aren't switched for files without the bits.
+        assert_eq!(write("plain", other, true), 0o666);
+        assert_eq!(fs::read(dir.join("plain")).unwrap(), b"data");
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_security_xattrs() {
+        let dir = tmpdir("xattrs");
+        fs::write(dir.join("file"), b"").unwrap();
+        let path = CString::new(dir.join("file").to_str().unwrap()).unwrap();
+        let xattr = name("security.test");
+        let probe = |fs: &PassthroughFs, inode| {
+            fs.getxattr(ctx(), inode, &xattr, 0)
+                .err()
+                .and_then(|e| e.raw_os_error())
+        };
+        let state = |fs: &PassthroughFs, inode| {
+            fs.inodes
+                .read()
+                .unwrap()
+                .get(&inode)
+                .unwrap()
+                .security_xattrs
+                .load(Ordering::Relaxed)
+        };
+
+        // Without the host cache, changes done on the host can't be noticed, so every probe goes
+        // to the host.
+        let fs = new_fs(
+            &dir,
+            Config {
+                host_cache: false,
+                ..Default::default()
+            },
+        );
+        let inode = fs
+            .lookup(ctx(), fuse::ROOT_ID, &name("file"))
+            .unwrap()
+            .inode;
+        assert_eq!(probe(&fs, inode), Some(libc::ENODATA));
+        assert_eq!(state(&fs, inode), SECURITY_XATTRS_UNKNOWN);
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let res = unsafe {
+            libc::setxattr(
+                path.as_ptr(),
+                xattr.as_ptr(),
+                b"x".as_ptr() as *const libc::c_void,
+                1,
+                0,
+            )
+        };
+        if res != 0 {
+            // Setting "security." xattrs takes CAP_SYS_ADMIN, and not every file system has them.
+            let err = io::Error::last_os_error();
+            eprintln!("skipping test, can't set security xattrs: {:?}", err);
+            let _ = fs::remove_dir_all(&dir);
+            return;
+        }
+        assert_eq!(probe(&fs, inode), None);
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        assert_eq!(
+            unsafe { libc::removexattr(path.as_ptr(), xattr.as_ptr()) },
+            0
+        );
+
+        // With it, the answer is remembered and forgotten when the xattrs change.
+        let fs = new_fs(&dir, Config::default());
+        let inode = fs
+            .lookup(ctx(), fuse::ROOT_ID, &name("file"))
+            .unwrap()
+            .inode;
+        assert_eq!(probe(&fs, inode), Some(libc::ENODATA));
+        assert_eq!(state(&fs, inode), SECURITY_XATTRS_NONE);
+        assert_eq!(probe(&fs, inode), Some(libc::ENODATA));
+
+        fs.setxattr(ctx(), inode, &xattr, b"x", 0).unwrap();
+        assert_eq!(state(&fs, inode), SECURITY_XATTRS_UNKNOWN);
+        assert_eq!(probe(&fs, inode), None);
+        assert_eq!(state(&fs, inode), SECURITY_XATTRS_SOME);
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    // Takes the names in the pending InvalEntry notifications, skipping any others.
+    fn inval_entries(notifier: &Notifier) -> Vec<CString> {
+        let mut names = Vec::new();
+        while let Some(msg) = notifier.pop() {
+            let header = fuse::OutHeader::from_slice(&msg[..size_of::<fuse::OutHeader>()]).unwrap();
+            if header.error == fuse::NotifyOpcode::InvalEntry as i32 {
+                let start = size_of::<fuse::OutHeader>() + size_of::<fuse::NotifyInvalEntryOut>();
+                names.push(CStr::from_bytes_with_nul(&msg[start..]).unwrap().to_owned());
+            }
+        }
+        names
+    }
+
+    #[test]
+    fn test_evict_cold_inodes() {
+        let dir = tmpdir("evict");
+        for i in 0..21 {
+            fs::write(dir.join(format!("f{}", i)), b"").unwrap();
+        }
+
+        let notifier = Notifier::new().unwrap();
+        notifier.set_enabled(true);
+        let fs = new_fs(
+            &dir,
+            Config {
+                host_cache: false,
+                notifier: Some(notifier.clone()),
+                inode_budget: 8,
+                ..Default::default()
+            },
+        );
+
+        // With the queue nearly full, only as many entries as fit are invalidated.
+        while notifier.room() > 2 {
+            notifier.inval_inode(fuse::ROOT_ID, -1, 0);
+        }
+        let inodes: Vec<Inode> = (0..20)
+            .map(|i| {
+                fs.lookup(ctx(), fuse::ROOT_ID, &name(&format!("f{}", i)))
+                    .unwrap()
+                    .inode
+            })
+            .collect();
+        assert_eq!(notifier.room(), 0);
+        assert_eq!(inval_entries(&notifier), vec![name("f0"), name("f1")]);
+
+        // Once the client catches up, the rest goes in one go, coldest first. The table has the
+        // root and 21 files, so 14 over the budget and a batch of 1.
+        fs.lookup(ctx(), fuse::ROOT_ID, &name("f20")).unwrap();
+        let expected: Vec<CString> = (0..15).map(|i| name(&format!("f{}", i))).collect();
+        let mut names = inval_entries(&notifier);
+        names.sort_by_key(|n| n.to_str().unwrap()[1..].parse::<u32>().unwrap());
+        assert_eq!(names, expected);
+        assert!(fs.eviction_at.load(Ordering::Relaxed) > 8);
+
+        // As the client forgets them, eviction goes back to starting at the budget.
+        let forgets = inodes[..15].iter().map(|&inode| (inode, 1)).collect();
+        fs.batch_forget(ctx(), forgets);
+        assert_eq!(fs.inodes.read().unwrap().len(), 7);
+        assert_eq!(fs.eviction_at.load(Ordering::Relaxed), 8);
+    }
+
+    #[test]
+    fn test_batch_forget() {
+        let dir = tmpdir("forget");
+        fs::write(dir.join("a"), b"").unwrap();
+        fs::write(dir.join("b"), b"").unwrap();
+        let fs = new_fs(
+            &dir,
+            Config {
+                host_cache: false,
+                ..Default::default()
+            },
+        );
+
+        let a = fs.lookup(ctx(), fuse::ROOT_ID, &name("a")).unwrap().inode;
+        fs.lookup(ctx(), fuse::ROOT_ID, &name("a")).unwrap();
+        let b = fs.lookup(ctx(), fuse::ROOT_ID, &name("b")).unwrap().inode;
+        assert_eq!(fs.inodes.read().unwrap().len(), 3);
+
+        // Unknown inodes are skipped, and an inode only goes with its last reference.
+        fs.batch_forget(ctx(), vec![(a, 1), (b, 1), (b + 100, 1)]);
+        assert!(fs.getattr(ctx(), a, None).is_ok());
+        let err = fs.getattr(ctx(), b, None).err().unwrap();
+        assert_eq!(err.raw_os_error(), Some(libc::EBADF));
+
+        fs.batch_forget(ctx(), vec![(a, 5)]);
+        assert_eq!(fs.inodes.read().unwrap().len(), 1);
+    }
+
+    #[test]
+    fn test_copyfilerange() {
+        let dir = tmpdir("copy");
+        fs::write(dir.join("src"), b"hello world").unwrap();
+        fs::write(dir.join("dst"), b"").unwrap();
+
+        let fs = new_fs(&dir, Config::default());
+        let (src, src_handle) = open(&fs, "src");
+        let (dst, dst_handle) = open(&fs, "dst");
+
+        // Whether the range is cloned or copied depends on the host file system, but the result
+        // must be the same.
+        let copied = fs
+            .copyfilerange(ctx(), src, src_handle, 6, dst, dst_handle, 0, 64, 0)
+            .unwrap();
+        assert_eq!(copied, 5);
+        assert_eq!(fs::read(dir.join("dst")).unwrap(), b"world");
+
+        // Nothing is left to copy past the end of the source.
+        let copied = fs
+            .copyfilerange(ctx(), src, src_handle, 11, dst, dst_handle, 5, 64, 0)
+            .unwrap();
+        assert_eq!(copied, 0);
+        assert_eq!(fs.getattr(ctx(), dst, None).unwrap().0.st_size, 5);
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_ioctl() {
+        let dir = tmpdir("ioctl");
+        fs::write(dir.join("file"), b"").unwrap();
+
+        let fs = new_fs(&dir, Config::default());
+        let (inode, handle) = open(&fs, "file");
+
+        let ioctl = |cmd| {
+            fs.ioctl(
+                ctx(),
+                inode,
+                handle,
+                IoctlFlags::empty(),
+                cmd,
+                0,
+                0,
+                0,
+                io::empty(),
+            )
+            .unwrap_err()
+            .raw_os_error()
+        };
+        // The guest is expected to fall back to copy_file_range for these.
+        assert_eq!(ioctl(FICLONE), Some(libc::EOPNOTSUPP));
+        assert_eq!(ioctl(FICLONERANGE), Some(libc::EOPNOTSUPP));
+        assert_eq!(ioctl(libc::FIONREAD as u32), Some(libc::ENOTTY));
+
+        let _ = fs::remove_dir_all(&dir);
+    }
+}
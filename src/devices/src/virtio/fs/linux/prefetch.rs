@@ -0,0 +1,397 @@
+//! Recording of the files the guest reads right after boot, so that they can be brought into the
+//! host page cache on the next boots, while the guest kernel is still starting.
+//!
+//! A profile is a text file with a line per file, in the order the guest first read them:
+//! "<offset> <length> <path>", where the range covers every read of the file and the path is
+//! relative to the root of the file system.
+
+use std::collections::hash_map::Entry;
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::fs::{self, File};
+use std::io::{self, BufRead, BufReader, BufWriter, Write};
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::path::{Component, Path, PathBuf};
+use std::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+
+type Inode = u64;
+
+/// Maximum number of files recorded in a profile.
+const MAX_FILES: usize = 16384;
+
+/// Number of parts the recorded inodes are split into, each behind its own lock, so that the
+/// reads of different files don't all contend on the same one.
+const SHARDS: usize = 16;
+
+#[derive(Clone, Debug, PartialEq)]
+struct RecordedFile {
+    path: PathBuf,
+    start: u64,
+    end: u64,
+}
+
+// A recorded file, with the order it was first read in.
+struct Recorded {
+    seq: u64,
+    file: RecordedFile,
+}
+
+/// Records the ranges of the files read by the guest until `finish` is called.
+pub struct Recorder {
+    // Canonical, to match the paths the kernel reports for the open files.
+    root_dir: PathBuf,
+    recording: AtomicBool,
+    // The inodes already recorded, by `inode % SHARDS`. `None` for those that can't be, so their
+    // path isn't looked up again.
+    shards: Vec<Mutex<HashMap<Inode, Option<Recorded>>>>,
+    // Number of files recorded so far, kept under `MAX_FILES`, and order of the next one.
+    files: AtomicUsize,
+    next_seq: AtomicU64,
+}
+
+impl Recorder {
+    pub fn new(root_dir: &str) -> Recorder {
+        Recorder {
+            root_dir: fs::canonicalize(root_dir).unwrap_or_else(|_| PathBuf::from(root_dir)),
+            recording: AtomicBool::new(true),
+            shards: (0..SHARDS).map(|_| Mutex::new(HashMap::new())).collect(),
+            files: AtomicUsize::new(0),
+            next_seq: AtomicU64::new(0),
+        }
+    }
+
+    /// Records a read of `len` bytes at `offset` from `inode`, which is open as `f`.
+    pub fn record(&self, inode: Inode, f: &File, offset: u64, len: u64) {
+        if !self.recording.load(Ordering::Relaxed) {
+            return;
+        }
+
+        let end = offset.saturating_add(len);
+        let shard = &self.shards[(inode % SHARDS as u64) as usize];
+        if let Some(recorded) = shard.lock().unwrap().get_mut(&inode) {
+            if let Some(recorded) = recorded {
+                recorded.file.extend(offset, end);
+            }
+            return;
+        }
+
+        // The path of a file read for the first time is looked up without holding the lock.
+        let path = if self.files.load(Ordering::Relaxed) < MAX_FILES {
+            self.relative_path(f)
+        } else {
+            None
+        };
+
+        match shard.lock().unwrap().entry(inode) {
+            // Another read of the file got here first.
+            Entry::Occupied(mut e) => {
+                if let Some(recorded) = e.get_mut() {
+                    recorded.file.extend(offset, end);
+                }
+            }
+            Entry::Vacant(e) => {
+                let recorded = path
+                    .filter(|_| self.files.fetch_add(1, Ordering::Relaxed) < MAX_FILES)
+                    .map(|path| Recorded {
+                        seq: self.next_seq.fetch_add(1, Ordering::Relaxed),
+                        file: RecordedFile {
+                            path,
+                            start: offset,
+                            end,
+                        },
+                    });
+                e.insert(recorded);
+            }
+        }
+    }
+
+    // Returns the path of `f` relative to the root of the file system, if it has one that can be
+    // written in a profile.
+    fn relative_path(&self, f: &File) -> Option<PathBuf> {
+        let path = fs::read_link(format!("/proc/self/fd/{}", f.as_raw_fd())).ok()?;
+        let path = path.strip_prefix(&self.root_dir).ok()?;
+
+        // Removed files are reported with a suffix, and names with line breaks can't be told
+        // apart from the next entry.
+        let name = path.to_str()?;
+        if name.is_empty() || name.ends_with(" (deleted)") || name.contains('\n') {
+            return None;
+        }
+
+        Some(path.to_path_buf())
+    }
+
+    /// Stops recording and writes the files read so far to `profile`.
+    pub fn finish(&self, profile: &Path) -> io::Result<()> {
+        self.recording.store(false, Ordering::Relaxed);
+        let mut files: Vec<Recorded> = self
+            .shards
+            .iter()
+            .flat_map(|shard| {
+                shard
+                    .lock()
+                    .unwrap()
+                    .drain()
+                    .filter_map(|(_, recorded)| recorded)
+                    .collect::<Vec<_>>()
+            })
+            .collect();
+        files.sort_unstable_by_key(|recorded| recorded.seq);
+
+        // Written aside and renamed, so a VM exiting in the middle doesn't leave a truncated
+        // profile behind. The temporary name is unique to this process, as other VMs may be
+        // writing the same profile.
+        let tmp = profile.with_extension(format!("{}.tmp", std::process::id()));
+        let mut w = BufWriter::new(File::create(&tmp)?);
+        for file in files
+            .iter()
+            .map(|recorded| &recorded.file)
+            .filter(|f| f.end > f.start)
+        {
+            writeln!(
+                w,
+                "{} {} {}",
+                file.start,
+                file.end - file.start,
+                file.path.display()
+            )?;
+        }
+        w.flush()?;
+        drop(w);
+
+        fs::rename(&tmp, profile)
+    }
+}
+
+impl RecordedFile {
+    // Widens the range to cover `start..end`.
+    fn extend(&mut self, start: u64, end: u64) {
+        self.start = self.start.min(start);
+        self.end = self.end.max(end);
+    }
+}
+
+// Parses a line of a profile.
+fn parse_line(line: &str) -> Option<RecordedFile> {
+    let mut fields = line.splitn(3, ' ');
+    let start: u64 = fields.next()?.parse().ok()?;
+    let len: u64 = fields.next()?.parse().ok()?;
+    let path = PathBuf::from(fields.next()?);
+
+    Some(RecordedFile {
+        path,
+        start,
+        end: start.checked_add(len)?,
+    })
+}
+
+fn load_profile(profile: &Path) -> io::Result<Vec<RecordedFile>> {
+    let mut files = Vec::new();
+    for line in BufReader::new(File::open(profile)?).lines() {
+        let line = line?;
+        match parse_line(&line) {
+            Some(file) => files.push(file),
+            None => warn!("fs prefetch: ignoring malformed line: {:?}", line),
+        }
+    }
+
+    Ok(files)
+}
+
+// Opens the regular file at `path`, relative to the directory `root`. Symlinks aren't followed
+// on the way, so that nothing out of `root` is opened, and special files are opened without
+// blocking and rejected.
+fn open_regular(root: &File, path: &Path) -> io::Result<File> {
+    let mut file: Option<File> = None;
+    let mut components = path.components().peekable();
+    while let Some(component) = components.next() {
+        let name = match component {
+            Component::Normal(name) => CString::new(name.as_bytes())?,
+            _ => return Err(io::Error::from_raw_os_error(libc::EINVAL)),
+        };
+        let flags = if components.peek().is_some() {
+            libc::O_PATH | libc::O_DIRECTORY
+        } else {
+            libc::O_RDONLY | libc::O_NONBLOCK
+        };
+
+        let dir = file.as_ref().unwrap_or(root);
+        // Safe because this doesn't modify any memory and we check the return value.
+        let fd = unsafe {
+            libc::openat(
+                dir.as_raw_fd(),
+                name.as_ptr(),
+                flags | libc::O_NOFOLLOW | libc::O_CLOEXEC,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // Safe because we just opened this fd.
+        file = Some(unsafe { File::from_raw_fd(fd) });
+    }
+
+    let file = file.ok_or_else(|| io::Error::from_raw_os_error(libc::EINVAL))?;
+    if !file.metadata()?.is_file() {
+        return Err(io::Error::from_raw_os_error(libc::EINVAL));
+    }
+    Ok(file)
+}
+
+// Asks the kernel to read the recorded ranges into the page cache. Doesn't wait for the data.
+fn prefetch(root: &File, files: &[RecordedFile]) {
+    for file in files {
+        // Files may have been removed or replaced since the profile was recorded.
+        let f = match open_regular(root, &file.path) {
+            Ok(f) => f,
+            Err(_) => continue,
+        };
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let ret = unsafe {
+            libc::posix_fadvise(
+                f.as_raw_fd(),
+                file.start as libc::off_t,
+                (file.end - file.start) as libc::off_t,
+                libc::POSIX_FADV_WILLNEED,
+            )
+        };
+        if ret != 0 {
+            debug!(
+                "fs prefetch: fadvise failed for {}: {}",
+                file.path.display(),
+                ret
+            );
+        }
+    }
+}
+
+/// Spawns a thread that prefetches the files recorded in `profile` on the previous boot, if any,
+/// and replaces it with the files read through `recorder` once `window` has passed.
+pub fn start(
+    root_dir: &str,
+    profile: PathBuf,
+    window: Duration,
+    recorder: Arc<Recorder>,
+) -> io::Result<()> {
+    let start = Instant::now();
+    let root = File::open(root_dir)?;
+
+    thread::Builder::new()
+        .name("fs prefetch".into())
+        .spawn(move || {
+            match load_profile(&profile) {
+                Ok(files) => {
+                    prefetch(&root, &files);
+                    debug!("fs prefetch: {} files prefetched", files.len());
+                }
+                Err(e) if e.kind() == io::ErrorKind::NotFound => {}
+                Err(e) => warn!("fs prefetch: failed to read {}: {}", profile.display(), e),
+            }
+
+            if let Some(remaining) = window.checked_sub(start.elapsed()) {
+                thread::sleep(remaining);
+            }
+            if let Err(e) = recorder.finish(&profile) {
+                error!("fs prefetch: failed to write {}: {}", profile.display(), e);
+            }
+        })?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::env;
+    use std::os::unix::fs::symlink;
+
+    #[test]
+    fn test_record_and_load() {
+        let dir = env::temp_dir().join(format!("fs-prefetch-test-{}", std::process::id()));
+        fs::create_dir_all(dir.join("lib")).unwrap();
+        fs::write(dir.join("lib/libc.so"), vec![0u8; 8192]).unwrap();
+        fs::write(dir.join("init"), vec![0u8; 4096]).unwrap();
+
+        let recorder = Recorder::new(dir.to_str().unwrap());
+        let libc = File::open(dir.join("lib/libc.so")).unwrap();
+        let init = File::open(dir.join("init")).unwrap();
+        recorder.record(3, &init, 0, 4096);
+        recorder.record(2, &libc, 4096, 4096);
+        recorder.record(2, &libc, 1024, 1024);
+
+        let profile = dir.join("profile");
+        recorder.finish(&profile).unwrap();
+        // Nothing is recorded once the profile is written.
+        recorder.record(4, &init, 0, 4096);
+
+        let files = load_profile(&profile).unwrap();
+        fs::remove_dir_all(&dir).unwrap();
+
+        assert_eq!(
+            files,
+            vec![
+                RecordedFile {
+                    path: PathBuf::from("init"),
+                    start: 0,
+                    end: 4096,
+                },
+                RecordedFile {
+                    path: PathBuf::from("lib/libc.so"),
+                    start: 1024,
+                    end: 8192,
+                },
+            ]
+        );
+    }
+
+    #[test]
+    fn test_non_canonical_root() {
+        let dir = env::temp_dir().join(format!("fs-prefetch-root-{}", std::process::id()));
+        fs::create_dir_all(dir.join("root/lib")).unwrap();
+        fs::write(dir.join("root/lib/libc.so"), b"libc").unwrap();
+        symlink("root", dir.join("link")).unwrap();
+
+        let root_dir = dir.join("link/lib/..");
+        let recorder = Recorder::new(root_dir.to_str().unwrap());
+        let libc = File::open(root_dir.join("lib/libc.so")).unwrap();
+        assert_eq!(
+            recorder.relative_path(&libc),
+            Some(PathBuf::from("lib/libc.so"))
+        );
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_open_regular() {
+        let dir = env::temp_dir().join(format!("fs-prefetch-open-{}", std::process::id()));
+        fs::create_dir_all(dir.join("root/lib")).unwrap();
+        fs::write(dir.join("root/lib/libc.so"), b"libc").unwrap();
+        fs::write(dir.join("secret"), b"secret").unwrap();
+        symlink("../secret", dir.join("root/file-link")).unwrap();
+        symlink("..", dir.join("root/dir-link")).unwrap();
+        let fifo = CString::new(dir.join("root/fifo").as_os_str().as_bytes()).unwrap();
+        // Safe because this doesn't modify any memory and we check the return value.
+        assert_eq!(unsafe { libc::mkfifo(fifo.as_ptr(), 0o600) }, 0);
+
+        let root = File::open(dir.join("root")).unwrap();
+        assert!(open_regular(&root, Path::new("lib/libc.so")).is_ok());
+        for path in [
+            "lib",
+            "fifo",
+            "file-link",
+            "dir-link/secret",
+            "../secret",
+            "/etc/passwd",
+            "",
+        ] {
+            assert!(open_regular(&root, Path::new(path)).is_err(), "{}", path);
+        }
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
@@ -0,0 +1,72 @@
+// Helpers shared by the tests of the file system backends.
+
+use std::cmp;
+use std::ffi::CString;
+use std::fs::{self, File};
+use std::io;
+use std::os::unix::fs::FileExt;
+use std::path::PathBuf;
+
+use super::super::filesystem::{Context, ZeroCopyReader, ZeroCopyWriter};
+
+/// The context of a request made with the credentials of the test process.
+pub(super) fn ctx() -> Context {
+    Context {
+        // Safe because these calls don't modify any memory.
+        uid: unsafe { libc::geteuid() },
+        gid: unsafe { libc::getegid() },
+        pid: 0,
+    }
+}
+
+pub(super) fn name(s: &str) -> CString {
+    CString::new(s).unwrap()
+}
+
+/// Creates an empty directory for the test tagged `tag`, unique to the test process.
+pub(super) fn tmpdir(tag: &str) -> PathBuf {
+    let dir = std::env::temp_dir().join(format!("fs-{}-{}", tag, std::process::id()));
+    let _ = fs::remove_dir_all(&dir);
+    fs::create_dir_all(&dir).unwrap();
+    dir
+}
+
+/// Stand-in for the virtqueue reader, taking the data from a slice.
+pub(super) struct Src<'a>(pub(super) &'a [u8]);
+
+impl io::Read for Src<'_> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        self.0.read(buf)
+    }
+}
+
+impl ZeroCopyReader for Src<'_> {
+    fn read_to(&mut self, f: &mut File, count: usize, off: u64) -> io::Result<usize> {
+        let count = cmp::min(count, self.0.len());
+        let written = f.write_at(&self.0[..count], off)?;
+        self.0 = &self.0[written..];
+        Ok(written)
+    }
+}
+
+/// Stand-in for the virtqueue writer, appending the data to a vector.
+pub(super) struct Dst<'a>(pub(super) &'a mut Vec<u8>);
+
+impl io::Write for Dst<'_> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.0.write(buf)
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl ZeroCopyWriter for Dst<'_> {
+    fn write_from(&mut self, f: &mut File, count: usize, off: u64) -> io::Result<usize> {
+        let mut buf = vec![0u8; count];
+        let read = f.read_at(&mut buf, off)?;
+        self.0.extend_from_slice(&buf[..read]);
+        Ok(read)
+    }
+}
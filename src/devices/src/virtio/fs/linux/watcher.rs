@@ -0,0 +1,142 @@
+use std::ffi::{CStr, CString};
+use std::fs::File;
+use std::io::{self, Read};
+use std::mem::size_of;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::ptr;
+use std::thread;
+
+// Changes we want to hear about on watched directories, both for the directory itself and for
+// its entries.
+const WATCH_MASK: u32 = libc::IN_ATTRIB
+    | libc::IN_MODIFY
+    | libc::IN_CREATE
+    | libc::IN_DELETE
+    | libc::IN_DELETE_SELF
+    | libc::IN_MOVED_FROM
+    | libc::IN_MOVED_TO
+    | libc::IN_MOVE_SELF
+    | libc::IN_ONLYDIR
+    | libc::IN_EXCL_UNLINK;
+
+// Maximum length of a file name, as defined in linux/limits.h.
+const NAME_MAX: usize = 255;
+
+// Enough room for a bunch of events with maximum length names.
+const EVENT_BUF_SIZE: usize = 64 * (size_of::<libc::inotify_event>() + NAME_MAX + 1);
+
+pub enum WatchEvent<'a> {
+    /// A watched directory (when `name` is `None`) or one of its entries changed. `mask` holds
+    /// the inotify event bits describing the change.
+    Changed {
+        wd: i32,
+        mask: u32,
+        name: Option<&'a CStr>,
+    },
+    /// The watch was removed, either explicitly or because the directory is gone.
+    Removed { wd: i32 },
+    /// The kernel dropped events, so anything we know about the host may be stale.
+    Overflow,
+}
+
+/// Watches directories in the host for changes done behind our back, using inotify.
+pub struct Watcher {
+    inotify: File,
+}
+
+impl Watcher {
+    pub fn new() -> io::Result<Watcher> {
+        // Safe because this doesn't modify any memory and we check the return value.
+        let fd = unsafe { libc::inotify_init1(libc::IN_CLOEXEC) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // Safe because we just opened this fd.
+        Ok(Watcher {
+            inotify: unsafe { File::from_raw_fd(fd) },
+        })
+    }
+
+    /// Starts watching the directory referred by `fd`, which may be an `O_PATH` fd. Returns the
+    /// watch descriptor that will be reported in the events for this directory.
+    pub fn add_watch(&self, fd: RawFd) -> io::Result<i32> {
+        let path = CString::new(format!("/proc/self/fd/{}", fd))
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+        // Safe because this doesn't modify any memory and we check the return value.
+        let wd =
+            unsafe { libc::inotify_add_watch(self.inotify.as_raw_fd(), path.as_ptr(), WATCH_MASK) };
+        if wd < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(wd)
+        }
+    }
+
+    pub fn remove_watch(&self, wd: i32) {
+        // Safe because this doesn't modify any memory. The watch may be already gone if the
+        // directory was removed, so there's no point in checking the return value.
+        unsafe { libc::inotify_rm_watch(self.inotify.as_raw_fd(), wd) };
+    }
+
+    /// Spawns a thread that reads the events from the kernel and passes them to `handler`.
+    pub fn start<F>(&self, mut handler: F) -> io::Result<()>
+    where
+        F: FnMut(WatchEvent) + Send + 'static,
+    {
+        let mut inotify = self.inotify.try_clone()?;
+
+        thread::Builder::new()
+            .name("fs watcher".into())
+            .spawn(move || {
+                let mut buf = vec![0u8; EVENT_BUF_SIZE];
+                loop {
+                    let len = match inotify.read(&mut buf) {
+                        Ok(len) => len,
+                        Err(e) if e.kind() == io::ErrorKind::Interrupted => continue,
+                        Err(e) => {
+                            error!("fs watcher: failed to read events: {:?}", e);
+                            // We can't keep track of the changes anymore.
+                            handler(WatchEvent::Overflow);
+                            break;
+                        }
+                    };
+
+                    let mut off = 0;
+                    while off + size_of::<libc::inotify_event>() <= len {
+                        // Safe because the kernel guarantees there's a full event at `off`, and
+                        // we do an unaligned read.
+                        let event = unsafe {
+                            ptr::read_unaligned(buf[off..].as_ptr() as *const libc::inotify_event)
+                        };
+                        let name_start = off + size_of::<libc::inotify_event>();
+                        let name_end = name_start + event.len as usize;
+                        off = name_end;
+
+                        if event.mask & libc::IN_Q_OVERFLOW != 0 {
+                            handler(WatchEvent::Overflow);
+                        } else if event.mask & libc::IN_IGNORED != 0 {
+                            handler(WatchEvent::Removed { wd: event.wd });
+                        } else {
+                            // The name is nul-terminated and then padded with more nul bytes.
+                            let name = buf[name_start..name_end]
+                                .iter()
+                                .position(|c| *c == 0)
+                                .and_then(|nul| {
+                                    CStr::from_bytes_with_nul(&buf[name_start..=name_start + nul])
+                                        .ok()
+                                });
+                            handler(WatchEvent::Changed {
+                                wd: event.wd,
+                                mask: event.mask,
+                                name,
+                            });
+                        }
+                    }
+                }
+            })?;
+
+        Ok(())
+    }
+}
@@ -9,7 +9,11 @@ mod file_traits;
 mod filesystem;
 pub mod fuse;
 mod multikey;
+mod notify;
 mod server;
+pub mod stats;
+pub mod trace;
+mod worker;
 
 #[cfg(target_os = "linux")]
 pub mod linux;
@@ -22,13 +26,19 @@ pub use macos::passthrough;
 
 pub use self::defs::uapi::VIRTIO_ID_FS as TYPE_FS;
 pub use self::device::Fs;
+pub use self::filesystem::FileSystem;
+pub use self::server::{Server, MAX_MAX_BUFFER_SIZE};
 
 mod defs {
     pub const FS_DEV_ID: &str = "virtio_fs";
-    pub const NUM_QUEUES: usize = 2;
+    // The notification queue is only exposed if the driver acknowledges
+    // VIRTIO_FS_F_NOTIFICATION.
+    pub const NUM_QUEUES: usize = 3;
     pub const QUEUE_SIZES: &[u16] = &[1024; NUM_QUEUES];
 
     pub mod uapi {
+        /// The device supports FUSE notifications through the notification queue.
+        pub const VIRTIO_FS_F_NOTIFICATION: u32 = 0;
         /// The device conforms to the virtio spec version 1.0.
         pub const VIRTIO_F_VERSION_1: u32 = 32;
         pub const VIRTIO_ID_FS: u32 = 26;
@@ -48,6 +58,8 @@ pub enum FsError {
     EncodeMessage(io::Error),
     /// Failed to create event fd.
     EventFd(std::io::Error),
+    /// Failed to set up the file system backing the device.
+    CreateFs(io::Error),
     /// One or more parameters are missing.
     MissingParameter,
     /// A C string parameter is invalid.
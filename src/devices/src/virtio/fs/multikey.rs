@@ -107,6 +107,21 @@ where
         })
     }
 
+    /// Returns the number of entries in the map.
+    pub fn len(&self) -> usize {
+        self.main.len()
+    }
+
+    /// Returns `true` if the map has no entries.
+    pub fn is_empty(&self) -> bool {
+        self.main.is_empty()
+    }
+
+    /// Returns an iterator over the values of the map, in the order of their main keys.
+    pub fn values(&self) -> impl Iterator<Item = &V> {
+        self.main.values().map(|(_, v)| v)
+    }
+
     /// Clears the map, removing all values.
     pub fn clear(&mut self) {
         self.alt.clear();
@@ -271,4 +286,20 @@ mod test {
         assert!(m.get(&k1).is_none());
         assert!(m.get_alt(&k2).is_none());
     }
+
+    #[test]
+    fn len_and_values() {
+        let mut m = MultikeyBTreeMap::<u64, i64, u32>::new();
+        assert!(m.is_empty());
+
+        assert!(m.insert(3, -3, 30).is_none());
+        assert!(m.insert(1, -1, 10).is_none());
+        assert!(m.insert(2, -2, 20).is_none());
+        assert_eq!(m.len(), 3);
+        assert_eq!(m.values().copied().collect::<Vec<_>>(), vec![10, 20, 30]);
+
+        m.remove(&2);
+        assert_eq!(m.len(), 2);
+        assert_eq!(m.values().copied().collect::<Vec<_>>(), vec![10, 30]);
+    }
 }
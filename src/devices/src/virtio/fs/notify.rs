@@ -0,0 +1,279 @@
+use std::collections::VecDeque;
+use std::ffi::CStr;
+use std::io;
+use std::mem::size_of;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+
+use utils::eventfd::EventFd;
+use vm_memory::ByteValued;
+
+use super::fuse::{NotifyInvalEntryOut, NotifyInvalInodeOut, NotifyOpcode, OutHeader};
+
+// Number of notifications waiting for the guest to provide buffers past which the producers
+// that can wait (see `wait_for_room`) stop until the guest catches up. Notifications are never
+// dropped, since FUSE has nothing coarser that would make the guest drop everything it cached.
+const MAX_PENDING: usize = 4096;
+
+// Maximum length of a file name, as defined in linux/limits.h.
+const NAME_MAX: usize = 255;
+
+/// Size of the largest notification we send, which the guest is required to provide in every
+/// buffer of the notification queue.
+pub const NOTIFY_BUF_SIZE: usize =
+    size_of::<OutHeader>() + size_of::<NotifyInvalEntryOut>() + NAME_MAX + 1;
+
+#[derive(Debug)]
+struct Inner {
+    // Set once the driver has acknowledged VIRTIO_FS_F_NOTIFICATION.
+    enabled: AtomicBool,
+    pending: Mutex<VecDeque<Vec<u8>>>,
+    // Signaled when the pending queue drops below `MAX_PENDING`, or notifications are disabled.
+    room: Condvar,
+    evt: EventFd,
+}
+
+/// Host-side handle for sending FUSE notifications to the guest. Notifications are queued here
+/// and `evt` is signaled, so the device can move them to the notification queue from its own
+/// thread.
+#[derive(Debug, Clone)]
+pub struct Notifier {
+    inner: Arc<Inner>,
+}
+
+impl Notifier {
+    pub fn new() -> io::Result<Notifier> {
+        Ok(Notifier {
+            inner: Arc::new(Inner {
+                enabled: AtomicBool::new(false),
+                pending: Mutex::new(VecDeque::new()),
+                room: Condvar::new(),
+                evt: EventFd::new(utils::eventfd::EFD_NONBLOCK)?,
+            }),
+        })
+    }
+
+    pub fn set_enabled(&self, enabled: bool) {
+        self.inner.enabled.store(enabled, Ordering::Release);
+        if !enabled {
+            self.inner.pending.lock().unwrap().clear();
+            self.inner.room.notify_all();
+        }
+    }
+
+    pub fn is_enabled(&self) -> bool {
+        self.inner.enabled.load(Ordering::Acquire)
+    }
+
+    /// Asks the guest to drop the cached attributes of `ino` and, unless `off` is negative, the
+    /// cached data in the range starting at `off` and spanning `len` bytes (or up to the end of
+    /// the file if `len` is not positive).
+    pub fn inval_inode(&self, ino: u64, off: i64, len: i64) {
+        let out = NotifyInvalInodeOut { ino, off, len };
+        self.push(NotifyOpcode::InvalInode, out.as_slice(), &[]);
+    }
+
+    /// Asks the guest to drop the cached directory entry for `name` in `parent`.
+    pub fn inval_entry(&self, parent: u64, name: &CStr) {
+        let name = name.to_bytes_with_nul();
+        let out = NotifyInvalEntryOut {
+            parent,
+            namelen: (name.len() - 1) as u32,
+            padding: 0,
+        };
+        self.push(NotifyOpcode::InvalEntry, out.as_slice(), name);
+    }
+
+    fn push(&self, code: NotifyOpcode, out: &[u8], data: &[u8]) {
+        if !self.is_enabled() {
+            return;
+        }
+
+        self.inner
+            .pending
+            .lock()
+            .unwrap()
+            .push_back(message(code, out, data));
+
+        if let Err(e) = self.inner.evt.write(1) {
+            error!("fs: failed to signal notification: {:?}", e);
+        }
+    }
+
+    /// Waits until there are less than `MAX_PENDING` notifications waiting for the guest, or
+    /// notifications are disabled. Producers that can hold back the changes they report (i.e.
+    /// the host watcher, whose events wait in the kernel meanwhile) call this before queuing
+    /// more, so the queue stays bounded without losing any notification.
+    pub fn wait_for_room(&self) {
+        let mut pending = self.inner.pending.lock().unwrap();
+        while self.is_enabled() && pending.len() >= MAX_PENDING {
+            pending = self.inner.room.wait(pending).unwrap();
+        }
+    }
+
+    /// Takes the oldest pending notification.
+    pub fn pop(&self) -> Option<Vec<u8>> {
+        let mut pending = self.inner.pending.lock().unwrap();
+        let msg = pending.pop_front()?;
+        if pending.len() == MAX_PENDING - 1 {
+            self.inner.room.notify_all();
+        }
+        Some(msg)
+    }
+
+    /// Puts back a notification taken with `pop` that couldn't be delivered yet.
+    pub fn unpop(&self, msg: Vec<u8>) {
+        self.inner.pending.lock().unwrap().push_front(msg);
+    }
+
+    /// How many more notifications can be queued before the producers that can wait for room
+    /// have to.
+    pub fn room(&self) -> usize {
+        MAX_PENDING.saturating_sub(self.inner.pending.lock().unwrap().len())
+    }
+
+    pub fn has_pending(&self) -> bool {
+        !self.inner.pending.lock().unwrap().is_empty()
+    }
+
+    pub fn evt(&self) -> &EventFd {
+        &self.inner.evt
+    }
+}
+
+// Builds the notification `code`, made of `out` followed by `data`.
+fn message(code: NotifyOpcode, out: &[u8], data: &[u8]) -> Vec<u8> {
+    let len = size_of::<OutHeader>() + out.len() + data.len();
+    let header = OutHeader {
+        len: len as u32,
+        // Notifications carry the notification code in place of the error.
+        error: code as i32,
+        unique: 0,
+    };
+
+    let mut msg = Vec::with_capacity(len);
+    msg.extend_from_slice(header.as_slice());
+    msg.extend_from_slice(out);
+    msg.extend_from_slice(data);
+    msg
+}
+
+#[cfg(test)]
+mod tests {
+    use std::thread;
+    use std::time::Duration;
+
+    use super::*;
+
+    fn read_obj<T: ByteValued + Default>(buf: &[u8]) -> T {
+        let mut val = T::default();
+        val.as_mut_slice().copy_from_slice(&buf[..size_of::<T>()]);
+        val
+    }
+
+    #[test]
+    fn test_inval_entry() {
+        let notifier = Notifier::new().unwrap();
+
+        // Nothing is queued until the driver acknowledges the feature.
+        notifier.inval_entry(1, CStr::from_bytes_with_nul(b"foo\0").unwrap());
+        assert!(!notifier.has_pending());
+
+        notifier.set_enabled(true);
+        notifier.inval_entry(1, CStr::from_bytes_with_nul(b"foo\0").unwrap());
+        let msg = notifier.pop().unwrap();
+        assert!(notifier.pop().is_none());
+
+        let header: OutHeader = read_obj(&msg);
+        assert_eq!(header.len as usize, msg.len());
+        assert_eq!(header.error, NotifyOpcode::InvalEntry as i32);
+        assert_eq!(header.unique, 0);
+
+        let body = &msg[size_of::<OutHeader>()..];
+        let out: NotifyInvalEntryOut = read_obj(body);
+        assert_eq!(out.parent, 1);
+        assert_eq!(out.namelen, 3);
+        assert_eq!(&body[size_of::<NotifyInvalEntryOut>()..], b"foo\0");
+        assert!(msg.len() <= NOTIFY_BUF_SIZE);
+    }
+
+    #[test]
+    fn test_inval_inode() {
+        let notifier = Notifier::new().unwrap();
+        notifier.set_enabled(true);
+        notifier.inval_inode(5, -1, 0);
+
+        let msg = notifier.pop().unwrap();
+        let header: OutHeader = read_obj(&msg);
+        assert_eq!(header.error, NotifyOpcode::InvalInode as i32);
+        let out: NotifyInvalInodeOut = read_obj(&msg[size_of::<OutHeader>()..]);
+        assert_eq!(out.ino, 5);
+        assert_eq!(out.off, -1);
+
+        notifier.unpop(msg);
+        assert!(notifier.has_pending());
+        assert_eq!(notifier.room(), MAX_PENDING - 1);
+        notifier.set_enabled(false);
+        assert!(!notifier.has_pending());
+    }
+
+    #[test]
+    fn test_backpressure() {
+        const COUNT: usize = 2 * MAX_PENDING + 1;
+
+        let notifier = Notifier::new().unwrap();
+        notifier.set_enabled(true);
+        let producer = {
+            let notifier = notifier.clone();
+            thread::spawn(move || {
+                for ino in 0..COUNT as u64 {
+                    notifier.wait_for_room();
+                    notifier.inval_inode(ino + 2, -1, 0);
+                }
+            })
+        };
+
+        // The producer stops once the queue is full, until the guest takes some.
+        while notifier.room() > 0 {
+            thread::sleep(Duration::from_millis(1));
+        }
+        thread::sleep(Duration::from_millis(50));
+        assert_eq!(notifier.inner.pending.lock().unwrap().len(), MAX_PENDING);
+        assert!(!producer.is_finished());
+
+        // Every invalidation reaches the guest, in order.
+        let mut inodes = Vec::new();
+        while inodes.len() < COUNT {
+            match notifier.pop() {
+                Some(msg) => {
+                    let out: NotifyInvalInodeOut = read_obj(&msg[size_of::<OutHeader>()..]);
+                    inodes.push(out.ino);
+                }
+                None => thread::sleep(Duration::from_millis(1)),
+            }
+        }
+        producer.join().unwrap();
+        assert!(notifier.pop().is_none());
+        assert_eq!(inodes, (2..COUNT as u64 + 2).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn test_disable_wakes_producer() {
+        let notifier = Notifier::new().unwrap();
+        notifier.set_enabled(true);
+        for ino in 0..MAX_PENDING as u64 {
+            notifier.inval_inode(ino + 2, -1, 0);
+        }
+
+        let producer = {
+            let notifier = notifier.clone();
+            thread::spawn(move || notifier.wait_for_room())
+        };
+        thread::sleep(Duration::from_millis(50));
+        assert!(!producer.is_finished());
+
+        notifier.set_enabled(false);
+        producer.join().unwrap();
+        assert!(!notifier.has_pending());
+    }
+}
@@ -2,12 +2,17 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+use std::cell::Cell;
+use std::cmp;
 use std::convert::TryInto;
 use std::ffi::CStr;
 use std::fs::File;
 use std::io::{self, Read, Write};
 use std::mem::size_of;
 use std::collections::HashMap;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::sync::Arc;
+use std::time::Instant;
 
 use vm_memory::ByteValued;
 
@@ -18,13 +23,24 @@ use super::filesystem::{
     ZeroCopyWriter,
 };
 use super::fuse::*;
+use super::stats::Stats;
+use super::trace::TraceWriter;
 use super::{FsError as Error, Result};
 use crate::virtio::VirtioShmRegion;
 
-const MAX_BUFFER_SIZE: u32 = 1 << 20;
+/// Default for the largest amount of data transferred by a single request.
+pub const DEFAULT_MAX_BUFFER_SIZE: u32 = 1 << 20;
+/// Upper limit for the configurable maximum transfer size.
+pub const MAX_MAX_BUFFER_SIZE: u32 = 8 << 20;
 const BUFFER_HEADER_SIZE: u32 = 0x1000;
 const DIRENT_PADDING: [u8; 8] = [0; 8];
 
+thread_local! {
+    // Set by `reply_error`, so that `handle_message` can tell the failed requests apart. Each
+    // thread handles a single request at a time.
+    static REPLIED_ERROR: Cell<bool> = Cell::new(false);
+}
+
 struct ZCReader<'a>(Reader<'a>);
 
 impl<'a> ZeroCopyReader for ZCReader<'a> {
@@ -63,25 +79,104 @@ impl<'a> io::Write for ZCWriter<'a> {
 
 pub struct Server<F: FileSystem + Sync> {
     fs: F,
+    // Largest amount of data we accept to transfer in a single request.
+    max_buffer_size: AtomicU32,
+    stats: Arc<Stats>,
+    trace: Option<TraceWriter>,
     // map: HashMap<u64,u64>
 }
 
 impl<F: FileSystem + Sync> Server<F> {
-    pub fn new(fs: F) -> Server<F> {
+    /// Creates a server for `fs` that transfers up to `max_buffer_size` bytes of data per
+    /// request. `max_buffer_size` is clamped to `MAX_MAX_BUFFER_SIZE`.
+    pub fn new(fs: F, max_buffer_size: u32) -> Server<F> {
         // Server { fs ,map:HashMap::new()}
-        Server { fs }
+        Server {
+            fs,
+            max_buffer_size: AtomicU32::new(cmp::min(max_buffer_size, MAX_MAX_BUFFER_SIZE)),
+            stats: Arc::new(Stats::new()),
+            trace: None,
+        }
+    }
+
+    /// Changes the largest amount of data transferred per request, which only affects the sizes
+    /// negotiated by a later `FUSE_INIT`. `max_buffer_size` is clamped to `MAX_MAX_BUFFER_SIZE`.
+    pub fn set_max_buffer_size(&self, max_buffer_size: u32) {
+        self.max_buffer_size.store(
+            cmp::min(max_buffer_size, MAX_MAX_BUFFER_SIZE),
+            Ordering::Relaxed,
+        );
+    }
+
+    pub(crate) fn max_buffer_size(&self) -> u32 {
+        self.max_buffer_size.load(Ordering::Relaxed)
+    }
+
+    /// Makes the server record every request it receives into `trace`.
+    pub fn set_trace(&mut self, trace: TraceWriter) {
+        self.trace = Some(trace);
+    }
+
+    /// Returns the statistics of the requests handled by this server.
+    pub fn stats(&self) -> Arc<Stats> {
+        self.stats.clone()
     }
 
-    #[allow(clippy::cognitive_complexity)]
     pub fn handle_message(
         &self,
         mut r: Reader,
         w: Writer,
         shm_region: Option<&VirtioShmRegion>,
     ) -> Result<usize> {
+        // The request is copied as a whole before it gets consumed, which is only worth it when
+        // it's going to be recorded.
+        let request = match self.trace {
+            Some(_) => {
+                let mut buf = vec![0u8; r.available_bytes()];
+                r.clone()
+                    .read_exact(&mut buf)
+                    .map_err(Error::DecodeMessage)?;
+                Some((buf, w.available_bytes()))
+            }
+            None => None,
+        };
+
         let in_header: InHeader = r.read_obj().map_err(Error::DecodeMessage)?;
 
-        if in_header.len > (MAX_BUFFER_SIZE + BUFFER_HEADER_SIZE) {
+        let start = Instant::now();
+        REPLIED_ERROR.with(|e| e.set(false));
+
+        let res = self.dispatch(in_header, r, w, shm_region);
+        let latency = start.elapsed();
+
+        if let (Some(trace), Some((request, out_len))) = (self.trace.as_ref(), request) {
+            if let Err(e) = trace.record(&request, out_len, start, latency) {
+                error!("Failed to record FUSE request, stopping the trace: {}", e);
+            }
+        }
+
+        let error = res.is_err() || REPLIED_ERROR.with(|e| e.get());
+        self.stats.record(
+            in_header.opcode,
+            in_header.nodeid,
+            in_header.len as usize,
+            *res.as_ref().unwrap_or(&0),
+            error,
+            latency,
+        );
+
+        res
+    }
+
+    #[allow(clippy::cognitive_complexity)]
+    fn dispatch(
+        &self,
+        in_header: InHeader,
+        r: Reader,
+        w: Writer,
+        shm_region: Option<&VirtioShmRegion>,
+    ) -> Result<usize> {
+        if in_header.len > (self.max_buffer_size() + BUFFER_HEADER_SIZE) {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -495,7 +590,7 @@ impl<F: FileSystem + Sync> Server<F> {
             ..
         } = r.read_obj().map_err(Error::DecodeMessage)?;
 
-        if size > MAX_BUFFER_SIZE {
+        if size > self.max_buffer_size() {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -549,7 +644,7 @@ impl<F: FileSystem + Sync> Server<F> {
             ..
         } = r.read_obj().map_err(Error::DecodeMessage)?;
 
-        if size > MAX_BUFFER_SIZE {
+        if size > self.max_buffer_size() {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -697,7 +792,7 @@ impl<F: FileSystem + Sync> Server<F> {
 
         r.read_exact(&mut name).map_err(Error::DecodeMessage)?;
 
-        if size > MAX_BUFFER_SIZE {
+        if size > self.max_buffer_size() {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -727,7 +822,7 @@ impl<F: FileSystem + Sync> Server<F> {
     fn listxattr(&self, in_header: InHeader, mut r: Reader, w: Writer) -> Result<usize> {
         let GetxattrIn { size, .. } = r.read_obj().map_err(Error::DecodeMessage)?;
 
-        if size > MAX_BUFFER_SIZE {
+        if size > self.max_buffer_size() {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -840,7 +935,7 @@ impl<F: FileSystem + Sync> Server<F> {
         let capable = FsOptions::from_bits_truncate(flags);
 
         let page_size: u32 = unsafe { libc::sysconf(libc::_SC_PAGESIZE).try_into().unwrap() };
-        let max_pages = ((MAX_BUFFER_SIZE - 1) / page_size) + 1;
+        let max_pages = ((self.max_buffer_size() - 1) / page_size) + 1;
 
         match self.fs.init(capable) {
             Ok(want) => {
@@ -853,7 +948,7 @@ impl<F: FileSystem + Sync> Server<F> {
                     flags: enabled.bits(),
                     max_background: ::std::u16::MAX,
                     congestion_threshold: (::std::u16::MAX / 4) * 3,
-                    max_write: MAX_BUFFER_SIZE,
+                    max_write: self.max_buffer_size(),
                     time_gran: 1, // nanoseconds
                     max_pages: max_pages.try_into().unwrap(),
                     ..Default::default()
@@ -896,7 +991,7 @@ impl<F: FileSystem + Sync> Server<F> {
             fh, offset, size, ..
         } = r.read_obj().map_err(Error::DecodeMessage)?;
 
-        if size > MAX_BUFFER_SIZE {
+        if size > self.max_buffer_size() {
             return reply_error(
                 io::Error::from_raw_os_error(libc::ENOMEM),
                 in_header.unique,
@@ -1098,11 +1193,50 @@ impl<F: FileSystem + Sync> Server<F> {
         Ok(0)
     }
 
-    fn ioctl(&self, in_header: InHeader, _r: Reader, w: Writer) -> Result<usize> {
-        if let Err(e) = self.fs.ioctl() {
-            reply_error(e, in_header.unique, w)
-        } else {
-            Ok(0)
+    fn ioctl(&self, in_header: InHeader, mut r: Reader, w: Writer) -> Result<usize> {
+        let IoctlIn {
+            fh,
+            flags,
+            cmd,
+            arg,
+            in_size,
+            out_size,
+        } = r.read_obj().map_err(Error::DecodeMessage)?;
+
+        if in_size > self.max_buffer_size() || out_size > self.max_buffer_size() {
+            return reply_error(
+                io::Error::from_raw_os_error(libc::ENOMEM),
+                in_header.unique,
+                w,
+            );
+        }
+
+        match self.fs.ioctl(
+            Context::from(in_header),
+            in_header.nodeid.into(),
+            fh.into(),
+            IoctlFlags::from_bits_truncate(flags),
+            cmd,
+            arg,
+            in_size,
+            out_size,
+            r,
+        ) {
+            // The guest only has room for `out_size` bytes of output.
+            Ok(data) if data.len() > out_size as usize => reply_error(
+                io::Error::from_raw_os_error(libc::EOVERFLOW),
+                in_header.unique,
+                w,
+            ),
+            Ok(data) => {
+                let out = IoctlOut {
+                    result: 0,
+                    ..Default::default()
+                };
+
+                reply_ok(Some(out), Some(&data), in_header.unique, w)
+            }
+            Err(e) => reply_error(e, in_header.unique, w),
         }
     }
 
@@ -1126,7 +1260,7 @@ impl<F: FileSystem + Sync> Server<F> {
         let BatchForgetIn { count, .. } = r.read_obj().map_err(Error::DecodeMessage)?;
 
         if let Some(size) = (count as usize).checked_mul(size_of::<ForgetOne>()) {
-            if size > MAX_BUFFER_SIZE as usize {
+            if size > self.max_buffer_size() as usize {
                 return reply_error(
                     io::Error::from_raw_os_error(libc::ENOMEM),
                     in_header.unique,
@@ -1277,7 +1411,7 @@ impl<F: FileSystem + Sync> Server<F> {
         let RemovemappingIn { count } = r.read_obj().map_err(Error::DecodeMessage)?;
 
         if let Some(size) = (count as usize).checked_mul(size_of::<RemovemappingOne>()) {
-            if size > MAX_BUFFER_SIZE as usize {
+            if size > self.max_buffer_size() as usize {
                 return reply_error(
                     io::Error::from_raw_os_error(libc::ENOMEM),
                     in_header.unique,
@@ -1348,6 +1482,8 @@ fn reply_ok<T: ByteValued>(
 }
 
 fn reply_error(e: io::Error, unique: u64, mut w: Writer) -> Result<usize> {
+    REPLIED_ERROR.with(|e| e.set(true));
+
     let header = OutHeader {
         len: size_of::<OutHeader>() as u32,
         error: -e.raw_os_error().unwrap_or(libc::EIO),
@@ -1423,3 +1559,96 @@ fn add_dirent(
         Ok(total_len)
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use vm_memory::{Bytes, GuestAddress, GuestMemoryMmap};
+
+    use super::super::descriptor_utils::{create_descriptor_chain, DescriptorType};
+
+    // A file system whose ioctls all return `reply_len` bytes of output.
+    struct IoctlFs {
+        reply_len: usize,
+    }
+
+    impl FileSystem for IoctlFs {
+        type Inode = u64;
+        type Handle = u64;
+
+        fn ioctl<R: io::Read>(
+            &self,
+            _ctx: Context,
+            _inode: u64,
+            _handle: u64,
+            _flags: IoctlFlags,
+            _cmd: u32,
+            _arg: u64,
+            _in_size: u32,
+            _out_size: u32,
+            _r: R,
+        ) -> io::Result<Vec<u8>> {
+            Ok(vec![0xaa; self.reply_len])
+        }
+    }
+
+    // Sends an ioctl request with room for `out_size` bytes of output, and returns the header
+    // of the reply.
+    fn ioctl_reply(server: &Server<IoctlFs>, out_size: u32) -> OutHeader {
+        let mem = GuestMemoryMmap::from_ranges(&[(GuestAddress(0), 0x10000)]).unwrap();
+
+        let in_header = InHeader {
+            len: (size_of::<InHeader>() + size_of::<IoctlIn>()) as u32,
+            opcode: Opcode::Ioctl as u32,
+            unique: 1,
+            ..Default::default()
+        };
+        let ioctl_in = IoctlIn {
+            out_size,
+            ..Default::default()
+        };
+        mem.write_slice(in_header.as_slice(), GuestAddress(0x1000))
+            .unwrap();
+        mem.write_slice(
+            ioctl_in.as_slice(),
+            GuestAddress(0x1000 + size_of::<InHeader>() as u64),
+        )
+        .unwrap();
+
+        let reply_addr = GuestAddress(0x1000 + u64::from(in_header.len));
+        let chain = create_descriptor_chain(
+            &mem,
+            GuestAddress(0),
+            GuestAddress(0x1000),
+            vec![
+                (DescriptorType::Readable, in_header.len),
+                (DescriptorType::Writable, 0x1000),
+            ],
+            0,
+        )
+        .unwrap();
+        let reader = Reader::new(&mem, chain.clone()).unwrap();
+        let writer = Writer::new(&mem, chain).unwrap();
+        server.handle_message(reader, writer, None).unwrap();
+
+        mem.read_obj(reply_addr).unwrap()
+    }
+
+    #[test]
+    fn test_ioctl_out_size() {
+        let server = Server::new(IoctlFs { reply_len: 64 }, DEFAULT_MAX_BUFFER_SIZE);
+
+        let out = ioctl_reply(&server, 64);
+        assert_eq!(out.error, 0);
+        assert_eq!(
+            out.len as usize,
+            size_of::<OutHeader>() + size_of::<IoctlOut>() + 64
+        );
+
+        // A reply that doesn't fit in what the guest asked for is an error, not an overflow.
+        let out = ioctl_reply(&server, 63);
+        assert_eq!(out.error, -libc::EOVERFLOW);
+        assert_eq!(out.len as usize, size_of::<OutHeader>());
+    }
+}
@@ -0,0 +1,456 @@
+use std::cmp;
+use std::fmt;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Mutex;
+use std::time::Duration;
+
+use super::fuse::Opcode;
+
+// Every opcode we know of gets its own slot. Any other one is accounted in slot 0, which isn't a
+// valid opcode.
+const NUM_OPCODES: usize = Opcode::RemoveMapping as usize + 1;
+
+/// Number of buckets of the latency histograms. Bucket 0 counts the requests served in less than
+/// 1us, bucket `i` those that took from 2^(i-1) to 2^i us, and the last one everything slower.
+pub const NUM_BUCKETS: usize = 24;
+
+/// Number of inodes kept in the list of the slowest ones.
+pub const NUM_SLOWEST: usize = 16;
+
+const OPCODES: &[Opcode] = &[
+    Opcode::Lookup,
+    Opcode::Forget,
+    Opcode::Getattr,
+    Opcode::Setattr,
+    Opcode::Readlink,
+    Opcode::Symlink,
+    Opcode::Mknod,
+    Opcode::Mkdir,
+    Opcode::Unlink,
+    Opcode::Rmdir,
+    Opcode::Rename,
+    Opcode::Link,
+    Opcode::Open,
+    Opcode::Read,
+    Opcode::Write,
+    Opcode::Statfs,
+    Opcode::Release,
+    Opcode::Fsync,
+    Opcode::Setxattr,
+    Opcode::Getxattr,
+    Opcode::Listxattr,
+    Opcode::Removexattr,
+    Opcode::Flush,
+    Opcode::Init,
+    Opcode::Opendir,
+    Opcode::Readdir,
+    Opcode::Releasedir,
+    Opcode::Fsyncdir,
+    Opcode::Getlk,
+    Opcode::Setlk,
+    Opcode::Setlkw,
+    Opcode::Access,
+    Opcode::Create,
+    Opcode::Interrupt,
+    Opcode::Bmap,
+    Opcode::Destroy,
+    Opcode::Ioctl,
+    Opcode::Poll,
+    Opcode::NotifyReply,
+    Opcode::BatchForget,
+    Opcode::Fallocate,
+    Opcode::Readdirplus,
+    Opcode::Rename2,
+    Opcode::Lseek,
+    Opcode::CopyFileRange,
+    Opcode::SetupMapping,
+    Opcode::RemoveMapping,
+];
+
+fn opcode_slot(opcode: u32) -> usize {
+    if (opcode as usize) < NUM_OPCODES {
+        opcode as usize
+    } else {
+        0
+    }
+}
+
+fn bucket(latency_us: u64) -> usize {
+    let bits = (64 - latency_us.leading_zeros()) as usize;
+    if bits < NUM_BUCKETS {
+        bits
+    } else {
+        NUM_BUCKETS - 1
+    }
+}
+
+// The upper bound of the latencies counted in bucket `i`.
+fn bucket_limit(i: usize) -> Duration {
+    Duration::from_micros(1 << i)
+}
+
+#[derive(Default)]
+struct OpcodeStats {
+    requests: AtomicU64,
+    errors: AtomicU64,
+    bytes_in: AtomicU64,
+    bytes_out: AtomicU64,
+    total_us: AtomicU64,
+    max_us: AtomicU64,
+    histogram: [AtomicU64; NUM_BUCKETS],
+}
+
+/// Counters for the requests of a single opcode.
+#[derive(Clone, Debug, Default)]
+pub struct OpcodeSnapshot {
+    /// The FUSE opcode, or 0 for those the server doesn't know of.
+    pub opcode: u32,
+    pub requests: u64,
+    /// Requests that got an error as a reply, or couldn't even be decoded.
+    pub errors: u64,
+    /// Bytes of the requests, headers included.
+    pub bytes_in: u64,
+    /// Bytes of the replies, headers included.
+    pub bytes_out: u64,
+    pub total_latency: Duration,
+    pub max_latency: Duration,
+    /// The number of requests in each latency bucket, as described for `NUM_BUCKETS`.
+    pub histogram: [u64; NUM_BUCKETS],
+}
+
+impl OpcodeSnapshot {
+    /// Returns the name of the opcode.
+    pub fn name(&self) -> String {
+        OPCODES
+            .iter()
+            .find(|op| **op as u32 == self.opcode)
+            .map(|op| format!("{:?}", op))
+            .unwrap_or_else(|| "Unknown".to_string())
+    }
+
+    /// Returns an upper bound of the latency of the fraction `p` of the requests, as told by the
+    /// histogram.
+    pub fn percentile(&self, p: f64) -> Duration {
+        let target = (self.requests as f64 * p).ceil() as u64;
+        let mut seen = 0;
+        for (i, count) in self.histogram.iter().enumerate() {
+            seen += count;
+            if seen >= target && seen > 0 && i < NUM_BUCKETS - 1 {
+                return cmp::min(bucket_limit(i), self.max_latency);
+            }
+        }
+        self.max_latency
+    }
+}
+
+/// The inode a slow request was about.
+#[derive(Clone, Copy, Debug, PartialEq)]
+pub struct SlowInode {
+    pub inode: u64,
+    /// The opcode of the slowest request for the inode.
+    pub opcode: u32,
+    pub latency: Duration,
+}
+
+/// A copy of the statistics of a server at some point in time.
+#[derive(Clone, Debug, Default)]
+pub struct StatsSnapshot {
+    /// The opcodes that have been requested at least once, in numerical order.
+    pub opcodes: Vec<OpcodeSnapshot>,
+    /// The inodes with the slowest requests, the slowest first.
+    pub slowest: Vec<SlowInode>,
+}
+
+impl StatsSnapshot {
+    /// Adds the statistics of `other` to these, as if they had been collected by the same server.
+    pub fn merge(&mut self, other: &StatsSnapshot) {
+        for theirs in other.opcodes.iter() {
+            let pos = self
+                .opcodes
+                .binary_search_by_key(&theirs.opcode, |op| op.opcode);
+            let ours = match pos {
+                Ok(i) => &mut self.opcodes[i],
+                Err(i) => {
+                    self.opcodes.insert(
+                        i,
+                        OpcodeSnapshot {
+                            opcode: theirs.opcode,
+                            ..Default::default()
+                        },
+                    );
+                    &mut self.opcodes[i]
+                }
+            };
+
+            ours.requests += theirs.requests;
+            ours.errors += theirs.errors;
+            ours.bytes_in += theirs.bytes_in;
+            ours.bytes_out += theirs.bytes_out;
+            ours.total_latency += theirs.total_latency;
+            ours.max_latency = cmp::max(ours.max_latency, theirs.max_latency);
+            for (count, other) in ours.histogram.iter_mut().zip(theirs.histogram.iter()) {
+                *count += other;
+            }
+        }
+
+        self.slowest.extend_from_slice(&other.slowest);
+        self.slowest.sort_by(|a, b| b.latency.cmp(&a.latency));
+        self.slowest.truncate(NUM_SLOWEST);
+    }
+}
+
+impl fmt::Display for StatsSnapshot {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        writeln!(
+            f,
+            "{:<14} {:>10} {:>8} {:>12} {:>12} {:>10} {:>10} {:>10} {:>10}",
+            "opcode",
+            "requests",
+            "errors",
+            "bytes in",
+            "bytes out",
+            "avg us",
+            "p50 us",
+            "p99 us",
+            "max us"
+        )?;
+        for op in self.opcodes.iter() {
+            let avg = op.total_latency.as_micros() / u128::from(op.requests.max(1));
+            writeln!(
+                f,
+                "{:<14} {:>10} {:>8} {:>12} {:>12} {:>10} {:>10} {:>10} {:>10}",
+                op.name(),
+                op.requests,
+                op.errors,
+                op.bytes_in,
+                op.bytes_out,
+                avg,
+                op.percentile(0.5).as_micros(),
+                op.percentile(0.99).as_micros(),
+                op.max_latency.as_micros()
+            )?;
+        }
+
+        if !self.slowest.is_empty() {
+            writeln!(f, "slowest inodes:")?;
+        }
+        for slow in self.slowest.iter() {
+            let name = OpcodeSnapshot {
+                opcode: slow.opcode,
+                ..Default::default()
+            }
+            .name();
+            writeln!(
+                f,
+                "  inode {:<10} {:<14} {:>10} us",
+                slow.inode,
+                name,
+                slow.latency.as_micros()
+            )?;
+        }
+
+        Ok(())
+    }
+}
+
+/// Per-opcode counters, latency histograms and the slowest inodes of the requests handled by a
+/// FUSE server.
+///
+/// Recording a request only takes a few relaxed atomic operations, except for those slow enough
+/// to make it into the list of the slowest inodes, so it's always on.
+pub struct Stats {
+    opcodes: Vec<OpcodeStats>,
+    slowest: Mutex<Vec<SlowInode>>,
+    // The latency, in microseconds, a request must exceed to be considered for `slowest`: the
+    // lowest one in there once it's full.
+    slow_threshold_us: AtomicU64,
+}
+
+impl Default for Stats {
+    fn default() -> Self {
+        Stats {
+            opcodes: (0..NUM_OPCODES).map(|_| OpcodeStats::default()).collect(),
+            slowest: Mutex::new(Vec::with_capacity(NUM_SLOWEST + 1)),
+            slow_threshold_us: AtomicU64::new(0),
+        }
+    }
+}
+
+impl Stats {
+    pub fn new() -> Stats {
+        Default::default()
+    }
+
+    /// Accounts a request of `opcode` about `inode`.
+    pub fn record(
+        &self,
+        opcode: u32,
+        inode: u64,
+        bytes_in: usize,
+        bytes_out: usize,
+        error: bool,
+        latency: Duration,
+    ) {
+        let latency_us = latency.as_micros() as u64;
+        let op = &self.opcodes[opcode_slot(opcode)];
+
+        op.requests.fetch_add(1, Ordering::Relaxed);
+        if error {
+            op.errors.fetch_add(1, Ordering::Relaxed);
+        }
+        op.bytes_in.fetch_add(bytes_in as u64, Ordering::Relaxed);
+        op.bytes_out.fetch_add(bytes_out as u64, Ordering::Relaxed);
+        op.total_us.fetch_add(latency_us, Ordering::Relaxed);
+        op.max_us.fetch_max(latency_us, Ordering::Relaxed);
+        op.histogram[bucket(latency_us)].fetch_add(1, Ordering::Relaxed);
+
+        if latency_us > self.slow_threshold_us.load(Ordering::Relaxed) {
+            self.record_slow(SlowInode {
+                inode,
+                opcode,
+                latency,
+            });
+        }
+    }
+
+    fn record_slow(&self, slow: SlowInode) {
+        let mut slowest = self.slowest.lock().unwrap();
+
+        match slowest.iter().position(|s| s.inode == slow.inode) {
+            Some(i) if slowest[i].latency >= slow.latency => return,
+            Some(i) => slowest[i] = slow,
+            None => slowest.push(slow),
+        }
+        slowest.sort_by(|a, b| b.latency.cmp(&a.latency));
+        slowest.truncate(NUM_SLOWEST);
+
+        if slowest.len() == NUM_SLOWEST {
+            let lowest = slowest[NUM_SLOWEST - 1].latency.as_micros() as u64;
+            self.slow_threshold_us.store(lowest, Ordering::Relaxed);
+        }
+    }
+
+    /// Returns a copy of the statistics collected so far.
+    pub fn snapshot(&self) -> StatsSnapshot {
+        let opcodes = self
+            .opcodes
+            .iter()
+            .enumerate()
+            .filter(|(_, op)| op.requests.load(Ordering::Relaxed) != 0)
+            .map(|(opcode, op)| {
+                let mut histogram = [0; NUM_BUCKETS];
+                for (count, bucket) in histogram.iter_mut().zip(op.histogram.iter()) {
+                    *count = bucket.load(Ordering::Relaxed);
+                }
+                OpcodeSnapshot {
+                    opcode: opcode as u32,
+                    requests: op.requests.load(Ordering::Relaxed),
+                    errors: op.errors.load(Ordering::Relaxed),
+                    bytes_in: op.bytes_in.load(Ordering::Relaxed),
+                    bytes_out: op.bytes_out.load(Ordering::Relaxed),
+                    total_latency: Duration::from_micros(op.total_us.load(Ordering::Relaxed)),
+                    max_latency: Duration::from_micros(op.max_us.load(Ordering::Relaxed)),
+                    histogram,
+                }
+            })
+            .collect();
+
+        StatsSnapshot {
+            opcodes,
+            slowest: self.slowest.lock().unwrap().clone(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_histogram() {
+        let stats = Stats::new();
+        for us in [0, 1, 3, 1000, 1 << 40].iter() {
+            stats.record(
+                Opcode::Read as u32,
+                5,
+                80,
+                4096,
+                false,
+                Duration::from_micros(*us),
+            );
+        }
+        stats.record(
+            Opcode::Lookup as u32,
+            1,
+            50,
+            16,
+            true,
+            Duration::from_micros(2),
+        );
+        stats.record(1000, 1, 40, 16, true, Duration::from_micros(2));
+
+        let snapshot = stats.snapshot();
+        assert_eq!(snapshot.opcodes.len(), 3);
+        assert_eq!(snapshot.opcodes[0].name(), "Unknown");
+        assert_eq!(snapshot.opcodes[1].name(), "Lookup");
+        assert_eq!(snapshot.opcodes[1].errors, 1);
+
+        let read = &snapshot.opcodes[2];
+        assert_eq!(read.name(), "Read");
+        assert_eq!(read.requests, 5);
+        assert_eq!(read.bytes_out, 5 * 4096);
+        assert_eq!(&read.histogram[..3], &[1, 1, 1]);
+        assert_eq!(read.histogram[10], 1);
+        assert_eq!(read.histogram[NUM_BUCKETS - 1], 1);
+        assert_eq!(read.percentile(0.5), Duration::from_micros(4));
+        assert_eq!(read.percentile(1.0), Duration::from_micros(1 << 40));
+
+        let mut merged = StatsSnapshot::default();
+        merged.merge(&snapshot);
+        merged.merge(&Stats::new().snapshot());
+        merged.merge(&snapshot);
+        assert_eq!(merged.opcodes.len(), 3);
+        assert_eq!(merged.opcodes[2].requests, 10);
+        assert_eq!(merged.opcodes[2].histogram[10], 2);
+        assert_eq!(merged.opcodes[2].max_latency, read.max_latency);
+    }
+
+    #[test]
+    fn test_slowest() {
+        let stats = Stats::new();
+        for inode in 0..(2 * NUM_SLOWEST as u64) {
+            let latency = Duration::from_micros(inode * 10);
+            stats.record(Opcode::Getattr as u32, inode, 0, 0, false, latency);
+        }
+        // Only the slowest request for each inode is kept.
+        stats.record(
+            Opcode::Read as u32,
+            31,
+            0,
+            0,
+            false,
+            Duration::from_micros(1000),
+        );
+        stats.record(
+            Opcode::Read as u32,
+            30,
+            0,
+            0,
+            false,
+            Duration::from_micros(1),
+        );
+
+        let slowest = stats.snapshot().slowest;
+        assert_eq!(slowest.len(), NUM_SLOWEST);
+        assert_eq!(
+            slowest[0],
+            SlowInode {
+                inode: 31,
+                opcode: Opcode::Read as u32,
+                latency: Duration::from_micros(1000),
+            }
+        );
+        assert_eq!(slowest[1].inode, 30);
+        assert_eq!(slowest[NUM_SLOWEST - 1].inode, NUM_SLOWEST as u64);
+    }
+}
@@ -0,0 +1,211 @@
+//! Capture of the FUSE requests received by a `Server`, so they can be replayed later against any
+//! `FileSystem` without booting a guest.
+//!
+//! A trace file starts with `TRACE_MAGIC`, followed by a record for each request: a
+//! `RecordHeader`, in native byte order, and the request exactly as the guest sent it, starting
+//! with its `InHeader`.
+
+use std::fs::File;
+use std::io::{self, Read, Write};
+use std::path::Path;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+use vm_memory::ByteValued;
+
+use super::fuse::InHeader;
+
+/// The bytes every trace file starts with. The last one is the version of the format.
+pub const TRACE_MAGIC: &[u8; 8] = b"KRUNFST1";
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+struct RecordHeader {
+    // When the request was received, since the trace was started.
+    time_ns: u64,
+    // How long it took to handle it.
+    latency_ns: u64,
+    // Length of the request that follows.
+    in_len: u32,
+    // Bytes the guest made available for the reply.
+    out_len: u32,
+}
+// Safe because it only has data and has no implicit padding.
+unsafe impl ByteValued for RecordHeader {}
+
+/// A request read from a trace.
+#[derive(Clone, Debug)]
+pub struct TraceRecord {
+    /// When the request was received, since the trace was started.
+    pub time: Duration,
+    /// How long it took to handle the request when it was captured.
+    pub latency: Duration,
+    /// Bytes the guest made available for the reply.
+    pub out_len: u32,
+    /// The request, starting with its `InHeader`.
+    pub request: Vec<u8>,
+}
+
+impl TraceRecord {
+    /// Returns the header of the request, or `None` if it's too short to have one.
+    pub fn header(&self) -> Option<InHeader> {
+        let bytes = self.request.get(..std::mem::size_of::<InHeader>())?;
+
+        // Copied, since the request isn't necessarily aligned for it.
+        let mut header = InHeader::default();
+        header.as_mut_slice().copy_from_slice(bytes);
+        Some(header)
+    }
+}
+
+/// Appends the requests received by a server to a trace file.
+pub struct TraceWriter {
+    file: Mutex<File>,
+    start: Instant,
+    // Set after the first error, to stop capturing instead of failing on every request.
+    failed: AtomicBool,
+}
+
+impl TraceWriter {
+    /// Creates a new trace file at `path`, replacing any existing one.
+    pub fn create<P: AsRef<Path>>(path: P) -> io::Result<TraceWriter> {
+        let mut file = File::create(path)?;
+        file.write_all(TRACE_MAGIC)?;
+
+        Ok(TraceWriter {
+            file: Mutex::new(file),
+            start: Instant::now(),
+            failed: AtomicBool::new(false),
+        })
+    }
+
+    /// Records `request`, received at `received` and handled in `latency`, for which the guest
+    /// offered `out_len` bytes for the reply.
+    pub fn record(
+        &self,
+        request: &[u8],
+        out_len: usize,
+        received: Instant,
+        latency: Duration,
+    ) -> io::Result<()> {
+        if self.failed.load(Ordering::Relaxed) {
+            return Ok(());
+        }
+
+        let header = RecordHeader {
+            time_ns: received.saturating_duration_since(self.start).as_nanos() as u64,
+            latency_ns: latency.as_nanos() as u64,
+            in_len: request.len() as u32,
+            out_len: out_len as u32,
+        };
+
+        // A single write per record, so that nothing is lost if the process exits abruptly.
+        let mut buf = Vec::with_capacity(header.as_slice().len() + request.len());
+        buf.extend_from_slice(header.as_slice());
+        buf.extend_from_slice(request);
+
+        let res = self.file.lock().unwrap().write_all(&buf);
+        if res.is_err() {
+            self.failed.store(true, Ordering::Relaxed);
+        }
+        res
+    }
+}
+
+/// Reads the requests of a trace file, in the order they were received.
+pub struct TraceReader<R: Read> {
+    r: R,
+}
+
+impl<R: Read> TraceReader<R> {
+    /// Checks that `r` starts like a trace file and returns a reader for its records.
+    pub fn new(mut r: R) -> io::Result<TraceReader<R>> {
+        let mut magic = [0u8; 8];
+        r.read_exact(&mut magic)?;
+        if &magic != TRACE_MAGIC {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "not a FUSE request trace",
+            ));
+        }
+
+        Ok(TraceReader { r })
+    }
+
+    fn read_record(&mut self) -> io::Result<Option<TraceRecord>> {
+        let mut header = RecordHeader::default();
+        match self.r.read_exact(header.as_mut_slice()) {
+            Ok(()) => {}
+            Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => return Ok(None),
+            Err(e) => return Err(e),
+        }
+
+        let mut request = vec![0u8; header.in_len as usize];
+        self.r.read_exact(&mut request)?;
+
+        Ok(Some(TraceRecord {
+            time: Duration::from_nanos(header.time_ns),
+            latency: Duration::from_nanos(header.latency_ns),
+            out_len: header.out_len,
+            request,
+        }))
+    }
+}
+
+impl<R: Read> Iterator for TraceReader<R> {
+    type Item = io::Result<TraceRecord>;
+
+    fn next(&mut self) -> Option<Self::Item> {
+        self.read_record().transpose()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::env;
+    use std::fs;
+
+    use super::super::fuse::Opcode;
+
+    #[test]
+    fn test_trace_roundtrip() {
+        let path = env::temp_dir().join(format!("fs-trace-test-{}", std::process::id()));
+        let trace = TraceWriter::create(&path).unwrap();
+
+        let in_header = InHeader {
+            len: (std::mem::size_of::<InHeader>() + 2) as u32,
+            opcode: Opcode::Lookup as u32,
+            unique: 7,
+            nodeid: 1,
+            ..Default::default()
+        };
+        let mut request = in_header.as_slice().to_vec();
+        request.extend_from_slice(b"a\0");
+
+        let now = Instant::now();
+        trace
+            .record(&request, 144, now, Duration::from_micros(3))
+            .unwrap();
+        trace
+            .record(&request[..4], 0, now, Duration::from_micros(5))
+            .unwrap();
+
+        let records: Vec<TraceRecord> = TraceReader::new(File::open(&path).unwrap())
+            .unwrap()
+            .collect::<io::Result<_>>()
+            .unwrap();
+        fs::remove_file(&path).unwrap();
+
+        assert_eq!(records.len(), 2);
+        assert_eq!(records[0].request, request);
+        assert_eq!(records[0].out_len, 144);
+        assert_eq!(records[0].latency, Duration::from_micros(3));
+        let header = records[0].header().unwrap();
+        assert_eq!(header.opcode, Opcode::Lookup as u32);
+        assert_eq!(header.unique, 7);
+        assert!(records[1].header().is_none());
+    }
+}
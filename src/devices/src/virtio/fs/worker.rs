@@ -0,0 +1,259 @@
+//! Helper thread for the FUSE requests that wait for the disk (i.e. fsync, fsyncdir, flush and
+//! fallocate). The device shares its event loop with the rest of the VM, so these are handed to
+//! the worker instead of being handled in place, and the worker reports them back to the event
+//! loop once done, to be added to the used ring of the queue they came from.
+
+use std::io;
+use std::sync::mpsc::{channel, Sender};
+use std::sync::{Arc, Mutex};
+use std::thread;
+
+use utils::eventfd::EventFd;
+use vm_memory::{GuestAddress, GuestMemoryMmap};
+
+use super::descriptor_utils::{Reader, Writer};
+use super::fuse::{InHeader, Opcode};
+use crate::virtio::queue::DescriptorChain;
+
+/// Returns whether the request read by `r` is one that should be handed to the worker.
+pub(crate) fn is_sync_request(r: &Reader) -> bool {
+    // The reader is cloned so the request is left untouched for the server.
+    let in_header: InHeader = match r.clone().read_obj() {
+        Ok(in_header) => in_header,
+        Err(_) => return false,
+    };
+
+    let opcode = in_header.opcode;
+    opcode == Opcode::Fsync as u32
+        || opcode == Opcode::Fsyncdir as u32
+        || opcode == Opcode::Flush as u32
+        || opcode == Opcode::Fallocate as u32
+}
+
+// Rebuilds the descriptor chain of `req` and passes it to `handler`.
+fn handle_request<F>(mem: &GuestMemoryMmap, req: &SyncRequest, handler: &F) -> usize
+where
+    F: Fn(Reader, Writer) -> usize,
+{
+    let head =
+        match DescriptorChain::checked_new(mem, req.desc_table, req.queue_size, req.head_index) {
+            Some(head) => head,
+            None => {
+                error!("fs sync: invalid descriptor: {}", req.head_index);
+                return 0;
+            }
+        };
+
+    match (Reader::new(mem, head.clone()), Writer::new(mem, head)) {
+        (Ok(reader), Ok(writer)) => handler(reader, writer),
+        (Err(e), _) | (_, Err(e)) => {
+            error!("fs sync: invalid descriptor chain: {:?}", e);
+            0
+        }
+    }
+}
+
+/// A request handed to the worker, as the head of its descriptor chain.
+pub(crate) struct SyncRequest {
+    pub queue_index: usize,
+    pub desc_table: GuestAddress,
+    pub queue_size: u16,
+    pub head_index: u16,
+}
+
+/// A request the worker is done with, to be returned to the driver.
+pub(crate) struct SyncCompletion {
+    pub queue_index: usize,
+    pub head_index: u16,
+    pub len: u32,
+}
+
+pub(crate) struct SyncWorker {
+    requests: Sender<SyncRequest>,
+    completions: Arc<Mutex<Vec<SyncCompletion>>>,
+    // Signaled every time a request is completed.
+    evt: EventFd,
+}
+
+impl SyncWorker {
+    /// Spawns the worker thread, which passes the requests it gets to `handler` and returns the
+    /// number of bytes written in reply.
+    pub fn start<F>(mem: GuestMemoryMmap, handler: F) -> io::Result<SyncWorker>
+    where
+        F: Fn(Reader, Writer) -> usize + Send + 'static,
+    {
+        let (requests, receiver) = channel::<SyncRequest>();
+        let completions = Arc::new(Mutex::new(Vec::new()));
+        let evt = EventFd::new(utils::eventfd::EFD_NONBLOCK)?;
+
+        let worker_completions = completions.clone();
+        let worker_evt = evt.try_clone()?;
+        thread::Builder::new()
+            .name("fs sync".into())
+            .spawn(move || {
+                // Ends when the device, and with it the sending end, is gone.
+                for req in receiver.iter() {
+                    let len = handle_request(&mem, &req, &handler);
+                    worker_completions.lock().unwrap().push(SyncCompletion {
+                        queue_index: req.queue_index,
+                        head_index: req.head_index,
+                        len: len as u32,
+                    });
+                    if let Err(e) = worker_evt.write(1) {
+                        error!("fs sync: failed to signal completion: {:?}", e);
+                    }
+                }
+            })?;
+
+        Ok(SyncWorker {
+            requests,
+            completions,
+            evt,
+        })
+    }
+
+    /// Hands `req` to the worker. Returns it back if the worker is gone.
+    pub fn submit(&self, req: SyncRequest) -> Result<(), SyncRequest> {
+        self.requests.send(req).map_err(|e| e.0)
+    }
+
+    pub fn evt(&self) -> &EventFd {
+        &self.evt
+    }
+
+    /// Takes the requests completed since the last call.
+    pub fn take_completions(&self) -> Vec<SyncCompletion> {
+        std::mem::take(&mut *self.completions.lock().unwrap())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::io::Write;
+    use std::mem::size_of;
+    use std::time::Duration;
+
+    use vm_memory::{ByteValued, Bytes};
+
+    use super::super::descriptor_utils::{create_descriptor_chain, DescriptorType};
+    use super::super::fuse::OutHeader;
+
+    fn request_reader(mem: &GuestMemoryMmap, opcode: Opcode) -> Reader {
+        let in_header = InHeader {
+            len: std::mem::size_of::<InHeader>() as u32,
+            opcode: opcode as u32,
+            ..Default::default()
+        };
+        mem.write_slice(in_header.as_slice(), GuestAddress(0x1000))
+            .unwrap();
+
+        let chain = create_descriptor_chain(
+            mem,
+            GuestAddress(0),
+            GuestAddress(0x1000),
+            vec![(DescriptorType::Readable, in_header.len)],
+            0,
+        )
+        .unwrap();
+        Reader::new(mem, chain).unwrap()
+    }
+
+    #[test]
+    fn test_is_sync_request() {
+        let mem = GuestMemoryMmap::from_ranges(&[(GuestAddress(0), 0x2000)]).unwrap();
+
+        for opcode in [
+            Opcode::Fsync,
+            Opcode::Fsyncdir,
+            Opcode::Flush,
+            Opcode::Fallocate,
+        ] {
+            let reader = request_reader(&mem, opcode);
+            assert!(is_sync_request(&reader));
+            // The request is still there for the server.
+            assert_eq!(reader.available_bytes(), std::mem::size_of::<InHeader>());
+        }
+        for opcode in [Opcode::Lookup, Opcode::Read, Opcode::Write] {
+            assert!(!is_sync_request(&request_reader(&mem, opcode)));
+        }
+    }
+
+    // Waits for the worker to complete a request, and takes the completions.
+    fn wait_completions(worker: &SyncWorker) -> Vec<SyncCompletion> {
+        for _ in 0..1000 {
+            if worker.evt().read().is_ok() {
+                return worker.take_completions();
+            }
+            thread::sleep(Duration::from_millis(5));
+        }
+        panic!("the worker didn't complete the request");
+    }
+
+    #[test]
+    fn test_sync_worker() {
+        let mem = GuestMemoryMmap::from_ranges(&[(GuestAddress(0), 0x2000)]).unwrap();
+        let in_header = InHeader {
+            len: size_of::<InHeader>() as u32,
+            opcode: Opcode::Fsync as u32,
+            unique: 7,
+            ..Default::default()
+        };
+        mem.write_obj(in_header, GuestAddress(0x1000)).unwrap();
+        create_descriptor_chain(
+            &mem,
+            GuestAddress(0),
+            GuestAddress(0x1000),
+            vec![
+                (DescriptorType::Readable, in_header.len),
+                (DescriptorType::Writable, 0x100),
+            ],
+            0,
+        )
+        .unwrap();
+
+        // Replies with just the header, like the server does for fsync.
+        let worker = SyncWorker::start(mem.clone(), |mut r, mut w| {
+            let in_header: InHeader = r.read_obj().unwrap();
+            let out_header = OutHeader {
+                len: size_of::<OutHeader>() as u32,
+                error: 0,
+                unique: in_header.unique,
+            };
+            w.write_all(out_header.as_slice()).unwrap();
+            w.bytes_written()
+        })
+        .unwrap();
+
+        let req = SyncRequest {
+            queue_index: 1,
+            desc_table: GuestAddress(0),
+            queue_size: 0x100,
+            head_index: 0,
+        };
+        assert!(worker.submit(req).is_ok());
+        let completions = wait_completions(&worker);
+        assert_eq!(completions.len(), 1);
+        assert_eq!(completions[0].queue_index, 1);
+        assert_eq!(completions[0].head_index, 0);
+        assert_eq!(completions[0].len as usize, size_of::<OutHeader>());
+
+        let reply_addr = GuestAddress(0x1000 + u64::from(in_header.len));
+        let out_header: OutHeader = mem.read_obj(reply_addr).unwrap();
+        assert_eq!(out_header.unique, 7);
+
+        // A request the worker can't make sense of is still completed, with nothing written.
+        let req = SyncRequest {
+            queue_index: 1,
+            desc_table: GuestAddress(0),
+            queue_size: 0x100,
+            head_index: 0x100,
+        };
+        assert!(worker.submit(req).is_ok());
+        let completions = wait_completions(&worker);
+        assert_eq!(completions.len(), 1);
+        assert_eq!(completions[0].head_index, 0x100);
+        assert_eq!(completions[0].len, 0);
+    }
+}
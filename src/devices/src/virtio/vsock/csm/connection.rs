@@ -78,21 +78,22 @@
 //          2. The receiver can be proactive, and send VSOCK_OP_CREDIT_UPDATE packet, whenever
 //             it thinks its peer's information is out of date.
 //          Our implementation uses the proactive approach.
-use std::io::{ErrorKind, Read, Write};
+use std::io::{ErrorKind, IoSlice, Read, Write};
 use std::net::Shutdown;
 use std::num::Wrapping;
 use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::Arc;
 use std::time::{Duration, Instant};
 
 use utils::epoll::EventSet;
 
-use libc::{getpeername, sockaddr, socklen_t};
+use libc::{c_int, c_void, getpeername, getsockopt, sockaddr, socklen_t};
 
 use super::super::defs::uapi;
 use super::super::packet::VsockPacket;
 use super::super::{Result as VsockResult, VsockChannel, VsockEpollListener, VsockError};
 use super::defs;
-use super::txbuf::TxBuf;
+use super::txbuf::{TxBudget, TxBuf};
 use super::{CommonStream, ConnState, Error, PendingRx, PendingRxSet, Result};
 
 /// A self-managing connection object, that handles communication between a guest-side AF_VSOCK
@@ -110,11 +111,23 @@ pub struct VsockConnection {
     peer_port: u32,
     /// The (connected) host-side stream.
     stream: Box<dyn CommonStream>,
-    /// The TX buffer for this connection.
+    /// The TX buffer for this connection, whose memory is taken out of the (global) TX budget.
     tx_buf: TxBuf,
     /// Total number of bytes that have been successfully written to `self.stream`, either
     /// directly, or flushed from `self.tx_buf`.
     fwd_cnt: Wrapping<u32>,
+    /// The buffer space we advertise to the peer, i.e. our window. It starts out at
+    /// `defs::CONN_TX_BUF_SIZE`, grows while the peer is starved for credit, and shrinks back
+    /// once the connection goes idle.
+    buf_alloc: u32,
+    /// The furthest the peer may send data to (in terms of `self.fwd_cnt`), given all the
+    /// credit we've advertised so far. This bounds the data we may have to buffer.
+    tx_limit: Wrapping<u32>,
+    /// Instant when we'll check whether the connection has gone idle, in which case its window
+    /// is shrunk back, and the memory of its TX buffer released.
+    tx_idle_check: Option<Instant>,
+    /// The total number of bytes received from the peer, as of the last idle check.
+    tx_idle_cnt: Wrapping<u32>,
     /// The amount of buffer space that the peer (guest) has allocated for this connection.
     peer_buf_alloc: u32,
     /// The total number of bytes that the peer has forwarded away.
@@ -127,9 +140,15 @@ pub struct VsockConnection {
     /// The set of pending RX packet indications that `recv_pkt()` will use to fill in a
     /// packet for the peer (guest).
     pending_rx: PendingRxSet,
+    /// The RX indications held back while in the `PeerConnecting` state, i.e. the response to
+    /// the peer's connection request.
+    connect_rx: PendingRxSet,
     /// Instant when this connection should be scheduled for immediate termination, due to some
     /// timeout condition having been fulfilled.
     expiry: Option<Instant>,
+    /// Instant when we'll ask the peer for credit again, if it still hasn't granted us any
+    /// since our last credit request.
+    credit_request_retry: Option<Instant>,
 }
 
 impl VsockChannel for VsockConnection {
@@ -224,6 +243,12 @@ impl VsockChannel for VsockConnection {
             return Ok(());
         }
 
+        // Our previous credit request went unanswered, so we're asking again.
+        if self.pending_rx.remove(PendingRx::CreditRequest) {
+            self.request_credit(pkt);
+            return Ok(());
+        }
+
         // A credit update is basically a no-op, so we should only waste a perfectly fine RX
         // buffer on it if we really have nothing else to say.
         if self.pending_rx.remove(PendingRx::CreditUpdate) && !self.has_pending_rx() {
@@ -253,19 +278,21 @@ impl VsockChannel for VsockConnection {
         // Oh wait, before we start bringing in the big data, can our peer handle receiving so
         // much bytey goodness?
         if self.need_credit_update_from_peer() {
-            self.last_fwd_cnt_to_peer = self.fwd_cnt;
-            pkt.set_op(uapi::VSOCK_OP_CREDIT_REQUEST);
+            self.request_credit(pkt);
             return Ok(());
         }
 
-        let buf = pkt.buf_mut().ok_or(VsockError::PktBufMissing)?;
+        if pkt.buf().is_none() {
+            return Err(VsockError::PktBufMissing);
+        }
 
         // The maximum amount of data we can read in is limited by both the RX buffer size and
         // the peer available buffer space.
-        let max_len = std::cmp::min(buf.len(), self.peer_avail_credit());
+        let max_len = std::cmp::min(pkt.buf_len(), self.peer_avail_credit());
 
-        // Read data from the stream straight to the RX buffer, for maximum throughput.
-        match self.stream.read(&mut buf[..max_len]) {
+        // Read data from the stream straight to the RX buffer (which may span several
+        // descriptors), for maximum throughput.
+        match self.stream.read_vectored(&mut pkt.bufs_mut(max_len)) {
             Ok(read_cnt) => {
                 if read_cnt == 0 {
                     // A 0-length read means the host stream was closed down. In that case,
@@ -280,8 +307,10 @@ impl VsockChannel for VsockConnection {
                         .set_flag(uapi::VSOCK_FLAGS_SHUTDOWN_SEND);
                 } else {
                     // On a successful data read, we fill in the packet with the RW op, and
-                    // length of the read data.
+                    // length of the read data. The packet also lets the peer know about our
+                    // current credit.
                     pkt.set_op(uapi::VSOCK_OP_RW).set_len(read_cnt as u32);
+                    self.last_fwd_cnt_to_peer = self.fwd_cnt;
                 }
             }
             Err(err) => {
@@ -309,9 +338,7 @@ impl VsockChannel for VsockConnection {
     /// Returns:
     /// always `Ok(())`: the packet has been consumed;
     fn send_pkt(&mut self, pkt: &VsockPacket) -> VsockResult<()> {
-        // Update the peer credit information.
-        self.peer_buf_alloc = pkt.buf_alloc();
-        self.peer_fwd_cnt = Wrapping(pkt.fwd_cnt());
+        self.update_peer_credit(pkt);
 
         match self.state {
             // Most frequent case: this is an established connection that needs to forward some
@@ -347,6 +374,7 @@ impl VsockChannel for VsockConnection {
                 if self.peer_needs_credit_update() {
                     self.pending_rx.insert(PendingRx::CreditUpdate);
                 }
+                self.tune_window();
             }
 
             // Next up: receiving a response / confirmation for a host-initiated connection.
@@ -430,6 +458,56 @@ impl VsockChannel for VsockConnection {
         Ok(())
     }
 
+    /// Deliver a batch of guest-generated packets to this connection.
+    ///
+    /// When the batch only holds data (RW) packets, and the connection can still forward data
+    /// to the host stream, all their data is written with a single vectored write, instead of a
+    /// write per packet. Any other batch is handled one packet at a time.
+    ///
+    /// Returns:
+    /// always the size of the batch: all the packets have been consumed.
+    fn send_pkts(&mut self, pkts: &[VsockPacket]) -> usize {
+        let data_only = matches!(
+            self.state,
+            ConnState::Established | ConnState::PeerClosed(_, false)
+        ) && pkts
+            .iter()
+            .all(|pkt| pkt.op() == uapi::VSOCK_OP_RW && pkt.buf().is_some());
+        let last = match pkts.last() {
+            Some(pkt) if data_only => pkt,
+            _ => {
+                for pkt in pkts {
+                    // This never fails.
+                    let _ = self.send_pkt(pkt);
+                }
+                return pkts.len();
+            }
+        };
+
+        // The last packet has the most recent credit information.
+        self.update_peer_credit(last);
+
+        // Unwrapping here is safe, since we just checked `pkt.buf()` above.
+        let bufs: Vec<&[u8]> = pkts
+            .iter()
+            .map(|pkt| &pkt.buf().unwrap()[..(pkt.len() as usize)])
+            .collect();
+        if let Err(err) = self.send_bytes_vectored(&bufs) {
+            warn!(
+                "vsock: error writing to local stream (lp={}, pp={}): {:?}",
+                self.local_port, self.peer_port, err
+            );
+            self.kill();
+            return pkts.len();
+        }
+
+        if self.peer_needs_credit_update() {
+            self.pending_rx.insert(PendingRx::CreditUpdate);
+        }
+        self.tune_window();
+        pkts.len()
+    }
+
     /// Check if the connection has any pending packet addressed to the peer.
     fn has_pending_rx(&self) -> bool {
         !self.pending_rx.is_empty()
@@ -452,8 +530,15 @@ impl VsockEpollListener for VsockConnection {
     /// A connection will want to be notified when:
     /// - data is available to be read from the host stream, so that it can store an RW pending
     ///   RX indication; and
-    /// - data can be written to the host stream, and the TX buffer needs to be flushed.
+    /// - data can be written to the host stream, and the TX buffer needs to be flushed; or
+    /// - the host stream is done connecting.
     fn get_polled_evset(&self) -> EventSet {
+        if self.state == ConnState::PeerConnecting {
+            // A connecting stream is reported writable (or in error) once the connect is
+            // resolved.
+            return EventSet::OUT;
+        }
+
         let mut evset = EventSet::empty();
         if !self.tx_buf.is_empty() {
             // There's data waiting in the TX buffer, so we are interested in being notified
@@ -465,6 +550,8 @@ impl VsockEpollListener for VsockConnection {
         match self.state {
             ConnState::Killed | ConnState::LocalClosed | ConnState::PeerClosed(true, _) => (),
             _ if self.need_credit_update_from_peer() => (),
+            // A data packet is already due, and it will read whatever the stream has by then.
+            _ if self.pending_rx.contains(PendingRx::Rw) => (),
             _ => evset.insert(EventSet::IN),
         }
         evset
@@ -472,6 +559,11 @@ impl VsockEpollListener for VsockConnection {
 
     /// Notify the connection about an event (or set of events) that it was interested in.
     fn notify(&mut self, evset: EventSet) {
+        if self.state == ConnState::PeerConnecting {
+            self.complete_connect(evset);
+            return;
+        }
+
         if evset.contains(EventSet::IN) {
             // Data can be read from the host stream. Setting a Rw pending indication, so that
             // the muxer will know to call `recv_pkt()` later.
@@ -520,6 +612,7 @@ impl VsockConnection {
         local_port: u32,
         peer_port: u32,
         peer_buf_alloc: u32,
+        tx_budget: Arc<TxBudget>,
     ) -> Self {
         Self {
             local_cid,
@@ -528,14 +621,20 @@ impl VsockConnection {
             peer_port,
             stream,
             state: ConnState::PeerInit,
-            tx_buf: TxBuf::new(),
+            tx_buf: TxBuf::new(tx_budget),
             fwd_cnt: Wrapping(0),
+            buf_alloc: defs::CONN_TX_BUF_SIZE as u32,
+            tx_limit: Wrapping(defs::CONN_TX_BUF_SIZE as u32),
+            tx_idle_check: None,
+            tx_idle_cnt: Wrapping(0),
             peer_buf_alloc,
             peer_fwd_cnt: Wrapping(0),
             rx_cnt: Wrapping(0),
             last_fwd_cnt_to_peer: Wrapping(0),
             pending_rx: PendingRxSet::from(PendingRx::Response),
+            connect_rx: PendingRxSet::default(),
             expiry: None,
+            credit_request_retry: None,
         }
     }
 
@@ -547,6 +646,7 @@ impl VsockConnection {
         local_port: u32,
         peer_port: u32,
         peer_buf_alloc: u32,
+        tx_budget: Arc<TxBudget>,
     ) -> Self {
         Self {
             local_cid,
@@ -555,14 +655,20 @@ impl VsockConnection {
             peer_port,
             stream,
             state: ConnState::PeerInit,
-            tx_buf: TxBuf::new(),
+            tx_buf: TxBuf::new(tx_budget),
             fwd_cnt: Wrapping(0),
+            buf_alloc: defs::CONN_TX_BUF_SIZE as u32,
+            tx_limit: Wrapping(defs::CONN_TX_BUF_SIZE as u32),
+            tx_idle_check: None,
+            tx_idle_cnt: Wrapping(0),
             peer_buf_alloc,
             peer_fwd_cnt: Wrapping(0),
             rx_cnt: Wrapping(0),
             last_fwd_cnt_to_peer: Wrapping(0),
             pending_rx: PendingRxSet::from(PendingRx::ResponseEx),
+            connect_rx: PendingRxSet::default(),
             expiry: None,
+            credit_request_retry: None,
         }
     }
 
@@ -573,6 +679,7 @@ impl VsockConnection {
         peer_cid: u64,
         local_port: u32,
         peer_port: u32,
+        tx_budget: Arc<TxBudget>,
     ) -> Self {
         Self {
             local_cid,
@@ -581,24 +688,30 @@ impl VsockConnection {
             peer_port,
             stream,
             state: ConnState::LocalWrapInit,
-            tx_buf: TxBuf::new(),
+            tx_buf: TxBuf::new(tx_budget),
             fwd_cnt: Wrapping(0),
+            buf_alloc: defs::CONN_TX_BUF_SIZE as u32,
+            tx_limit: Wrapping(defs::CONN_TX_BUF_SIZE as u32),
+            tx_idle_check: None,
+            tx_idle_cnt: Wrapping(0),
             peer_buf_alloc: 0,
             peer_fwd_cnt: Wrapping(0),
             rx_cnt: Wrapping(0),
             last_fwd_cnt_to_peer: Wrapping(0),
             pending_rx: PendingRxSet::from(PendingRx::RequestEx),
+            connect_rx: PendingRxSet::default(),
             expiry: None,
+            credit_request_retry: None,
         }
     }
 
-    /// Check if there is an expiry (kill) timer set for this connection, sometime in the
-    /// future.
-    pub fn will_expire(&self) -> bool {
-        match self.expiry {
-            None => false,
-            Some(t) => t > Instant::now(),
-        }
+    /// Hold back the response to a guest-initiated connection until its host-side stream,
+    /// which is still connecting, is connected. The connection is killed if that takes longer
+    /// than `timeout`.
+    pub fn wait_for_connect(&mut self, timeout: Duration) {
+        self.state = ConnState::PeerConnecting;
+        self.connect_rx = std::mem::take(&mut self.pending_rx);
+        self.expiry = Some(Instant::now() + timeout);
     }
 
     /// Check if this connection needs to be scheduled for forceful termination, due to its
@@ -610,9 +723,39 @@ impl VsockConnection {
         }
     }
 
-    /// Get the kill timer value, if one is set.
-    pub fn expiry(&self) -> Option<Instant> {
-        self.expiry
+    /// Get the earliest instant at which `handle_timers()` needs to be called, if any.
+    pub fn next_timer(&self) -> Option<Instant> {
+        [self.expiry, self.credit_request_retry, self.tx_idle_check]
+            .iter()
+            .flatten()
+            .min()
+            .copied()
+    }
+
+    /// Handle the timers that are due: kill the connection if its kill timer has expired, ask
+    /// the peer for credit again, if it still hasn't granted us any, or shrink the window of an
+    /// idle connection.
+    pub fn handle_timers(&mut self) {
+        if self.has_expired() {
+            self.kill();
+            return;
+        }
+
+        let now = Instant::now();
+        if matches!(self.credit_request_retry, Some(t) if t <= now) {
+            self.credit_request_retry = None;
+            match self.state {
+                ConnState::Established | ConnState::PeerClosed(false, _)
+                    if self.need_credit_update_from_peer() =>
+                {
+                    self.pending_rx.insert(PendingRx::CreditRequest);
+                }
+                _ => (),
+            }
+        }
+        if matches!(self.tx_idle_check, Some(t) if t <= now) {
+            self.check_tx_idle(now);
+        }
     }
 
     /// Schedule the connection to be forcefully terminated ASAP (i.e. the next time the
@@ -627,16 +770,24 @@ impl VsockConnection {
     /// Raw data can either be sent straight to the host stream, or to our TX buffer, if the
     /// former fails.
     pub fn send_bytes(&mut self, buf: &[u8]) -> Result<()> {
+        self.send_bytes_vectored(&[buf])
+    }
+
+    /// Send some raw data, gathered from several byte-slices, to the host stream, in a single
+    /// (vectored) write. Just like with `send_bytes()`, whatever can't be written right away
+    /// goes to our TX buffer.
+    pub fn send_bytes_vectored(&mut self, bufs: &[&[u8]]) -> Result<()> {
         // If there is data in the TX buffer, that means we're already registered for EPOLLOUT
         // events on the underlying stream. Therefore, there's no point in attempting a write
         // at this point. `self.notify()` will get called when EPOLLOUT arrives, and it will
         // attempt to drain the TX buffer then.
         if !self.tx_buf.is_empty() {
-            return self.tx_buf.push(buf);
+            return bufs.iter().try_for_each(|buf| self.buffer_bytes(buf));
         }
 
         // The TX buffer is empty, so we can try to write straight to the host stream.
-        let written = match self.stream.write(buf) {
+        let iovs: Vec<IoSlice> = bufs.iter().map(|buf| IoSlice::new(buf)).collect();
+        let mut written = match self.stream.write_vectored(&iovs) {
             Ok(cnt) => cnt,
             Err(e) => {
                 // Absorb any would-block errors, since we can always try again later.
@@ -652,23 +803,175 @@ impl VsockConnection {
         // Move the "forwarded bytes" counter ahead by how much we were able to send out.
         self.fwd_cnt += Wrapping(written as u32);
 
-        // If we couldn't write the whole slice, we'll need to push the remaining data to our
+        // If we couldn't write all the slices, we'll need to push the remaining data to our
         // buffer.
-        if written < buf.len() {
-            self.tx_buf.push(&buf[written..])?;
+        for buf in bufs {
+            if written >= buf.len() {
+                written -= buf.len();
+                continue;
+            }
+            self.buffer_bytes(&buf[written..])?;
+            written = 0;
         }
 
         Ok(())
     }
 
+    /// Push some data to our TX buffer. The peer isn't supposed to send more data than we've
+    /// given it credit for, so that's all the buffer may hold, as long as the TX budget can
+    /// cover its memory.
+    fn buffer_bytes(&mut self, buf: &[u8]) -> Result<()> {
+        let credit = std::cmp::max((self.tx_limit - self.fwd_cnt).0 as i32, 0) as usize;
+        if self.tx_buf.len() + buf.len() > credit {
+            return Err(Error::TxBufFull);
+        }
+        self.tx_buf.push(buf)
+    }
+
     /// Return the connections state.
     pub fn state(&self) -> ConnState {
         self.state
     }
 
-    /// Check if the credit information the peer has last received from us is outdated.
+    /// Resolve the connect of the host-side stream, after being notified about `evset` on it.
+    /// Once connected, the response held back by `wait_for_connect()` is sent to the peer. If
+    /// the connect failed, the connection is reset instead.
+    fn complete_connect(&mut self, evset: EventSet) {
+        let mut err: c_int = 0;
+        let mut len = std::mem::size_of::<c_int>() as socklen_t;
+        // Safe because we provide a valid buffer, of the length we pass along, and check the
+        // return value.
+        let ret = unsafe {
+            getsockopt(
+                self.stream.as_raw_fd(),
+                libc::SOL_SOCKET,
+                libc::SO_ERROR,
+                &mut err as *mut c_int as *mut c_void,
+                &mut len,
+            )
+        };
+        let res = if ret < 0 {
+            Err(std::io::Error::last_os_error())
+        } else if err != 0 {
+            Err(std::io::Error::from_raw_os_error(err))
+        } else {
+            Ok(evset.contains(EventSet::OUT))
+        };
+
+        match res {
+            Ok(true) => {
+                self.state = ConnState::PeerInit;
+                self.expiry = None;
+                self.pending_rx = std::mem::take(&mut self.connect_rx);
+            }
+            // Nothing to do until the stream is writable.
+            Ok(false) => (),
+            Err(err) => {
+                info!(
+                    "vsock: unable to connect (lp={}, pp={}): {}",
+                    self.local_port, self.peer_port, err
+                );
+                self.kill();
+            }
+        }
+    }
+
+    /// Check if the credit information the peer has last received from us is outdated, i.e. if
+    /// the peer thinks it has filled three quarters of our window.
     fn peer_needs_credit_update(&self) -> bool {
-        (self.fwd_cnt - self.last_fwd_cnt_to_peer).0 as usize >= defs::CONN_CREDIT_UPDATE_THRESHOLD
+        (self.fwd_cnt - self.last_fwd_cnt_to_peer).0 >= self.buf_alloc - self.buf_alloc / 4
+    }
+
+    /// Get the total number of bytes received from the peer.
+    fn peer_tx_cnt(&self) -> Wrapping<u32> {
+        self.fwd_cnt + Wrapping(self.tx_buf.len() as u32)
+    }
+
+    /// Grow our window, if the peer has used up all the credit it knows of while we kept up with
+    /// forwarding its data to the host stream: what holds it back is then the round trip of our
+    /// credit updates, not the host. The TX buffer takes what the grown window may make it
+    /// buffer out of the (global) TX budget up front, so the peer's credit can always be honored.
+    fn tune_window(&mut self) {
+        let starved = self.tx_buf.is_empty()
+            && (self.peer_tx_cnt() - self.last_fwd_cnt_to_peer).0 >= self.buf_alloc;
+        if starved && (self.buf_alloc as usize) < defs::CONN_TX_BUF_MAX_SIZE {
+            let grow = std::cmp::min(
+                self.buf_alloc as usize,
+                defs::CONN_TX_BUF_MAX_SIZE - self.buf_alloc as usize,
+            );
+            // The buffer may still hold some of the budget from before the window last shrank.
+            if self.tx_buf.reserve(self.buf_alloc as usize + grow) {
+                self.buf_alloc += grow as u32;
+                // Let the peer know about its new credit right away.
+                self.pending_rx.insert(PendingRx::CreditUpdate);
+            }
+        }
+
+        if self.tx_idle_check.is_none() && self.holds_tx_memory() {
+            self.tx_idle_cnt = self.peer_tx_cnt();
+            self.tx_idle_check =
+                Some(Instant::now() + Duration::from_millis(defs::CONN_TX_BUF_IDLE_MS));
+        }
+    }
+
+    /// Check if the TX buffer of this connection holds some of the TX budget, which it does
+    /// for as long as it's allocated.
+    fn holds_tx_memory(&self) -> bool {
+        self.tx_buf.reserved() > 0
+    }
+
+    /// Shrink our window back to `defs::CONN_TX_BUF_SIZE`, and release the memory of the TX
+    /// buffer, if the peer hasn't sent any data since the last check. Otherwise, check again
+    /// later. The credit we've already advertised still holds (see `self.tx_limit`), so the
+    /// window only goes back to the TX budget once it's no longer needed to cover it.
+    fn check_tx_idle(&mut self, now: Instant) {
+        let tx_cnt = self.peer_tx_cnt();
+        if tx_cnt == self.tx_idle_cnt {
+            self.buf_alloc = defs::CONN_TX_BUF_SIZE as u32;
+            self.tx_buf.release();
+        }
+        self.release_tx_budget();
+
+        self.tx_idle_cnt = tx_cnt;
+        self.tx_idle_check = if self.holds_tx_memory() {
+            Some(now + Duration::from_millis(defs::CONN_TX_BUF_IDLE_MS))
+        } else {
+            None
+        };
+    }
+
+    /// Give back the TX budget the TX buffer holds beyond its memory, once our window has
+    /// shrunk, the TX buffer is empty, and the peer can't send us more than
+    /// `defs::CONN_TX_BUF_SIZE` bytes with the credit it's been given. Until then, the peer may
+    /// still make us buffer more than that. Buffering up to `defs::CONN_TX_BUF_SIZE` bytes
+    /// again takes the memory out of the budget as the buffer grows, and fails if there isn't
+    /// enough left.
+    fn release_tx_budget(&mut self) {
+        if self.buf_alloc as usize == defs::CONN_TX_BUF_SIZE
+            && self.tx_buf.is_empty()
+            && (self.tx_limit - self.fwd_cnt).0 as usize <= defs::CONN_TX_BUF_SIZE
+        {
+            self.tx_buf.unreserve();
+        }
+    }
+
+    /// Update our view of the peer's buffer space, with the credit information in `pkt`.
+    fn update_peer_credit(&mut self, pkt: &VsockPacket) {
+        self.peer_buf_alloc = pkt.buf_alloc();
+        self.peer_fwd_cnt = Wrapping(pkt.fwd_cnt());
+        if !self.need_credit_update_from_peer() {
+            // We don't need to ask for credit anymore.
+            self.credit_request_retry = None;
+            self.pending_rx.remove(PendingRx::CreditRequest);
+        }
+    }
+
+    /// Fill in a credit request packet, and arm the timer for asking again.
+    fn request_credit(&mut self, pkt: &mut VsockPacket) {
+        self.last_fwd_cnt_to_peer = self.fwd_cnt;
+        self.credit_request_retry =
+            Some(Instant::now() + Duration::from_millis(defs::CONN_CREDIT_REQUEST_RETRY_MS));
+        pkt.set_op(uapi::VSOCK_OP_CREDIT_REQUEST);
     }
 
     /// Check if we need to ask the peer for a credit update before sending any more data its
@@ -684,7 +987,13 @@ impl VsockConnection {
     }
 
     /// Prepare a packet header for transmission to our peer.
-    fn init_pkt<'a>(&self, pkt: &'a mut VsockPacket) -> &'a mut VsockPacket {
+    fn init_pkt<'a>(&mut self, pkt: &'a mut VsockPacket) -> &'a mut VsockPacket {
+        // The peer may send data up to the end of the window we're about to advertise.
+        let limit = self.fwd_cnt + Wrapping(self.buf_alloc);
+        if (limit - self.tx_limit).0 as i32 > 0 {
+            self.tx_limit = limit;
+        }
+
         // Make sure the header is zeroed-out first.
         // This looks sub-optimal, but it is actually optimized-out in the compiled code to be
         // faster than a memset().
@@ -697,7 +1006,7 @@ impl VsockConnection {
             .set_src_port(self.local_port)
             .set_dst_port(self.peer_port)
             .set_type(uapi::VSOCK_TYPE_STREAM)
-            .set_buf_alloc(defs::CONN_TX_BUF_SIZE as u32)
+            .set_buf_alloc(self.buf_alloc)
             .set_fwd_cnt(self.fwd_cnt.0)
     }
 }
@@ -715,6 +1024,7 @@ mod tests {
     use super::super::defs as csm_defs;
     use super::*;
 
+    use crate::virtio::vsock::defs::DEFAULT_MAX_PKT_BUF_SIZE;
     use crate::virtio::vsock::device::RXQ_INDEX;
 
     const LOCAL_CID: u64 = 2;
@@ -722,6 +1032,7 @@ mod tests {
     const LOCAL_PORT: u32 = 1002;
     const PEER_PORT: u32 = 1003;
     const PEER_BUF_ALLOC: u32 = 64 * 1024;
+    const TX_BUDGET: usize = 4 * 64 * 1024;
 
     enum StreamState {
         Closed,
@@ -834,6 +1145,7 @@ mod tests {
         _vsock_test_ctx: TestContext,
         pkt: VsockPacket,
         conn: VsockConnection,
+        tx_budget: Arc<TxBudget>,
     }
 
     impl CsmTestContext {
@@ -849,8 +1161,10 @@ mod tests {
                 &handler_ctx.device.queues[RXQ_INDEX]
                     .pop(&vsock_test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             )
             .unwrap();
+            let tx_budget = Arc::new(TxBudget::new(TX_BUDGET));
             let conn = match conn_state {
                 ConnState::PeerInit => VsockConnection::new_peer_wrap_init(
                     Box::new(stream),
@@ -859,6 +1173,7 @@ mod tests {
                     LOCAL_PORT,
                     PEER_PORT,
                     PEER_BUF_ALLOC,
+                    tx_budget.clone(),
                 ),
                 ConnState::Established => {
                     let mut conn = VsockConnection::new_peer_init(
@@ -868,6 +1183,7 @@ mod tests {
                         LOCAL_PORT,
                         PEER_PORT,
                         PEER_BUF_ALLOC,
+                        tx_budget.clone(),
                     );
                     assert!(conn.has_pending_rx());
                     conn.recv_pkt(&mut pkt).unwrap();
@@ -881,6 +1197,7 @@ mod tests {
                 _vsock_test_ctx: vsock_test_ctx,
                 pkt,
                 conn,
+                tx_budget,
             }
         }
 
@@ -931,8 +1248,11 @@ mod tests {
         ctx.set_stream(TestStream::new_with_read_buf(data));
         assert_eq!(ctx.conn.as_raw_fd(), ctx.conn.stream.as_raw_fd());
         ctx.notify_epollin();
+        // There's no point in polling the stream again until the data is read.
+        assert!(!ctx.conn.get_polled_evset().contains(EventSet::IN));
         ctx.recv();
         assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RW);
+        assert!(ctx.conn.get_polled_evset().contains(EventSet::IN));
         assert_eq!(ctx.pkt.len() as usize, data.len());
         assert_eq!(ctx.pkt.buf().unwrap()[..ctx.pkt.len() as usize], *data);
 
@@ -949,6 +1269,28 @@ mod tests {
         assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RST);
     }
 
+    #[test]
+    fn test_peer_connecting() {
+        let mut ctx = CsmTestContext::new(ConnState::PeerInit);
+        ctx.conn.wait_for_connect(Duration::from_millis(1));
+
+        // Nothing is sent to the peer until the stream is connected, and it's only polled for
+        // the connect to be resolved.
+        assert_eq!(ctx.conn.state, ConnState::PeerConnecting);
+        assert!(!ctx.conn.has_pending_rx());
+        assert_eq!(ctx.conn.get_polled_evset(), EventSet::OUT);
+        assert!(ctx.conn.next_timer().is_some());
+        std::thread::sleep(Duration::from_millis(2));
+        assert!(ctx.conn.has_expired());
+
+        // The test stream isn't a socket, so its connect can't be resolved, and the connection
+        // gets reset.
+        ctx.notify_epollout();
+        assert_eq!(ctx.conn.state, ConnState::Killed);
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RST);
+    }
+
     #[test]
     fn test_local_close() {
         let mut ctx = CsmTestContext::new_established();
@@ -965,11 +1307,9 @@ mod tests {
         assert_ne!(ctx.pkt.flags() & uapi::VSOCK_FLAGS_SHUTDOWN_RCV, 0);
 
         // The kill timer should now be armed.
-        assert!(ctx.conn.will_expire());
-        assert!(
-            ctx.conn.expiry().unwrap()
-                < Instant::now() + Duration::from_millis(defs::CONN_SHUTDOWN_TIMEOUT_MS)
-        );
+        let expiry = ctx.conn.next_timer().unwrap();
+        assert!(expiry > Instant::now());
+        assert!(expiry < Instant::now() + Duration::from_millis(defs::CONN_SHUTDOWN_TIMEOUT_MS));
     }
 
     #[test]
@@ -1063,6 +1403,46 @@ mod tests {
         assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_CREDIT_REQUEST);
     }
 
+    #[test]
+    fn test_credit_request_retry() {
+        let mut ctx = CsmTestContext::new_established();
+        ctx.set_peer_credit(0);
+        ctx.notify_epollin();
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_CREDIT_REQUEST);
+        assert!(ctx.conn.next_timer().unwrap() > Instant::now());
+
+        // Nothing happens until the retry timer expires.
+        ctx.conn.handle_timers();
+        assert!(!ctx.conn.has_pending_rx());
+
+        // Then, the peer is asked for credit again.
+        ctx.conn.credit_request_retry = Some(Instant::now());
+        ctx.conn.handle_timers();
+        assert!(ctx.conn.has_pending_rx());
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_CREDIT_REQUEST);
+        assert!(ctx.conn.next_timer().is_some());
+
+        // Getting some credit disarms the retry timer.
+        let rx_cnt = ctx.conn.rx_cnt.0;
+        ctx.init_pkt(uapi::VSOCK_OP_CREDIT_UPDATE, 0)
+            .set_fwd_cnt(rx_cnt);
+        ctx.send();
+        assert!(ctx.conn.next_timer().is_none());
+    }
+
+    #[test]
+    fn test_kill_timer() {
+        let mut ctx = CsmTestContext::new_established();
+        ctx.conn.expiry = Some(Instant::now());
+        assert_eq!(ctx.conn.next_timer(), ctx.conn.expiry);
+        ctx.conn.handle_timers();
+        assert_eq!(ctx.conn.state, ConnState::Killed);
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RST);
+    }
+
     #[test]
     fn test_credit_request_from_peer() {
         let mut ctx = CsmTestContext::new_established();
@@ -1080,8 +1460,9 @@ mod tests {
         let mut ctx = CsmTestContext::new_established();
 
         // Force a stale state, where the peer hasn't been updated on our credit situation.
+        let threshold = 3 * csm_defs::CONN_TX_BUF_SIZE / 4;
         ctx.conn.last_fwd_cnt_to_peer = Wrapping(0);
-        ctx.conn.fwd_cnt = Wrapping(csm_defs::CONN_CREDIT_UPDATE_THRESHOLD as u32);
+        ctx.conn.fwd_cnt = Wrapping(threshold as u32);
 
         // Fake a data send from the peer, to bring us over the credit update threshold.
         let data = &[1, 2, 3, 4];
@@ -1092,13 +1473,63 @@ mod tests {
         assert!(ctx.conn.has_pending_rx());
         ctx.recv();
         assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_CREDIT_UPDATE);
-        assert_eq!(
-            ctx.pkt.fwd_cnt() as usize,
-            csm_defs::CONN_CREDIT_UPDATE_THRESHOLD + data.len()
-        );
+        assert_eq!(ctx.pkt.fwd_cnt() as usize, threshold + data.len());
         assert_eq!(ctx.conn.fwd_cnt, ctx.conn.last_fwd_cnt_to_peer);
     }
 
+    #[test]
+    fn test_window_tuning() {
+        const WINDOW: u32 = csm_defs::CONN_TX_BUF_SIZE as u32;
+
+        let mut ctx = CsmTestContext::new_established();
+
+        // The peer used up all of its credit, while we kept up with forwarding its data: the
+        // window doubles, and the peer gets to know right away.
+        let data = &[1, 2, 3, 4];
+        ctx.conn.last_fwd_cnt_to_peer = Wrapping(0);
+        ctx.conn.fwd_cnt = Wrapping(WINDOW - data.len() as u32);
+        ctx.init_data_pkt(data);
+        ctx.send();
+        assert!(ctx.conn.tx_idle_check.is_some());
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_CREDIT_UPDATE);
+        assert_eq!(ctx.pkt.buf_alloc(), 2 * WINDOW);
+        assert_eq!(ctx.conn.tx_limit, ctx.conn.fwd_cnt + Wrapping(2 * WINDOW));
+
+        // The window can't grow past what's left of the TX budget.
+        ctx.conn.last_fwd_cnt_to_peer = ctx.conn.fwd_cnt - Wrapping(2 * WINDOW);
+        ctx.init_data_pkt(data);
+        ctx.send();
+        assert_eq!(ctx.conn.buf_alloc, 4 * WINDOW);
+        ctx.conn.last_fwd_cnt_to_peer = ctx.conn.fwd_cnt - Wrapping(4 * WINDOW);
+        ctx.init_data_pkt(data);
+        ctx.send();
+        assert_eq!(ctx.conn.buf_alloc, 4 * WINDOW);
+        assert!(!ctx.tx_budget.reserve(1));
+
+        // Once the connection goes idle, the window shrinks back, but the credit that's already
+        // been advertised is still honored, and keeps its share of the TX budget.
+        let tx_limit = ctx.conn.tx_limit;
+        ctx.conn.tx_idle_check = Some(Instant::now());
+        ctx.conn.handle_timers();
+        assert_eq!(ctx.conn.buf_alloc, 4 * WINDOW);
+        ctx.conn.tx_idle_check = Some(Instant::now());
+        ctx.conn.handle_timers();
+        assert_eq!(ctx.conn.buf_alloc, WINDOW);
+        assert!(ctx.conn.tx_idle_check.is_some());
+        assert!(!ctx.tx_budget.reserve(1));
+        ctx.recv();
+        assert_eq!(ctx.pkt.buf_alloc(), WINDOW);
+        assert_eq!(ctx.conn.tx_limit, tx_limit);
+
+        // The budget goes back once the peer is down to a regular window's worth of credit.
+        ctx.conn.fwd_cnt = tx_limit - Wrapping(WINDOW);
+        ctx.conn.tx_idle_check = Some(Instant::now());
+        ctx.conn.handle_timers();
+        assert!(ctx.conn.tx_idle_check.is_none());
+        assert!(ctx.tx_budget.reserve(TX_BUDGET));
+    }
+
     #[test]
     fn test_tx_buffering() {
         // Test case:
@@ -1132,6 +1563,31 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_tx_vectored() {
+        let mut ctx = CsmTestContext::new_established();
+
+        // The test stream only takes the first (non-empty) slice of a vectored write, so the
+        // rest should end up in the TX buffer, in order.
+        ctx.conn
+            .send_bytes_vectored(&[&[1, 2], &[], &[3], &[4, 5]])
+            .unwrap();
+        assert_eq!(ctx.conn.stream.get_write_buf().unwrap(), [1, 2]);
+        assert_eq!(ctx.conn.fwd_cnt, Wrapping(2));
+        assert_eq!(ctx.conn.tx_buf.len(), 3);
+
+        // The data of a batch of packets goes after the buffered data.
+        ctx.init_data_pkt(&[6, 7]);
+        assert_eq!(ctx.conn.send_pkts(std::slice::from_ref(&ctx.pkt)), 1);
+        assert_eq!(ctx.conn.tx_buf.len(), 5);
+        ctx.conn.notify(EventSet::OUT);
+        assert!(ctx.conn.tx_buf.is_empty());
+        assert_eq!(
+            ctx.conn.stream.get_write_buf().unwrap(),
+            [1, 2, 3, 4, 5, 6, 7]
+        );
+    }
+
     #[test]
     fn test_stream_write_error() {
         // Test case: sending a data packet to a broken / closed backing stream should kill it.
@@ -7,22 +7,35 @@ mod connection;
 mod txbuf;
 
 pub use connection::VsockConnection;
+pub use txbuf::TxBudget;
 
 use std::net::Shutdown;
 
 pub mod defs {
-    /// Vsock connection TX buffer capacity.
+    /// Initial (and minimum) vsock connection window, i.e. the TX buffer space we advertise to
+    /// the guest.
     pub const CONN_TX_BUF_SIZE: usize = 64 * 1024;
 
-    /// After the guest thinks it has filled our TX buffer up to this limit (in bytes), we'll send
-    /// them a credit update packet, to let them know we can handle more.
-    pub const CONN_CREDIT_UPDATE_THRESHOLD: usize = CONN_TX_BUF_SIZE - 4 * 4 * 1024;
+    /// Maximum vsock connection window, and TX buffer capacity.
+    pub const CONN_TX_BUF_MAX_SIZE: usize = 4 * 1024 * 1024;
+
+    /// How long a connection has to go without any TX data before its window is shrunk back to
+    /// `CONN_TX_BUF_SIZE`, and the memory of its TX buffer released, in millis.
+    pub const CONN_TX_BUF_IDLE_MS: u64 = 5000;
 
     /// Connection request timeout, in millis.
     pub const CONN_REQUEST_TIMEOUT_MS: u64 = 2000;
 
+    /// Default timeout for connecting the host-side stream of a guest-initiated connection, in
+    /// millis.
+    pub const CONN_CONNECT_TIMEOUT_MS: u64 = 10000;
+
     /// Connection graceful shutdown timeout, in millis.
     pub const CONN_SHUTDOWN_TIMEOUT_MS: u64 = 2000;
+
+    /// How long to wait for the peer to grant us some credit, after asking for it, before
+    /// asking again, in millis.
+    pub const CONN_CREDIT_REQUEST_RETRY_MS: u64 = 1000;
 }
 
 #[derive(Debug)]
@@ -47,6 +60,9 @@ pub enum ConnState {
     /// The connection has been initiated by the guest, but we are yet to confirm it, by sending
     /// a response packet (VSOCK_OP_RESPONSE).
     PeerInit,
+    /// The connection has been initiated by the guest, but the host-side stream is still
+    /// connecting. It moves on to `PeerInit` once the stream is connected.
+    PeerConnecting,
     /// The connection handshake has been performed successfully, and data can now be exchanged.
     Established,
     /// The host (AF_UNIX) socket was closed.
@@ -83,6 +99,8 @@ enum PendingRx {
     RequestEx = 5,
     /// We need to yield a connection response packet with extended parameters (VSOCK_OP_RESPONSE_EX).
     ResponseEx = 6,
+    /// We need to (again) ask our peer for some credit (VSOCK_OP_CREDIT_REQUEST).
+    CreditRequest = 7,
 }
 impl PendingRx {
     /// Transform the enum value into a bitmask, that can be used for set operations.
@@ -92,6 +110,7 @@ impl PendingRx {
 }
 
 /// A set of RX indications (`PendingRx` items).
+#[derive(Default)]
 struct PendingRxSet {
     data: u16,
 }
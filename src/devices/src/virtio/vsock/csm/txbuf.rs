@@ -4,32 +4,49 @@
 
 use std::io::Write;
 use std::num::Wrapping;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Arc;
 
 use super::defs;
 use super::{Error, Result};
 
 /// A simple ring-buffer implementation, used by vsock connections to buffer TX (guest -> host)
 /// data.  Memory for this buffer is allocated lazily, since buffering will only be needed when
-/// the host can't read fast enough.
+/// the host can't read fast enough. It then grows, by powers of two, as more data needs to be
+/// buffered. Keeping the data within the credit granted to the peer is up to the connection.
+///
+/// The memory of the buffer is taken out of a `TxBudget`, shared by all the connections. The
+/// buffer may also hold more of the budget than it has allocated, so that it can later grow
+/// into it (see `reserve()`).
 pub struct TxBuf {
-    /// The actual u8 buffer - only allocated after the first push.
+    /// The actual u8 buffer - only allocated after the first push. Its size is always a power of
+    /// two, so the (wrapping) head and tail offsets stay consistent.
     data: Option<Box<[u8]>>,
     /// Ring-buffer head offset - where new data is pushed to.
     head: Wrapping<u32>,
     /// Ring-buffer tail offset - where data is flushed from.
     tail: Wrapping<u32>,
+    /// The budget that the memory of the buffer is taken out of.
+    budget: Arc<TxBudget>,
+    /// The number of bytes this buffer holds out of `self.budget`. This is never less than its
+    /// capacity.
+    reserved: usize,
 }
 
 impl TxBuf {
-    /// Total buffer size, in bytes.
-    const SIZE: usize = defs::CONN_TX_BUF_SIZE;
+    /// Initial buffer size, in bytes.
+    const MIN_SIZE: usize = 4 * 1024;
+    /// Maximum buffer size, in bytes.
+    const MAX_SIZE: usize = defs::CONN_TX_BUF_MAX_SIZE;
 
     /// Ring-buffer constructor.
-    pub fn new() -> Self {
+    pub fn new(budget: Arc<TxBudget>) -> Self {
         Self {
             data: None,
             head: Wrapping(0),
             tail: Wrapping(0),
+            budget,
+            reserved: 0,
         }
     }
 
@@ -42,26 +59,35 @@ impl TxBuf {
     /// Push a byte slice onto the ring-buffer.
     ///
     /// Either the entire source slice will be pushed to the ring-buffer, or none of it, if
-    /// there isn't enough room, in which case `Err(Error::TxBufFull)` is returned.
+    /// there isn't enough room, or the budget can't cover the memory the buffer would grow to,
+    /// in which case `Err(Error::TxBufFull)` is returned.
     pub fn push(&mut self, src: &[u8]) -> Result<()> {
         // Error out if there's no room to push the entire slice.
-        if self.len() + src.len() > Self::SIZE {
+        let new_len = self.len() + src.len();
+        if new_len > Self::MAX_SIZE {
             return Err(Error::TxBufFull);
         }
+        if new_len > self.capacity() {
+            let size = std::cmp::max(new_len.next_power_of_two(), Self::MIN_SIZE);
+            if !self.reserve(size) {
+                return Err(Error::TxBufFull);
+            }
+            self.resize(size);
+        }
 
-        let data = self
-            .data
-            .get_or_insert_with(|| vec![0u8; Self::SIZE].into_boxed_slice());
+        // It's safe to unwrap here, since we've just made room for the slice.
+        let data = self.data.as_mut().unwrap();
+        let size = data.len();
 
         // Buffer head, as an offset into the data slice.
-        let head_ofs = self.head.0 as usize % Self::SIZE;
+        let head_ofs = self.head.0 as usize % size;
 
         // Pushing a slice to this buffer can take either one or two slice copies: - one copy,
-        // if the slice fits between `head_ofs` and `Self::SIZE`; or - two copies, if the
+        // if the slice fits between `head_ofs` and `size`; or - two copies, if the
         // ring-buffer head wraps around.
 
         // First copy length: we can only go from the head offset up to the total buffer size.
-        let len = std::cmp::min(Self::SIZE - head_ofs, src.len());
+        let len = std::cmp::min(size - head_ofs, src.len());
         data[head_ofs..(head_ofs + len)].copy_from_slice(&src[..len]);
 
         // If the slice didn't fit, the buffer head will wrap around, and pushing continues
@@ -90,8 +116,11 @@ impl TxBuf {
             return Ok(0);
         }
 
+        // It's safe to unwrap here, since we've already checked if the buffer was empty.
+        let data = self.data.as_ref().unwrap();
+
         // Buffer tail, as an offset into the buffer data slice.
-        let tail_ofs = self.tail.0 as usize % Self::SIZE;
+        let tail_ofs = self.tail.0 as usize % data.len();
 
         // Flushing the buffer can take either one or two writes:
         // - one write, if the tail doesn't need to wrap around to reach the head; or
@@ -99,10 +128,7 @@ impl TxBuf {
         //   head.
 
         // First write length: the lesser of tail to slice end, or tail to head.
-        let len_to_write = std::cmp::min(Self::SIZE - tail_ofs, self.len());
-
-        // It's safe to unwrap here, since we've already checked if the buffer was empty.
-        let data = self.data.as_ref().unwrap();
+        let len_to_write = std::cmp::min(data.len() - tail_ofs, self.len());
 
         // Issue the first write and absorb any `WouldBlock` error (we can just try again
         // later).
@@ -129,6 +155,100 @@ impl TxBuf {
     pub fn is_empty(&self) -> bool {
         self.len() == 0
     }
+
+    /// Get the amount of memory allocated for this buffer, in bytes.
+    pub fn capacity(&self) -> usize {
+        self.data.as_ref().map_or(0, |data| data.len())
+    }
+
+    /// Get the number of bytes this buffer holds out of the TX budget.
+    pub fn reserved(&self) -> usize {
+        self.reserved
+    }
+
+    /// Make sure this buffer holds at least `bytes` out of the TX budget, so that it can grow
+    /// to that size without running out of budget. Nothing is taken, and `false` is returned,
+    /// if there isn't enough left.
+    pub fn reserve(&mut self, bytes: usize) -> bool {
+        if bytes > self.reserved {
+            if !self.budget.reserve(bytes - self.reserved) {
+                return false;
+            }
+            self.reserved = bytes;
+        }
+        true
+    }
+
+    /// Free the memory allocated for this buffer, if it doesn't hold any data. It will be
+    /// allocated again on the next push. The budget it holds is kept (see `unreserve()`).
+    pub fn release(&mut self) {
+        if self.is_empty() {
+            self.data = None;
+        }
+    }
+
+    /// Give back the budget this buffer holds beyond its capacity.
+    pub fn unreserve(&mut self) {
+        let capacity = self.capacity();
+        self.budget.release(self.reserved - capacity);
+        self.reserved = capacity;
+    }
+
+    /// Move the buffered data to a new buffer of `size` bytes, which must be a power of two,
+    /// large enough to hold it.
+    fn resize(&mut self, size: usize) {
+        let mut data = vec![0u8; size].into_boxed_slice();
+        let len = self.len();
+        if let Some(old) = self.data.as_ref() {
+            let tail_ofs = self.tail.0 as usize % old.len();
+            let first = std::cmp::min(old.len() - tail_ofs, len);
+            data[..first].copy_from_slice(&old[tail_ofs..(tail_ofs + first)]);
+            data[first..len].copy_from_slice(&old[..(len - first)]);
+        }
+
+        self.data = Some(data);
+        self.tail = Wrapping(0);
+        self.head = Wrapping(len as u32);
+    }
+}
+
+impl Drop for TxBuf {
+    fn drop(&mut self) {
+        self.budget.release(self.reserved);
+    }
+}
+
+/// The memory budget for the TX buffers of vsock connections, shared by all of them. A TX
+/// buffer takes its memory out of the budget as it grows, and a connection growing its window
+/// beyond `defs::CONN_TX_BUF_SIZE` takes what its buffer may then grow to up front. Both are
+/// given back once the buffer is released, and the peer can no longer make it buffer more than
+/// `defs::CONN_TX_BUF_SIZE` bytes.
+pub struct TxBudget {
+    /// The number of bytes left in the budget.
+    available: AtomicUsize,
+}
+
+impl TxBudget {
+    pub fn new(size: usize) -> Self {
+        Self {
+            available: AtomicUsize::new(size),
+        }
+    }
+
+    /// Take `bytes` out of the budget. Nothing is taken, and `false` is returned, if there isn't
+    /// that much left.
+    pub fn reserve(&self, bytes: usize) -> bool {
+        self.available
+            .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |available| {
+                available.checked_sub(bytes)
+            })
+            .is_ok()
+    }
+
+    /// Give `bytes` back to the budget.
+    pub fn release(&self, bytes: usize) {
+        self.available.fetch_add(bytes, Ordering::Relaxed);
+    }
 }
 
 #[cfg(test)]
@@ -145,7 +265,7 @@ mod tests {
     }
 
     impl TestSink {
-        const DEFAULT_CAPACITY: usize = 2 * TxBuf::SIZE;
+        const DEFAULT_CAPACITY: usize = 2 * TxBuf::MIN_SIZE;
         fn new() -> Self {
             Self {
                 data: Vec::with_capacity(Self::DEFAULT_CAPACITY),
@@ -169,6 +289,10 @@ mod tests {
         }
     }
 
+    fn new_txbuf() -> TxBuf {
+        TxBuf::new(Arc::new(TxBudget::new(TxBuf::MAX_SIZE)))
+    }
+
     impl TestSink {
         fn clear(&mut self) {
             self.data = Vec::with_capacity(self.capacity);
@@ -187,7 +311,7 @@ mod tests {
 
     #[test]
     fn test_push_nowrap() {
-        let mut txbuf = TxBuf::new();
+        let mut txbuf = new_txbuf();
         let mut sink = TestSink::new();
         assert!(txbuf.is_empty());
 
@@ -200,26 +324,101 @@ mod tests {
 
     #[test]
     fn test_push_wrap() {
-        let mut txbuf = TxBuf::new();
+        let mut txbuf = new_txbuf();
         let mut sink = TestSink::new();
         let mut tmp: Vec<u8> = Vec::new();
 
-        tmp.resize(TxBuf::SIZE - 2, 0);
+        tmp.resize(TxBuf::MIN_SIZE - 2, 0);
         txbuf.push(tmp.as_slice()).unwrap();
         txbuf.flush_to(&mut sink).unwrap();
         sink.clear();
 
         txbuf.push(&[1, 2, 3, 4]).unwrap();
+        assert_eq!(txbuf.capacity(), TxBuf::MIN_SIZE);
         assert_eq!(txbuf.flush_to(&mut sink).unwrap(), 4);
         assert_eq!(sink.data, [1, 2, 3, 4]);
     }
 
+    #[test]
+    fn test_grow_release() {
+        let mut txbuf = new_txbuf();
+        let mut sink = TestSink::new();
+        let mut tmp: Vec<u8> = Vec::new();
+
+        // Wrap the head around, then grow the buffer: the data should be kept in order.
+        tmp.resize(TxBuf::MIN_SIZE - 2, 0);
+        txbuf.push(tmp.as_slice()).unwrap();
+        txbuf.flush_to(&mut sink).unwrap();
+        sink.clear();
+        txbuf.push(&[1, 2, 3, 4]).unwrap();
+        let data: Vec<u8> = (0..TxBuf::MIN_SIZE).map(|i| i as u8).collect();
+        txbuf.push(data.as_slice()).unwrap();
+        assert_eq!(txbuf.capacity(), 2 * TxBuf::MIN_SIZE);
+        assert_eq!(txbuf.len(), TxBuf::MIN_SIZE + 4);
+
+        // The memory can only be released once all the data has been flushed.
+        txbuf.release();
+        assert_eq!(txbuf.capacity(), 2 * TxBuf::MIN_SIZE);
+        assert_eq!(txbuf.flush_to(&mut sink).unwrap(), TxBuf::MIN_SIZE + 4);
+        assert_eq!(sink.data[..4], [1, 2, 3, 4]);
+        assert_eq!(sink.data[4..], data[..]);
+        txbuf.release();
+        assert_eq!(txbuf.capacity(), 0);
+    }
+
+    #[test]
+    fn test_budget() {
+        let budget = TxBudget::new(100);
+        assert!(budget.reserve(60));
+        assert!(!budget.reserve(60));
+        assert!(budget.reserve(40));
+        budget.release(60);
+        assert!(budget.reserve(60));
+        assert!(!budget.reserve(1));
+    }
+
+    #[test]
+    fn test_budget_charge() {
+        let budget = Arc::new(TxBudget::new(3 * TxBuf::MIN_SIZE));
+        let mut txbuf = TxBuf::new(budget.clone());
+        let mut sink = TestSink::new();
+        let data: Vec<u8> = vec![0; TxBuf::MIN_SIZE + 1];
+
+        // The buffer can't grow past what's left of the budget.
+        txbuf.push(&data[..TxBuf::MIN_SIZE]).unwrap();
+        assert_eq!(txbuf.reserved(), TxBuf::MIN_SIZE);
+        match txbuf.push(&data) {
+            Err(Error::TxBufFull) => (),
+            other => panic!("Unexpected result: {:?}", other),
+        }
+        assert_eq!(txbuf.capacity(), TxBuf::MIN_SIZE);
+
+        // What's been reserved up front can be grown into.
+        assert!(!txbuf.reserve(4 * TxBuf::MIN_SIZE));
+        assert!(txbuf.reserve(2 * TxBuf::MIN_SIZE));
+        assert!(!budget.reserve(TxBuf::MIN_SIZE + 1));
+        txbuf.push(&data[..1]).unwrap();
+        assert_eq!(txbuf.capacity(), 2 * TxBuf::MIN_SIZE);
+        assert_eq!(txbuf.reserved(), 2 * TxBuf::MIN_SIZE);
+
+        // The budget only goes back once the memory is released.
+        txbuf.unreserve();
+        assert_eq!(txbuf.reserved(), 2 * TxBuf::MIN_SIZE);
+        txbuf.flush_to(&mut sink).unwrap();
+        txbuf.release();
+        txbuf.unreserve();
+        assert_eq!(txbuf.reserved(), 0);
+        assert!(txbuf.reserve(2 * TxBuf::MIN_SIZE));
+        drop(txbuf);
+        assert!(budget.reserve(3 * TxBuf::MIN_SIZE));
+    }
+
     #[test]
     fn test_push_error() {
-        let mut txbuf = TxBuf::new();
-        let mut tmp = Vec::with_capacity(TxBuf::SIZE);
+        let mut txbuf = new_txbuf();
+        let mut tmp = Vec::with_capacity(TxBuf::MAX_SIZE);
 
-        tmp.resize(TxBuf::SIZE - 1, 0);
+        tmp.resize(TxBuf::MAX_SIZE - 1, 0);
         txbuf.push(tmp.as_slice()).unwrap();
         match txbuf.push(&[1, 2]) {
             Err(Error::TxBufFull) => (),
@@ -229,7 +428,7 @@ mod tests {
 
     #[test]
     fn test_incomplete_flush() {
-        let mut txbuf = TxBuf::new();
+        let mut txbuf = new_txbuf();
         let mut sink = TestSink::new();
 
         sink.set_capacity(2);
@@ -248,7 +447,7 @@ mod tests {
     fn test_flush_error() {
         const EACCESS: i32 = 13;
 
-        let mut txbuf = TxBuf::new();
+        let mut txbuf = new_txbuf();
         let mut sink = TestSink::new();
 
         txbuf.push(&[1, 2, 3, 4]).unwrap();
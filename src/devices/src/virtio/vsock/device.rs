@@ -12,8 +12,8 @@ use std::result;
 /// We aim to conform to the VirtIO v1.1 spec:
 /// https://docs.oasis-open.org/virtio/virtio/v1.1/virtio-v1.1.html
 ///
-/// The vsock device has two input parameters: a CID to identify the device, and a `VsockBackend`
-/// to use for offloading vsock traffic.
+/// The vsock device has three input parameters: a CID to identify the device, a `VsockBackend`
+/// to use for offloading vsock traffic, and (optionally) the max packet data size.
 ///
 /// Upon its activation, the vsock device registers handlers for the following events/FDs:
 /// - an RX queue FD;
@@ -50,6 +50,10 @@ pub(crate) const AVAIL_FEATURES: u64 =
 
 pub struct Vsock<B> {
     cid: u64,
+    // The largest amount of data carried by a single RX packet. TX packets may still carry up to
+    // `defs::DEFAULT_MAX_PKT_BUF_SIZE` bytes if that's larger, as the guest driver doesn't know
+    // about this limit.
+    max_pkt_size: usize,
     pub(crate) queues: Vec<VirtQueue>,
     pub(crate) queue_events: Vec<EventFd>,
     pub(crate) backend: B,
@@ -80,6 +84,7 @@ where
     pub(crate) fn with_queues(
         cid: u64,
         backend: B,
+        max_pkt_size: Option<u32>,
         queues: Vec<VirtQueue>,
     ) -> super::Result<Vsock<B>> {
         let mut queue_events = Vec::new();
@@ -88,8 +93,13 @@ where
                 .push(EventFd::new(utils::eventfd::EFD_NONBLOCK).map_err(VsockError::EventFd)?);
         }
 
+        let max_pkt_size = max_pkt_size
+            .map_or(defs::DEFAULT_MAX_PKT_BUF_SIZE, |size| size as usize)
+            .clamp(defs::MIN_MAX_PKT_BUF_SIZE, defs::MAX_MAX_PKT_BUF_SIZE);
+
         Ok(Vsock {
             cid,
+            max_pkt_size,
             queues,
             queue_events,
             backend,
@@ -106,13 +116,14 @@ where
         })
     }
 
-    /// Create a new virtio-vsock device with the given VM CID and vsock backend.
-    pub fn new(cid: u64, backend: B) -> super::Result<Vsock<B>> {
+    /// Create a new virtio-vsock device with the given VM CID and vsock backend. Packets carry
+    /// up to `max_pkt_size` bytes of data, or `defs::DEFAULT_MAX_PKT_BUF_SIZE` if it's `None`.
+    pub fn new(cid: u64, backend: B, max_pkt_size: Option<u32>) -> super::Result<Vsock<B>> {
         let queues: Vec<VirtQueue> = defs::QUEUE_SIZES
             .iter()
             .map(|&max_size| VirtQueue::new(max_size))
             .collect();
-        Self::with_queues(cid, backend, queues)
+        Self::with_queues(cid, backend, max_pkt_size, queues)
     }
 
     pub fn id(&self) -> &str {
@@ -162,7 +173,7 @@ where
         let mut have_used = false;
 
         while let Some(head) = self.queues[RXQ_INDEX].pop(mem) {
-            let used_len = match VsockPacket::from_rx_virtq_head(&head) {
+            let used_len = match VsockPacket::from_rx_virtq_head(&head, self.max_pkt_size) {
                 Ok(mut pkt) => {
                     if self.backend.recv_pkt(&mut pkt).is_ok() {
                         pkt.hdr().len() as u32 + pkt.len()
@@ -198,25 +209,50 @@ where
         };
 
         let mut have_used = false;
-
-        while let Some(head) = self.queues[TXQ_INDEX].pop(mem) {
-            let pkt = match VsockPacket::from_tx_virtq_head(&head) {
-                Ok(pkt) => pkt,
-                Err(e) => {
-                    error!("vsock: error reading TX packet: {:?}", e);
-                    have_used = true;
-                    self.queues[TXQ_INDEX].add_used(mem, head.index, 0);
-                    continue;
+        let mut heads = Vec::new();
+        let mut pkts = Vec::new();
+
+        loop {
+            // Gather all the packets available, so the backend gets to send the ones going to
+            // the same connection in one go.
+            while let Some(head) = self.queues[TXQ_INDEX].pop(mem) {
+                let max_pkt_size = self.max_pkt_size.max(defs::DEFAULT_MAX_PKT_BUF_SIZE);
+                match VsockPacket::from_tx_virtq_head(&head, max_pkt_size) {
+                    Ok(pkt) => {
+                        heads.push(head.index);
+                        pkts.push(pkt);
+                    }
+                    // A bad packet mustn't be returned ahead of the batch, which might have to
+                    // be put back into the queue.
+                    Err(_) if !pkts.is_empty() => {
+                        self.queues[TXQ_INDEX].undo_pop();
+                        break;
+                    }
+                    Err(e) => {
+                        error!("vsock: error reading TX packet: {:?}", e);
+                        have_used = true;
+                        self.queues[TXQ_INDEX].add_used(mem, head.index, 0);
+                    }
                 }
-            };
+            }
+            if pkts.is_empty() {
+                break;
+            }
 
-            if self.backend.send_pkt(&pkt).is_err() {
-                self.queues[TXQ_INDEX].undo_pop();
+            let sent = self.backend.send_pkts(&pkts);
+            for &index in &heads[..sent] {
+                have_used = true;
+                self.queues[TXQ_INDEX].add_used(mem, index, 0);
+            }
+            if sent < pkts.len() {
+                for _ in sent..pkts.len() {
+                    self.queues[TXQ_INDEX].undo_pop();
+                }
                 break;
             }
 
-            have_used = true;
-            self.queues[TXQ_INDEX].add_used(mem, head.index, 0);
+            heads.clear();
+            pkts.clear();
         }
 
         have_used
@@ -235,6 +235,7 @@ mod tests {
     use super::*;
 
     use crate::virtio::device::VirtioDevice;
+    use crate::virtio::vsock::defs::DEFAULT_MAX_PKT_BUF_SIZE;
     use crate::virtio::vsock::packet::VSOCK_PKT_HDR_SIZE;
     use crate::virtio::VIRTIO_MMIO_INT_VRING;
     use crate::Error as DeviceError;
@@ -483,7 +484,9 @@ mod tests {
             // If the descriptor chain is already declared invalid, there's no reason to assemble
             // a packet.
             if let Some(rx_desc) = ctx.device.queues[RXQ_INDEX].pop(&test_ctx.mem) {
-                assert!(VsockPacket::from_rx_virtq_head(&rx_desc).is_err());
+                assert!(
+                    VsockPacket::from_rx_virtq_head(&rx_desc, DEFAULT_MAX_PKT_BUF_SIZE).is_err()
+                );
             }
         }
 
@@ -505,7 +508,9 @@ mod tests {
             ctx.guest_txvq.dtable[desc_idx].len.set(len);
 
             if let Some(tx_desc) = ctx.device.queues[TXQ_INDEX].pop(&test_ctx.mem) {
-                assert!(VsockPacket::from_tx_virtq_head(&tx_desc).is_err());
+                assert!(
+                    VsockPacket::from_tx_virtq_head(&tx_desc, DEFAULT_MAX_PKT_BUF_SIZE).is_err()
+                );
             }
         }
     }
@@ -531,13 +536,13 @@ mod tests {
         {
             let mut ctx = test_ctx.create_event_handler_context();
             let rx_desc = ctx.device.queues[RXQ_INDEX].pop(&test_ctx.mem).unwrap();
-            assert!(VsockPacket::from_rx_virtq_head(&rx_desc).is_ok());
+            assert!(VsockPacket::from_rx_virtq_head(&rx_desc, DEFAULT_MAX_PKT_BUF_SIZE).is_ok());
         }
 
         {
             let mut ctx = test_ctx.create_event_handler_context();
             let tx_desc = ctx.device.queues[TXQ_INDEX].pop(&test_ctx.mem).unwrap();
-            assert!(VsockPacket::from_tx_virtq_head(&tx_desc).is_ok());
+            assert!(VsockPacket::from_tx_virtq_head(&tx_desc, DEFAULT_MAX_PKT_BUF_SIZE).is_ok());
         }
 
         // Let's check what happens when the header descriptor is right before the gap.
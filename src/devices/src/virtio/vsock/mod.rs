@@ -14,6 +14,9 @@ mod unix;
 use std::os::unix::io::AsRawFd;
 
 pub use self::defs::uapi::VIRTIO_ID_VSOCK as TYPE_VSOCK;
+pub use self::defs::{
+    MAX_MAX_PKT_BUF_SIZE as VSOCK_MAX_MAX_PKT_SIZE, MIN_MAX_PKT_BUF_SIZE as VSOCK_MIN_MAX_PKT_SIZE,
+};
 pub use self::device::Vsock;
 pub use self::unix::{Error as VsockUnixBackendError, VsockUnixBackend};
 
@@ -33,8 +36,11 @@ mod defs {
     /// There are 3 queues for a virtio device (in this order): RX, TX, Event
     pub const QUEUE_SIZES: &[u16] = &[256; NUM_QUEUES];
 
-    /// Max vsock packet data/buffer size.
-    pub const MAX_PKT_BUF_SIZE: usize = 64 * 1024;
+    /// Default max vsock packet data/buffer size.
+    pub const DEFAULT_MAX_PKT_BUF_SIZE: usize = 64 * 1024;
+    /// Bounds for the (configurable) max vsock packet data/buffer size.
+    pub const MIN_MAX_PKT_BUF_SIZE: usize = 4 * 1024;
+    pub const MAX_MAX_PKT_BUF_SIZE: usize = 1024 * 1024;
 
     pub mod uapi {
 
@@ -76,6 +82,26 @@ mod defs {
         pub const VSOCK_OP_WRAP_CLOSE: u16 = 10;
         /// Connection response.
         pub const VSOCK_OP_RESPONSE_EX: u16 = 11;
+        /// Socket options for an established connection.
+        pub const VSOCK_OP_SETSOCKOPT: u16 = 12;
+
+        /// Socket options carried by the extended ops (the guest's `setsockopt()` calls on its
+        /// end of the connection), as (option, value) pairs.
+        ///
+        /// `TCP_NODELAY` (0 or 1).
+        pub const VSOCK_SOCKOPT_NODELAY: u32 = 1;
+        /// `SO_SNDBUF`, in bytes.
+        pub const VSOCK_SOCKOPT_SNDBUF: u32 = 2;
+        /// `SO_RCVBUF`, in bytes.
+        pub const VSOCK_SOCKOPT_RCVBUF: u32 = 3;
+        /// `SO_KEEPALIVE` (0 or 1).
+        pub const VSOCK_SOCKOPT_KEEPALIVE: u32 = 4;
+        /// `TCP_KEEPIDLE`, in seconds.
+        pub const VSOCK_SOCKOPT_KEEPIDLE: u32 = 5;
+        /// `TCP_KEEPINTVL`, in seconds.
+        pub const VSOCK_SOCKOPT_KEEPINTVL: u32 = 6;
+        /// `TCP_KEEPCNT`.
+        pub const VSOCK_SOCKOPT_KEEPCNT: u32 = 7;
 
         /// Vsock packet flags.
         /// Defined in `/include/uapi/linux/virtio_vsock.h`.
@@ -96,6 +122,11 @@ mod defs {
         /// UNIX sa_family
         pub const AF_UNIX: u16 = 1;
         pub const AF_INET: u16 = 2;
+
+        /// Size of the (guest) `sockaddr_in` and `sockaddr_un` carried by the extended ops. The
+        /// socket options of the connection, if any, follow the address.
+        pub const SOCKADDR_IN_SIZE: usize = 16;
+        pub const SOCKADDR_UN_SIZE: usize = 110;
     }
 }
 
@@ -156,6 +187,17 @@ pub trait VsockChannel {
     /// Write/send a packet through the channel.
     fn send_pkt(&mut self, pkt: &VsockPacket) -> Result<()>;
 
+    /// Write/send a batch of packets through the channel, in order, stopping at the first one
+    /// that can't be sent. Channels can override this to handle the whole batch at once, e.g.
+    /// with fewer syscalls.
+    ///
+    /// Returns the number of packets that have been sent.
+    fn send_pkts(&mut self, pkts: &[VsockPacket]) -> usize {
+        pkts.iter()
+            .take_while(|pkt| self.send_pkt(pkt).is_ok())
+            .count()
+    }
+
     /// Checks whether there is pending incoming data inside the channel, meaning that a subsequent
     /// call to `recv_pkt()` won't fail.
     fn has_pending_rx(&self) -> bool;
@@ -277,7 +319,7 @@ pub(crate) mod tests {
                 cid: CID,
                 mem,
                 mem_size: MEM_SIZE,
-                device: Vsock::new(CID, TestBackend::new()).unwrap(),
+                device: Vsock::new(CID, TestBackend::new(), None).unwrap(),
             }
         }
 
@@ -314,7 +356,7 @@ pub(crate) mod tests {
                 guest_rxvq,
                 guest_txvq,
                 guest_evvq,
-                device: Vsock::with_queues(self.cid, TestBackend::new(), queues).unwrap(),
+                device: Vsock::with_queues(self.cid, TestBackend::new(), None, queues).unwrap(),
             }
         }
     }
@@ -8,14 +8,17 @@
 /// - the packet header; and
 /// - the packet data/buffer.
 /// There is a 1:1 relation between descriptor chains and packets: the first (chain head) holds
-/// the header, and an optional second descriptor holds the data. The second descriptor is only
-/// present for data packets (VSOCK_OP_RW).
+/// the header, and the following descriptor(s) hold the data. TX data is only present for data
+/// packets (VSOCK_OP_RW), in a single descriptor. RX buffers are always present, and may span
+/// several descriptors, so the guest can take in large packets without having to provide large
+/// contiguous buffers.
 ///
 /// `VsockPacket` wraps these two buffers and provides direct access to the data stored
 /// in guest memory. This is done to avoid unnecessarily copying data from guest memory
 /// to temporary buffers, before passing it on to the vsock backend.
 use std::convert::TryInto;
 use std::ffi::CStr;
+use std::io::IoSliceMut;
 use std::os::raw::c_char;
 use std::result;
 
@@ -23,7 +26,6 @@ use utils::byte_order;
 use vm_memory::{self, GuestAddress, GuestMemory, GuestMemoryError};
 
 use super::super::DescriptorChain;
-use super::defs;
 use super::{Result, VsockError};
 
 // The vsock packet header is defined by the C struct:
@@ -93,11 +95,14 @@ const HDROFF_FWD_CNT: usize = 40;
 
 /// The vsock packet, implemented as a wrapper over a virtq descriptor chain:
 /// - the chain head, holding the packet header; and
-/// - (an optional) data/buffer descriptor, only present for data packets (VSOCK_OP_RW).
+/// - (an optional) data/buffer descriptor, only present for data packets (VSOCK_OP_RW), or, for
+///   RX packets, one or more data/buffer descriptors.
 pub struct VsockPacket {
     hdr: *mut u8,
     buf: Option<*mut u8>,
     buf_size: usize,
+    /// The RX data/buffer descriptors following the first one, as (pointer, size) pairs.
+    more_bufs: Vec<(*mut u8, usize)>,
 }
 
 fn get_host_address<T: GuestMemory>(
@@ -112,9 +117,9 @@ impl VsockPacket {
     /// Create the packet wrapper from a TX virtq chain head.
     ///
     /// The chain head is expected to hold valid packet header data. A following packet buffer
-    /// descriptor can optionally end the chain. Bounds and pointer checks are performed when
-    /// creating the wrapper.
-    pub fn from_tx_virtq_head(head: &DescriptorChain) -> Result<Self> {
+    /// descriptor can optionally end the chain, holding up to `max_buf_size` bytes of data. Bounds
+    /// and pointer checks are performed when creating the wrapper.
+    pub fn from_tx_virtq_head(head: &DescriptorChain, max_buf_size: usize) -> Result<Self> {
         // All buffers in the TX queue must be readable.
         //
         if head.is_write_only() {
@@ -131,6 +136,7 @@ impl VsockPacket {
                 .map_err(VsockError::GuestMemoryMmap)?,
             buf: None,
             buf_size: 0,
+            more_bufs: Vec::new(),
         };
 
         // No point looking for a data/buffer descriptor, if the packet is zero-lengthed.
@@ -140,7 +146,7 @@ impl VsockPacket {
 
         // Reject weirdly-sized packets.
         //
-        if pkt.len() > defs::MAX_PKT_BUF_SIZE as u32 {
+        if pkt.len() as usize > max_buf_size {
             return Err(VsockError::InvalidPktLen(pkt.len()));
         }
 
@@ -169,9 +175,11 @@ impl VsockPacket {
 
     /// Create the packet wrapper from an RX virtq chain head.
     ///
-    /// There must be two descriptors in the chain, both writable: a header descriptor and a data
-    /// descriptor. Bounds and pointer checks are performed when creating the wrapper.
-    pub fn from_rx_virtq_head(head: &DescriptorChain) -> Result<Self> {
+    /// There must be at least two descriptors in the chain, all writable: a header descriptor and
+    /// one or more data descriptors. The packet buffer takes in as many of those as needed to
+    /// cover `max_buf_size` bytes. Bounds and pointer checks are performed when creating the
+    /// wrapper.
+    pub fn from_rx_virtq_head(head: &DescriptorChain, max_buf_size: usize) -> Result<Self> {
         // All RX buffers must be writable.
         //
         if !head.is_write_only() {
@@ -187,10 +195,13 @@ impl VsockPacket {
         if !head.has_next() {
             return Err(VsockError::BufDescMissing);
         }
-        let buf_desc = head.next_descriptor().ok_or(VsockError::BufDescMissing)?;
-        let buf_size = buf_desc.len as usize;
+        let mut buf_desc = head.next_descriptor().ok_or(VsockError::BufDescMissing)?;
+        if !buf_desc.is_write_only() {
+            return Err(VsockError::UnwritableDescriptor);
+        }
+        let buf_size = std::cmp::min(buf_desc.len as usize, max_buf_size);
 
-        Ok(Self {
+        let mut pkt = Self {
             hdr: get_host_address(head.mem, head.addr, VSOCK_PKT_HDR_SIZE)
                 .map_err(VsockError::GuestMemoryMmap)?,
             buf: Some(
@@ -198,7 +209,32 @@ impl VsockPacket {
                     .map_err(VsockError::GuestMemoryMmap)?,
             ),
             buf_size,
-        })
+            more_bufs: Vec::new(),
+        };
+
+        // Chain in the following data descriptors, up to the maximum packet size.
+        let mut total_size = buf_size;
+        while total_size < max_buf_size {
+            buf_desc = match buf_desc.next_descriptor() {
+                Some(desc) => desc,
+                None => break,
+            };
+            if !buf_desc.is_write_only() {
+                return Err(VsockError::UnwritableDescriptor);
+            }
+            let size = std::cmp::min(buf_desc.len as usize, max_buf_size - total_size);
+            if size == 0 {
+                continue;
+            }
+            pkt.more_bufs.push((
+                get_host_address(buf_desc.mem, buf_desc.addr, size)
+                    .map_err(VsockError::GuestMemoryMmap)?,
+                size,
+            ));
+            total_size += size;
+        }
+
+        Ok(pkt)
     }
 
     /// Provides in-place, byte-slice, access to the vsock packet header.
@@ -245,6 +281,39 @@ impl VsockPacket {
         })
     }
 
+    /// Get the total size of the packet data/buffer, across all of its descriptors.
+    ///
+    /// Note: `buf()` and `buf_mut()` only give access to the first descriptor, which may be
+    ///       smaller than this.
+    pub fn buf_len(&self) -> usize {
+        self.buf_size + self.more_bufs.iter().map(|&(_, size)| size).sum::<usize>()
+    }
+
+    /// Provides in-place, mutable access to the first `len` bytes of the packet data/buffer, as
+    /// one slice per descriptor, suitable for vectored reads.
+    pub fn bufs_mut(&mut self, len: usize) -> Vec<IoSliceMut<'_>> {
+        let mut left = len;
+        let mut bufs = Vec::with_capacity(1 + self.more_bufs.len());
+        let segments = self
+            .buf
+            .map(|ptr| (ptr, self.buf_size))
+            .into_iter()
+            .chain(self.more_bufs.iter().copied());
+        for (ptr, size) in segments {
+            if left == 0 {
+                break;
+            }
+            let size = std::cmp::min(size, left);
+            // This is safe since bound checks have already been performed when creating the packet
+            // from the virtq descriptors.
+            bufs.push(IoSliceMut::new(unsafe {
+                std::slice::from_raw_parts_mut(ptr, size)
+            }));
+            left -= size;
+        }
+        bufs
+    }
+
     pub fn src_cid(&self) -> u64 {
         byte_order::read_le_u64(&self.hdr()[HDROFF_SRC_CID..])
     }
@@ -375,19 +444,48 @@ impl VsockPacket {
             None
         }
     }
+
+    /// Get the socket options found at `offset` in the packet data, as (option, value) pairs.
+    /// The options are laid out as a count, followed by that many pairs, all of them
+    /// little-endian u32s. There are no options if the data ends before `offset`, or if the
+    /// list doesn't fit in it.
+    pub fn sock_opts(&self, offset: usize) -> Vec<(u32, u32)> {
+        let len = (self.len() as usize).min(self.buf_size);
+        let list = match self.buf() {
+            Some(buf) if len >= offset + 4 => &buf[offset..len],
+            _ => return Vec::new(),
+        };
+
+        let count = byte_order::read_le_u32(list) as usize;
+        let pairs = &list[4..];
+        if count > pairs.len() / 8 {
+            return Vec::new();
+        }
+        pairs
+            .chunks_exact(8)
+            .take(count)
+            .map(|pair| {
+                (
+                    byte_order::read_le_u32(&pair[0..]),
+                    byte_order::read_le_u32(&pair[4..]),
+                )
+            })
+            .collect()
+    }
 }
 
 #[cfg(test)]
 mod tests {
 
-    use vm_memory::{GuestAddress, GuestMemoryMmap};
+    use vm_memory::{Bytes, GuestAddress, GuestMemoryMmap};
 
     use super::super::tests::TestContext;
     use super::*;
+    use crate::virtio::queue::tests::VirtQueue as GuestQ;
     use crate::virtio::queue::tests::VirtqDesc as GuestQDesc;
-    use crate::virtio::vsock::defs::MAX_PKT_BUF_SIZE;
+    use crate::virtio::vsock::defs::DEFAULT_MAX_PKT_BUF_SIZE;
     use crate::virtio::vsock::device::{RXQ_INDEX, TXQ_INDEX};
-    use crate::virtio::VIRTQ_DESC_F_WRITE;
+    use crate::virtio::{VIRTQ_DESC_F_NEXT, VIRTQ_DESC_F_WRITE};
 
     macro_rules! create_context {
         ($test_ctx:ident, $handler_ctx:ident) => {
@@ -410,6 +508,7 @@ mod tests {
                 &$handler_ctx.device.queues[$vq_index]
                     .pop(&$test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             ) {
                 Err($err) => (),
                 Ok(_) => panic!("Packet assembly should've failed!"),
@@ -437,6 +536,7 @@ mod tests {
                 &handler_ctx.device.queues[TXQ_INDEX]
                     .pop(&test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             )
             .unwrap();
             assert_eq!(pkt.hdr().len(), VSOCK_PKT_HDR_SIZE);
@@ -472,6 +572,7 @@ mod tests {
                 &handler_ctx.device.queues[TXQ_INDEX]
                     .pop(&test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             )
             .unwrap();
             assert!(pkt.buf().is_none());
@@ -482,7 +583,7 @@ mod tests {
         {
             create_context!(test_ctx, handler_ctx);
             set_pkt_len(
-                MAX_PKT_BUF_SIZE as u32 + 1,
+                DEFAULT_MAX_PKT_BUF_SIZE as u32 + 1,
                 &handler_ctx.guest_txvq.dtable[0],
                 &test_ctx.mem,
             );
@@ -527,6 +628,7 @@ mod tests {
                 &handler_ctx.device.queues[RXQ_INDEX]
                     .pop(&test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             )
             .unwrap();
             assert_eq!(pkt.hdr().len(), VSOCK_PKT_HDR_SIZE);
@@ -534,6 +636,26 @@ mod tests {
                 pkt.buf().unwrap().len(),
                 handler_ctx.guest_rxvq.dtable[1].len.get() as usize
             );
+            assert_eq!(pkt.buf_len(), pkt.buf().unwrap().len());
+        }
+
+        // Test case: the packet buffer is capped at the max packet size, and vectored access
+        // only covers the requested length.
+        {
+            create_context!(test_ctx, handler_ctx);
+            let mut pkt = VsockPacket::from_rx_virtq_head(
+                &handler_ctx.device.queues[RXQ_INDEX]
+                    .pop(&test_ctx.mem)
+                    .unwrap(),
+                1024,
+            )
+            .unwrap();
+            assert_eq!(pkt.buf_len(), 1024);
+            assert_eq!(pkt.buf().unwrap().len(), 1024);
+            let bufs = pkt.bufs_mut(512);
+            assert_eq!(bufs.len(), 1);
+            assert_eq!(bufs[0].len(), 512);
+            assert_eq!(pkt.bufs_mut(4096)[0].len(), 1024);
         }
 
         // Test case: read-only RX packet header.
@@ -552,6 +674,13 @@ mod tests {
             expect_asm_error!(rx, test_ctx, handler_ctx, VsockError::HdrDescTooSmall(_));
         }
 
+        // Test case: read-only RX packet buffer.
+        {
+            create_context!(test_ctx, handler_ctx);
+            handler_ctx.guest_rxvq.dtable[1].flags.set(0);
+            expect_asm_error!(rx, test_ctx, handler_ctx, VsockError::UnwritableDescriptor);
+        }
+
         // Test case: RX descriptor chain is missing the packet buffer descriptor.
         {
             create_context!(test_ctx, handler_ctx);
@@ -562,6 +691,55 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_rx_packet_multi_desc() {
+        const FLAGS: u16 = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
+
+        let test_ctx = TestContext::new();
+        let guest_rxvq = GuestQ::new(GuestAddress(0x0060_0000), &test_ctx.mem, 8);
+        let mut rxvq = guest_rxvq.create_queue();
+
+        // A header descriptor, followed by data descriptors of 1 KiB, none, 2 KiB and 4 KiB,
+        // made available twice.
+        guest_rxvq.dtable[0].set(0x0070_0000, VSOCK_PKT_HDR_SIZE as u32, FLAGS, 1);
+        guest_rxvq.dtable[1].set(0x0070_1000, 1024, FLAGS, 2);
+        guest_rxvq.dtable[2].set(0x0070_2000, 0, FLAGS, 3);
+        guest_rxvq.dtable[3].set(0x0070_3000, 2048, FLAGS, 4);
+        guest_rxvq.dtable[4].set(0x0070_4000, 4096, VIRTQ_DESC_F_WRITE, 0);
+        guest_rxvq.avail.ring[0].set(0);
+        guest_rxvq.avail.ring[1].set(0);
+        guest_rxvq.avail.idx.set(2);
+
+        // The packet buffer takes in the following descriptors, skipping the empty one, up to the
+        // max packet size.
+        let mut pkt =
+            VsockPacket::from_rx_virtq_head(&rxvq.pop(&test_ctx.mem).unwrap(), 5000).unwrap();
+        assert_eq!(pkt.buf().unwrap().len(), 1024);
+        assert_eq!(pkt.buf_len(), 5000);
+        assert_eq!(pkt.more_bufs.len(), 2);
+
+        // Vectored access spans descriptors, up to the requested length.
+        let lens: Vec<usize> = pkt.bufs_mut(4000).iter().map(|buf| buf.len()).collect();
+        assert_eq!(lens, vec![1024, 2048, 928]);
+        for buf in pkt.bufs_mut(4000).iter_mut() {
+            buf.fill(0xaa);
+        }
+        let byte_at = |addr: u64| test_ctx.mem.read_obj::<u8>(GuestAddress(addr)).unwrap();
+        assert_eq!(byte_at(0x0070_1000 + 1023), 0xaa);
+        assert_eq!(byte_at(0x0070_3000 + 2047), 0xaa);
+        assert_eq!(byte_at(0x0070_4000 + 927), 0xaa);
+        assert_eq!(byte_at(0x0070_4000 + 928), 0);
+
+        // The chain may end before the max packet size.
+        let pkt = VsockPacket::from_rx_virtq_head(
+            &rxvq.pop(&test_ctx.mem).unwrap(),
+            DEFAULT_MAX_PKT_BUF_SIZE,
+        )
+        .unwrap();
+        assert_eq!(pkt.buf_len(), 1024 + 2048 + 4096);
+        assert_eq!(pkt.more_bufs.len(), 2);
+    }
+
     #[test]
     #[allow(clippy::cognitive_complexity)]
     fn test_packet_hdr_accessors() {
@@ -581,6 +759,7 @@ mod tests {
             &handler_ctx.device.queues[RXQ_INDEX]
                 .pop(&test_ctx.mem)
                 .unwrap(),
+            DEFAULT_MAX_PKT_BUF_SIZE,
         )
         .unwrap();
 
@@ -669,6 +848,7 @@ mod tests {
             &handler_ctx.device.queues[RXQ_INDEX]
                 .pop(&test_ctx.mem)
                 .unwrap(),
+            DEFAULT_MAX_PKT_BUF_SIZE,
         )
         .unwrap();
 
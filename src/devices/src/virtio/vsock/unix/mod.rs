@@ -5,23 +5,54 @@
 /// This module implements the Unix Domain Sockets backend for vsock - a mediator between
 /// guest-side AF_VSOCK sockets and host-side AF_UNIX sockets. The heavy lifting is performed by
 /// `muxer::VsockMuxer`, a connection multiplexer that uses `super::csm::VsockConnection` for
-/// handling vsock connection states.
+/// handling vsock connection states. `muxer_shards::VsockShardedMuxer` spreads the connections
+/// over several of those, each one running on its own thread.
 /// Check out `muxer.rs` for a more detailed explanation of the inner workings of this backend.
 mod muxer;
-mod muxer_killq;
+mod muxer_ports;
 mod muxer_rxq;
+mod muxer_shards;
+mod muxer_slab;
+mod muxer_sockopts;
+mod muxer_timers;
 
-pub use muxer::VsockMuxer as VsockUnixBackend;
+pub use muxer_shards::VsockShardedMuxer as VsockUnixBackend;
 
 mod defs {
-    /// Maximum number of established connections that we can handle.
-    pub const MAX_CONNECTIONS: usize = 1023;
+    /// Maximum number of established connections that we can handle, per muxer shard.
+    pub const MAX_CONNECTIONS: usize = 32768;
 
-    /// Size of the muxer RX packet queue.
+    /// The first host-side port assigned to host-initiated connections.
+    pub const LOCAL_PORT_BASE: u32 = 1 << 30;
+
+    /// The number of host-side ports, starting at `LOCAL_PORT_BASE`, that can be assigned to
+    /// host-initiated connections.
+    pub const LOCAL_PORT_RANGE: usize = 1 << 20;
+
+    /// Maximum number of muxer shards, unless set otherwise.
+    pub const DEFAULT_MAX_SHARDS: usize = 4;
+
+    /// Number of bytes a connection may yield to the guest per turn of the muxer RX queue, unless
+    /// it's given a larger weight.
+    pub const MUXER_RX_QUANTUM: u32 = 16 * 1024;
+
+    /// Maximum RX weight of a connection.
+    pub const MAX_RX_WEIGHT: u32 = 64;
+
+    /// Memory that the TX buffers of the connections of all the muxer shards may take, including
+    /// what the connections with grown windows hold on to for them.
+    pub const TX_BUF_BUDGET: usize = 128 * 1024 * 1024;
+
+    /// Maximum number of RST packets, for guest packets that don't belong to any connection, in
+    /// the muxer RX packet queue.
     pub const MUXER_RXQ_SIZE: usize = 256;
 
-    /// Size of the muxer connection kill queue.
-    pub const MUXER_KILLQ_SIZE: usize = 128;
+    /// Number of slots in the muxer timer wheel.
+    pub const TIMER_WHEEL_SLOTS: usize = 512;
+
+    /// Duration of a muxer timer wheel tick, i.e. the resolution of the connection timers, in
+    /// millis.
+    pub const TIMER_WHEEL_TICK_MS: u64 = 10;
 }
 
 #[derive(Debug)]
@@ -40,6 +71,8 @@ pub enum Error {
     EpollAdd(std::io::Error),
     /// Error creating an epoll FD.
     EpollFdCreate(std::io::Error),
+    /// Error creating or cloning the RX readiness event of the muxer shards.
+    EventFd(std::io::Error),
     /// The host made an invalid vsock port connection request.
     InvalidPortRequest,
     /// Error accepting a new connection from the host-side Unix socket.
@@ -50,6 +83,10 @@ pub enum Error {
     UnixConnect(std::io::Error),
     /// Error reading from host-side Unix socket.
     UnixRead(std::io::Error),
+    /// Error spawning the thread of a muxer shard.
+    ShardSpawn(std::io::Error),
+    /// Error creating the timer FD of a muxer shard.
+    TimerFdCreate(std::io::Error),
     /// Error connecting to a host-side TCP address.
     TcpConnect(std::io::Error),
     /// Muxer connection limit reached.
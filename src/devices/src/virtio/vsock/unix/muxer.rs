@@ -29,27 +29,35 @@ use libc::unlink;
 ///    The muxer gets notified about all of these events, because, as a `VsockEpollListener`
 ///    implementor, it gets to register a nested epoll FD into the main VMM epolling loop. All
 ///    other pollable FDs are then registered under this nested epoll FD.
-///    To route all these events to their handlers, the muxer uses another `HashMap` object,
-///    mapping `RawFd`s to `EpollListener`s.
-use std::collections::{HashMap, HashSet};
-use std::net::Ipv4Addr;
+///    To route all these events to their handlers, the muxer keeps the connections, along with
+///    the wrapped listeners, in a `FdSlab` of `EpollListener`s. Events are reported by the FD
+///    they occurred on (which is also its epoll token), and the slab maps it to the listener's
+///    id, by which the rest of the muxer state (connection map, RX queue, timers) refers to it.
+use std::collections::HashMap;
+use std::io;
 use std::net::Shutdown;
+use std::net::{Ipv4Addr, SocketAddrV4};
 use std::net::{TcpListener, TcpStream};
 use std::os::raw::c_char;
-use std::os::unix::io::{AsRawFd, RawFd};
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
 use std::os::unix::net::{UnixListener, UnixStream};
+use std::sync::Arc;
+use std::time::Duration;
 
 use utils::epoll::{ControlOperation, Epoll, EpollEvent, EventSet};
 
-use super::super::csm::{CommonStream, ConnState, Error as CsmError};
+use super::super::csm::{CommonStream, ConnState, Error as CsmError, TxBudget};
 use super::super::defs::uapi;
-use super::super::packet::VsockPacket;
+use super::super::packet::{VsockPacket, VSOCK_PKT_HDR_SIZE};
 use super::super::{
     Result as VsockResult, VsockBackend, VsockChannel, VsockEpollListener, VsockError,
 };
 use super::defs;
-use super::muxer_killq::MuxerKillQ;
+use super::muxer_ports::LocalPortBitmap;
 use super::muxer_rxq::MuxerRxQ;
+use super::muxer_slab::FdSlab;
+use super::muxer_sockopts::SockOpts;
+use super::muxer_timers::TimerWheel;
 use super::MuxerConnection;
 use super::{Error, Result};
 
@@ -72,19 +80,123 @@ impl CommonStream for TcpStream {
     }
 }
 
-/// A unique identifier of a `MuxerConnection` object. Connections are stored in a hash map,
-/// keyed by a `ConnMapKey` object.
+/// Create a non-blocking stream socket in `domain`, with the socket options `opts`, and start
+/// connecting it to `addr`, of `len` bytes.
+///
+/// Returns the socket, and whether it is already connected. If it isn't, the connect is in
+/// progress, and the socket will be reported writable once it's resolved.
+fn start_connect<S: FromRawFd>(
+    domain: libc::c_int,
+    addr: *const libc::sockaddr,
+    len: libc::socklen_t,
+    opts: &SockOpts,
+) -> io::Result<(S, bool)> {
+    // Safe because this doesn't modify any memory and we check the return value.
+    let fd = unsafe { libc::socket(domain, libc::SOCK_STREAM, 0) };
+    if fd < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    // Safe because we just created `fd`, and nothing else owns it. It will be closed along with
+    // `stream` if we return early.
+    let stream = unsafe { S::from_raw_fd(fd) };
+
+    // Safe because `fd` is valid, these don't modify any memory, and we check the return values.
+    if unsafe { libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC) } < 0
+        || unsafe { libc::fcntl(fd, libc::F_SETFL, libc::O_NONBLOCK) } < 0
+    {
+        return Err(io::Error::last_os_error());
+    }
+    // The buffer sizes have to be set before connecting, for the TCP window to scale to them.
+    opts.apply(fd);
+
+    // Safe because the caller provides a valid address of `len` bytes, and we check the return
+    // value.
+    if unsafe { libc::connect(fd, addr, len) } == 0 {
+        return Ok((stream, true));
+    }
+    let err = io::Error::last_os_error();
+    if err.raw_os_error() == Some(libc::EINPROGRESS) {
+        Ok((stream, false))
+    } else {
+        Err(err)
+    }
+}
+
+/// Start connecting to the TCP address `addr`, without blocking. See `start_connect()`.
+fn start_tcp_connect(addr: SocketAddrV4, opts: &SockOpts) -> io::Result<(TcpStream, bool)> {
+    // Safe because `sockaddr_in` is a plain C struct, for which all zeroes is a valid value.
+    let mut sin: libc::sockaddr_in = unsafe { std::mem::zeroed() };
+    #[cfg(target_os = "macos")]
+    {
+        sin.sin_len = std::mem::size_of::<libc::sockaddr_in>() as u8;
+    }
+    sin.sin_family = libc::AF_INET as libc::sa_family_t;
+    sin.sin_port = addr.port().to_be();
+    sin.sin_addr.s_addr = u32::from(*addr.ip()).to_be();
+
+    start_connect(
+        libc::AF_INET,
+        &sin as *const libc::sockaddr_in as *const libc::sockaddr,
+        std::mem::size_of::<libc::sockaddr_in>() as libc::socklen_t,
+        opts,
+    )
+}
+
+/// Start connecting to the Unix socket at `path`, without blocking. See `start_connect()`.
+///
+/// Note that this fails with `EAGAIN`, instead of waiting, if the listener's backlog is full.
+fn start_unix_connect(path: &str, opts: &SockOpts) -> io::Result<(UnixStream, bool)> {
+    // Safe because `sockaddr_un` is a plain C struct, for which all zeroes is a valid value.
+    let mut sun: libc::sockaddr_un = unsafe { std::mem::zeroed() };
+    // The path must leave room for its null terminator.
+    if path.len() >= sun.sun_path.len() {
+        return Err(io::Error::from(io::ErrorKind::InvalidInput));
+    }
+    #[cfg(target_os = "macos")]
+    {
+        sun.sun_len = std::mem::size_of::<libc::sockaddr_un>() as u8;
+    }
+    sun.sun_family = libc::AF_UNIX as libc::sa_family_t;
+    for (dst, src) in sun.sun_path.iter_mut().zip(path.as_bytes()) {
+        *dst = *src as c_char;
+    }
+
+    start_connect(
+        libc::AF_UNIX,
+        &sun as *const libc::sockaddr_un as *const libc::sockaddr,
+        std::mem::size_of::<libc::sockaddr_un>() as libc::socklen_t,
+        opts,
+    )
+}
+
+/// A unique identifier of a `MuxerConnection` object. The listener ids of the connections are
+/// stored in a hash map, keyed by a `ConnMapKey` object.
 #[derive(Clone, Copy, Debug, Eq, Hash, PartialEq)]
 pub struct ConnMapKey {
     local_port: u32,
     peer_port: u32,
 }
 
+impl ConnMapKey {
+    /// The key of the connection a guest-generated packet belongs to.
+    pub fn from_peer_pkt(pkt: &VsockPacket) -> Self {
+        Self {
+            local_port: pkt.dst_port(),
+            peer_port: pkt.src_port(),
+        }
+    }
+
+    /// The index of the muxer shard, out of `shards`, that handles this connection.
+    pub fn shard(&self, shards: usize) -> usize {
+        (self.local_port ^ self.peer_port) as usize % shards
+    }
+}
+
 /// A muxer RX queue item.
-#[derive(Debug)]
+#[derive(Clone, Copy, Debug)]
 pub enum MuxerRx {
-    /// The packet must be fetched from the connection identified by `ConnMapKey`.
-    ConnRx(ConnMapKey),
+    /// The packet must be fetched from the connection with this listener id.
+    ConnRx(usize),
     /// The muxer must produce an RST packet.
     RstPkt { local_port: u32, peer_port: u32 },
 }
@@ -93,20 +205,28 @@ pub enum MuxerRx {
 enum EpollListener {
     /// The listener is a `MuxerConnection`, identified by `key`, and interested in the events
     /// in `evset`. Since `MuxerConnection` implements `VsockEpollListener`, notifications will
-    /// be forwarded to the listener via `VsockEpollListener::notify()`.
+    /// be forwarded to the listener via `VsockEpollListener::notify()`. An empty `evset` means
+    /// that the connection isn't registered under the nested epoll FD at the moment.
     Connection {
         key: ConnMapKey,
         evset: EventSet,
+        conn: Box<MuxerConnection>,
     },
 
+    /// The connections accepted by this listener get the socket options `opts`.
     WrapUnix {
         port: u32,
         listener: UnixListener,
+        opts: SockOpts,
     },
 
+    /// The connections accepted by this listener get `rx_weight` times the RX quantum of the
+    /// others, and the socket options `opts`.
     WrapTcp {
         port: u32,
         listener: TcpListener,
+        rx_weight: u32,
+        opts: SockOpts,
     },
 }
 
@@ -114,14 +234,20 @@ enum EpollListener {
 pub struct VsockMuxer {
     /// Guest CID.
     cid: u64,
-    /// A hash map used to store the active UNIX connections.
-    conn_map: HashMap<ConnMapKey, MuxerConnection>,
-    /// A hash map used to store epoll event listeners / handlers.
-    listener_map: HashMap<RawFd, EpollListener>,
-    /// A hash map used to store wrapped listeners.
-    wrap_map: HashMap<u32, RawFd>,
+    /// A hash map used to look up the listener ids of the active UNIX connections.
+    conn_map: HashMap<ConnMapKey, usize>,
+    /// The epoll event listeners / handlers, i.e. the active connections and the wrapped
+    /// listeners, indexed by their id.
+    listeners: FdSlab<EpollListener>,
+    /// A hash map used to look up the listener ids of the wrapped listeners.
+    wrap_map: HashMap<u32, usize>,
     /// An optional hash map with host to guest port mappings.
     host_port_map: Option<HashMap<u16, u16>>,
+    /// A hash map with the RX weights of the connections accepted by the wrapped listeners of the
+    /// (mapped) guest ports. Guest-initiated connections always get the default weight.
+    host_port_weights: HashMap<u16, u32>,
+    /// The memory budget the connections of all the shards grow their windows out of.
+    tx_budget: Arc<TxBudget>,
     /// The RX queue. Items in this queue are consumed by `VsockMuxer::recv_pkt()`, and
     /// produced
     /// - by `VsockMuxer::send_pkt()` (e.g. RST in response to a connection request packet);
@@ -129,15 +255,20 @@ pub struct VsockMuxer {
     /// - in response to EPOLLIN events (e.g. data available to be read from an AF_UNIX
     ///   socket).
     rxq: MuxerRxQ,
-    /// A queue used for terminating connections that are taking too long to shut down.
-    killq: MuxerKillQ,
+    /// The connection timers, used for terminating connections that are taking too long to
+    /// connect or shut down, and for retrying unanswered credit requests.
+    timers: TimerWheel,
     /// The nested epoll event set, used to register epoll listeners.
     epoll: Epoll,
-    /// A hash set used to keep track of used host-side (local) ports, in order to assign local
+    /// A bitmap used to keep track of used host-side (local) ports, in order to assign local
     /// ports to host-initiated connections.
-    local_port_set: HashSet<u32>,
-    /// The last used host-side port.
-    local_port_last: u32,
+    local_ports: LocalPortBitmap,
+    /// The index of this muxer among the shards of the backend, and their number. Host-initiated
+    /// connections get a local port that maps them to this shard.
+    shard_index: usize,
+    shard_count: usize,
+    /// The time allowed for the host-side stream of a guest-initiated connection to connect.
+    connect_timeout: Duration,
 }
 
 impl VsockChannel for VsockMuxer {
@@ -148,14 +279,8 @@ impl VsockChannel for VsockMuxer {
     /// - `Err(VsockError::NoData)`: there was no available data with which to fill in the
     ///   packet.
     fn recv_pkt(&mut self, pkt: &mut VsockPacket) -> VsockResult<()> {
-        // We'll look for instructions on how to build the RX packet in the RX queue. If the
-        // queue is empty, that doesn't necessarily mean we don't have any pending RX, since
-        // the queue might be out-of-sync. If that's the case, we'll attempt to sync it first,
-        // and then try to pop something out again.
-        if self.rxq.is_empty() && !self.rxq.is_synced() {
-            self.rxq = MuxerRxQ::from_conn_map(&self.conn_map);
-        }
-
+        // We'll look for instructions on how to build the RX packet in the RX queue, which
+        // holds every connection that has pending RX.
         while let Some(rx) = self.rxq.pop() {
             let res = match rx {
                 // We need to build an RST packet, going from `local_port` to `peer_port`.
@@ -178,11 +303,24 @@ impl VsockChannel for VsockMuxer {
 
                 // We'll defer building the packet to this connection, since it has something
                 // to say.
-                MuxerRx::ConnRx(key) => {
+                MuxerRx::ConnRx(id) => {
                     let mut conn_res = Err(VsockError::NoData);
-                    self.apply_conn_mutation(key, |conn| {
+                    self.apply_conn_mutation(id, |conn| {
                         conn_res = conn.recv_pkt(pkt);
                     });
+
+                    // Let the RX queue know how much of this connection's turn the packet
+                    // took, so it can move on to the next connection when it's over.
+                    let cost = match conn_res {
+                        Ok(()) => VSOCK_PKT_HDR_SIZE + pkt.len() as usize,
+                        Err(_) => 0,
+                    };
+                    let has_more = match self.listeners.get(id) {
+                        Some(EpollListener::Connection { conn, .. }) => conn.has_pending_rx(),
+                        _ => false,
+                    };
+                    self.rxq.charge(id, cost, has_more);
+
                     conn_res
                 }
             };
@@ -236,32 +374,35 @@ impl VsockChannel for VsockMuxer {
             return Ok(());
         }
 
-        if !self.conn_map.contains_key(&conn_key) {
-            // This packet can't be routed to any active connection (based on its src and dst
-            // ports).  The only orphan / unroutable packets we know how to handle are
-            // connection requests.
-            match pkt.op() {
-                uapi::VSOCK_OP_REQUEST_EX => {
-                    // A connection request with extended parameters
-                    self.handle_peer_request_ex_pkt(pkt)
-                        .unwrap_or_else(|_| self.enq_rst(pkt.dst_port(), pkt.src_port()))
-                }
-                uapi::VSOCK_OP_WRAP_LISTEN => {
-                    // A listen request for wrapped socket with extended parameters
-                    self.handle_peer_wrap_listen(pkt)
-                        .unwrap_or_else(|_| self.enq_rst(pkt.dst_port(), pkt.src_port()))
-                }
-                uapi::VSOCK_OP_WRAP_CLOSE => {
-                    // A close request for wrapped socket
-                    self.handle_peer_wrap_close(pkt);
-                }
-                _ => {
-                    // Send back an RST, to let the drive know we weren't expecting this packet.
-                    self.enq_rst(pkt.dst_port(), pkt.src_port());
+        let id = match self.conn_map.get(&conn_key) {
+            Some(&id) => id,
+            None => {
+                // This packet can't be routed to any active connection (based on its src and
+                // dst ports).  The only orphan / unroutable packets we know how to handle are
+                // connection requests.
+                match pkt.op() {
+                    uapi::VSOCK_OP_REQUEST_EX => {
+                        // A connection request with extended parameters
+                        self.handle_peer_request_ex_pkt(pkt)
+                            .unwrap_or_else(|_| self.enq_rst(pkt.dst_port(), pkt.src_port()))
+                    }
+                    uapi::VSOCK_OP_WRAP_LISTEN => {
+                        // A listen request for wrapped socket with extended parameters
+                        self.handle_peer_wrap_listen(pkt)
+                            .unwrap_or_else(|_| self.enq_rst(pkt.dst_port(), pkt.src_port()))
+                    }
+                    uapi::VSOCK_OP_WRAP_CLOSE => {
+                        // A close request for wrapped socket
+                        self.handle_peer_wrap_close(pkt);
+                    }
+                    _ => {
+                        // Send back an RST, to let the drive know we weren't expecting this packet.
+                        self.enq_rst(pkt.dst_port(), pkt.src_port());
+                    }
                 }
+                return Ok(());
             }
-            return Ok(());
-        }
+        };
 
         // Right, we know where to send this packet, then (to `conn_key`).
         // However, if this is an RST, we have to forcefully terminate the connection, so
@@ -271,19 +412,76 @@ impl VsockChannel for VsockMuxer {
             return Ok(());
         }
 
+        // Socket options go straight to the host stream, which is what the connection is
+        // polled on.
+        if pkt.op() == uapi::VSOCK_OP_SETSOCKOPT {
+            if let Some(fd) = self.listeners.fd(id) {
+                SockOpts::from_setsockopt(pkt).apply(fd);
+            }
+            return Ok(());
+        }
+
         // Alright, everything looks in order - forward this packet to its owning connection.
         let mut res: VsockResult<()> = Ok(());
-        self.apply_conn_mutation(conn_key, |conn| {
+        self.apply_conn_mutation(id, |conn| {
             res = conn.send_pkt(pkt);
         });
 
         res
     }
 
+    /// Deliver a batch of guest-generated packets, in order, to their destinations in the vsock
+    /// backend.
+    ///
+    /// Consecutive data packets for the same connection are handed to it together, so it can
+    /// write them to its host stream all at once.
+    ///
+    /// Returns:
+    /// always the size of the batch - all the packets have been consumed.
+    fn send_pkts(&mut self, pkts: &[VsockPacket]) -> usize {
+        let mut sent = 0;
+        while sent < pkts.len() {
+            let key = ConnMapKey::from_peer_pkt(&pkts[sent]);
+            let run = pkts[sent..]
+                .iter()
+                .take_while(|pkt| {
+                    pkt.op() == uapi::VSOCK_OP_RW
+                        && pkt.dst_cid() == uapi::VSOCK_HOST_CID
+                        && ConnMapKey::from_peer_pkt(pkt) == key
+                })
+                .count();
+
+            match self.conn_map.get(&key) {
+                Some(&id) if run > 1 => {
+                    debug!(
+                        "vsock: muxer.send[rxq.len={}]: {} data packets for (lp={}, pp={})",
+                        self.rxq.len(),
+                        run,
+                        key.local_port,
+                        key.peer_port
+                    );
+                    let batch = &pkts[sent..(sent + run)];
+                    self.apply_conn_mutation(id, |conn| {
+                        conn.send_pkts(batch);
+                    });
+                    sent += run;
+                }
+                _ => {
+                    if self.send_pkt(&pkts[sent]).is_err() {
+                        break;
+                    }
+                    sent += 1;
+                }
+            }
+        }
+
+        sent
+    }
+
     /// Check if the muxer has any pending RX data, with which to fill a guest-provided RX
     /// buffer.
     fn has_pending_rx(&self) -> bool {
-        !self.rxq.is_empty() || !self.rxq.is_synced()
+        !self.rxq.is_empty()
     }
 }
 
@@ -336,29 +534,58 @@ impl VsockEpollListener for VsockMuxer {
 impl VsockBackend for VsockMuxer {}
 
 impl VsockMuxer {
-    /// Muxer constructor.
-    pub fn new(cid: u64, host_port_map: Option<HashMap<u16, u16>>) -> Result<Self> {
+    /// Create the muxer for shard `shard_index`, out of `shard_count`. The host-side streams of
+    /// guest-initiated connections are given `connect_timeout` to connect.
+    pub fn new_shard(
+        cid: u64,
+        host_port_map: Option<HashMap<u16, u16>>,
+        host_port_weights: HashMap<u16, u32>,
+        tx_budget: Arc<TxBudget>,
+        connect_timeout: Duration,
+        shard_index: usize,
+        shard_count: usize,
+    ) -> Result<Self> {
         #[allow(unused_mut)]
         let mut epoll = Epoll::new().map_err(Error::EpollFdCreate)?;
         #[cfg(target_os = "macos")]
         epoll.disable_clears();
 
+        let timers = TimerWheel::new().map_err(Error::TimerFdCreate)?;
+        epoll
+            .ctl(
+                ControlOperation::Add,
+                timers.as_raw_fd(),
+                &EpollEvent::new(EventSet::IN, timers.as_raw_fd() as u64),
+            )
+            .map_err(Error::EpollAdd)?;
+
         let muxer = Self {
             cid,
             epoll,
             rxq: MuxerRxQ::new(),
-            conn_map: HashMap::with_capacity(defs::MAX_CONNECTIONS),
-            listener_map: HashMap::with_capacity(defs::MAX_CONNECTIONS + 1),
-            wrap_map: HashMap::with_capacity(defs::MAX_CONNECTIONS),
+            conn_map: HashMap::new(),
+            listeners: FdSlab::new(),
+            wrap_map: HashMap::new(),
             host_port_map,
-            killq: MuxerKillQ::new(),
-            local_port_last: (1u32 << 30) - 1,
-            local_port_set: HashSet::with_capacity(defs::MAX_CONNECTIONS),
+            host_port_weights,
+            tx_budget,
+            timers,
+            local_ports: LocalPortBitmap::new(),
+            shard_index,
+            shard_count,
+            connect_timeout,
         };
 
         Ok(muxer)
     }
 
+    /// Get the number of bytes this muxer may yield to the guest per turn, when taking turns
+    /// with the other shards: the RX quantum of the connection at the front of its RX queue, so
+    /// a weighted connection gets its share across shards too.
+    pub fn rx_quantum(&self) -> u32 {
+        self.rxq.front_quantum().unwrap_or(defs::MUXER_RX_QUANTUM)
+    }
+
     /// Handle/dispatch an epoll event to its listener.
     fn handle_event(&mut self, fd: RawFd, evset: EventSet) {
         debug!(
@@ -366,23 +593,42 @@ impl VsockMuxer {
             fd, evset
         );
 
-        match self.listener_map.get_mut(&fd) {
+        if fd == self.timers.as_raw_fd() {
+            self.handle_timers();
+            return;
+        }
+
+        let id = match self.listeners.id(fd) {
+            Some(id) => id,
+            None => {
+                info!("vsock: unexpected event: fd={:?}, evset={:?}", fd, evset);
+                return;
+            }
+        };
+
+        match self.listeners.get_mut(id) {
             // This event needs to be forwarded to a `MuxerConnection` that is listening for
             // it.
-            Some(EpollListener::Connection { key, evset }) => {
-                let key_copy = *key;
+            Some(EpollListener::Connection { evset, .. }) => {
                 let evset_copy = *evset;
                 // The handling of this event will most probably mutate the state of the
                 // receiving conection. We'll need to check for new pending RX, event set
                 // mutation, and all that, so we're wrapping the event delivery inside those
                 // checks.
-                self.apply_conn_mutation(key_copy, |conn| {
+                self.apply_conn_mutation(id, |conn| {
                     conn.notify(evset_copy);
                 });
             }
 
-            Some(EpollListener::WrapTcp { port, listener }) => {
+            Some(EpollListener::WrapTcp {
+                port,
+                listener,
+                rx_weight,
+                opts,
+            }) => {
                 let peer_port = *port;
+                let rx_weight = *rx_weight;
+                let opts = *opts;
 
                 debug!("WrapTcp: peer_port {}", peer_port);
 
@@ -401,8 +647,13 @@ impl VsockMuxer {
                             .map(|_| stream)
                             .map_err(Error::WrapUnixAccept)
                     })
+                    .map(|stream| {
+                        // The guest may still have turned Nagle's algorithm back on.
+                        opts.apply(stream.as_raw_fd());
+                        stream
+                    })
                     .and_then(|stream| {
-                        let local_port = self.allocate_local_port();
+                        let local_port = self.allocate_local_port(peer_port)?;
                         self.add_connection(
                             ConnMapKey {
                                 local_port,
@@ -414,16 +665,27 @@ impl VsockMuxer {
                                 self.cid,
                                 local_port,
                                 peer_port,
+                                self.tx_budget.clone(),
                             ),
+                            rx_weight,
                         )
+                        .map_err(|err| {
+                            self.free_local_port(local_port);
+                            err
+                        })
                     })
                     .unwrap_or_else(|err| {
                         warn!("vsock: unable to accept wrapped TCP connection: {:?}", err);
                     });
             }
 
-            Some(EpollListener::WrapUnix { port, listener }) => {
+            Some(EpollListener::WrapUnix {
+                port,
+                listener,
+                opts,
+            }) => {
                 let peer_port = *port;
+                let opts = *opts;
 
                 listener
                     .accept()
@@ -434,8 +696,12 @@ impl VsockMuxer {
                             .map(|_| stream)
                             .map_err(Error::WrapUnixAccept)
                     })
+                    .map(|stream| {
+                        opts.apply(stream.as_raw_fd());
+                        stream
+                    })
                     .and_then(|stream| {
-                        let local_port = self.allocate_local_port();
+                        let local_port = self.allocate_local_port(peer_port)?;
                         self.add_connection(
                             ConnMapKey {
                                 local_port,
@@ -447,8 +713,14 @@ impl VsockMuxer {
                                 self.cid,
                                 local_port,
                                 peer_port,
+                                self.tx_budget.clone(),
                             ),
+                            1,
                         )
+                        .map_err(|err| {
+                            self.free_local_port(local_port);
+                            err
+                        })
                     })
                     .unwrap_or_else(|err| {
                         warn!("vsock: unable to accept wrapped unix connection: {:?}", err);
@@ -460,15 +732,14 @@ impl VsockMuxer {
         }
     }
 
-    /// Add a new connection to the active connection pool.
-    fn add_connection(&mut self, key: ConnMapKey, conn: MuxerConnection) -> Result<()> {
-        // We might need to make room for this new connection, so let's sweep the kill queue
-        // first.  It's fine to do this here because:
-        // - unless the kill queue is out of sync, this is a pretty inexpensive operation; and
-        // - we are under no pressure to respect any accurate timing for connection
-        //   termination.
-        self.sweep_killq();
-
+    /// Add a new connection to the active connection pool, with `rx_weight` times the RX
+    /// quantum of a default connection.
+    fn add_connection(
+        &mut self,
+        key: ConnMapKey,
+        conn: MuxerConnection,
+        rx_weight: u32,
+    ) -> Result<()> {
         if self.conn_map.len() >= defs::MAX_CONNECTIONS {
             info!(
                 "vsock: muxer connection limit reached ({})",
@@ -477,78 +748,72 @@ impl VsockMuxer {
             return Err(Error::TooManyConnections);
         }
 
-        self.add_listener(
-            conn.as_raw_fd(),
+        let fd = conn.as_raw_fd();
+        let evset = conn.get_polled_evset();
+        if !evset.is_empty() {
+            self.epoll
+                .ctl(
+                    ControlOperation::Add,
+                    fd,
+                    &EpollEvent::new(evset, fd as u64),
+                )
+                .map_err(Error::EpollAdd)?;
+        }
+
+        let has_pending_rx = conn.has_pending_rx();
+        let next_timer = conn.next_timer();
+        let id = self.listeners.insert(
+            fd,
             EpollListener::Connection {
                 key,
-                evset: conn.get_polled_evset(),
+                evset,
+                conn: Box::new(conn),
             },
-        )
-        .map(|_| {
-            if conn.has_pending_rx() {
-                // We can safely ignore any error in adding a connection RX indication. Worst
-                // case scenario, the RX queue will get desynchronized, but we'll handle that
-                // the next time we need to yield an RX packet.
-                self.rxq.push(MuxerRx::ConnRx(key));
-            }
-            self.conn_map.insert(key, conn);
-        })
+        );
+
+        let rx_weight = rx_weight.clamp(1, defs::MAX_RX_WEIGHT);
+        self.rxq.set_quantum(id, defs::MUXER_RX_QUANTUM * rx_weight);
+        if has_pending_rx {
+            self.rxq.push(MuxerRx::ConnRx(id));
+        }
+        if let Some(deadline) = next_timer {
+            self.timers.schedule(id, deadline);
+        }
+        self.conn_map.insert(key, id);
+
+        Ok(())
     }
 
     /// Remove a connection from the active connection poll.
     fn remove_connection(&mut self, key: ConnMapKey) {
-        if let Some(conn) = self.conn_map.remove(&key) {
-            self.remove_listener(conn.as_raw_fd());
+        if let Some(id) = self.conn_map.remove(&key) {
+            self.remove_listener(id);
         }
         self.free_local_port(key.local_port);
     }
 
-    /// Schedule a connection for immediate termination.
-    /// I.e. as soon as we can also let our peer know we're dropping the connection, by sending
-    /// it an RST packet.
-    fn kill_connection(&mut self, key: ConnMapKey) {
-        let mut had_rx = false;
-        self.conn_map.entry(key).and_modify(|conn| {
-            had_rx = conn.has_pending_rx();
-            conn.kill();
-        });
-        // This connection will now have an RST packet to yield, so we need to add it to the RX
-        // queue.  However, there's no point in doing that if it was already in the queue.
-        if !had_rx {
-            // We can safely ignore any error in adding a connection RX indication. Worst case
-            // scenario, the RX queue will get desynchronized, but we'll handle that the next
-            // time we need to yield an RX packet.
-            self.rxq.push(MuxerRx::ConnRx(key));
-        }
-    }
-
-    /// Register a new epoll listener under the muxer's nested epoll FD.
-    fn add_listener(&mut self, fd: RawFd, listener: EpollListener) -> Result<()> {
-        let evset = match listener {
-            EpollListener::Connection { evset, .. } => evset,
-            EpollListener::WrapUnix { .. } => EventSet::IN,
-            EpollListener::WrapTcp { .. } => EventSet::IN,
-        };
-
+    /// Register a new wrapped listener, polled on `fd`, under the muxer's nested epoll FD.
+    /// Returns its id.
+    fn add_listener(&mut self, fd: RawFd, listener: EpollListener) -> Result<usize> {
         self.epoll
             .ctl(
                 ControlOperation::Add,
                 fd,
-                &EpollEvent::new(evset, fd as u64),
+                &EpollEvent::new(EventSet::IN, fd as u64),
             )
-            .map(|_| {
-                self.listener_map.insert(fd, listener);
-            })
-            .map_err(Error::EpollAdd)?;
-
-        Ok(())
+            .map(|_| self.listeners.insert(fd, listener))
+            .map_err(Error::EpollAdd)
     }
 
     /// Remove (and return) a previously registered epoll listener.
-    fn remove_listener(&mut self, fd: RawFd) -> Option<EpollListener> {
-        let maybe_listener = self.listener_map.remove(&fd);
+    fn remove_listener(&mut self, id: usize) -> Option<EpollListener> {
+        let (fd, listener) = self.listeners.remove(id)?;
 
-        if maybe_listener.is_some() {
+        let registered = match &listener {
+            EpollListener::Connection { evset, .. } => !evset.is_empty(),
+            _ => true,
+        };
+        if registered {
             self.epoll
                 .ctl(ControlOperation::Delete, fd, &EpollEvent::default())
                 .unwrap_or_else(|err| {
@@ -559,30 +824,37 @@ impl VsockMuxer {
                 });
         }
 
-        maybe_listener
+        Some(listener)
     }
 
-    /// Allocate a host-side port to be assigned to a new host-initiated connection.
-    fn allocate_local_port(&mut self) -> u32 {
-        // TODO: this doesn't seem very space-efficient.
-        // Mybe rewrite this to limit port range and use a bitmap?
-        //
-
-        loop {
-            self.local_port_last = (self.local_port_last + 1) & !(1 << 31) | (1 << 30);
-            if self.local_port_set.insert(self.local_port_last) {
-                break;
-            }
-        }
-        self.local_port_last
+    /// Allocate a host-side port to be assigned to a new host-initiated connection, to
+    /// `peer_port`. The resulting connection is always handled by this shard.
+    fn allocate_local_port(&mut self, peer_port: u32) -> Result<u32> {
+        let (shard_index, shard_count) = (self.shard_index, self.shard_count);
+        self.local_ports
+            .allocate(|local_port| {
+                let key = ConnMapKey {
+                    local_port,
+                    peer_port,
+                };
+                key.shard(shard_count) == shard_index
+            })
+            .ok_or_else(|| {
+                info!(
+                    "vsock: muxer ran out of local ports ({} in use)",
+                    self.local_ports.len()
+                );
+                Error::TooManyConnections
+            })
     }
 
     /// Mark a previously used host-side port as free.
     fn free_local_port(&mut self, port: u32) {
-        self.local_port_set.remove(&port);
+        self.local_ports.free(port);
     }
 
     fn handle_peer_request_ex_pkt(&mut self, pkt: &VsockPacket) -> Result<()> {
+        let opts = SockOpts::from_request(pkt);
         match pkt.sa_family() {
             Some(uapi::AF_INET) => {
                 let port = pkt.inet_port().ok_or(Error::AddressInvalidPort)?;
@@ -591,23 +863,30 @@ impl VsockMuxer {
                 debug!("vsock ports src={} dst={}", pkt.src_port(), pkt.dst_port());
                 debug!("should connect to {}:{}", ipv4_addr, port);
 
-                TcpStream::connect(format!("{}:{}", ipv4_addr, port))
-                    .and_then(|stream| stream.set_nonblocking(true).map(|_| stream))
+                // The response is only sent once the connect is resolved, so a slow or
+                // unreachable destination doesn't hold up the event loop in the meantime.
+                start_tcp_connect(SocketAddrV4::new(ipv4_addr, port), &opts)
                     .map_err(Error::TcpConnect)
-                    .and_then(|stream| {
+                    .and_then(|(stream, connected)| {
+                        let mut conn = MuxerConnection::new_peer_wrap_init(
+                            Box::new(stream) as Box<dyn CommonStream>,
+                            uapi::VSOCK_HOST_CID,
+                            self.cid,
+                            pkt.dst_port(),
+                            pkt.src_port(),
+                            pkt.buf_alloc(),
+                            self.tx_budget.clone(),
+                        );
+                        if !connected {
+                            conn.wait_for_connect(self.connect_timeout);
+                        }
                         self.add_connection(
                             ConnMapKey {
                                 local_port: pkt.dst_port(),
                                 peer_port: pkt.src_port(),
                             },
-                            MuxerConnection::new_peer_wrap_init(
-                                Box::new(stream) as Box<dyn CommonStream>,
-                                uapi::VSOCK_HOST_CID,
-                                self.cid,
-                                pkt.dst_port(),
-                                pkt.src_port(),
-                                pkt.buf_alloc(),
-                            ),
+                            conn,
+                            1,
                         )
                     })
             }
@@ -615,23 +894,28 @@ impl VsockMuxer {
                 let path = pkt.unix_path().ok_or(Error::AddressInvalidPath)?;
 
                 debug!("should connect to unix socket at: {:?}", path);
-                UnixStream::connect(path)
-                    .and_then(|stream| stream.set_nonblocking(true).map(|_| stream))
+                start_unix_connect(path, &opts)
                     .map_err(Error::UnixConnect)
-                    .and_then(|stream| {
+                    .and_then(|(stream, connected)| {
+                        let mut conn = MuxerConnection::new_peer_init(
+                            Box::new(stream) as Box<dyn CommonStream>,
+                            uapi::VSOCK_HOST_CID,
+                            self.cid,
+                            pkt.dst_port(),
+                            pkt.src_port(),
+                            pkt.buf_alloc(),
+                            self.tx_budget.clone(),
+                        );
+                        if !connected {
+                            conn.wait_for_connect(self.connect_timeout);
+                        }
                         self.add_connection(
                             ConnMapKey {
                                 local_port: pkt.dst_port(),
                                 peer_port: pkt.src_port(),
                             },
-                            MuxerConnection::new_peer_init(
-                                Box::new(stream) as Box<dyn CommonStream>,
-                                uapi::VSOCK_HOST_CID,
-                                self.cid,
-                                pkt.dst_port(),
-                                pkt.src_port(),
-                                pkt.buf_alloc(),
-                            ),
+                            conn,
+                            1,
                         )
                     })
             }
@@ -668,15 +952,20 @@ impl VsockMuxer {
                     .and_then(|sock| sock.set_nonblocking(true).map(|_| sock))
                     .map_err(Error::WrapTcpBind)
                     .and_then(|sock| {
-                        let fd = sock.as_raw_fd();
-                        self.add_listener(
-                            fd,
+                        let id = self.add_listener(
+                            sock.as_raw_fd(),
                             EpollListener::WrapTcp {
                                 port: pkt.src_port(),
                                 listener: sock,
+                                rx_weight: self
+                                    .host_port_weights
+                                    .get(&guest_port)
+                                    .copied()
+                                    .unwrap_or(1),
+                                opts: SockOpts::from_request(pkt),
                             },
                         )?;
-                        self.wrap_map.insert(pkt.src_port(), fd);
+                        self.wrap_map.insert(pkt.src_port(), id);
                         Ok(())
                     })
             }
@@ -694,15 +983,15 @@ impl VsockMuxer {
                     .and_then(|sock| sock.set_nonblocking(true).map(|_| sock))
                     .map_err(Error::WrapUnixBind)
                     .and_then(|sock| {
-                        let fd = sock.as_raw_fd();
-                        self.add_listener(
-                            fd,
+                        let id = self.add_listener(
+                            sock.as_raw_fd(),
                             EpollListener::WrapUnix {
                                 port: pkt.src_port(),
                                 listener: sock,
+                                opts: SockOpts::from_request(pkt),
                             },
                         )?;
-                        self.wrap_map.insert(pkt.src_port(), fd);
+                        self.wrap_map.insert(pkt.src_port(), id);
                         Ok(())
                     })
             }
@@ -718,25 +1007,29 @@ impl VsockMuxer {
     }
 
     fn handle_peer_wrap_close(&mut self, pkt: &VsockPacket) {
-        if let Some(fd) = self.wrap_map.remove(&pkt.src_port()) {
-            self.remove_listener(fd);
+        if let Some(id) = self.wrap_map.remove(&pkt.src_port()) {
+            self.remove_listener(id);
         }
     }
 
-    /// Perform an action that might mutate a connection's state.
+    /// Perform an action that might mutate the state of the connection `id`.
     ///
     /// This is used as shorthand for repetitive tasks that need to be performed after a
     /// connection object mutates. E.g.
     /// - update the connection's epoll listener;
     /// - schedule the connection to be queried for RX data;
     /// - kill the connection if an unrecoverable error occurs.
-    fn apply_conn_mutation<F>(&mut self, key: ConnMapKey, mut_fn: F)
+    fn apply_conn_mutation<F>(&mut self, id: usize, mut_fn: F)
     where
         F: FnOnce(&mut MuxerConnection),
     {
-        if let Some(conn) = self.conn_map.get_mut(&key) {
-            let had_rx = conn.has_pending_rx();
-            let was_expiring = conn.will_expire();
+        let fd = match self.listeners.fd(id) {
+            Some(fd) => fd,
+            None => return,
+        };
+        if let Some(EpollListener::Connection { key, evset, conn }) = self.listeners.get_mut(id) {
+            let key = *key;
+            let prev_timer = conn.next_timer();
             let prev_state = conn.state();
 
             mut_fn(conn);
@@ -751,95 +1044,76 @@ impl VsockMuxer {
                     });
             }
 
-            // If the connection wasn't previously scheduled for RX, add it to our RX queue.
-            if !had_rx && conn.has_pending_rx() {
-                self.rxq.push(MuxerRx::ConnRx(key));
+            // If the connection has pending RX, make sure it's in our RX queue. This is a no-op
+            // if it already is.
+            if conn.has_pending_rx() {
+                self.rxq.push(MuxerRx::ConnRx(id));
             }
 
-            // If the connection wasn't previously scheduled for termination, add it to the
-            // kill queue.
-            if !was_expiring && conn.will_expire() {
-                // It's safe to unwrap here, since `conn.will_expire()` already guaranteed that
-                // an `conn.expiry` is available.
-                self.killq.push(key, conn.expiry().unwrap());
+            // If the connection has a new timer, schedule it. Its previous one, if any, is left
+            // in the timer wheel, to find nothing to do when it expires.
+            match conn.next_timer() {
+                Some(deadline) if prev_timer != Some(deadline) => {
+                    self.timers.schedule(id, deadline);
+                }
+                _ => (),
             }
 
-            let fd = conn.as_raw_fd();
             let new_evset = conn.get_polled_evset();
+            if new_evset == *evset {
+                return;
+            }
+            debug!(
+                "vsock: updating listener for (lp={}, pp={}): old={:?}, new={:?}",
+                key.local_port, key.peer_port, *evset, new_evset
+            );
+
             if new_evset.is_empty() {
-                // If the connection no longer needs epoll notifications, remove its listener
-                // from our list.
-                self.remove_listener(fd);
+                // If the connection no longer needs epoll notifications, stop polling its FD.
+                self.epoll
+                    .ctl(ControlOperation::Delete, fd, &EpollEvent::default())
+                    .unwrap_or_else(|err| {
+                        warn!(
+                            "vosck muxer: error removing epoll listener for fd {:?}: {:?}",
+                            fd, err
+                        );
+                    });
+                *evset = new_evset;
                 return;
             }
-            if let Some(EpollListener::Connection { evset, .. }) = self.listener_map.get_mut(&fd) {
-                if *evset != new_evset {
-                    // If the set of events that the connection is interested in has changed,
-                    // we need to update its epoll listener.
-                    debug!(
-                        "vsock: updating listener for (lp={}, pp={}): old={:?}, new={:?}",
-                        key.local_port, key.peer_port, *evset, new_evset
-                    );
 
-                    *evset = new_evset;
-                    self.epoll
-                        .ctl(
-                            ControlOperation::Modify,
-                            fd,
-                            &EpollEvent::new(new_evset, fd as u64),
-                        )
-                        .unwrap_or_else(|err| {
-                            // This really shouldn't happen, like, ever. However, "famous last
-                            // words" and all that, so let's just kill it with fire, and walk away.
-                            self.kill_connection(key);
-                            error!(
-                                "vsock: error updating epoll listener for (lp={}, pp={}): {:?}",
-                                key.local_port, key.peer_port, err
-                            );
-                        });
-                }
+            // If the set of events that the connection is interested in has changed, we need to
+            // update its epoll listener, or add it back if it had previously asked to be removed
+            // (by returning an empty event set via `get_polled_evset()`).
+            let op = if evset.is_empty() {
+                ControlOperation::Add
             } else {
-                // The connection had previously asked to be removed from the listener map (by
-                // returning an empty event set via `get_polled_fd()`), but now wants back in.
-                self.add_listener(
-                    fd,
-                    EpollListener::Connection {
-                        key,
-                        evset: new_evset,
-                    },
-                )
-                .unwrap_or_else(|err| {
-                    self.kill_connection(key);
+                ControlOperation::Modify
+            };
+            match self
+                .epoll
+                .ctl(op, fd, &EpollEvent::new(new_evset, fd as u64))
+            {
+                Ok(_) => *evset = new_evset,
+                Err(err) => {
+                    // This really shouldn't happen, like, ever. However, "famous last words" and
+                    // all that, so let's just kill it with fire, and walk away.
+                    conn.kill();
+                    self.rxq.push(MuxerRx::ConnRx(id));
                     error!(
                         "vsock: error updating epoll listener for (lp={}, pp={}): {:?}",
                         key.local_port, key.peer_port, err
                     );
-                });
+                }
             }
         }
     }
 
-    /// Check if any connections have timed out, and if so, schedule them for immediate
-    /// termination.
-    fn sweep_killq(&mut self) {
-        while let Some(key) = self.killq.pop() {
-            // Connections don't get removed from the kill queue when their kill timer is
-            // disarmed, since that would be a costly operation. This means we must check if
-            // the connection has indeed expired, prior to killing it.
-            let mut kill = false;
-            self.conn_map
-                .entry(key)
-                .and_modify(|conn| kill = conn.has_expired());
-            if kill {
-                self.kill_connection(key);
-            }
-        }
-
-        if self.killq.is_empty() && !self.killq.is_synced() {
-            self.killq = MuxerKillQ::from_conn_map(&self.conn_map);
-            // If we've just re-created the kill queue, we can sweep it again; maybe there's
-            // more to kill.
-            self.sweep_killq();
+    /// Let the connections whose timers have expired handle them. E.g. the connections that
+    /// have timed out get scheduled for immediate termination.
+    fn handle_timers(&mut self) {
+        for id in self.timers.expire() {
+            self.apply_conn_mutation(id, |conn| conn.handle_timers());
         }
     }
 
@@ -867,6 +1141,8 @@ mod tests {
     use super::super::super::tests::TestContext as VsockTestContext;
     use super::*;
 
+    use crate::virtio::vsock::csm::defs::CONN_CONNECT_TIMEOUT_MS;
+    use crate::virtio::vsock::defs::DEFAULT_MAX_PKT_BUF_SIZE;
     use crate::virtio::vsock::device::RXQ_INDEX;
 
     const PEER_CID: u64 = 3;
@@ -886,10 +1162,20 @@ mod tests {
                 &handler_ctx.device.queues[RXQ_INDEX]
                     .pop(&vsock_test_ctx.mem)
                     .unwrap(),
+                DEFAULT_MAX_PKT_BUF_SIZE,
             )
             .unwrap();
 
-            let muxer = VsockMuxer::new(PEER_CID, None).unwrap();
+            let muxer = VsockMuxer::new_shard(
+                PEER_CID,
+                None,
+                HashMap::new(),
+                Arc::new(TxBudget::new(defs::TX_BUF_BUDGET)),
+                Duration::from_millis(CONN_CONNECT_TIMEOUT_MS),
+                0,
+                1,
+            )
+            .unwrap();
             Self {
                 _vsock_test_ctx: vsock_test_ctx,
                 pkt,
@@ -918,6 +1204,44 @@ mod tests {
         fn recv(&mut self) {
             self.muxer.recv_pkt(&mut self.pkt).unwrap();
         }
+
+        fn init_request_ex_pkt(&mut self, local_port: u32, peer_port: u32, addr: SocketAddrV4) {
+            self.init_pkt(local_port, peer_port, uapi::VSOCK_OP_REQUEST_EX);
+            let buf = self.pkt.buf_mut().unwrap();
+            buf[0..2].copy_from_slice(&uapi::AF_INET.to_le_bytes());
+            buf[2..4].copy_from_slice(&addr.port().to_be_bytes());
+            buf[4..8].copy_from_slice(&addr.ip().octets());
+        }
+
+        fn set_sock_opts(&mut self, offset: usize, opts: &[(u32, u32)]) {
+            let buf = self.pkt.buf_mut().unwrap();
+            buf[offset..(offset + 4)].copy_from_slice(&(opts.len() as u32).to_le_bytes());
+            for (i, (opt, value)) in opts.iter().enumerate() {
+                let pair = offset + 4 + 8 * i;
+                buf[pair..(pair + 4)].copy_from_slice(&opt.to_le_bytes());
+                buf[(pair + 4)..(pair + 8)].copy_from_slice(&value.to_le_bytes());
+            }
+            self.pkt.set_len((offset + 4 + 8 * opts.len()) as u32);
+        }
+
+        fn conn_state(&self, key: ConnMapKey) -> ConnState {
+            match self.muxer.listeners.get(self.muxer.conn_map[&key]) {
+                Some(EpollListener::Connection { conn, .. }) => conn.state(),
+                _ => panic!("no connection for {:?}", key),
+            }
+        }
+
+        // Wait for the muxer's nested epoll FD to report some event, and let the muxer handle it.
+        fn wait_and_notify(&mut self) {
+            let mut pfd = libc::pollfd {
+                fd: self.muxer.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            // Safe because we pass a single, valid, pollfd struct.
+            assert_eq!(unsafe { libc::poll(&mut pfd, 1, 5000) }, 1);
+            self.muxer.notify(EventSet::IN);
+        }
     }
 
     #[test]
@@ -974,4 +1298,125 @@ mod tests {
         ctx.send();
         assert!(!ctx.muxer.has_pending_rx());
     }
+
+    #[test]
+    fn test_local_port_shard() {
+        const PEER_PORT: u32 = 1025;
+
+        let mut muxer = VsockMuxer::new_shard(
+            PEER_CID,
+            None,
+            HashMap::new(),
+            Arc::new(TxBudget::new(defs::TX_BUF_BUDGET)),
+            Duration::from_millis(CONN_CONNECT_TIMEOUT_MS),
+            2,
+            4,
+        )
+        .unwrap();
+        for _ in 0..16 {
+            let local_port = muxer.allocate_local_port(PEER_PORT).unwrap();
+            let key = ConnMapKey {
+                local_port,
+                peer_port: PEER_PORT,
+            };
+            assert_eq!(key.shard(4), 2);
+        }
+        assert_eq!(muxer.local_ports.len(), 16);
+    }
+
+    #[test]
+    fn test_peer_request_ex() {
+        const LOCAL_PORT: u32 = 1026;
+        const PEER_PORT: u32 = 1025;
+
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = match listener.local_addr().unwrap() {
+            std::net::SocketAddr::V4(addr) => addr,
+            _ => unreachable!(),
+        };
+
+        let mut ctx = MuxerTestContext::new();
+        ctx.init_request_ex_pkt(LOCAL_PORT, PEER_PORT, addr);
+        ctx.send();
+
+        // The response is only sent once the host-side stream is connected.
+        let key = ConnMapKey {
+            local_port: LOCAL_PORT,
+            peer_port: PEER_PORT,
+        };
+        while ctx.conn_state(key) == ConnState::PeerConnecting {
+            assert!(!ctx.muxer.has_pending_rx());
+            ctx.wait_and_notify();
+        }
+        assert!(ctx.muxer.has_pending_rx());
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RESPONSE_EX);
+        assert_eq!(ctx.pkt.src_port(), LOCAL_PORT);
+        assert_eq!(ctx.pkt.dst_port(), PEER_PORT);
+        let _stream = listener.accept().unwrap();
+
+        // Connecting to a port nobody listens on gets the connection reset.
+        drop(listener);
+        ctx.init_request_ex_pkt(LOCAL_PORT + 1, PEER_PORT, addr);
+        ctx.send();
+        while !ctx.muxer.has_pending_rx() {
+            ctx.wait_and_notify();
+        }
+        ctx.recv();
+        assert_eq!(ctx.pkt.op(), uapi::VSOCK_OP_RST);
+        assert_eq!(ctx.pkt.src_port(), LOCAL_PORT + 1);
+        assert_eq!(ctx.pkt.dst_port(), PEER_PORT);
+        assert!(!ctx.muxer.conn_map.contains_key(&ConnMapKey {
+            local_port: LOCAL_PORT + 1,
+            peer_port: PEER_PORT,
+        }));
+    }
+
+    #[test]
+    fn test_peer_sock_opts() {
+        const LOCAL_PORT: u32 = 1026;
+        const PEER_PORT: u32 = 1025;
+
+        fn nodelay(fd: RawFd) -> bool {
+            let mut value: libc::c_int = 0;
+            let mut len = std::mem::size_of::<libc::c_int>() as libc::socklen_t;
+            // Safe because `value` and `len` are valid for the call, and we check the result.
+            let ret = unsafe {
+                libc::getsockopt(
+                    fd,
+                    libc::IPPROTO_TCP,
+                    libc::TCP_NODELAY,
+                    &mut value as *mut libc::c_int as *mut libc::c_void,
+                    &mut len,
+                )
+            };
+            assert_eq!(ret, 0);
+            value != 0
+        }
+
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = match listener.local_addr().unwrap() {
+            std::net::SocketAddr::V4(addr) => addr,
+            _ => unreachable!(),
+        };
+        let key = ConnMapKey {
+            local_port: LOCAL_PORT,
+            peer_port: PEER_PORT,
+        };
+
+        // The options following the address of a connection request apply to the host stream.
+        let mut ctx = MuxerTestContext::new();
+        ctx.init_request_ex_pkt(LOCAL_PORT, PEER_PORT, addr);
+        ctx.set_sock_opts(uapi::SOCKADDR_IN_SIZE, &[(uapi::VSOCK_SOCKOPT_NODELAY, 1)]);
+        ctx.send();
+        let fd = ctx.muxer.listeners.fd(ctx.muxer.conn_map[&key]).unwrap();
+        assert!(nodelay(fd));
+
+        // And so do those set later on.
+        ctx.init_pkt(LOCAL_PORT, PEER_PORT, uapi::VSOCK_OP_SETSOCKOPT);
+        ctx.set_sock_opts(0, &[(uapi::VSOCK_SOCKOPT_NODELAY, 0)]);
+        ctx.send();
+        assert!(!nodelay(fd));
+        assert!(!ctx.muxer.has_pending_rx());
+    }
 }
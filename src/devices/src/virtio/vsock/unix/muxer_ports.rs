@@ -0,0 +1,164 @@
+/// `LocalPortBitmap` keeps track of the host-side (local) ports `VsockMuxer` assigns to
+/// host-initiated connections, as a bitmap over `defs::LOCAL_PORT_RANGE` ports, starting at
+/// `defs::LOCAL_PORT_BASE`.
+///
+/// Ports are handed out next-fit, so a port that was just freed isn't reused right away. The
+/// bitmap starts out empty, and it only doubles once more than half of the ports it covers are in
+/// use, so it stays proportional to the number of live connections (and so do the scans for a
+/// free port).
+use super::defs;
+
+const WORD_BITS: usize = u64::BITS as usize;
+const MAX_WORDS: usize = defs::LOCAL_PORT_RANGE / WORD_BITS;
+
+pub struct LocalPortBitmap {
+    /// The bitmap, with a bit set for every port in use.
+    words: Vec<u64>,
+    /// The number of ports in use.
+    used: usize,
+    /// The index of the bit the next scan starts at.
+    next: usize,
+}
+
+impl LocalPortBitmap {
+    pub fn new() -> Self {
+        Self {
+            words: Vec::new(),
+            used: 0,
+            next: 0,
+        }
+    }
+
+    /// Allocate a free port for which `accept` returns true.
+    ///
+    /// Returns `None` if there is no such port left in the range.
+    pub fn allocate<F>(&mut self, accept: F) -> Option<u32>
+    where
+        F: Fn(u32) -> bool,
+    {
+        if self.used * 2 >= self.words.len() * WORD_BITS {
+            self.grow();
+        }
+
+        loop {
+            if let Some(port) = self.scan(&accept) {
+                self.used += 1;
+                return Some(port);
+            }
+            if !self.grow() {
+                return None;
+            }
+        }
+    }
+
+    /// Mark a previously allocated port as free. Ports outside the range are ignored.
+    pub fn free(&mut self, port: u32) {
+        let index = match port.checked_sub(defs::LOCAL_PORT_BASE) {
+            Some(index) => index as usize,
+            None => return,
+        };
+        if let Some(word) = self.words.get_mut(index / WORD_BITS) {
+            let mask = 1u64 << (index % WORD_BITS);
+            if *word & mask != 0 {
+                *word &= !mask;
+                self.used -= 1;
+            }
+        }
+    }
+
+    /// Get the number of ports in use.
+    pub fn len(&self) -> usize {
+        self.used
+    }
+
+    // Find, and mark as used, the first free port accepted by `accept`, starting at `self.next`
+    // and wrapping around the current end of the bitmap.
+    fn scan<F>(&mut self, accept: &F) -> Option<u32>
+    where
+        F: Fn(u32) -> bool,
+    {
+        let len = self.words.len();
+        if len == 0 {
+            return None;
+        }
+        let start = self.next % (len * WORD_BITS);
+        let start_bit = start % WORD_BITS;
+
+        // The word `start` is in is visited twice: first from `start` on, and last up to it.
+        for i in 0..=len {
+            let w = (start / WORD_BITS + i) % len;
+            let mut free = !self.words[w];
+            if i == 0 {
+                free &= !0u64 << start_bit;
+            } else if i == len {
+                free &= !(!0u64 << start_bit);
+            }
+
+            while free != 0 {
+                let bit = free.trailing_zeros() as usize;
+                free &= free - 1;
+
+                let index = w * WORD_BITS + bit;
+                let port = defs::LOCAL_PORT_BASE + index as u32;
+                if accept(port) {
+                    self.words[w] |= 1u64 << bit;
+                    self.next = index + 1;
+                    return Some(port);
+                }
+            }
+        }
+
+        None
+    }
+
+    // Double the bitmap, and have the next scan start with the new ports. Returns false if it
+    // already covers the whole range.
+    fn grow(&mut self) -> bool {
+        let len = self.words.len();
+        if len >= MAX_WORDS {
+            return false;
+        }
+        self.words.resize((len * 2).clamp(1, MAX_WORDS), 0);
+        self.next = len * WORD_BITS;
+        true
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_local_port_bitmap() {
+        let mut ports = LocalPortBitmap::new();
+
+        // Ports are handed out in order, skipping the rejected ones.
+        let even: Vec<u32> = (0..4)
+            .map(|_| ports.allocate(|port| port % 2 == 0).unwrap())
+            .collect();
+        let base = defs::LOCAL_PORT_BASE;
+        assert_eq!(even, vec![base, base + 2, base + 4, base + 6]);
+        assert_eq!(ports.len(), 4);
+
+        // Freed ports aren't reused until the scan wraps around.
+        ports.free(base + 2);
+        ports.free(base + 2);
+        ports.free(1024);
+        assert_eq!(ports.len(), 3);
+        assert_eq!(ports.allocate(|_| true), Some(base + 7));
+
+        // The bitmap only grows as needed.
+        for _ in 0..60 {
+            ports.allocate(|_| true).unwrap();
+        }
+        assert_eq!(ports.len(), 64);
+        assert_eq!(ports.words.len(), 2);
+
+        // Running out of ports is reported.
+        while ports.allocate(|_| true).is_some() {}
+        assert_eq!(ports.len(), defs::LOCAL_PORT_RANGE);
+        assert_eq!(ports.allocate(|_| true), None);
+        ports.free(base + 1000);
+        assert_eq!(ports.allocate(|_| true), Some(base + 1000));
+    }
+}
@@ -5,111 +5,161 @@
 /// `MuxerRxQ` implements a helper object that `VsockMuxer` can use for queuing RX (host -> guest)
 /// packets (or rather instructions on how to build said packets).
 ///
-/// Under ideal operation, every connection, that has pending RX data, will be present in the muxer
-/// RX queue. However, since the RX queue is smaller than the connection pool, it may, under some
-/// conditions, become full, meaning that it can no longer account for all the connections that can
-/// yield RX data.  When that happens, we say that it is no longer "synchronized" (i.e. with the
-/// connection pool).  A desynchronized RX queue still holds valid data, and the muxer will
-/// continue to pop packets from it. However, when a desynchronized queue is drained, additional
-/// data may still be available, so the muxer will have to perform a more costly walk of the entire
-/// connection pool to find it.  This walk is performed here, as part of building an RX queue from
-/// the connection pool. When an out-of-sync is drained, the muxer will discard it, and attempt to
-/// rebuild a synced one.
-use std::collections::{HashMap, VecDeque};
-
-use super::super::VsockChannel;
+/// Every connection that has pending RX data is present in the muxer RX queue, exactly once. The
+/// connections are identified by their id in the muxer's listener table, and the queue keeps its
+/// per-connection state in a table indexed by that id, which also tells whether a connection is
+/// already queued, so pushing it again is a no-op. Since the queue only holds the connections that
+/// are ready, it can't overflow, and the muxer never has to walk its entire connection pool to
+/// find RX data.
+///
+/// The queued connections are served by deficit round robin: each connection gets to yield up
+/// to its quantum of bytes (headers included) per turn, before going to the back of the queue.
+/// A packet may take a connection past its quantum, in which case the overdraft is taken off its
+/// next turns. This way, a connection moving bulk data can only delay the others by its quantum
+/// (plus a packet), however big its packets are, and connections can be given a larger share of
+/// the RX bandwidth by giving them a larger quantum.
+///
+/// A queued id may outlive its connection, and even be reused by a new one in the meantime. Both
+/// are harmless: the muxer will just find no data, or the data of the new connection (which would
+/// have been queued anyway), when popping it.
+///
+/// RST packets, for guest packets that don't belong to any connection, are queued along with the
+/// connections. Those have no other storage, so at most `defs::MUXER_RXQ_SIZE` of them are kept.
+use std::collections::VecDeque;
+
 use super::defs;
-use super::muxer::{ConnMapKey, MuxerRx};
-use super::MuxerConnection;
+use super::muxer::MuxerRx;
+
+/// The RX scheduling state of a connection slot.
+#[derive(Clone, Copy)]
+struct RxSlot {
+    /// Whether the connection is in the queue.
+    queued: bool,
+    /// The number of bytes the connection may still yield in its current turn.
+    deficit: i64,
+    /// The number of bytes the connection may yield per turn.
+    quantum: u32,
+}
+
+impl Default for RxSlot {
+    fn default() -> Self {
+        Self {
+            queued: false,
+            deficit: 0,
+            quantum: defs::MUXER_RX_QUANTUM,
+        }
+    }
+}
 
 /// The muxer RX queue.
 pub struct MuxerRxQ {
     /// The RX queue data.
     q: VecDeque<MuxerRx>,
-    /// The RX queue sync status.
-    synced: bool,
+    /// The scheduling state of the connections, indexed by id.
+    slots: Vec<RxSlot>,
+    /// The number of RST packets in the queue.
+    rst_count: usize,
 }
 
 impl MuxerRxQ {
-    const SIZE: usize = defs::MUXER_RXQ_SIZE;
+    const MAX_RSTS: usize = defs::MUXER_RXQ_SIZE;
 
     /// Trivial RX queue constructor.
     pub fn new() -> Self {
         Self {
-            q: VecDeque::with_capacity(Self::SIZE),
-            synced: true,
+            q: VecDeque::new(),
+            slots: Vec::new(),
+            rst_count: 0,
         }
     }
 
-    /// Attempt to build an RX queue, that is synchronized to the connection pool.
-    /// Note: the resulting queue may still be desynchronized, if there are too many connections
-    ///       that have pending RX data. In that case, the muxer will first drain this queue, and
-    ///       then try again to build a synchronized one.
-    pub fn from_conn_map(conn_map: &HashMap<ConnMapKey, MuxerConnection>) -> Self {
-        let mut q = VecDeque::new();
-        let mut synced = true;
-
-        for (key, conn) in conn_map.iter() {
-            if !conn.has_pending_rx() {
-                continue;
-            }
-            if q.len() >= Self::SIZE {
-                synced = false;
-                break;
-            }
-            q.push_back(MuxerRx::ConnRx(*key));
-        }
-        Self { q, synced }
+    /// Set the quantum of the (new) connection `id`.
+    pub fn set_quantum(&mut self, id: usize, quantum: u32) {
+        let slot = self.slot_mut(id);
+        slot.quantum = quantum.max(1);
+        slot.deficit = 0;
     }
 
     /// Push a new RX item to the queue.
     ///
-    /// A push will fail when:
-    /// - trying to push a connection key onto an out-of-sync, or full queue; or
-    /// - trying to push an RST onto a queue already full of RSTs.
-    /// RSTs take precedence over connections, because connections can always be queried for
-    /// pending RX data later. Aside from this queue, there is no other storage for RSTs, so
-    /// failing to push one means that we have to drop the packet.
+    /// Pushing a connection always succeeds, and does nothing if the connection is already
+    /// queued. Otherwise, it starts a new turn at the back of the queue. Pushing an RST fails if
+    /// the queue is already holding `defs::MUXER_RXQ_SIZE` of them, in which case we have to drop
+    /// the packet.
     ///
     /// Returns:
     /// - `true` if the new item has been successfully queued; or
     /// - `false` if there was no room left in the queue.
     pub fn push(&mut self, rx: MuxerRx) -> bool {
-        // Pushing to a non-full, synchronized queue will always succeed.
-        if self.is_synced() && !self.is_full() {
-            self.q.push_back(rx);
-            return true;
-        }
-
         match rx {
-            MuxerRx::RstPkt { .. } => {
-                // If we just failed to push an RST packet, we'll look through the queue, trying to
-                // find a connection key that we could evict. This way, the queue does lose sync,
-                // but we don't drop any packets.
-                for qi in self.q.iter_mut().rev() {
-                    if let MuxerRx::ConnRx(_) = qi {
-                        *qi = rx;
-                        self.synced = false;
-                        return true;
-                    }
+            MuxerRx::ConnRx(id) => {
+                let slot = self.slot_mut(id);
+                if !slot.queued {
+                    slot.queued = true;
+                    slot.deficit = slot.quantum as i64;
+                    self.q.push_back(rx);
                 }
             }
-            MuxerRx::ConnRx(_) => {
-                self.synced = false;
+            MuxerRx::RstPkt { .. } => {
+                if self.rst_count >= Self::MAX_RSTS {
+                    return false;
+                }
+                self.rst_count += 1;
+                self.q.push_back(rx);
             }
-        };
+        }
 
-        false
+        true
     }
 
-    /// Pop an RX item from the front of the queue.
+    /// Get the next RX item to be served.
+    ///
+    /// RSTs are removed from the queue right away. A connection, though, stays at the front of
+    /// the queue until the muxer reports, via `charge()`, what it yielded.
     pub fn pop(&mut self) -> Option<MuxerRx> {
-        self.q.pop_front()
+        loop {
+            let rx = *self.q.front()?;
+            match rx {
+                MuxerRx::RstPkt { .. } => {
+                    self.q.pop_front();
+                    self.rst_count -= 1;
+                    return Some(rx);
+                }
+                MuxerRx::ConnRx(id) => {
+                    let slot = &mut self.slots[id];
+                    if slot.deficit > 0 {
+                        return Some(rx);
+                    }
+                    // This connection's turn is over. It gets a new quantum, and goes to the
+                    // back of the queue.
+                    slot.deficit += slot.quantum as i64;
+                    self.q.rotate_left(1);
+                }
+            }
+        }
+    }
+
+    /// Account for the `cost` bytes just yielded by the connection `id`, which must be the one
+    /// returned by the last `pop()`. The connection leaves the queue if it doesn't have any more
+    /// RX data.
+    pub fn charge(&mut self, id: usize, cost: usize, has_more: bool) {
+        debug_assert!(matches!(self.q.front(), Some(MuxerRx::ConnRx(front)) if *front == id));
+
+        let slot = &mut self.slots[id];
+        slot.deficit -= cost as i64;
+        if !has_more {
+            slot.queued = false;
+            self.q.pop_front();
+        }
     }
 
-    /// Check if the RX queue is synchronized with the connection pool.
-    pub fn is_synced(&self) -> bool {
-        self.synced
+    /// Get the quantum of the item at the front of the queue: that of its connection, or the
+    /// default one for an RST.
+    pub fn front_quantum(&self) -> Option<u32> {
+        self.q.front().map(|rx| match rx {
+            MuxerRx::ConnRx(id) => self.slots[*id].quantum,
+            MuxerRx::RstPkt { .. } => defs::MUXER_RX_QUANTUM,
+        })
     }
 
     /// Get the total number of items in the queue.
@@ -122,8 +172,91 @@ impl MuxerRxQ {
         self.len() == 0
     }
 
-    /// Check if the queue is full.
-    pub fn is_full(&self) -> bool {
-        self.len() == Self::SIZE
+    fn slot_mut(&mut self, id: usize) -> &mut RxSlot {
+        if id >= self.slots.len() {
+            self.slots.resize(id + 1, RxSlot::default());
+        }
+        &mut self.slots[id]
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Serve the RX queue `count` times, with every connection yielding `cost` bytes, and having
+    // more to yield. Returns the connections served, in order.
+    fn serve(rxq: &mut MuxerRxQ, count: usize, cost: usize) -> Vec<usize> {
+        (0..count)
+            .map(|_| match rxq.pop() {
+                Some(MuxerRx::ConnRx(id)) => {
+                    rxq.charge(id, cost, true);
+                    id
+                }
+                rx => panic!("unexpected RX item: {:?}", rx),
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_rxq_push_pop() {
+        let mut rxq = MuxerRxQ::new();
+
+        // Connections are only queued once, and leave the queue once they're done.
+        assert!(rxq.push(MuxerRx::ConnRx(3)));
+        assert!(rxq.push(MuxerRx::ConnRx(130)));
+        assert!(rxq.push(MuxerRx::ConnRx(3)));
+        assert_eq!(rxq.len(), 2);
+        assert!(matches!(rxq.pop(), Some(MuxerRx::ConnRx(3))));
+        rxq.charge(3, 100, false);
+        assert!(matches!(rxq.pop(), Some(MuxerRx::ConnRx(130))));
+        rxq.charge(130, 100, false);
+        assert!(rxq.pop().is_none());
+
+        // RSTs are bounded, but connections can still be queued past them.
+        for port in 0..MuxerRxQ::MAX_RSTS as u32 {
+            assert!(rxq.push(MuxerRx::RstPkt {
+                local_port: port,
+                peer_port: port,
+            }));
+        }
+        assert!(!rxq.push(MuxerRx::RstPkt {
+            local_port: 0,
+            peer_port: 0,
+        }));
+        assert!(rxq.push(MuxerRx::ConnRx(5)));
+        assert_eq!(rxq.len(), MuxerRxQ::MAX_RSTS + 1);
+        assert!(matches!(rxq.pop(), Some(MuxerRx::RstPkt { .. })));
+        assert!(rxq.push(MuxerRx::RstPkt {
+            local_port: 0,
+            peer_port: 0,
+        }));
+    }
+
+    #[test]
+    fn test_rxq_drr() {
+        const QUANTUM: u32 = 1000;
+
+        let mut rxq = MuxerRxQ::new();
+        rxq.set_quantum(3, QUANTUM);
+        rxq.set_quantum(4, QUANTUM);
+        rxq.set_quantum(5, 2 * QUANTUM);
+        rxq.push(MuxerRx::ConnRx(3));
+        rxq.push(MuxerRx::ConnRx(4));
+        rxq.push(MuxerRx::ConnRx(5));
+        assert_eq!(rxq.front_quantum(), Some(QUANTUM));
+
+        // Each connection is served up to its quantum per turn.
+        assert_eq!(serve(&mut rxq, 8, 500), vec![3, 3, 4, 4, 5, 5, 5, 5]);
+        // Packets larger than the quantum take a connection's next turns.
+        assert_eq!(serve(&mut rxq, 4, 3000), vec![3, 4, 5, 5]);
+        assert_eq!(serve(&mut rxq, 4, 500), vec![3, 3, 4, 4]);
+
+        // A connection that goes idle and comes back gets a fresh turn, at the back.
+        assert!(matches!(rxq.pop(), Some(MuxerRx::ConnRx(5))));
+        rxq.charge(5, 500, false);
+        rxq.push(MuxerRx::ConnRx(5));
+        assert_eq!(serve(&mut rxq, 4, 500), vec![3, 3, 4, 4]);
+        assert_eq!(serve(&mut rxq, 4, 500), vec![5, 5, 5, 5]);
     }
 }
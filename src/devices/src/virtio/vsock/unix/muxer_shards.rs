@@ -0,0 +1,393 @@
+//! `VsockShardedMuxer` spreads the connections of the Unix domain sockets backend over several
+//! `VsockMuxer` shards, each with its own nested epoll FD, connection map and RX queue, and its
+//! own thread waiting for and handling the events of its connections. This keeps the host side of
+//! busy connections (e.g. flushing their TX buffers, or resolving their connects) off the event
+//! loop the vsock device shares with the rest of the VM.
+//!
+//! Connections are assigned to shards by `ConnMapKey`. The device still moves all the packets
+//! through the sharded muxer: the ones sent by the guest are routed to the shard owning their
+//! connection, and the RX packets are taken from the shards by deficit round robin, the same way
+//! each shard serves its own connections: a shard yields up to the RX quantum of the connection at
+//! the front of its queue per turn, so weighted connections keep their share of the guest RX
+//! bandwidth over the connections of other shards. The shard threads signal an `EventFd`, polled
+//! by the device, whenever their shard has some RX packet to yield.
+
+use std::collections::HashMap;
+use std::io;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::sync::{Arc, Mutex, Weak};
+use std::thread;
+use std::time::Duration;
+
+use utils::epoll::EventSet;
+use utils::eventfd::EventFd;
+
+use super::super::csm::defs::CONN_CONNECT_TIMEOUT_MS;
+use super::super::csm::TxBudget;
+use super::super::defs::uapi;
+use super::super::packet::{VsockPacket, VSOCK_PKT_HDR_SIZE};
+use super::super::{
+    Result as VsockResult, VsockBackend, VsockChannel, VsockEpollListener, VsockError,
+};
+use super::defs;
+use super::muxer::{ConnMapKey, VsockMuxer};
+use super::{Error, Result};
+
+/// The body of a shard thread: waits for events on the shard's nested epoll FD, lets the shard
+/// handle them, and signals `rx_evt` if the shard has RX packets to yield. The connection timers
+/// are driven by the timerfd of the shard's timer wheel, registered with that same epoll FD, so
+/// there's no need to wake up otherwise. Returns once `exit_evt` is signaled, or the shard is
+/// gone.
+fn run_shard(shard: Weak<Mutex<VsockMuxer>>, epoll_fd: RawFd, rx_evt: EventFd, exit_evt: EventFd) {
+    loop {
+        let mut pfds = [
+            libc::pollfd {
+                fd: exit_evt.as_raw_fd(),
+                events: libc::POLLIN,
+                revents: 0,
+            },
+            libc::pollfd {
+                fd: epoll_fd,
+                events: libc::POLLIN,
+                revents: 0,
+            },
+        ];
+        // Safe because we pass a valid array of pollfd structs, along with its length, and check
+        // the return value.
+        let ret = unsafe { libc::poll(pfds.as_mut_ptr(), pfds.len() as libc::nfds_t, -1) };
+        if ret < 0 {
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                error!("vsock: muxer shard failed to poll: {:?}", err);
+                return;
+            }
+            continue;
+        }
+        // The shard's epoll FD may be closed, or even reused, once this is signaled, so it's
+        // checked first.
+        if pfds[0].revents != 0 {
+            return;
+        }
+
+        let shard = match shard.upgrade() {
+            Some(shard) => shard,
+            None => return,
+        };
+        let mut muxer = shard.lock().unwrap();
+        muxer.notify(EventSet::IN);
+        if muxer.has_pending_rx() {
+            if let Err(e) = rx_evt.write(1) {
+                error!("vsock: muxer shard failed to signal RX: {:?}", e);
+            }
+        }
+    }
+}
+
+/// The vsock connection multiplexer, split into shards.
+pub struct VsockShardedMuxer {
+    /// The shards, each one handled by its own thread.
+    shards: Vec<Arc<Mutex<VsockMuxer>>>,
+    /// Signaled by the shard threads when their shard has pending RX.
+    rx_evt: EventFd,
+    /// Signaled when the muxer is dropped, for the shard threads to exit. It's never read, so it
+    /// stays readable for all of them.
+    exit_evt: EventFd,
+    /// The shard whose turn it is to yield RX packets.
+    next_rx: usize,
+    /// The number of bytes each shard may still yield in its current turn, or `None` if it had
+    /// nothing to yield last time it was checked.
+    rx_deficits: Vec<Option<i64>>,
+}
+
+impl VsockChannel for VsockShardedMuxer {
+    /// Deliver a vsock packet to the guest vsock driver, from the shard whose turn it is, or the
+    /// next one that has some.
+    fn recv_pkt(&mut self, pkt: &mut VsockPacket) -> VsockResult<()> {
+        let count = self.shards.len();
+        // Stop once every shard has been found with nothing to yield, in a row.
+        let mut idle = 0;
+        while idle < count {
+            let index = self.next_rx;
+            let mut muxer = self.shards[index].lock().unwrap();
+            if !muxer.has_pending_rx() {
+                // The shard will start a fresh turn once it has RX again.
+                self.rx_deficits[index] = None;
+                idle += 1;
+            } else {
+                idle = 0;
+                let quantum = muxer.rx_quantum() as i64;
+                let deficit = self.rx_deficits[index].get_or_insert(quantum);
+                if *deficit > 0 {
+                    if muxer.recv_pkt(pkt).is_ok() {
+                        *deficit -= (VSOCK_PKT_HDR_SIZE + pkt.len() as usize) as i64;
+                        return Ok(());
+                    }
+                    // The shard's RX queue turned out to be empty, which will be noticed on the
+                    // next check.
+                    continue;
+                }
+                // This shard's turn is over. It gets a new quantum, and the next shard goes.
+                *deficit += quantum;
+            }
+            self.next_rx = (index + 1) % count;
+        }
+
+        Err(VsockError::NoData)
+    }
+
+    /// Deliver a guest-generated packet to the shard handling its connection.
+    fn send_pkt(&mut self, pkt: &VsockPacket) -> VsockResult<()> {
+        let index = self.shard_of(pkt);
+        self.shards[index].lock().unwrap().send_pkt(pkt)
+    }
+
+    /// Deliver a batch of guest-generated packets, in order, to the shards handling their
+    /// connections. Consecutive packets for the same shard are delivered together, under a
+    /// single lock of the shard.
+    fn send_pkts(&mut self, pkts: &[VsockPacket]) -> usize {
+        let mut sent = 0;
+        while sent < pkts.len() {
+            let index = self.shard_of(&pkts[sent]);
+            let run = pkts[sent..]
+                .iter()
+                .take_while(|pkt| self.shard_of(pkt) == index)
+                .count();
+
+            let count = self.shards[index]
+                .lock()
+                .unwrap()
+                .send_pkts(&pkts[sent..(sent + run)]);
+            sent += count;
+            if count < run {
+                break;
+            }
+        }
+
+        sent
+    }
+
+    /// Check if any shard has pending RX data.
+    fn has_pending_rx(&self) -> bool {
+        self.shards
+            .iter()
+            .any(|shard| shard.lock().unwrap().has_pending_rx())
+    }
+}
+
+impl AsRawFd for VsockShardedMuxer {
+    /// Get the FD to be registered for polling upstream: the event signaled by the shard threads.
+    fn as_raw_fd(&self) -> RawFd {
+        self.rx_evt.as_raw_fd()
+    }
+}
+
+impl VsockEpollListener for VsockShardedMuxer {
+    fn get_polled_evset(&self) -> EventSet {
+        EventSet::IN
+    }
+
+    /// Notify the muxer that some shard has pending RX. The device will fetch it right after.
+    fn notify(&mut self, _: EventSet) {
+        if let Err(e) = self.rx_evt.read() {
+            if e.kind() != io::ErrorKind::WouldBlock {
+                warn!("vsock: failed to consume muxer RX event: {:?}", e);
+            }
+        }
+    }
+}
+
+impl VsockBackend for VsockShardedMuxer {}
+
+impl VsockShardedMuxer {
+    /// Get the index of the shard handling the connection `pkt` belongs to.
+    fn shard_of(&self, pkt: &VsockPacket) -> usize {
+        match pkt.op() {
+            // Wrapped listeners are only identified by their guest port.
+            uapi::VSOCK_OP_WRAP_LISTEN | uapi::VSOCK_OP_WRAP_CLOSE => {
+                pkt.src_port() as usize % self.shards.len()
+            }
+            _ => ConnMapKey::from_peer_pkt(pkt).shard(self.shards.len()),
+        }
+    }
+
+    /// Create the muxer with `shards` shards, or a default based on the number of host CPUs.
+    /// `connect_timeout_ms` overrides the time allowed for the host-side stream of a
+    /// guest-initiated connection to connect, before the connection is reset.
+    pub fn new(
+        cid: u64,
+        host_port_map: Option<HashMap<u16, u16>>,
+        host_port_weights: HashMap<u16, u32>,
+        connect_timeout_ms: Option<u32>,
+        shards: Option<u32>,
+    ) -> Result<Self> {
+        let connect_timeout = connect_timeout_ms
+            .map(|ms| Duration::from_millis(u64::from(ms)))
+            .unwrap_or_else(|| Duration::from_millis(CONN_CONNECT_TIMEOUT_MS));
+
+        let count = shards.map(|count| count as usize).unwrap_or_else(|| {
+            thread::available_parallelism()
+                .map(|n| n.get())
+                .unwrap_or(1)
+                .min(defs::DEFAULT_MAX_SHARDS)
+        });
+
+        Self::with_shards(
+            cid,
+            host_port_map,
+            host_port_weights,
+            connect_timeout,
+            count,
+        )
+    }
+
+    /// Create the muxer with `count` shards, and spawn their threads.
+    pub fn with_shards(
+        cid: u64,
+        host_port_map: Option<HashMap<u16, u16>>,
+        host_port_weights: HashMap<u16, u32>,
+        connect_timeout: Duration,
+        count: usize,
+    ) -> Result<Self> {
+        let count = count.max(1);
+        let tx_budget = Arc::new(TxBudget::new(defs::TX_BUF_BUDGET));
+        // Built before spawning any shard thread, so the threads already spawned are told to exit
+        // if a later shard fails.
+        let mut sharded = Self {
+            shards: Vec::with_capacity(count),
+            rx_evt: EventFd::new(utils::eventfd::EFD_NONBLOCK).map_err(Error::EventFd)?,
+            exit_evt: EventFd::new(utils::eventfd::EFD_NONBLOCK).map_err(Error::EventFd)?,
+            next_rx: 0,
+            rx_deficits: vec![None; count],
+        };
+
+        for index in 0..count {
+            let muxer = VsockMuxer::new_shard(
+                cid,
+                host_port_map.clone(),
+                host_port_weights.clone(),
+                tx_budget.clone(),
+                connect_timeout,
+                index,
+                count,
+            )?;
+            let epoll_fd = muxer.as_raw_fd();
+            let shard = Arc::new(Mutex::new(muxer));
+
+            let weak_shard = Arc::downgrade(&shard);
+            let rx_evt = sharded.rx_evt.try_clone().map_err(Error::EventFd)?;
+            let exit_evt = sharded.exit_evt.try_clone().map_err(Error::EventFd)?;
+            thread::Builder::new()
+                .name(format!("vsock shard {}", index))
+                .spawn(move || run_shard(weak_shard, epoll_fd, rx_evt, exit_evt))
+                .map_err(Error::ShardSpawn)?;
+
+            sharded.shards.push(shard);
+        }
+
+        Ok(sharded)
+    }
+}
+
+impl Drop for VsockShardedMuxer {
+    fn drop(&mut self) {
+        // The shard threads only wake up on events, so they have to be told to exit.
+        if let Err(e) = self.exit_evt.write(1) {
+            error!("vsock: failed to signal the muxer shards to exit: {:?}", e);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+    use std::net::{SocketAddr, TcpListener};
+
+    use super::super::super::tests::TestContext as VsockTestContext;
+    use super::*;
+
+    use crate::virtio::vsock::defs::DEFAULT_MAX_PKT_BUF_SIZE;
+    use crate::virtio::vsock::device::RXQ_INDEX;
+
+    const PEER_CID: u64 = 3;
+    const PEER_BUF_ALLOC: u32 = 64 * 1024;
+    const SHARDS: usize = 4;
+
+    // Wait for the muxer to report some event, and notify it.
+    fn wait_and_notify(muxer: &mut VsockShardedMuxer) {
+        let mut pfd = libc::pollfd {
+            fd: muxer.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        // Safe because we pass a single, valid, pollfd struct.
+        assert_eq!(unsafe { libc::poll(&mut pfd, 1, 5000) }, 1);
+        muxer.notify(EventSet::IN);
+    }
+
+    #[test]
+    fn test_sharded_request_ex() {
+        const LOCAL_PORT: u32 = 1026;
+        const PEER_PORT: u32 = 1025;
+
+        let vsock_test_ctx = VsockTestContext::new();
+        let mut handler_ctx = vsock_test_ctx.create_event_handler_context();
+        let mut pkt = VsockPacket::from_rx_virtq_head(
+            &handler_ctx.device.queues[RXQ_INDEX]
+                .pop(&vsock_test_ctx.mem)
+                .unwrap(),
+            DEFAULT_MAX_PKT_BUF_SIZE,
+        )
+        .unwrap();
+
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let addr = match listener.local_addr().unwrap() {
+            SocketAddr::V4(addr) => addr,
+            _ => unreachable!(),
+        };
+
+        let mut muxer = VsockShardedMuxer::with_shards(
+            PEER_CID,
+            None,
+            HashMap::new(),
+            Duration::from_millis(CONN_CONNECT_TIMEOUT_MS),
+            SHARDS,
+        )
+        .unwrap();
+        let mut pending = Vec::new();
+        let mut shards = HashSet::new();
+        for i in 0..SHARDS as u32 {
+            for b in pkt.hdr_mut() {
+                *b = 0;
+            }
+            pkt.set_type(uapi::VSOCK_TYPE_STREAM)
+                .set_src_cid(PEER_CID)
+                .set_dst_cid(uapi::VSOCK_HOST_CID)
+                .set_src_port(PEER_PORT + i)
+                .set_dst_port(LOCAL_PORT)
+                .set_op(uapi::VSOCK_OP_REQUEST_EX)
+                .set_buf_alloc(PEER_BUF_ALLOC);
+            let buf = pkt.buf_mut().unwrap();
+            buf[0..2].copy_from_slice(&uapi::AF_INET.to_le_bytes());
+            buf[2..4].copy_from_slice(&addr.port().to_be_bytes());
+            buf[4..8].copy_from_slice(&addr.ip().octets());
+            muxer.send_pkt(&pkt).unwrap();
+
+            shards.insert(ConnMapKey::from_peer_pkt(&pkt).shard(SHARDS));
+            pending.push(PEER_PORT + i);
+        }
+        // Each connection is handled by its own shard.
+        assert_eq!(shards.len(), SHARDS);
+
+        // Every connection gets its response, as its shard resolves its connect.
+        while !pending.is_empty() {
+            if !muxer.has_pending_rx() {
+                wait_and_notify(&mut muxer);
+            }
+            while muxer.recv_pkt(&mut pkt).is_ok() {
+                assert_eq!(pkt.op(), uapi::VSOCK_OP_RESPONSE_EX);
+                assert_eq!(pkt.src_port(), LOCAL_PORT);
+                pending.retain(|port| *port != pkt.dst_port());
+            }
+        }
+    }
+}
@@ -0,0 +1,150 @@
+/// `FdSlab` is the table `VsockMuxer` keeps its connections and wrapped listeners in. Each entry
+/// gets an id, which the rest of the muxer state (the connection map, the RX queue and the
+/// timers) refers to it by, and which indexes the table without any hashing.
+///
+/// The ids are dense within a muxer: a new entry takes the lowest vacant id, so the table (and the
+/// per-id state kept elsewhere) only grows as far as the number of live entries, whatever the
+/// file descriptors of the process look like, and it shrinks back as the last ones are removed.
+/// Events are reported by the file descriptor an entry is polled on, so the table also maps those
+/// to ids.
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, HashMap};
+use std::os::unix::io::RawFd;
+
+pub struct FdSlab<T> {
+    /// The entries, along with the file descriptor they're polled on, indexed by id.
+    entries: Vec<Option<(RawFd, T)>>,
+    /// The ids of the entries, by file descriptor.
+    ids: HashMap<RawFd, usize>,
+    /// The vacant ids, lowest first. Ids past the end of `entries`, or that have been taken again
+    /// since, are skipped when popped.
+    free: BinaryHeap<Reverse<usize>>,
+}
+
+impl<T> FdSlab<T> {
+    pub fn new() -> Self {
+        Self {
+            entries: Vec::new(),
+            ids: HashMap::new(),
+            free: BinaryHeap::new(),
+        }
+    }
+
+    /// Store `value`, polled on `fd`, returning its id. If there's already an entry for `fd`, its
+    /// value is replaced, and it keeps its id.
+    pub fn insert(&mut self, fd: RawFd, value: T) -> usize {
+        if let Some(&id) = self.ids.get(&fd) {
+            self.entries[id] = Some((fd, value));
+            return id;
+        }
+
+        let id = loop {
+            match self.free.pop() {
+                Some(Reverse(id)) if id < self.entries.len() && self.entries[id].is_none() => {
+                    break id
+                }
+                Some(_) => continue,
+                None => {
+                    self.entries.push(None);
+                    break self.entries.len() - 1;
+                }
+            }
+        };
+        self.entries[id] = Some((fd, value));
+        self.ids.insert(fd, id);
+        id
+    }
+
+    /// Get the id of the entry polled on `fd`.
+    pub fn id(&self, fd: RawFd) -> Option<usize> {
+        self.ids.get(&fd).copied()
+    }
+
+    /// Get the file descriptor the entry `id` is polled on.
+    pub fn fd(&self, id: usize) -> Option<RawFd> {
+        self.entries
+            .get(id)
+            .and_then(|entry| entry.as_ref())
+            .map(|(fd, _)| *fd)
+    }
+
+    pub fn get(&self, id: usize) -> Option<&T> {
+        self.entries
+            .get(id)
+            .and_then(|entry| entry.as_ref())
+            .map(|(_, value)| value)
+    }
+
+    pub fn get_mut(&mut self, id: usize) -> Option<&mut T> {
+        self.entries
+            .get_mut(id)
+            .and_then(|entry| entry.as_mut())
+            .map(|(_, value)| value)
+    }
+
+    /// Remove (and return) the entry `id`, along with the file descriptor it was polled on.
+    pub fn remove(&mut self, id: usize) -> Option<(RawFd, T)> {
+        let (fd, value) = self.entries.get_mut(id)?.take()?;
+        self.ids.remove(&fd);
+        self.free.push(Reverse(id));
+
+        // Give back the trailing vacant entries.
+        while let Some(None) = self.entries.last() {
+            self.entries.pop();
+        }
+        if self.entries.len() < self.entries.capacity() / 4 {
+            self.entries.shrink_to(self.entries.len() * 2);
+        }
+        if self.entries.is_empty() {
+            self.free.clear();
+        }
+
+        Some((fd, value))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_fd_slab() {
+        let mut slab = FdSlab::new();
+
+        // Ids are dense, whatever the descriptors.
+        assert_eq!(slab.insert(300, "a"), 0);
+        assert_eq!(slab.insert(7000, "b"), 1);
+        assert_eq!(slab.insert(5, "c"), 2);
+        assert_eq!(slab.insert(300, "d"), 0);
+        assert_eq!(slab.id(7000), Some(1));
+        assert_eq!(slab.id(6), None);
+        assert_eq!(slab.fd(2), Some(5));
+        assert_eq!(slab.get(0), Some(&"d"));
+        assert_eq!(slab.get(3), None);
+        assert_eq!(slab.get_mut(100), None);
+        *slab.get_mut(1).unwrap() = "e";
+        assert_eq!(slab.get(1), Some(&"e"));
+
+        // The lowest vacant id is taken first.
+        assert_eq!(slab.remove(1), Some((7000, "e")));
+        assert_eq!(slab.remove(1), None);
+        assert_eq!(slab.id(7000), None);
+        assert_eq!(slab.remove(0), Some((300, "d")));
+        assert_eq!(slab.insert(8, "f"), 0);
+        assert_eq!(slab.insert(9, "g"), 1);
+        assert_eq!(slab.insert(10, "h"), 3);
+
+        // The table shrinks back as the highest ids go away.
+        assert_eq!(slab.remove(3), Some((10, "h")));
+        assert_eq!(slab.entries.len(), 3);
+        assert_eq!(slab.remove(2), Some((5, "c")));
+        assert_eq!(slab.remove(1), Some((9, "g")));
+        assert_eq!(slab.entries.len(), 1);
+        assert_eq!(slab.insert(11, "i"), 1);
+        assert_eq!(slab.remove(0), Some((8, "f")));
+        assert_eq!(slab.remove(1), Some((11, "i")));
+        assert!(slab.entries.is_empty());
+        assert!(slab.ids.is_empty());
+        assert!(slab.free.is_empty());
+    }
+}
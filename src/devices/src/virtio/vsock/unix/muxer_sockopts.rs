@@ -0,0 +1,153 @@
+/// `SockOpts` are the socket options the guest has set on its end of a connection (or of a
+/// wrapped listener), which `VsockMuxer` applies to the host-side socket standing for it. They
+/// come with the extended ops: following the address, in `VSOCK_OP_REQUEST_EX` and
+/// `VSOCK_OP_WRAP_LISTEN` packets, for the options set before connecting (or listening), and
+/// in `VSOCK_OP_SETSOCKOPT` packets, for those set on an established connection.
+///
+/// The guest's `setsockopt()` has already returned by the time the options get here, so they're
+/// applied on a best-effort basis: an option the host socket won't take (e.g. `TCP_NODELAY` on
+/// a Unix socket) is only logged, and doesn't affect the connection.
+use std::io;
+use std::os::unix::io::RawFd;
+
+use super::super::defs::uapi;
+use super::super::packet::VsockPacket;
+
+#[cfg(target_os = "macos")]
+const TCP_KEEPIDLE: libc::c_int = libc::TCP_KEEPALIVE;
+#[cfg(not(target_os = "macos"))]
+const TCP_KEEPIDLE: libc::c_int = libc::TCP_KEEPIDLE;
+
+#[derive(Clone, Copy, Debug, Default, PartialEq)]
+pub struct SockOpts {
+    /// `TCP_NODELAY`.
+    pub nodelay: Option<bool>,
+    /// `SO_SNDBUF` and `SO_RCVBUF`, in bytes.
+    pub sndbuf: Option<u32>,
+    pub rcvbuf: Option<u32>,
+    /// `SO_KEEPALIVE`, along with the keepalive idle time and probe interval (in seconds), and
+    /// probe count.
+    pub keepalive: Option<bool>,
+    pub keepidle: Option<u32>,
+    pub keepintvl: Option<u32>,
+    pub keepcnt: Option<u32>,
+}
+
+impl SockOpts {
+    /// Collect the options set by `pairs`, of (option, value). Unknown options are ignored, and
+    /// an option set twice takes its last value.
+    pub fn from_pairs(pairs: &[(u32, u32)]) -> Self {
+        let mut opts = Self::default();
+        for &(opt, value) in pairs {
+            match opt {
+                uapi::VSOCK_SOCKOPT_NODELAY => opts.nodelay = Some(value != 0),
+                uapi::VSOCK_SOCKOPT_SNDBUF => opts.sndbuf = Some(value),
+                uapi::VSOCK_SOCKOPT_RCVBUF => opts.rcvbuf = Some(value),
+                uapi::VSOCK_SOCKOPT_KEEPALIVE => opts.keepalive = Some(value != 0),
+                uapi::VSOCK_SOCKOPT_KEEPIDLE => opts.keepidle = Some(value),
+                uapi::VSOCK_SOCKOPT_KEEPINTVL => opts.keepintvl = Some(value),
+                uapi::VSOCK_SOCKOPT_KEEPCNT => opts.keepcnt = Some(value),
+                _ => debug!("vsock: ignoring unknown socket option {}", opt),
+            }
+        }
+        opts
+    }
+
+    /// Get the options following the address of a `VSOCK_OP_REQUEST_EX` or
+    /// `VSOCK_OP_WRAP_LISTEN` packet.
+    pub fn from_request(pkt: &VsockPacket) -> Self {
+        let offset = match pkt.sa_family() {
+            Some(uapi::AF_INET) => uapi::SOCKADDR_IN_SIZE,
+            Some(uapi::AF_UNIX) => uapi::SOCKADDR_UN_SIZE,
+            _ => return Self::default(),
+        };
+        Self::from_pairs(&pkt.sock_opts(offset))
+    }
+
+    /// Get the options of a `VSOCK_OP_SETSOCKOPT` packet.
+    pub fn from_setsockopt(pkt: &VsockPacket) -> Self {
+        Self::from_pairs(&pkt.sock_opts(0))
+    }
+
+    /// Apply the options that have been set to the socket `fd`.
+    pub fn apply(&self, fd: RawFd) {
+        let flag = |value: Option<bool>| value.map(u32::from);
+        let opts = [
+            (libc::IPPROTO_TCP, libc::TCP_NODELAY, flag(self.nodelay)),
+            (libc::SOL_SOCKET, libc::SO_SNDBUF, self.sndbuf),
+            (libc::SOL_SOCKET, libc::SO_RCVBUF, self.rcvbuf),
+            (libc::SOL_SOCKET, libc::SO_KEEPALIVE, flag(self.keepalive)),
+            (libc::IPPROTO_TCP, TCP_KEEPIDLE, self.keepidle),
+            (libc::IPPROTO_TCP, libc::TCP_KEEPINTVL, self.keepintvl),
+            (libc::IPPROTO_TCP, libc::TCP_KEEPCNT, self.keepcnt),
+        ];
+        for (level, name, value) in opts {
+            if let Some(value) = value {
+                setsockopt(fd, level, name, value).unwrap_or_else(|err| {
+                    debug!(
+                        "vsock: unable to set socket option {}:{}={} on fd {}: {:?}",
+                        level, name, value, fd, err
+                    );
+                });
+            }
+        }
+    }
+}
+
+fn setsockopt(fd: RawFd, level: libc::c_int, name: libc::c_int, value: u32) -> io::Result<()> {
+    let value = value.min(libc::c_int::MAX as u32) as libc::c_int;
+    // Safe because `value` outlives the call, which doesn't keep any reference to it, and we
+    // check the return value.
+    let ret = unsafe {
+        libc::setsockopt(
+            fd,
+            level,
+            name,
+            &value as *const libc::c_int as *const libc::c_void,
+            std::mem::size_of::<libc::c_int>() as libc::socklen_t,
+        )
+    };
+    if ret < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::net::{TcpListener, TcpStream};
+    use std::os::unix::io::AsRawFd;
+
+    #[test]
+    fn test_sock_opts() {
+        let opts = SockOpts::from_pairs(&[
+            (uapi::VSOCK_SOCKOPT_NODELAY, 1),
+            (uapi::VSOCK_SOCKOPT_SNDBUF, 4096),
+            (uapi::VSOCK_SOCKOPT_KEEPALIVE, 1),
+            (1000, 1),
+            (uapi::VSOCK_SOCKOPT_SNDBUF, 8192),
+        ]);
+        assert_eq!(
+            opts,
+            SockOpts {
+                nodelay: Some(true),
+                sndbuf: Some(8192),
+                keepalive: Some(true),
+                ..Default::default()
+            }
+        );
+
+        let listener = TcpListener::bind("127.0.0.1:0").unwrap();
+        let stream = TcpStream::connect(listener.local_addr().unwrap()).unwrap();
+        opts.apply(stream.as_raw_fd());
+        assert!(stream.nodelay().unwrap());
+
+        // Options that aren't set are left alone.
+        SockOpts::from_pairs(&[(uapi::VSOCK_SOCKOPT_RCVBUF, 16384)]).apply(stream.as_raw_fd());
+        assert!(stream.nodelay().unwrap());
+        SockOpts::from_pairs(&[(uapi::VSOCK_SOCKOPT_NODELAY, 0)]).apply(stream.as_raw_fd());
+        assert!(!stream.nodelay().unwrap());
+    }
+}
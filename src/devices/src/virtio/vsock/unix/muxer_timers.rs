@@ -0,0 +1,191 @@
+/// `TimerWheel` keeps track of the connection timers (kill, connect and credit request retry
+/// deadlines) of a `VsockMuxer`, as a hashed timer wheel driven by a single `TimerFd`, which the
+/// muxer polls under its nested epoll FD.
+///
+/// Time is divided in ticks of `defs::TIMER_WHEEL_TICK_MS`, and a timer is kept in the slot of
+/// the first tick at (or after) its deadline, modulo the number of slots. Scheduling a timer, and
+/// expiring it, are both constant time operations, however many connections the muxer has. The
+/// timer FD is always armed for the first tick that holds any timer, so the muxer is woken up
+/// right when its connections need it, and only then. Timers that are further away than a full
+/// turn of the wheel just stay in their slot until their turn comes.
+///
+/// Timers are identified by the id of their connection in the muxer's listener table. Rescheduling
+/// a timer doesn't remove its previous deadline from the wheel, and a connection may even be gone,
+/// and its id reused, by the time its timer expires. That's harmless, since the connections check
+/// their own deadlines when the muxer hands them an expired timer.
+use std::io;
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::time::{Duration, Instant};
+
+use utils::timerfd::TimerFd;
+
+use super::defs;
+
+pub struct TimerWheel {
+    /// The timers, along with their deadlines, in the slot of the tick they're due at.
+    slots: Vec<Vec<(usize, Instant)>>,
+    /// The start of the first tick.
+    origin: Instant,
+    /// The duration of a tick.
+    tick: Duration,
+    /// The first tick that hasn't been expired yet.
+    next_tick: u64,
+    /// The number of timers in the wheel.
+    len: usize,
+    /// The timer FD, and the instant it's armed for, if any.
+    timerfd: TimerFd,
+    armed: Option<Instant>,
+}
+
+impl TimerWheel {
+    const SLOTS: usize = defs::TIMER_WHEEL_SLOTS;
+
+    pub fn new() -> io::Result<Self> {
+        Ok(Self {
+            slots: vec![Vec::new(); Self::SLOTS],
+            origin: Instant::now(),
+            tick: Duration::from_millis(defs::TIMER_WHEEL_TICK_MS),
+            next_tick: 0,
+            len: 0,
+            timerfd: TimerFd::new()?,
+            armed: None,
+        })
+    }
+
+    /// Schedule a timer for the connection `id`, to expire at `deadline`.
+    pub fn schedule(&mut self, id: usize, deadline: Instant) {
+        // The timer can't go in a tick that has already been expired.
+        let tick = self.tick_at_or_after(deadline).max(self.next_tick);
+        self.slots[tick as usize % Self::SLOTS].push((id, deadline));
+        self.len += 1;
+
+        let due = self.tick_start(tick);
+        if self.armed.map_or(true, |armed| due < armed) {
+            self.arm(Some(due));
+        }
+    }
+
+    /// Remove and return the timers that have expired, and re-arm the timer FD for the next
+    /// ones.
+    pub fn expire(&mut self) -> Vec<usize> {
+        let expired = self.expire_at(Instant::now());
+        self.arm(self.next_expiry());
+        expired
+    }
+
+    // Remove and return the timers that have expired by `now`, going over the slots of the ticks
+    // that have passed since the last call (at most once).
+    fn expire_at(&mut self, now: Instant) -> Vec<usize> {
+        let now_tick = self.tick_before(now);
+        let mut expired = Vec::new();
+
+        let mut visited = 0;
+        while self.next_tick <= now_tick && self.len > 0 && visited < Self::SLOTS {
+            let count = expired.len();
+            let slot = &mut self.slots[self.next_tick as usize % Self::SLOTS];
+            slot.retain(|&(id, deadline)| {
+                if deadline > now {
+                    return true;
+                }
+                expired.push(id);
+                false
+            });
+            self.len -= expired.len() - count;
+            self.next_tick += 1;
+            visited += 1;
+        }
+        // All the slots are up to date by now.
+        self.next_tick = self.next_tick.max(now_tick + 1);
+
+        expired
+    }
+
+    // Get the start of the first tick, from now on, that holds some timer.
+    fn next_expiry(&self) -> Option<Instant> {
+        if self.len == 0 {
+            return None;
+        }
+        (self.next_tick..self.next_tick + Self::SLOTS as u64)
+            .find(|&tick| !self.slots[tick as usize % Self::SLOTS].is_empty())
+            .map(|tick| self.tick_start(tick))
+    }
+
+    // Arm the timer FD to fire at `due`, or disarm it. This also clears any previous expiration.
+    fn arm(&mut self, due: Option<Instant>) {
+        let res = match due {
+            Some(due) => self
+                .timerfd
+                .reset(due.saturating_duration_since(Instant::now())),
+            None => self.timerfd.clear(),
+        };
+        match res {
+            Ok(()) => self.armed = due,
+            Err(err) => {
+                // The muxer will still catch up on its timers, whenever it gets some other event.
+                error!("vsock: failed to arm the muxer timer: {:?}", err);
+                self.armed = None;
+            }
+        }
+    }
+
+    // Get the first tick that starts at, or after, `t`.
+    fn tick_at_or_after(&self, t: Instant) -> u64 {
+        let nanos = t.saturating_duration_since(self.origin).as_nanos();
+        let tick = self.tick.as_nanos();
+        ((nanos + tick - 1) / tick) as u64
+    }
+
+    // Get the last tick that starts at, or before, `t`.
+    fn tick_before(&self, t: Instant) -> u64 {
+        (t.saturating_duration_since(self.origin).as_nanos() / self.tick.as_nanos()) as u64
+    }
+
+    fn tick_start(&self, tick: u64) -> Instant {
+        self.origin + Duration::from_nanos(self.tick.as_nanos() as u64 * tick)
+    }
+}
+
+impl AsRawFd for TimerWheel {
+    /// Get the timer FD, which becomes readable once some timer has expired.
+    fn as_raw_fd(&self) -> RawFd {
+        self.timerfd.as_raw_fd()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_timer_wheel() {
+        let mut wheel = TimerWheel::new().unwrap();
+        let origin = wheel.origin;
+        let tick = wheel.tick;
+        let at = |ticks: u32| origin + tick * ticks;
+        let turn = TimerWheel::SLOTS as u32;
+
+        wheel.schedule(3, at(5) - tick / 2);
+        wheel.schedule(4, at(5));
+        wheel.schedule(5, at(7));
+        wheel.schedule(6, at(turn + 5));
+        assert_eq!(wheel.armed, Some(at(5)));
+        assert_eq!(wheel.next_expiry(), Some(at(5)));
+
+        // Timers never expire before their deadline.
+        assert!(wheel.expire_at(at(5) - tick / 4).is_empty());
+        assert_eq!(wheel.expire_at(at(5)), vec![3, 4]);
+        assert_eq!(wheel.next_expiry(), Some(at(7)));
+
+        // Timers scheduled in the past go in the first tick that hasn't been expired yet.
+        wheel.schedule(7, at(2));
+        assert_eq!(wheel.next_expiry(), Some(at(6)));
+        assert_eq!(wheel.expire_at(at(8)), vec![7, 5]);
+
+        // Timers more than a turn away are kept until they're due.
+        assert_eq!(wheel.next_expiry(), Some(at(turn + 5)));
+        assert!(wheel.expire_at(at(turn + 4)).is_empty());
+        assert_eq!(wheel.expire_at(at(3 * turn)), vec![6]);
+        assert_eq!(wheel.len, 0);
+        assert_eq!(wheel.next_expiry(), None);
+    }
+}
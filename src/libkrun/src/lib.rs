@@ -11,12 +11,15 @@ use std::ffi::CString;
 #[cfg(not(feature = "amd-sev"))]
 use std::path::Path;
 use std::process;
+use std::ptr;
 use std::slice;
 use std::sync::atomic::{AtomicI32, Ordering};
-use std::sync::Mutex;
+use std::sync::{Arc, Mutex};
 
+use devices::virtio::fs::stats::Stats as FsStats;
 #[cfg(feature = "amd-sev")]
 use devices::virtio::CacheType;
+use devices::virtio::{VSOCK_MAX_MAX_PKT_SIZE, VSOCK_MIN_MAX_PKT_SIZE};
 use libc::{c_char, size_t};
 use logger::{LevelFilter, LOGGER};
 use once_cell::sync::Lazy;
@@ -57,9 +60,15 @@ struct ContextConfig {
     rlimits: Option<String>,
     #[cfg(not(feature = "amd-sev"))]
     fs_cfg: Option<FsDeviceConfig>,
+    #[cfg(not(feature = "amd-sev"))]
+    scratch_volumes: Vec<(String, u64)>,
     #[cfg(feature = "amd-sev")]
     block_cfg: Option<BlockDeviceConfig>,
     port_map: Option<HashMap<u16, u16>>,
+    port_weights: HashMap<u16, u32>,
+    vsock_max_pkt_size: Option<u32>,
+    vsock_connect_timeout_ms: Option<u32>,
+    vsock_shards: Option<u32>,
     #[cfg(feature = "amd-sev")]
     attestation_url: Option<String>,
 }
@@ -130,6 +139,46 @@ impl ContextConfig {
         self.fs_cfg.clone()
     }
 
+    #[cfg(not(feature = "amd-sev"))]
+    fn add_scratch_volume(&mut self, guest_path: String, size: u64) {
+        self.scratch_volumes.push((guest_path, size));
+    }
+
+    // Each scratch volume is a virtio-fs device of its own, mounted by init at the given path.
+    #[cfg(not(feature = "amd-sev"))]
+    fn get_scratch_volumes(&self) -> Vec<FsDeviceConfig> {
+        self.scratch_volumes
+            .iter()
+            .enumerate()
+            .map(|(i, (_, size))| FsDeviceConfig {
+                fs_id: format!("scratch{}", i),
+                scratch_size: Some(*size),
+                trace_dir: self.fs_cfg.as_ref().and_then(|c| c.trace_dir.clone()),
+                ..Default::default()
+            })
+            .collect()
+    }
+
+    #[cfg(not(feature = "amd-sev"))]
+    fn get_scratch(&self) -> String {
+        if self.scratch_volumes.is_empty() {
+            return "".to_string();
+        }
+
+        let volumes: Vec<String> = self
+            .scratch_volumes
+            .iter()
+            .enumerate()
+            .map(|(i, (guest_path, _))| format!("scratch{}:{}", i, guest_path))
+            .collect();
+        format!("KRUN_SCRATCH={}", volumes.join(","))
+    }
+
+    #[cfg(feature = "amd-sev")]
+    fn get_scratch(&self) -> String {
+        "".to_string()
+    }
+
     #[cfg(feature = "amd-sev")]
     fn set_block_cfg(&mut self, block_cfg: BlockDeviceConfig) {
         self.block_cfg = Some(block_cfg);
@@ -140,14 +189,43 @@ impl ContextConfig {
         self.block_cfg.clone()
     }
 
-    fn set_port_map(&mut self, port_map: HashMap<u16, u16>) {
+    fn set_port_map(&mut self, port_map: HashMap<u16, u16>, port_weights: HashMap<u16, u32>) {
         self.port_map = Some(port_map);
+        self.port_weights = port_weights;
     }
 
     fn get_port_map(&self) -> Option<HashMap<u16, u16>> {
         self.port_map.clone()
     }
 
+    fn get_port_weights(&self) -> HashMap<u16, u32> {
+        self.port_weights.clone()
+    }
+
+    fn set_vsock_max_pkt_size(&mut self, max_pkt_size: u32) {
+        self.vsock_max_pkt_size = Some(max_pkt_size);
+    }
+
+    fn get_vsock_max_pkt_size(&self) -> Option<u32> {
+        self.vsock_max_pkt_size
+    }
+
+    fn set_vsock_connect_timeout(&mut self, timeout_ms: u32) {
+        self.vsock_connect_timeout_ms = Some(timeout_ms);
+    }
+
+    fn get_vsock_connect_timeout(&self) -> Option<u32> {
+        self.vsock_connect_timeout_ms
+    }
+
+    fn set_vsock_shards(&mut self, shards: u32) {
+        self.vsock_shards = Some(shards);
+    }
+
+    fn get_vsock_shards(&self) -> Option<u32> {
+        self.vsock_shards
+    }
+
     #[cfg(feature = "amd-sev")]
     fn set_attestation_url(&mut self, url: String) {
         self.attestation_url = Some(url);
@@ -161,6 +239,10 @@ impl ContextConfig {
 
 static CTX_MAP: Lazy<Mutex<HashMap<u32, ContextConfig>>> = Lazy::new(|| Mutex::new(HashMap::new()));
 static CTX_IDS: AtomicI32 = AtomicI32::new(0);
+// Request statistics of the virtio-fs devices of the started microVMs, by context ID.
+#[allow(clippy::type_complexity)]
+static FS_STATS: Lazy<Mutex<HashMap<u32, Vec<(String, Arc<FsStats>)>>>> =
+    Lazy::new(|| Mutex::new(HashMap::new()));
 
 #[link(name = "krunfw")]
 extern "C" {
@@ -301,17 +383,118 @@ pub unsafe extern "C" fn krun_set_root(ctx_id: u32, c_root_path: *const c_char)
     match CTX_MAP.lock().unwrap().entry(ctx_id) {
         Entry::Occupied(mut ctx_cfg) => {
             let cfg = ctx_cfg.get_mut();
-            let fs_device_config = match cfg.get_fs_cfg() {
-                Some(fs_cfg) => FsDeviceConfig {
-                    fs_id,
-                    shared_dir,
-                    mapped_volumes: fs_cfg.mapped_volumes,
-                },
-                None => FsDeviceConfig {
-                    fs_id,
-                    shared_dir,
-                    mapped_volumes: None,
-                },
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                fs_id,
+                shared_dir,
+                root_layers: None,
+                root_archive: None,
+                scratch_size: None,
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub unsafe extern "C" fn krun_set_root_layers(
+    ctx_id: u32,
+    c_upper_dir: *const c_char,
+    c_lower_dirs: *const *const c_char,
+) -> i32 {
+    if cfg!(not(target_os = "linux")) {
+        return -libc::EOPNOTSUPP;
+    }
+
+    let upper_dir = match CStr::from_ptr(c_upper_dir).to_str() {
+        Ok(upper) => upper,
+        Err(_) => return -libc::EINVAL,
+    };
+    // The upper directory holds the changes, so it must exist like the lower ones.
+    let upper_path = Path::new(upper_dir);
+    if !upper_path.is_absolute() || !upper_path.is_dir() {
+        return -libc::EINVAL;
+    }
+
+    let mut lower_dirs = Vec::new();
+    let lower_dirs_array: &[*const c_char] = slice::from_raw_parts(c_lower_dirs, MAX_ARGS);
+    for item in lower_dirs_array.iter().take(MAX_ARGS) {
+        if item.is_null() {
+            break;
+        } else {
+            let s = match CStr::from_ptr(*item).to_str() {
+                Ok(s) => s,
+                Err(_) => return -libc::EINVAL,
+            };
+            let lower_dir = Path::new(s);
+            if !lower_dir.is_absolute() || !lower_dir.is_dir() {
+                return -libc::EINVAL;
+            }
+
+            lower_dirs.push(lower_dir.to_path_buf());
+        }
+    }
+
+    let fs_id = "/dev/root".to_string();
+    let shared_dir = upper_dir.to_string();
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                fs_id,
+                shared_dir,
+                root_layers: Some(lower_dirs),
+                root_archive: None,
+                scratch_size: None,
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub unsafe extern "C" fn krun_set_root_archive(ctx_id: u32, c_archive_path: *const c_char) -> i32 {
+    if cfg!(not(target_os = "linux")) {
+        return -libc::EOPNOTSUPP;
+    }
+
+    let archive_path = match CStr::from_ptr(c_archive_path).to_str() {
+        Ok(archive) => Path::new(archive),
+        Err(_) => return -libc::EINVAL,
+    };
+    if !archive_path.is_file() {
+        return -libc::EINVAL;
+    }
+
+    let fs_id = "/dev/root".to_string();
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                fs_id,
+                shared_dir: String::new(),
+                // The archive is served as it is, without any volume mapped on top.
+                mapped_volumes: None,
+                root_layers: None,
+                root_archive: Some(archive_path.to_path_buf()),
+                scratch_size: None,
+                ..fs_cfg
             };
             cfg.set_fs_cfg(fs_device_config);
         }
@@ -360,17 +543,153 @@ pub unsafe extern "C" fn krun_set_mapped_volumes(
     match CTX_MAP.lock().unwrap().entry(ctx_id) {
         Entry::Occupied(mut ctx_cfg) => {
             let cfg = ctx_cfg.get_mut();
-            let fs_device_config = match cfg.get_fs_cfg() {
-                Some(fs_cfg) => FsDeviceConfig {
-                    fs_id: fs_cfg.fs_id.clone(),
-                    shared_dir: fs_cfg.shared_dir,
-                    mapped_volumes: Some(mapped_volumes),
-                },
-                None => FsDeviceConfig {
-                    fs_id: String::new(),
-                    shared_dir: String::new(),
-                    mapped_volumes: Some(mapped_volumes),
-                },
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                mapped_volumes: Some(mapped_volumes),
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub unsafe extern "C" fn krun_add_scratch_volume(
+    ctx_id: u32,
+    c_guest_path: *const c_char,
+    size_mib: u32,
+) -> i32 {
+    if cfg!(not(target_os = "linux")) {
+        return -libc::EOPNOTSUPP;
+    }
+
+    let guest_path = match CStr::from_ptr(c_guest_path).to_str() {
+        Ok(guest_path) => guest_path,
+        Err(_) => return -libc::EINVAL,
+    };
+    // The paths are passed to init in the kernel command line, separated by commas.
+    if size_mib == 0
+        || !Path::new(guest_path).is_absolute()
+        || guest_path.contains(|c: char| c == ',' || c == ':' || c.is_whitespace())
+    {
+        return -libc::EINVAL;
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            cfg.add_scratch_volume(guest_path.to_string(), u64::from(size_mib) << 20);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub extern "C" fn krun_set_fs_max_io_size(ctx_id: u32, max_io_size: u32) -> i32 {
+    if max_io_size == 0 {
+        return -libc::EINVAL;
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                max_io_size: Some(max_io_size),
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub extern "C" fn krun_set_fs_inode_file_handles(ctx_id: u32, enable: u32) -> i32 {
+    if cfg!(not(target_os = "linux")) {
+        return -libc::EOPNOTSUPP;
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                inode_file_handles: enable != 0,
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub unsafe extern "C" fn krun_set_fs_trace_dir(ctx_id: u32, c_dir_path: *const c_char) -> i32 {
+    let trace_dir = match CStr::from_ptr(c_dir_path).to_str() {
+        Ok(dir) => Path::new(dir),
+        Err(_) => return -libc::EINVAL,
+    };
+    if !trace_dir.is_absolute() || !trace_dir.is_dir() {
+        return -libc::EINVAL;
+    }
+    let trace_dir = Some(trace_dir.to_path_buf());
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                trace_dir,
+                ..fs_cfg
+            };
+            cfg.set_fs_cfg(fs_device_config);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+#[cfg(not(feature = "amd-sev"))]
+pub unsafe extern "C" fn krun_set_fs_prefetch_dir(ctx_id: u32, c_dir_path: *const c_char) -> i32 {
+    if cfg!(not(target_os = "linux")) {
+        return -libc::EOPNOTSUPP;
+    }
+
+    let prefetch_dir = match CStr::from_ptr(c_dir_path).to_str() {
+        Ok(dir) => Path::new(dir),
+        Err(_) => return -libc::EINVAL,
+    };
+    if !prefetch_dir.is_absolute() || !prefetch_dir.is_dir() {
+        return -libc::EINVAL;
+    }
+    let prefetch_dir = Some(prefetch_dir.to_path_buf());
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            let fs_cfg = cfg.get_fs_cfg().unwrap_or_default();
+            let fs_device_config = FsDeviceConfig {
+                prefetch_dir,
+                ..fs_cfg
             };
             cfg.set_fs_cfg(fs_device_config);
         }
@@ -414,6 +733,7 @@ pub unsafe extern "C" fn krun_set_root_disk(ctx_id: u32, c_disk_path: *const c_c
 #[no_mangle]
 pub unsafe extern "C" fn krun_set_port_map(ctx_id: u32, c_port_map: *const *const c_char) -> i32 {
     let mut port_map = HashMap::new();
+    let mut port_weights = HashMap::new();
     let port_map_array: &[*const c_char] = slice::from_raw_parts(c_port_map, MAX_ARGS);
     for item in port_map_array.iter().take(MAX_ARGS) {
         if item.is_null() {
@@ -424,7 +744,7 @@ pub unsafe extern "C" fn krun_set_port_map(ctx_id: u32, c_port_map: *const *cons
                 Err(_) => return -libc::EINVAL,
             };
             let port_tuple: Vec<&str> = s.split(':').collect();
-            if port_tuple.len() != 2 {
+            if port_tuple.len() != 2 && port_tuple.len() != 3 {
                 return -libc::EINVAL;
             }
             let host_port: u16 = match port_tuple[0].parse() {
@@ -445,13 +765,72 @@ pub unsafe extern "C" fn krun_set_port_map(ctx_id: u32, c_port_map: *const *cons
                 }
             }
             port_map.insert(guest_port, host_port);
+
+            if let Some(weight) = port_tuple.get(2) {
+                let weight: u32 = match weight.parse() {
+                    Ok(w) if w > 0 => w,
+                    _ => return -libc::EINVAL,
+                };
+                port_weights.insert(guest_port, weight);
+            }
+        }
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            cfg.set_port_map(port_map, port_weights);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[no_mangle]
+pub extern "C" fn krun_set_vsock_max_pkt_size(ctx_id: u32, max_pkt_size: u32) -> i32 {
+    if !(VSOCK_MIN_MAX_PKT_SIZE..=VSOCK_MAX_MAX_PKT_SIZE).contains(&(max_pkt_size as usize)) {
+        return -libc::EINVAL;
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            cfg.set_vsock_max_pkt_size(max_pkt_size);
         }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[no_mangle]
+pub extern "C" fn krun_set_vsock_connect_timeout(ctx_id: u32, timeout_ms: u32) -> i32 {
+    if timeout_ms == 0 {
+        return -libc::EINVAL;
     }
 
     match CTX_MAP.lock().unwrap().entry(ctx_id) {
         Entry::Occupied(mut ctx_cfg) => {
             let cfg = ctx_cfg.get_mut();
-            cfg.set_port_map(port_map);
+            cfg.set_vsock_connect_timeout(timeout_ms);
+        }
+        Entry::Vacant(_) => return -libc::ENOENT,
+    }
+
+    KRUN_SUCCESS
+}
+
+#[no_mangle]
+pub extern "C" fn krun_set_vsock_shards(ctx_id: u32, shards: u32) -> i32 {
+    if shards == 0 {
+        return -libc::EINVAL;
+    }
+
+    match CTX_MAP.lock().unwrap().entry(ctx_id) {
+        Entry::Occupied(mut ctx_cfg) => {
+            let cfg = ctx_cfg.get_mut();
+            cfg.set_vsock_shards(shards);
         }
         Entry::Vacant(_) => return -libc::ENOENT,
     }
@@ -603,6 +982,29 @@ pub unsafe extern "C" fn krun_set_attestation_url(ctx_id: u32, c_url: *const c_c
     KRUN_SUCCESS
 }
 
+#[allow(clippy::missing_safety_doc)]
+#[no_mangle]
+pub unsafe extern "C" fn krun_get_fs_stats(ctx_id: u32, buf: *mut c_char, size: u32) -> i32 {
+    let report = match FS_STATS.lock().unwrap().get(&ctx_id) {
+        Some(fs_stats) => fs_stats
+            .iter()
+            .map(|(tag, stats)| format!("virtio-fs \"{}\" requests:\n{}", tag, stats.snapshot()))
+            .collect::<String>(),
+        None => return -libc::ENOENT,
+    };
+
+    if size > 0 {
+        if buf.is_null() {
+            return -libc::EINVAL;
+        }
+        let len = report.len().min(size as usize - 1);
+        ptr::copy_nonoverlapping(report.as_ptr() as *const c_char, buf, len);
+        *buf.add(len) = 0;
+    }
+
+    report.len().try_into().unwrap_or(i32::MAX)
+}
+
 #[no_mangle]
 pub extern "C" fn krun_start_enter(ctx_id: u32) -> i32 {
     #[cfg(target_os = "linux")]
@@ -634,6 +1036,13 @@ pub extern "C" fn krun_start_enter(ctx_id: u32) -> i32 {
         }
     }
 
+    #[cfg(not(feature = "amd-sev"))]
+    for fs_cfg in ctx_cfg.get_scratch_volumes() {
+        if ctx_cfg.vmr.set_fs_device(fs_cfg).is_err() {
+            return -libc::EINVAL;
+        }
+    }
+
     #[cfg(feature = "amd-sev")]
     if let Some(block_cfg) = ctx_cfg.get_block_cfg() {
         if ctx_cfg.vmr.set_block_device(block_cfg).is_err() {
@@ -648,12 +1057,13 @@ pub extern "C" fn krun_start_enter(ctx_id: u32) -> i32 {
 
     let boot_source = BootSourceConfig {
         kernel_cmdline_prolog: Some(format!(
-            "{} init={} KRUN_INIT={} KRUN_WORKDIR={} {} {}",
+            "{} init={} KRUN_INIT={} KRUN_WORKDIR={} {} {} {}",
             DEFAULT_KERNEL_CMDLINE,
             INIT_PATH,
             ctx_cfg.get_exec_path(),
             ctx_cfg.get_workdir(),
             ctx_cfg.get_rlimits(),
+            ctx_cfg.get_scratch(),
             ctx_cfg.get_env(),
         )),
         kernel_cmdline_epilog: Some(format!(" -- {}", ctx_cfg.get_args())),
@@ -667,16 +1077,24 @@ pub extern "C" fn krun_start_enter(ctx_id: u32) -> i32 {
         vsock_id: "vsock0".to_string(),
         guest_cid: 3,
         host_port_map: ctx_cfg.get_port_map(),
+        host_port_weights: ctx_cfg.get_port_weights(),
+        max_pkt_size: ctx_cfg.get_vsock_max_pkt_size(),
+        connect_timeout_ms: ctx_cfg.get_vsock_connect_timeout(),
+        shards: ctx_cfg.get_vsock_shards(),
     };
     ctx_cfg.vmr.set_vsock_device(vsock_device_config).unwrap();
 
-    let _vmm = match vmm::builder::build_microvm(&ctx_cfg.vmr, &mut event_manager) {
+    let vmm = match vmm::builder::build_microvm(&ctx_cfg.vmr, &mut event_manager) {
         Ok(vmm) => vmm,
         Err(e) => {
             warn!("Building the microVM failed: {:?}", e);
             return -libc::EINVAL;
         }
     };
+    FS_STATS
+        .lock()
+        .unwrap()
+        .insert(ctx_id, vmm.lock().unwrap().fs_stats().to_vec());
 
     loop {
         match event_manager.run() {
@@ -10,13 +10,15 @@ pub mod byte_order;
 #[cfg(target_os = "linux")]
 pub mod linux;
 #[cfg(target_os = "linux")]
-pub use linux::epoll;
+pub use linux::{epoll, timerfd};
 #[cfg(target_os = "macos")]
 pub mod macos;
 #[cfg(target_os = "macos")]
 pub use macos::epoll;
 #[cfg(target_os = "macos")]
 pub use macos::eventfd;
+#[cfg(target_os = "macos")]
+pub use macos::timerfd;
 pub mod rand;
 #[cfg(target_os = "linux")]
 pub mod signal;
@@ -0,0 +1,111 @@
+//! A thin wrapper around a non-blocking, monotonic `timerfd`, which becomes readable once its
+//! deadline has passed, so timers can be polled along with the other FDs of an epoll loop.
+
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::time::Duration;
+use std::{io, mem, ptr};
+
+#[derive(Debug)]
+pub struct TimerFd {
+    fd: RawFd,
+}
+
+impl TimerFd {
+    pub fn new() -> io::Result<TimerFd> {
+        // Safe because this doesn't modify any memory, and we check the return value.
+        let fd = unsafe {
+            libc::timerfd_create(
+                libc::CLOCK_MONOTONIC,
+                libc::TFD_NONBLOCK | libc::TFD_CLOEXEC,
+            )
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(TimerFd { fd })
+    }
+
+    /// Arm the timer to fire once, `dur` from now. Re-arming the timer also clears its pending
+    /// expiration, if any.
+    pub fn reset(&mut self, dur: Duration) -> io::Result<()> {
+        // A zero value would disarm the timer instead.
+        let dur = dur.max(Duration::from_nanos(1));
+        let spec = libc::itimerspec {
+            it_interval: duration_to_timespec(Duration::ZERO),
+            it_value: duration_to_timespec(dur),
+        };
+        self.settime(&spec)
+    }
+
+    /// Disarm the timer, and clear its pending expirations.
+    pub fn clear(&mut self) -> io::Result<()> {
+        // Safe because `itimerspec` is a plain C struct, for which all zeroes is a valid value.
+        let spec: libc::itimerspec = unsafe { mem::zeroed() };
+        self.settime(&spec)
+    }
+
+    fn settime(&mut self, spec: &libc::itimerspec) -> io::Result<()> {
+        // Safe because we own the FD, pass a valid itimerspec struct, and check the return value.
+        let ret = unsafe { libc::timerfd_settime(self.fd, 0, spec, ptr::null_mut()) };
+        if ret < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(())
+    }
+}
+
+fn duration_to_timespec(dur: Duration) -> libc::timespec {
+    libc::timespec {
+        tv_sec: dur.as_secs() as libc::time_t,
+        tv_nsec: dur.subsec_nanos() as libc::c_long,
+    }
+}
+
+impl AsRawFd for TimerFd {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd
+    }
+}
+
+impl Drop for TimerFd {
+    fn drop(&mut self) {
+        // Safe because we own the FD, and nobody else uses it after this.
+        unsafe { libc::close(self.fd) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Check whether `timer` has fired, waiting for it up to `timeout_ms`.
+    fn fired(timer: &TimerFd, timeout_ms: i32) -> bool {
+        let mut pfd = libc::pollfd {
+            fd: timer.as_raw_fd(),
+            events: libc::POLLIN,
+            revents: 0,
+        };
+        // Safe because we pass a single, valid, pollfd struct.
+        unsafe { libc::poll(&mut pfd, 1, timeout_ms) == 1 }
+    }
+
+    #[test]
+    fn test_timerfd() {
+        let mut timer = TimerFd::new().unwrap();
+        assert!(!fired(&timer, 0));
+
+        timer.reset(Duration::from_millis(10)).unwrap();
+        assert!(fired(&timer, 5000));
+
+        // Re-arming the timer clears the previous expiration.
+        timer.reset(Duration::from_secs(60)).unwrap();
+        assert!(!fired(&timer, 0));
+        timer.reset(Duration::ZERO).unwrap();
+        assert!(fired(&timer, 5000));
+
+        timer.clear().unwrap();
+        assert!(!fired(&timer, 20));
+    }
+}
@@ -1,2 +1,3 @@
 pub mod epoll;
 pub mod eventfd;
+pub mod timerfd;
@@ -0,0 +1,106 @@
+//! Structure emulating a monotonic `timerfd` using a kqueue with a single `EVFILT_TIMER` filter.
+//! A kqueue FD is readable whenever it has pending events, i.e. once the timer has fired, so it
+//! can be polled just like a timerfd.
+
+use std::os::unix::io::{AsRawFd, RawFd};
+use std::time::Duration;
+use std::{io, mem, ptr};
+
+// The identifier of the timer filter within the kqueue.
+const TIMER_IDENT: usize = 1;
+
+#[derive(Debug)]
+pub struct TimerFd {
+    fd: RawFd,
+}
+
+impl TimerFd {
+    pub fn new() -> io::Result<TimerFd> {
+        // Safe because this doesn't modify any memory, and we check the return value.
+        let fd = unsafe { libc::kqueue() };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        // Safe because we own the FD, and check the return value.
+        if unsafe { libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC) } < 0 {
+            let err = io::Error::last_os_error();
+            // Safe because we own the FD, and nobody else uses it after this.
+            unsafe { libc::close(fd) };
+            return Err(err);
+        }
+
+        Ok(TimerFd { fd })
+    }
+
+    /// Arm the timer to fire once, `dur` from now. Re-arming the timer also clears its pending
+    /// expiration, if any.
+    pub fn reset(&mut self, dur: Duration) -> io::Result<()> {
+        self.clear()?;
+        let nanos = dur.max(Duration::from_nanos(1)).as_nanos();
+        self.kevent(
+            libc::EV_ADD | libc::EV_ENABLE | libc::EV_ONESHOT,
+            nanos.min(isize::MAX as u128) as isize,
+        )
+    }
+
+    /// Disarm the timer, and clear its pending expirations.
+    pub fn clear(&mut self) -> io::Result<()> {
+        if let Err(e) = self.kevent(libc::EV_DELETE, 0) {
+            if e.raw_os_error() != Some(libc::ENOENT) {
+                return Err(e);
+            }
+        }
+        self.drain()
+    }
+
+    fn kevent(&mut self, flags: u16, data: isize) -> io::Result<()> {
+        // Safe because `kevent` is a plain C struct, for which all zeroes is a valid value.
+        let mut kev: libc::kevent = unsafe { mem::zeroed() };
+        kev.ident = TIMER_IDENT;
+        kev.filter = libc::EVFILT_TIMER;
+        kev.flags = flags;
+        kev.fflags = libc::NOTE_NSECONDS;
+        kev.data = data;
+        // Safe because we own the FD, pass a single, valid, kevent struct, and check the return
+        // value.
+        let ret = unsafe { libc::kevent(self.fd, &kev, 1, ptr::null_mut(), 0, ptr::null()) };
+        if ret < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        Ok(())
+    }
+
+    // Consume the pending expirations, so the FD isn't readable anymore.
+    fn drain(&mut self) -> io::Result<()> {
+        let timeout = libc::timespec {
+            tv_sec: 0,
+            tv_nsec: 0,
+        };
+        loop {
+            // Safe because `kevent` is a plain C struct, for which all zeroes is a valid value.
+            let mut kev: libc::kevent = unsafe { mem::zeroed() };
+            // Safe because we own the FD, pass room for a single event, and check the return
+            // value.
+            let ret = unsafe { libc::kevent(self.fd, ptr::null(), 0, &mut kev, 1, &timeout) };
+            match ret {
+                0 => return Ok(()),
+                n if n < 0 => return Err(io::Error::last_os_error()),
+                _ => (),
+            }
+        }
+    }
+}
+
+impl AsRawFd for TimerFd {
+    fn as_raw_fd(&self) -> RawFd {
+        self.fd
+    }
+}
+
+impl Drop for TimerFd {
+    fn drop(&mut self) {
+        // Safe because we own the FD, and nobody else uses it after this.
+        unsafe { libc::close(self.fd) };
+    }
+}
@@ -539,6 +539,7 @@ pub fn build_microvm(
         mmio_device_manager,
         #[cfg(target_arch = "x86_64")]
         pio_device_manager,
+        fs_stats: Vec::new(),
     };
 
     #[cfg(not(feature = "amd-sev"))]
@@ -975,7 +976,7 @@ fn attach_fs_devices(
     vmm: &mut Vmm,
     fs_devs: &FsBuilder,
     event_manager: &mut EventManager,
-    shm_region: Option<VirtioShmRegion>,
+    mut shm_region: Option<VirtioShmRegion>,
     intc: Option<Arc<Mutex<Gic>>>,
 ) -> std::result::Result<(), StartMicrovmError> {
     use self::StartMicrovmError::*;
@@ -983,12 +984,22 @@ fn attach_fs_devices(
     for fs in fs_devs.list.iter() {
         let id = String::from(fs.lock().unwrap().id());
 
+        let (tag, stats) = {
+            let fs = fs.lock().unwrap();
+            (fs.tag(), fs.stats())
+        };
+        vmm.fs_stats.push((tag, stats));
+
         if let Some(ref intc) = intc {
             fs.lock().unwrap().set_intc(intc.clone());
         }
 
-        if let Some(ref shm) = shm_region {
-            fs.lock().unwrap().set_shm_region(shm.clone());
+        // A DAX window can't be shared, so it's only given to the root device. The scratch
+        // volumes that follow don't use one.
+        if fs.lock().unwrap().uses_shm_region() {
+            if let Some(shm) = shm_region.take() {
+                fs.lock().unwrap().set_shm_region(shm);
+            }
         }
 
         event_manager
@@ -1215,6 +1226,7 @@ pub mod tests {
             mmio_device_manager,
             #[cfg(target_arch = "x86_64")]
             pio_device_manager,
+            fs_stats: Vec::new(),
         }
     }
 
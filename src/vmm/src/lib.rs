@@ -37,7 +37,7 @@ use macos::vstate;
 use std::fmt::{Display, Formatter};
 use std::io;
 use std::os::unix::io::AsRawFd;
-use std::sync::Mutex;
+use std::sync::{Arc, Mutex};
 #[cfg(target_os = "linux")]
 use std::time::Duration;
 
@@ -50,6 +50,7 @@ use crate::vstate::{Vcpu, VcpuHandle, VcpuResponse, Vm};
 use arch::ArchMemoryInfo;
 use arch::DeviceType;
 use arch::InitrdConfig;
+use devices::virtio::fs::stats::Stats as FsStats;
 use devices::BusDevice;
 use kernel::cmdline::Cmdline as KernelCmdline;
 use logger::LoggerError;
@@ -200,6 +201,9 @@ pub struct Vmm {
     mmio_device_manager: MMIODeviceManager,
     #[cfg(target_arch = "x86_64")]
     pio_device_manager: PortIODeviceManager,
+
+    // Request statistics of the virtio-fs devices, by tag, dumped when stopping.
+    fs_stats: Vec<(String, Arc<FsStats>)>,
 }
 
 impl Vmm {
@@ -212,6 +216,11 @@ impl Vmm {
         self.mmio_device_manager.get_device(device_type, device_id)
     }
 
+    /// Returns the request statistics of the virtio-fs devices, along with their tags.
+    pub fn fs_stats(&self) -> &[(String, Arc<FsStats>)] {
+        &self.fs_stats
+    }
+
     /// Starts the microVM vcpus.
     pub fn start_vcpus(&mut self, mut vcpus: Vec<Vcpu>) -> Result<()> {
         let vcpu_count = vcpus.len();
@@ -333,6 +342,10 @@ impl Vmm {
     pub fn stop(&mut self, exit_code: i32) {
         info!("Vmm is stopping.");
 
+        for (tag, stats) in self.fs_stats.iter() {
+            info!("virtio-fs \"{}\" requests:\n{}", tag, stats.snapshot());
+        }
+
         //if let Some(observer) = self.events_observer.as_mut() {
         //    if let Err(e) = observer.on_vmm_stop() {
         //        warn!("{}", Error::VmmObserverTeardown(e));
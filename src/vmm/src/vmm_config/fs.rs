@@ -22,11 +22,18 @@ impl fmt::Display for FsConfigError {
 
 type Result<T> = std::result::Result<T, FsConfigError>;
 
-#[derive(Clone, Debug, PartialEq)]
+#[derive(Clone, Debug, Default, PartialEq)]
 pub struct FsDeviceConfig {
     pub fs_id: String,
     pub shared_dir: String,
     pub mapped_volumes: Option<Vec<(PathBuf, PathBuf)>>,
+    pub root_layers: Option<Vec<PathBuf>>,
+    pub root_archive: Option<PathBuf>,
+    pub scratch_size: Option<u64>,
+    pub max_io_size: Option<u32>,
+    pub inode_file_handles: bool,
+    pub trace_dir: Option<PathBuf>,
+    pub prefetch_dir: Option<PathBuf>,
 }
 
 #[derive(Default)]
@@ -48,7 +55,18 @@ impl FsBuilder {
     }
 
     pub fn create_fs(config: FsDeviceConfig) -> Result<Fs> {
-        devices::virtio::Fs::new(config.fs_id, config.shared_dir, config.mapped_volumes)
-            .map_err(FsConfigError::CreateFsDevice)
+        devices::virtio::Fs::new(
+            config.fs_id,
+            config.shared_dir,
+            config.mapped_volumes,
+            config.root_layers,
+            config.root_archive,
+            config.scratch_size,
+            config.max_io_size,
+            config.inode_file_handles,
+            config.trace_dir,
+            config.prefetch_dir,
+        )
+        .map_err(FsConfigError::CreateFsDevice)
     }
 }
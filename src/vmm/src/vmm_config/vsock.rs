@@ -42,6 +42,15 @@ pub struct VsockDeviceConfig {
     pub guest_cid: u32,
     /// An optional map of host to guest port mappings.
     pub host_port_map: Option<HashMap<u16, u16>>,
+    /// The RX weights of the connections to the mapped guest ports, keyed by guest port.
+    pub host_port_weights: HashMap<u16, u32>,
+    /// The max amount of data carried by a single vsock packet, if not the default.
+    pub max_pkt_size: Option<u32>,
+    /// The time (in millis) allowed for the host-side stream of a guest-initiated connection to
+    /// connect, if not the default.
+    pub connect_timeout_ms: Option<u32>,
+    /// The number of threads the connections are spread over, if not the default.
+    pub shards: Option<u32>,
 }
 
 struct VsockWrapper {
@@ -76,10 +85,17 @@ impl VsockBuilder {
 
     /// Creates a Vsock device from a VsockDeviceConfig.
     pub fn create_unixsock_vsock(cfg: VsockDeviceConfig) -> Result<Vsock<VsockUnixBackend>> {
-        let backend = VsockUnixBackend::new(u64::from(cfg.guest_cid), cfg.host_port_map)
-            .map_err(VsockConfigError::CreateVsockBackend)?;
-
-        Vsock::new(u64::from(cfg.guest_cid), backend).map_err(VsockConfigError::CreateVsockDevice)
+        let backend = VsockUnixBackend::new(
+            u64::from(cfg.guest_cid),
+            cfg.host_port_map,
+            cfg.host_port_weights,
+            cfg.connect_timeout_ms,
+            cfg.shards,
+        )
+        .map_err(VsockConfigError::CreateVsockBackend)?;
+
+        Vsock::new(u64::from(cfg.guest_cid), backend, cfg.max_pkt_size)
+            .map_err(VsockConfigError::CreateVsockDevice)
     }
 }
 
@@ -114,6 +130,10 @@ pub(crate) mod tests {
             vsock_id: vsock_dev_id.to_string(),
             guest_cid: 3,
             host_port_map: None,
+            host_port_weights: HashMap::new(),
+            max_pkt_size: None,
+            connect_timeout_ms: None,
+            shards: None,
         }
     }
 